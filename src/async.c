@@ -0,0 +1,318 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and pthread_condattr_setclock
+#include "async.h"
+#include "knn.h"
+#include "pool.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+//convenience
+typedef unsigned char uchar;
+
+struct async
+{
+	int num_imgs;
+	unsigned int x, y;
+	const uchar ** imgs;
+	int * train_labels;
+	int k;
+	distance_t distance;
+	int max_batch;
+	long deadline;
+
+	pool_t pool;
+	//distances and knn_vote labels of every thread, ASYNC_GROUP*num_imgs each
+	double * distances;
+	int * labels;
+
+	//submitted requests, newest first
+	_Atomic(async_request_t *) head;
+	//submissions so far; the engine is woken by the one reaching wake_at
+	atomic_long submitted, wake_at;
+	atomic_bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t engine;
+	bool started;
+
+	//taken off the stack but not classified yet, oldest first
+	async_request_t * backlog, * backlog_tail;
+	int backlog_len;
+	long taken;
+	//the batch being classified, in groups of group queries
+	async_request_t ** batch;
+	int batch_len, group;
+
+	//completed requests, oldest first, and those not completed yet
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+	async_request_t * done_head, * done_tail;
+	atomic_long pending;
+};
+
+static void _take(async_t a)
+{
+	//moves the submitted requests to the backlog, in submission order
+	async_request_t * r = atomic_exchange(&a->head, NULL), * fifo = NULL;
+	int n = 0;
+	for(async_request_t * next; r; r=next, n++)
+	{
+		next = r->next;
+		r->next = fifo;
+		fifo = r;
+	}
+	if(!fifo) return;
+	if(a->backlog_tail) a->backlog_tail->next = fifo;
+	else a->backlog = fifo;
+	while(fifo->next) fifo = fifo->next;
+	a->backlog_tail = fifo;
+	a->backlog_len += n;
+	a->taken += n;
+}
+
+static bool _sleep(async_t a, long need, const struct timespec * until)
+{
+	//waits until need more requests were submitted, until (if not NULL)
+	// or async_free. Returns false on time out.
+	bool timed_out = false;
+	pthread_mutex_lock(&a->lock);
+	atomic_store(&a->wake_at, a->taken+need);
+	while(atomic_load(&a->submitted)<a->taken+need && !atomic_load(&a->stopping))
+	{
+		if(!until) pthread_cond_wait(&a->wake, &a->lock);
+		else if(pthread_cond_timedwait(&a->wake, &a->lock, until))
+		{
+			timed_out = true;
+			break;
+		}
+	}
+	atomic_store(&a->wake_at, LONG_MAX);
+	pthread_mutex_unlock(&a->lock);
+	return !timed_out;
+}
+
+static void _classify_task(void * arg, int task, int tid)
+{
+	//the queries of group task, against ASYNC_BLOCK training images at a
+	// time
+	async_t a = arg;
+	int n = a->num_imgs;
+	double * distances = a->distances+(size_t) tid*ASYNC_GROUP*n;
+	int * labels = a->labels+(size_t) tid*ASYNC_GROUP*n;
+	async_request_t ** queries = a->batch+task*a->group;
+	int m = a->batch_len-task*a->group;
+	if(m>a->group) m = a->group;
+	for(int b=0; b<n; b+=ASYNC_BLOCK)
+	{
+		int e = b+ASYNC_BLOCK<n ? b+ASYNC_BLOCK : n;
+		for(int q=0; q<m; q++)
+		{
+			double * d = distances+(size_t) q*n;
+			for(int i=b; i<e; i++)
+				d[i] = a->distance(queries[q]->img, a->imgs[i], a->x, a->y);
+		}
+	}
+	int k = a->k<n ? a->k : n-1;
+	for(int q=0; q<m; q++)
+	{
+		memcpy(labels, a->train_labels, n*sizeof(int));
+		queries[q]->label = knn_vote(distances+(size_t) q*n, labels, n, k);
+	}
+}
+
+static void _classify(async_t a)
+{
+	//classifies up to max_batch requests of the backlog and completes them
+	int m = a->backlog_len<a->max_batch ? a->backlog_len : a->max_batch;
+	async_request_t * first = a->backlog, * last = NULL;
+	for(int i=0; i<m; i++)
+	{
+		a->batch[i] = last = a->backlog;
+		a->backlog = a->backlog->next;
+	}
+	if(!a->backlog) a->backlog_tail = NULL;
+	a->backlog_len -= m;
+	last->next = NULL;
+
+	//groups small enough to keep every thread busy
+	int nthreads = pool_size(a->pool);
+	a->batch_len = m;
+	a->group = (m+nthreads-1)/nthreads;
+	if(a->group>ASYNC_GROUP) a->group = ASYNC_GROUP;
+	int ntasks = (m+a->group-1)/a->group;
+	if(!pool_run_tasks(a->pool, _classify_task, a, ntasks))
+		for(int i=0; i<m; i++) a->batch[i]->label = LABEL_INVALID;
+	dprint("%d requests in %d groups, %d left", m, ntasks, a->backlog_len);
+
+	pthread_mutex_lock(&a->done_lock);
+	if(a->done_tail) a->done_tail->next = first;
+	else a->done_head = first;
+	a->done_tail = last;
+	atomic_fetch_sub(&a->pending, m);
+	pthread_cond_broadcast(&a->done_cond);
+	pthread_mutex_unlock(&a->done_lock);
+}
+
+static void * _engine(void * arg)
+{
+	async_t a = arg;
+	bool idle = true;
+	while(true)
+	{
+		_take(a);
+		if(!a->backlog)
+		{
+			if(atomic_load(&a->stopping)) break;
+			_sleep(a, 1, NULL);
+			idle = true;
+			continue;
+		}
+		//a batch that starts after a wait gets the deadline to fill up;
+		// the requests that came in during the last batch go at once
+		if(idle && a->deadline>0)
+		{
+			struct timespec until;
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_nsec += (a->deadline%1000000)*1000;
+			until.tv_sec += a->deadline/1000000+until.tv_nsec/1000000000;
+			until.tv_nsec %= 1000000000;
+			while(a->backlog_len<a->max_batch && !atomic_load(&a->stopping)
+					&& _sleep(a, a->max_batch-a->backlog_len, &until))
+				_take(a);
+			_take(a);
+		}
+		_classify(a);
+		idle = false;
+	}
+	return NULL;
+}
+
+async_t async_create(mnist_dataset_handle train, int k, distance_t distance,
+		int nthreads, int max_batch, long deadline)
+{
+	int n = mnist_image_count(train);
+	if(n<=0 || k<0 || !distance || nthreads<=0 || max_batch<=0)
+		return ASYNC_INVALID;
+	async_t a = calloc(1, sizeof(struct async));
+	if(!a) return ASYNC_INVALID;
+	a->num_imgs = n;
+	mnist_image_size(train, &a->x, &a->y);
+	a->k = k;
+	a->distance = distance;
+	a->max_batch = max_batch;
+	a->deadline = deadline<0 ? ASYNC_DEADLINE : deadline;
+	atomic_init(&a->head, NULL);
+	atomic_init(&a->submitted, 0);
+	atomic_init(&a->wake_at, LONG_MAX);
+	atomic_init(&a->stopping, false);
+	atomic_init(&a->pending, 0);
+	a->imgs = malloc(n*sizeof(uchar *));
+	a->train_labels = malloc(n*sizeof(int));
+	a->distances = malloc((size_t) nthreads*ASYNC_GROUP*n*sizeof(double));
+	a->labels = malloc((size_t) nthreads*ASYNC_GROUP*n*sizeof(int));
+	a->batch = malloc(max_batch*sizeof(async_request_t *));
+	a->pool = POOL_INVALID;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->wake, &attr);
+	pthread_mutex_init(&a->done_lock, NULL);
+	pthread_cond_init(&a->done_cond, NULL);
+	pthread_condattr_destroy(&attr);
+	if(!a->imgs || !a->train_labels || !a->distances || !a->labels || !a->batch)
+	{
+		async_free(a);
+		return ASYNC_INVALID;
+	}
+	mnist_image_handle img = mnist_image_begin(train);
+	for(int i=0; i<n; i++, img=mnist_image_next(img))
+	{
+		a->imgs[i] = mnist_image_data(img);
+		a->train_labels[i] = mnist_image_label(img);
+	}
+	//the engine thread is thread 0 of the pool
+	a->pool = pool_create(nthreads);
+	if(a->pool==POOL_INVALID || pthread_create(&a->engine, NULL, _engine, a))
+	{
+		async_free(a);
+		return ASYNC_INVALID;
+	}
+	a->started = true;
+	return a;
+}
+
+bool async_submit(async_t a, async_request_t * req)
+{
+	if(a==ASYNC_INVALID || !req || !req->img || atomic_load(&a->stopping))
+		return false;
+	req->label = LABEL_INVALID;
+	atomic_fetch_add(&a->pending, 1);
+	req->next = atomic_load_explicit(&a->head, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&a->head, &req->next, req,
+				memory_order_release, memory_order_relaxed))
+		{/*req->next is the new head, try again*/}
+	//only the submission the engine waits for takes the lock
+	long t = atomic_fetch_add(&a->submitted, 1)+1;
+	if(t>=atomic_load(&a->wake_at))
+	{
+		pthread_mutex_lock(&a->lock);
+		pthread_cond_signal(&a->wake);
+		pthread_mutex_unlock(&a->lock);
+	}
+	return true;
+}
+
+int async_complete(async_t a, async_request_t * done[], int max, bool wait)
+{
+	if(a==ASYNC_INVALID) return -1;
+	int n = 0;
+	pthread_mutex_lock(&a->done_lock);
+	while(wait && !a->done_head && atomic_load(&a->pending)>0)
+		pthread_cond_wait(&a->done_cond, &a->done_lock);
+	for(; n<max && a->done_head; n++)
+	{
+		done[n] = a->done_head;
+		a->done_head = a->done_head->next;
+	}
+	if(!a->done_head) a->done_tail = NULL;
+	pthread_mutex_unlock(&a->done_lock);
+	return n;
+}
+
+void async_free(async_t a)
+{
+	if(a==ASYNC_INVALID) return;
+	if(a->started)
+	{
+		pthread_mutex_lock(&a->lock);
+		atomic_store(&a->stopping, true);
+		pthread_cond_signal(&a->wake);
+		pthread_mutex_unlock(&a->lock);
+		pthread_join(a->engine, NULL);
+	}
+	if(a->pool!=POOL_INVALID) pool_free(a->pool);
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->wake);
+	pthread_mutex_destroy(&a->done_lock);
+	pthread_cond_destroy(&a->done_cond);
+	free(a->imgs);
+	free(a->train_labels);
+	free(a->distances);
+	free(a->labels);
+	free(a->batch);
+	free(a);
+}
@@ -0,0 +1,70 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+#include <stdbool.h>
+#include "distance.h"
+#include "mnist.h"
+/*
+Asynchronous k-NN: callers submit images to classify and collect them
+later, from any number of threads, while an engine thread classifies
+them in batches.
+
+async_submit pushes a request on a lock-free stack (one compare and swap,
+however many threads submit); the engine takes the whole stack at once
+with an exchange and puts it back in submission order. Requests are
+classified in batches: the engine waits for up to ASYNC_DEADLINE
+microseconds after the first request of a batch for more of them, unless
+max_batch requests are waiting already. Under load, whatever arrived
+while a batch was classified makes the next batch, so batches grow with
+the load and the deadline only adds latency to a lone request.
+
+A batch is scanned a group of up to ASYNC_GROUP queries at a time (a task
+of pool_run_tasks): every block of ASYNC_BLOCK training images is
+compared to all the queries of the group while it is in cache, so the
+training set is read from memory once per group rather than once per
+query. Labels are those of knn_data_best_label.
+
+Finished requests go to a completion queue, which async_complete empties.
+*/
+
+#define ASYNC_INVALID NULL
+//default wait for more requests after the first of a batch, microseconds
+#define ASYNC_DEADLINE 200
+//queries scanned together, training images per block of the scan
+#define ASYNC_GROUP 8
+#define ASYNC_BLOCK 64
+
+typedef struct async * async_t;
+
+// a request, owned by the caller until async_complete hands it back
+typedef struct async_request
+{
+	const unsigned char * img; //x*y bytes, same size as the training set
+	void * user; //for the caller
+	int label; //set on completion, LABEL_INVALID on error
+	struct async_request * next; //private
+} async_request_t;
+
+// starts an engine classifying with the k nearest images of train
+// (0-indexed as in knn_vote) by distance on nthreads threads (the
+// engine's own included), in batches of at most max_batch requests flushed
+// deadline microseconds after their first request (<0: ASYNC_DEADLINE).
+// train must outlive the engine.
+// Returns ASYNC_INVALID on invalid arguments or if threads can't start.
+async_t async_create(mnist_dataset_handle train, int k, distance_t distance,
+		int nthreads, int max_batch, long deadline);
+
+// queues req; req->img must stay valid until it's completed.
+// Returns false if a or req is invalid or the engine is stopping.
+bool async_submit(async_t a, async_request_t * req);
+
+// moves up to max completed requests to done[], in completion order, and
+// returns how many. If wait is true and none is complete, waits for one
+// (or for every request to be done: returns 0 if nothing is pending).
+// Returns <0 if a is ASYNC_INVALID.
+int async_complete(async_t a, async_request_t * done[], int max, bool wait);
+
+// finishes the requests submitted so far, stops the engine and frees a.
+// Completed requests that weren't collected are simply dropped.
+void async_free(async_t a);
+
+#endif
@@ -0,0 +1,201 @@
+#define _POSIX_C_SOURCE 200809L // for getopt and clock_gettime
+#include "bench.h"
+#include "numa.h"
+#include "sample.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+static double _now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int _cmp_double(const void * a, const void * b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x>y) - (x<y);
+}
+
+int bench_options(int argc, char ** args, bench_options_t * opts)
+{
+	*opts = (bench_options_t) {BENCH_WARMUP, BENCH_REPS, 0, false};
+	int opt;
+	while ((opt = getopt(argc, args, "w:r:c:j")) != -1)
+	{
+		if (opt=='w') opts->warmup = atoi(optarg);
+		else if (opt=='r') opts->reps = atoi(optarg);
+		else if (opt=='c') opts->cpu = atoi(optarg);
+		else if (opt=='j') opts->json = true;
+		else return -1;
+	}
+	if(opts->warmup<0 || opts->reps<=0) return -1;
+	if(opts->cpu>=0 && !numa_pin_cpu(opts->cpu))
+	{
+		fprintf(stderr, "warning: can't pin to cpu %d, not pinned\n", opts->cpu);
+		opts->cpu = -1;
+	}
+	return optind;
+}
+
+double bench_median(double x[], int n)
+{
+	if(n<=0) return 0;
+	qsort(x, n, sizeof(double), _cmp_double);
+	return n%2 ? x[n/2] : (x[n/2-1]+x[n/2])/2;
+}
+
+double bench_mad(double x[], int n, double median)
+{
+	for(int i=0; i<n; i++) x[i] = fabs(x[i]-median);
+	return bench_median(x, n);
+}
+
+bench_stats_t bench_run(const bench_options_t * opts, void (*setup)(void *),
+		void (*fn)(void *), void * arg)
+{
+	bench_stats_t s = {0, 0, 0, 0, 0};
+	double * times = malloc(opts->reps*sizeof(double));
+	if(!times) return s;
+	for(int i=0; i<opts->warmup; i++)
+	{
+		if(setup) setup(arg);
+		fn(arg);
+	}
+	for(int i=0; i<opts->reps; i++)
+	{
+		if(setup) setup(arg);
+		double start = _now();
+		fn(arg);
+		times[i] = _now()-start;
+	}
+	s.reps = opts->reps;
+	s.median = bench_median(times, s.reps);
+	//sorted by bench_median
+	s.min = times[0];
+	s.max = times[s.reps-1];
+	s.mad = bench_mad(times, s.reps, s.median);
+	dprint("%d reps, median %g s", s.reps, s.median);
+	free(times);
+	return s;
+}
+
+mnist_dataset_handle bench_synthetic(int n, unsigned int x, unsigned int y,
+		uint64_t seed)
+{
+	mnist_dataset_handle mdh = mnist_create(x, y);
+	unsigned char * data = malloc((size_t) n*x*y);
+	unsigned char * labels = malloc(n);
+	if(mdh==MNIST_DATASET_INVALID || !data || !labels)
+	{
+		mnist_free(mdh);
+		free(data);
+		free(labels);
+		return MNIST_DATASET_INVALID;
+	}
+	sample_rng_t rng = sample_rng(seed, 0);
+	for(size_t i=0; i<(size_t) n*x*y; i++) data[i] = sample_rng_next(&rng);
+	for(int i=0; i<n; i++) labels[i] = sample_rng_uniform(&rng, 10);
+	if(n>0 && mnist_image_append_batch(mdh, data, n, labels)==MNIST_IMAGE_INVALID)
+	{
+		mnist_free(mdh);
+		mdh = MNIST_DATASET_INVALID;
+	}
+	free(data);
+	free(labels);
+	return mdh;
+}
+
+static void _json_string(FILE * out, const char * s)
+{
+	fputc('"', out);
+	for(; *s; s++)
+	{
+		if(*s=='"' || *s=='\\') fprintf(out, "\\%c", *s);
+		else if((unsigned char) *s<0x20) fprintf(out, "\\u%04x", *s);
+		else fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void _si(char * buf, size_t len, double v, const char * unit)
+{
+	//v per second, with a k, M or G prefix
+	const char * prefixes[] = {"", "k", "M", "G"};
+	int p = 0;
+	while(p<3 && fabs(v)>=1000)
+	{
+		v /= 1000;
+		p++;
+	}
+	snprintf(buf, len, "%.2f %s%s/s", v, prefixes[p], unit);
+}
+
+void bench_report_begin(bench_report_t * r, FILE * out, const char * suite,
+		const bench_options_t * opts)
+{
+	*r = (bench_report_t) {out, *opts, 0};
+	if(opts->json)
+	{
+		fprintf(out, "{\"suite\": ");
+		_json_string(out, suite);
+		fprintf(out, ", \"warmup\": %d, \"reps\": %d, \"cpu\": %d, \"results\": [",
+				opts->warmup, opts->reps, opts->cpu);
+	}
+	else
+	{
+		fprintf(out, "# %s: %d warmup, %d reps, cpu %d; median per item (MAD)\n",
+				suite, opts->warmup, opts->reps, opts->cpu);
+		fprintf(out, "%-24s %-12s %12s %8s %18s %10s\n", "# name", "data",
+				"ns/item", "MAD", "items/s", "GB/s");
+	}
+}
+
+void bench_report(bench_report_t * r, const char * name, const char * data,
+		bench_stats_t s, double items, const char * unit, double bytes)
+{
+	double ns = s.median*1e9/items;
+	double rate = s.median>0 ? items/s.median : 0;
+	double gbs = s.median>0 ? bytes/s.median/1e9 : 0;
+	if(r->opts.json)
+	{
+		fprintf(r->out, "%s\n  {\"name\": ", r->count ? "," : "");
+		_json_string(r->out, name);
+		fprintf(r->out, ", \"data\": ");
+		_json_string(r->out, data);
+		fprintf(r->out, ", \"reps\": %d, \"median_s\": %.9g, \"mad_s\": %.9g, "
+				"\"min_s\": %.9g, \"max_s\": %.9g, \"items\": %.0f, \"unit\": ",
+				s.reps, s.median, s.mad, s.min, s.max, items);
+		_json_string(r->out, unit);
+		fprintf(r->out, ", \"ns_per_item\": %.6g, \"items_per_s\": %.6g, "
+				"\"bytes\": %.0f, \"gb_per_s\": %.6g}", ns, rate, bytes, gbs);
+	}
+	else
+	{
+		char buf[64], gb[32] = "-";
+		_si(buf, sizeof(buf), rate, unit);
+		if(bytes>0) snprintf(gb, sizeof(gb), "%.2f", gbs);
+		fprintf(r->out, "%-24s %-12s %12.2f %7.1f%% %18s %10s\n", name, data,
+				ns, s.median>0 ? 100*s.mad/s.median : 0, buf, gb);
+	}
+	r->count++;
+}
+
+void bench_report_end(bench_report_t * r)
+{
+	if(r->opts.json) fprintf(r->out, "\n]}\n");
+	fflush(r->out);
+}
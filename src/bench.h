@@ -0,0 +1,100 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "mnist.h"
+/*
+What the bench_* programs share: options, timing, statistics and output.
+
+A benchmark is a function timed on its own: it runs BENCH_WARMUP times
+untimed (caches, page faults, branch predictors), then BENCH_REPS times,
+each repetition timed with CLOCK_MONOTONIC, with an untimed setup before
+every call (to restore the input of an in-place kernel, say). The
+repetitions are summarized by their median and their median absolute
+deviation (MAD), which a few repetitions preempted or slowed by an
+interrupt don't move, unlike the mean and the standard deviation.
+
+The thread is pinned to a CPU (0 by default) so it doesn't migrate
+between repetitions, taking its caches away.
+
+Every result is reported per item (pairs of images, images, elements)
+and as a rate: items/s and GB/s of the data the kernel reads. Either as
+a table, or as a single JSON object:
+  {"suite": ..., "warmup": ..., "reps": ..., "cpu": ..., "results": [
+    {"name": ..., "data": ..., "reps": ..., "median_s": ..., "mad_s": ...,
+     "min_s": ..., "max_s": ..., "items": ..., "unit": ...,
+     "ns_per_item": ..., "items_per_s": ..., "bytes": ..., "gb_per_s": ...},
+    ...]}
+with the times those of a repetition (items items, bytes bytes).
+*/
+
+//images of the synthetic datasets, and their size
+#define BENCH_IMGS 8192
+#define BENCH_X 28
+#define BENCH_Y 28
+#define BENCH_WARMUP 3
+#define BENCH_REPS 21
+#define BENCH_OPTIONS_DESC \
+	"  -w warmup  untimed repetitions first (default 3)\n"\
+	"  -r reps    timed repetitions (default 21)\n"\
+	"  -c cpu     pins the thread to cpu (default 0, -1: not pinned)\n"\
+	"  -j         JSON output instead of a table\n"
+
+typedef struct bench_options
+{
+	int warmup, reps, cpu;
+	bool json;
+} bench_options_t;
+
+// the seconds of a repetition
+typedef struct bench_stats
+{
+	int reps;
+	double median, mad, min, max;
+} bench_stats_t;
+
+typedef struct bench_report
+{
+	FILE * out;
+	bench_options_t opts;
+	int count;
+} bench_report_t;
+
+// sets opts from the options above in argc/args (with getopt), and pins
+// the thread to opts->cpu (a warning on stderr if it can't).
+// Returns the index of the first argument that isn't an option, <0 on an
+// unknown option or an invalid value.
+int bench_options(int argc, char ** args, bench_options_t * opts);
+
+// runs fn(arg) opts->warmup times, then opts->reps times timed, calling
+// setup(arg) (if not NULL) before each call, untimed
+bench_stats_t bench_run(const bench_options_t * opts, void (*setup)(void *),
+		void (*fn)(void *), void * arg);
+
+// median of the n values of x (sorts x), 0 if n<=0
+double bench_median(double x[], int n);
+
+// median of the absolute deviations of the n values of x from median
+// (overwrites x), 0 if n<=0
+double bench_mad(double x[], int n, double median);
+
+// a dataset of n images of x*y uniformly random pixels and random labels
+// in [0,10), the same for the same seed.
+// Returns MNIST_DATASET_INVALID if out of memory.
+mnist_dataset_handle bench_synthetic(int n, unsigned int x, unsigned int y,
+		uint64_t seed);
+
+// starts a report of the results of suite on out
+void bench_report_begin(bench_report_t * r, FILE * out, const char * suite,
+		const bench_options_t * opts);
+
+// reports benchmark name on data (e.g. "synthetic" or a dataset name):
+// every repetition handled items of unit (plural: "pairs", "images") and
+// read bytes bytes (0 if it isn't known: no GB/s in the table)
+void bench_report(bench_report_t * r, const char * name, const char * data,
+		bench_stats_t s, double items, const char * unit, double bytes);
+
+void bench_report_end(bench_report_t * r);
+
+#endif
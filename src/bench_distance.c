@@ -0,0 +1,94 @@
+#include "bench.h"
+#include "distance.h"
+#include "mnist.h"
+#include <stdlib.h>
+#include <stdio.h>
+#define ERRMSG "Usage: ./bench_distance [-w warmup] [-r reps] [-c cpu] [-j] [dataset-name]\n"\
+				"Times every distance scheme between a query and every image of a\n"\
+				"synthetic dataset (random pixels) and, if given, of the first\n"\
+				"images of dataset-name, and reports ns/pair, pairs/s and GB/s of\n"\
+				"images compared.\n" BENCH_OPTIONS_DESC
+
+/*
+    Usage: ./bench_distance [-w warmup] [-r reps] [-c cpu] [-j] [dataset-name]
+*/
+
+struct scan
+{
+	distance_t distance;
+	const unsigned char * query;
+	const unsigned char ** imgs;
+	int n;
+	unsigned int x, y;
+	double sum;
+};
+
+static void _scan(void * arg)
+{
+	//the distance loop of knn_data_get_distances
+	struct scan * s = arg;
+	double sum = 0;
+	for(int i=0; i<s->n; i++) sum += s->distance(s->query, s->imgs[i], s->x, s->y);
+	s->sum += sum;
+}
+
+static bool _bench(bench_report_t * r, mnist_dataset_handle mdh, const char * data)
+{
+	//the last image is the query, the others the ones it's compared to
+	struct scan s;
+	s.n = mnist_image_count(mdh)-1;
+	if(s.n>BENCH_IMGS) s.n = BENCH_IMGS;
+	if(s.n<=0) return false;
+	mnist_image_size(mdh, &s.x, &s.y);
+	s.imgs = malloc(s.n*sizeof(unsigned char *));
+	if(!s.imgs) return false;
+	mnist_image_handle img = mnist_image_begin(mdh);
+	for(int i=0; i<s.n; i++, img=mnist_image_next(img))
+		s.imgs[i] = mnist_image_data(img);
+	s.query = mnist_image_data(img);
+	s.sum = 0;
+
+	char * names[] = {"euclid", "reduced"};
+	for(int d=0; d<2; d++)
+	{
+		s.distance = create_distance_function(names[d]);
+		bench_stats_t stats = bench_run(&r->opts, NULL, _scan, &s);
+		bench_report(r, names[d], data, stats, s.n, "pairs",
+					 (double) s.n*s.x*s.y);
+	}
+	free(s.imgs);
+	return true;
+}
+
+int main (int argc, char ** args)
+{
+	bench_options_t opts;
+	int first = bench_options(argc, args, &opts);
+	if (first<0 || argc-first>1)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	mnist_dataset_handle mdh = MNIST_DATASET_INVALID;
+	if (argc-first==1)
+	{
+		mdh = mnist_open(args[first]);
+		if(mdh == MNIST_DATASET_INVALID)
+		{
+			printf("%s%s or %s%s cannot be opened.\n",
+				args[first], IMAGES, args[first], LABELS);
+			exit(EXIT_FAILURE);
+		}
+	}
+	mnist_dataset_handle synthetic = bench_synthetic(BENCH_IMGS+1, BENCH_X,
+													 BENCH_Y, 1);
+	bench_report_t r;
+	bench_report_begin(&r, stdout, "distance", &opts);
+	bool ok = synthetic!=MNIST_DATASET_INVALID && _bench(&r, synthetic, "synthetic");
+	if(ok && mdh!=MNIST_DATASET_INVALID) ok = _bench(&r, mdh, args[first]);
+	bench_report_end(&r);
+	if(!ok) puts("Out of memory, or a dataset with less than 2 images");
+	mnist_free(synthetic);
+	mnist_free(mdh);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,201 @@
+#include "bench.h"
+#include "knn.h"
+#include "distance.h"
+#include "mnist.h"
+#include "sample.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#define ERRMSG "Usage: ./bench_knn [-w warmup] [-r reps] [-c cpu] [-j] [k] [dataset-name]\n"\
+				"Times the selection of the k nearest of 60000 random distances\n"\
+				"(quickselect, knn_vote), then the classification of a few queries\n"\
+				"with k neighbours by knn_data_best_label and knn_classifier_predict,\n"\
+				"on a synthetic dataset (random pixels) and, if given, dataset-name.\n"\
+				"The last images are the queries, held out of the training images;\n"\
+				"classifier/*/exact predicts them with them left in (exact matches).\n"\
+				"k defaults to 3.\n" BENCH_OPTIONS_DESC
+//distances selected among, queries classified per repetition
+#define SELECT_N 60000
+#define QUERIES 8
+
+/*
+    Usage: ./bench_knn [-w warmup] [-r reps] [-c cpu] [-j] [k] [dataset-name]
+*/
+
+struct selection
+{
+	//the random distances and labels, and the copies that are selected in
+	double * distances, * work;
+	int * labels, * work_labels;
+	int n, k;
+	double sum;
+};
+
+static void _restore(void * arg)
+{
+	struct selection * s = arg;
+	memcpy(s->work, s->distances, s->n*sizeof(double));
+	memcpy(s->work_labels, s->labels, s->n*sizeof(int));
+}
+
+static void _quickselect(void * arg)
+{
+	struct selection * s = arg;
+	s->sum += quickselect(s->work, s->work_labels, 0, s->n-1, s->k);
+}
+
+static void _vote(void * arg)
+{
+	struct selection * s = arg;
+	s->sum += knn_vote(s->work, s->work_labels, s->n, s->k);
+}
+
+static bool _bench_selection(bench_report_t * r, int k)
+{
+	struct selection s = {.n = SELECT_N, .k = k, .sum = 0};
+	s.distances = malloc(s.n*sizeof(double));
+	s.work = malloc(s.n*sizeof(double));
+	s.labels = malloc(s.n*sizeof(int));
+	s.work_labels = malloc(s.n*sizeof(int));
+	bool ok = s.distances && s.work && s.labels && s.work_labels;
+	if(ok)
+	{
+		//distances of uniformly random images: euclid of about 10000
+		sample_rng_t rng = sample_rng(2, 0);
+		for(int i=0; i<s.n; i++)
+		{
+			s.distances[i] = 9000+sample_rng_uniform(&rng, 2000)
+							 +sample_rng_uniform(&rng, 1000)/1000.0;
+			s.labels[i] = sample_rng_uniform(&rng, 10);
+		}
+		double bytes = (double) s.n*(sizeof(double)+sizeof(int));
+		bench_stats_t stats = bench_run(&r->opts, _restore, _quickselect, &s);
+		bench_report(r, "quickselect", "synthetic", stats, s.n, "elements", bytes);
+		stats = bench_run(&r->opts, _restore, _vote, &s);
+		bench_report(r, "knn_vote", "synthetic", stats, s.n, "elements", bytes);
+	}
+	free(s.distances);
+	free(s.work);
+	free(s.labels);
+	free(s.work_labels);
+	return ok;
+}
+
+struct classify
+{
+	//the last QUERIES images of the dataset, and a view of the others
+	mnist_image_handle queries[QUERIES];
+	mnist_dataset_handle train;
+	knn_data_t knn;
+	knn_classifier_t classifier;
+	distance_t distance;
+	int k, sum;
+};
+
+static void _best_label(void * arg)
+{
+	struct classify * c = arg;
+	for(int q=0; q<QUERIES; q++)
+	{
+		knn_data_set_image(c->knn, c->queries[q]);
+		c->sum += knn_data_best_label(c->knn, c->k, c->distance);
+	}
+}
+
+static void _predict(void * arg)
+{
+	struct classify * c = arg;
+	for(int q=0; q<QUERIES; q++)
+		c->sum += knn_classifier_predict(c->classifier,
+										 mnist_image_data(c->queries[q]));
+}
+
+static bool _bench_classify(bench_report_t * r, int k, mnist_dataset_handle mdh,
+		const char * data)
+{
+	struct classify c = {.k = k-1, .sum = 0};
+	int n = mnist_image_count(mdh)-QUERIES;
+	if(n<=k) return false;
+	unsigned int x, y;
+	mnist_image_size(mdh, &x, &y);
+	for(int q=0; q<QUERIES; q++) c.queries[q] = mnist_image_at(mdh, n+q);
+	c.train = mnist_view_range(mdh, 0, n);
+	c.knn = knn_data_create(c.queries[0], c.train);
+	if(c.knn==KNN_INVALID)
+	{
+		mnist_free(c.train);
+		return false;
+	}
+	char * names[] = {"euclid", "reduced"};
+	char name[64];
+	bool ok = true;
+	for(int d=0; d<2 && ok; d++)
+	{
+		//both on the same held out queries
+		c.distance = create_distance_function(names[d]);
+		snprintf(name, sizeof(name), "best_label/%s", names[d]);
+		bench_stats_t stats = bench_run(&r->opts, NULL, _best_label, &c);
+		bench_report(r, name, data, stats, QUERIES, "queries",
+					 (double) QUERIES*n*x*y);
+		c.classifier = knn_classifier_fit(c.train, names[d], k-1);
+		ok = c.classifier!=KNN_CLASSIFIER_INVALID;
+		if(!ok) break;
+		//the images read depend on the pruning: no GB/s
+		snprintf(name, sizeof(name), "classifier/%s", names[d]);
+		stats = bench_run(&r->opts, NULL, _predict, &c);
+		bench_report(r, name, data, stats, QUERIES, "queries", 0);
+		knn_classifier_free(c.classifier);
+		//the queries left in: exact matches at distance 0, as in a
+		// resubmission, the best case of the norm pruning
+		c.classifier = knn_classifier_fit(mdh, names[d], k-1);
+		ok = c.classifier!=KNN_CLASSIFIER_INVALID;
+		if(!ok) break;
+		snprintf(name, sizeof(name), "classifier/%s/exact", names[d]);
+		stats = bench_run(&r->opts, NULL, _predict, &c);
+		bench_report(r, name, data, stats, QUERIES, "queries", 0);
+		knn_classifier_free(c.classifier);
+	}
+	knn_data_free(c.knn);
+	mnist_free(c.train);
+	return ok;
+}
+
+int main (int argc, char ** args)
+{
+	bench_options_t opts;
+	int first = bench_options(argc, args, &opts);
+	if (first<0 || argc-first>2)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	int k = argc-first>=1 ? atoi(args[first]) : 3;
+	if (k<=0 || k>SELECT_N)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	mnist_dataset_handle mdh = MNIST_DATASET_INVALID;
+	if (argc-first==2)
+	{
+		mdh = mnist_open(args[first+1]);
+		if(mdh == MNIST_DATASET_INVALID)
+		{
+			printf("%s%s or %s%s cannot be opened.\n",
+				args[first+1], IMAGES, args[first+1], LABELS);
+			exit(EXIT_FAILURE);
+		}
+	}
+	mnist_dataset_handle synthetic = bench_synthetic(BENCH_IMGS, BENCH_X,
+													 BENCH_Y, 1);
+	bench_report_t r;
+	bench_report_begin(&r, stdout, "knn", &opts);
+	bool ok = synthetic!=MNIST_DATASET_INVALID && _bench_selection(&r, k-1)
+			  && _bench_classify(&r, k, synthetic, "synthetic");
+	if(ok && mdh!=MNIST_DATASET_INVALID) ok = _bench_classify(&r, k, mdh, args[first+1]);
+	bench_report_end(&r);
+	if(!ok) puts("Out of memory, or a dataset with too few images for k");
+	mnist_free(synthetic);
+	mnist_free(mdh);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
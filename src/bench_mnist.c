@@ -0,0 +1,154 @@
+#include "bench.h"
+#include "mnist.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#define ERRMSG "Usage: ./bench_mnist [-w warmup] [-r reps] [-c cpu] [-j] [dataset-name]\n"\
+				"Times building a synthetic dataset (random pixels) with\n"\
+				"mnist_image_append_batch and scanning it, and, if given, opening\n"\
+				"dataset-name (mnist_open maps the files: the pages come in when\n"\
+				"they're first read), opening and scanning it, with and without\n"\
+				"MNIST_MAP_POPULATE, and scanning it once open. Reports images/s and\n"\
+				"GB/s of pixels.\n" BENCH_OPTIONS_DESC
+
+/*
+    Usage: ./bench_mnist [-w warmup] [-r reps] [-c cpu] [-j] [dataset-name]
+*/
+
+struct io
+{
+	const char * name;
+	int flags;
+	//an open dataset, or pixels and labels to build one from
+	mnist_dataset_handle mdh;
+	const unsigned char * data, * labels;
+	int n;
+	uint64_t sum;
+};
+
+static uint64_t _scan_dataset(mnist_dataset_handle mdh)
+{
+	//reads every pixel, through the handles as knn does
+	unsigned int x, y;
+	mnist_image_size(mdh, &x, &y);
+	uint64_t sum = 0;
+	for(mnist_image_handle img = mnist_image_begin(mdh); img!=MNIST_IMAGE_INVALID;
+		img = mnist_image_next(img))
+	{
+		const unsigned char * p = mnist_image_data(img);
+		for(unsigned int i=0; i<x*y; i++) sum += p[i];
+	}
+	return sum;
+}
+
+static void _open(void * arg)
+{
+	struct io * io = arg;
+	mnist_dataset_handle mdh = mnist_open_mapped(io->name, io->flags);
+	io->sum += mnist_image_count(mdh);
+	mnist_free(mdh);
+}
+
+static void _open_scan(void * arg)
+{
+	struct io * io = arg;
+	mnist_dataset_handle mdh = mnist_open_mapped(io->name, io->flags);
+	io->sum += _scan_dataset(mdh);
+	mnist_free(mdh);
+}
+
+static void _scan(void * arg)
+{
+	struct io * io = arg;
+	io->sum += _scan_dataset(io->mdh);
+}
+
+static void _append(void * arg)
+{
+	struct io * io = arg;
+	mnist_dataset_handle mdh = mnist_create(BENCH_X, BENCH_Y);
+	mnist_image_append_batch(mdh, io->data, io->n, io->labels);
+	io->sum += mnist_image_count(mdh);
+	mnist_free(mdh);
+}
+
+static bool _bench_synthetic(bench_report_t * r)
+{
+	struct io io = {.n = BENCH_IMGS, .sum = 0};
+	io.mdh = bench_synthetic(io.n, BENCH_X, BENCH_Y, 1);
+	if(io.mdh==MNIST_DATASET_INVALID) return false;
+	//the images and labels one after the other, as in the files
+	size_t size = BENCH_X*BENCH_Y;
+	unsigned char * data = malloc(io.n*size), * labels = malloc(io.n);
+	if(!data || !labels)
+	{
+		free(data);
+		free(labels);
+		mnist_free(io.mdh);
+		return false;
+	}
+	mnist_image_handle img = mnist_image_begin(io.mdh);
+	for(int i=0; i<io.n; i++, img=mnist_image_next(img))
+	{
+		memcpy(data+i*size, mnist_image_data(img), size);
+		labels[i] = mnist_image_label(img);
+	}
+	io.data = data;
+	io.labels = labels;
+	double bytes = (double) io.n*BENCH_X*BENCH_Y;
+	bench_stats_t stats = bench_run(&r->opts, NULL, _append, &io);
+	bench_report(r, "append_batch", "synthetic", stats, io.n, "images", bytes);
+	stats = bench_run(&r->opts, NULL, _scan, &io);
+	bench_report(r, "scan", "synthetic", stats, io.n, "images", bytes);
+	free(data);
+	free(labels);
+	mnist_free(io.mdh);
+	return true;
+}
+
+static bool _bench_dataset(bench_report_t * r, const char * name)
+{
+	struct io io = {.name = name, .flags = 0, .sum = 0};
+	io.mdh = mnist_open(name);
+	if(io.mdh==MNIST_DATASET_INVALID) return false;
+	int n = mnist_image_count(io.mdh);
+	unsigned int x, y;
+	mnist_image_size(io.mdh, &x, &y);
+	double bytes = (double) n*x*y;
+	//the headers only: no GB/s
+	bench_stats_t stats = bench_run(&r->opts, NULL, _open, &io);
+	bench_report(r, "open", name, stats, n, "images", 0);
+	stats = bench_run(&r->opts, NULL, _open_scan, &io);
+	bench_report(r, "open+scan", name, stats, n, "images", bytes);
+	io.flags = MNIST_MAP_POPULATE;
+	stats = bench_run(&r->opts, NULL, _open, &io);
+	bench_report(r, "open/populate", name, stats, n, "images", bytes);
+	stats = bench_run(&r->opts, NULL, _open_scan, &io);
+	bench_report(r, "open/populate+scan", name, stats, n, "images", bytes);
+	stats = bench_run(&r->opts, NULL, _scan, &io);
+	bench_report(r, "scan", name, stats, n, "images", bytes);
+	mnist_free(io.mdh);
+	return true;
+}
+
+int main (int argc, char ** args)
+{
+	bench_options_t opts;
+	int first = bench_options(argc, args, &opts);
+	if (first<0 || argc-first>1)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	bench_report_t r;
+	bench_report_begin(&r, stdout, "mnist", &opts);
+	bool ok = _bench_synthetic(&r);
+	bool opened = !ok || argc-first==0 || _bench_dataset(&r, args[first]);
+	bench_report_end(&r);
+	if(!ok) puts("Out of memory");
+	if(!opened)
+		printf("%s%s or %s%s cannot be opened.\n",
+			args[first], IMAGES, args[first], LABELS);
+	return ok && opened ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L // for pthreads
+#include "cache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+#define HASH_M1 0x9e3779b97f4a7c15ULL
+#define HASH_M2 0xc2b2ae3d27d4eb4fULL
+
+//convenience
+typedef unsigned char uchar;
+
+struct cache_entry
+{
+	uint64_t hash;
+	int label;
+	//holds an image, and was hit since the clock hand last passed
+	bool used, ref;
+};
+
+struct cache
+{
+	size_t size;
+	int num_sets;
+	//CACHE_WAYS entries per set, and their images (size bytes each)
+	struct cache_entry * entries;
+	uchar * imgs;
+	//clock hand of every set
+	uchar * hands;
+	pthread_mutex_t locks[CACHE_LOCKS];
+
+	//prefilled images: open addressing over their indices (-1 is empty)
+	const uchar ** pimgs;
+	int * plabels;
+	uint64_t * phashes;
+	int * ptable;
+	size_t pmask;
+	int pcount;
+
+	atomic_uint_fast64_t hits, misses;
+};
+
+static uint64_t _rotl(uint64_t x, int r)
+{
+	return x<<r | x>>(64-r);
+}
+
+uint64_t cache_hash(const unsigned char * data, size_t len)
+{
+	uint64_t h = len*HASH_M1, w;
+	size_t i = 0;
+	for(; i+8<=len; i+=8)
+	{
+		memcpy(&w, data+i, 8);
+		h = _rotl(h^(w*HASH_M2), 31)*HASH_M1;
+	}
+	w = 0;
+	memcpy(&w, data+i, len-i);
+	h = _rotl(h^(w*HASH_M2), 31)*HASH_M1;
+	//splitmix64 finalizer, so every bit of the image reaches every bit
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+cache_t cache_create(size_t size, int capacity)
+{
+	if(!size || capacity<=0) return CACHE_INVALID;
+	cache_t c = calloc(1, sizeof(struct cache));
+	if(!c) return CACHE_INVALID;
+	c->size = size;
+	c->num_sets = capacity/CACHE_WAYS ? capacity/CACHE_WAYS : 1;
+	size_t n = (size_t) c->num_sets*CACHE_WAYS;
+	c->entries = calloc(n, sizeof(struct cache_entry));
+	c->imgs = malloc(n*size);
+	c->hands = calloc(c->num_sets, 1);
+	if(!c->entries || !c->imgs || !c->hands)
+	{
+		free(c->entries);
+		free(c->imgs);
+		free(c->hands);
+		free(c);
+		return CACHE_INVALID;
+	}
+	for(int i=0; i<CACHE_LOCKS; i++) pthread_mutex_init(&c->locks[i], NULL);
+	atomic_init(&c->hits, 0);
+	atomic_init(&c->misses, 0);
+	return c;
+}
+
+static int _prefilled(const cache_t c, const uchar * img, uint64_t h)
+{
+	//index of img among the prefilled images, -1 if it isn't one
+	if(!c->pcount) return -1;
+	for(size_t s=h&c->pmask; c->ptable[s]>=0; s=(s+1)&c->pmask)
+	{
+		int i = c->ptable[s];
+		if(c->phashes[i]==h && !memcmp(c->pimgs[i], img, c->size)) return i;
+	}
+	return -1;
+}
+
+bool cache_prefill(cache_t c, mnist_dataset_handle train)
+{
+	if(c==CACHE_INVALID || train==MNIST_DATASET_INVALID) return false;
+	unsigned int x, y;
+	mnist_image_size(train, &x, &y);
+	int n = mnist_image_count(train), old = c->pcount;
+	if((size_t) x*y!=c->size) return false;
+	if(n<=0) return true;
+
+	//at most half full
+	size_t cap = 16;
+	while(cap<2*((size_t) old+n)) cap *= 2;
+	const uchar ** pimgs = realloc(c->pimgs, ((size_t) old+n)*sizeof(uchar *));
+	if(pimgs) c->pimgs = pimgs;
+	int * plabels = realloc(c->plabels, ((size_t) old+n)*sizeof(int));
+	if(plabels) c->plabels = plabels;
+	uint64_t * phashes = realloc(c->phashes, ((size_t) old+n)*sizeof(uint64_t));
+	if(phashes) c->phashes = phashes;
+	int * ptable = malloc(cap*sizeof(int));
+	if(!pimgs || !plabels || !phashes || !ptable)
+	{
+		free(ptable);
+		return false;
+	}
+	//the table again, with the images of train after those already there
+	memset(ptable, -1, cap*sizeof(int));
+	free(c->ptable);
+	c->ptable = ptable;
+	c->pmask = cap-1;
+	c->pcount = old+n;
+	mnist_image_handle img = mnist_image_begin(train);
+	for(int i=0; i<old+n; i++)
+	{
+		if(i>=old)
+		{
+			c->pimgs[i] = mnist_image_data(img);
+			c->plabels[i] = mnist_image_label(img);
+			c->phashes[i] = cache_hash(c->pimgs[i], c->size);
+			img = mnist_image_next(img);
+		}
+		//a duplicate of an earlier prefill
+		else if(c->plabels[i]<0) continue;
+		//the same image twice: the smaller label, as knn_vote with k=0
+		int dup = _prefilled(c, c->pimgs[i], c->phashes[i]);
+		if(dup>=0)
+		{
+			if(c->plabels[i]<c->plabels[dup]) c->plabels[dup] = c->plabels[i];
+			c->plabels[i] = -1;
+			continue;
+		}
+		size_t s = c->phashes[i]&c->pmask;
+		while(c->ptable[s]>=0) s = (s+1)&c->pmask;
+		c->ptable[s] = i;
+	}
+	dprint("%d images prefilled, table of %zu", c->pcount, cap);
+	return true;
+}
+
+int cache_lookup(cache_t c, const unsigned char * img)
+{
+	if(c==CACHE_INVALID || !img) return CACHE_MISS;
+	uint64_t h = cache_hash(img, c->size);
+	int i = _prefilled(c, img, h), label = CACHE_MISS;
+	if(i>=0) label = c->plabels[i];
+	else
+	{
+		int set = h%c->num_sets;
+		pthread_mutex_t * lock = &c->locks[set%CACHE_LOCKS];
+		pthread_mutex_lock(lock);
+		for(int w=0; w<CACHE_WAYS; w++)
+		{
+			struct cache_entry * e = &c->entries[set*CACHE_WAYS+w];
+			if(e->used && e->hash==h
+				&& !memcmp(c->imgs+(size_t)(set*CACHE_WAYS+w)*c->size, img, c->size))
+			{
+				e->ref = true;
+				label = e->label;
+				break;
+			}
+		}
+		pthread_mutex_unlock(lock);
+	}
+	atomic_fetch_add_explicit(label==CACHE_MISS ? &c->misses : &c->hits, 1,
+							  memory_order_relaxed);
+	return label;
+}
+
+void cache_insert(cache_t c, const unsigned char * img, int label)
+{
+	if(c==CACHE_INVALID || !img || label<0 || label>UINT8_MAX) return;
+	uint64_t h = cache_hash(img, c->size);
+	//a prefilled image is always found there
+	if(_prefilled(c, img, h)>=0) return;
+	int set = h%c->num_sets;
+	struct cache_entry * entries = &c->entries[set*CACHE_WAYS];
+	uchar * imgs = c->imgs+(size_t) set*CACHE_WAYS*c->size;
+	pthread_mutex_t * lock = &c->locks[set%CACHE_LOCKS];
+	pthread_mutex_lock(lock);
+	int w;
+	for(w=0; w<CACHE_WAYS; w++)
+		if(entries[w].used && entries[w].hash==h
+			&& !memcmp(imgs+w*c->size, img, c->size))
+			break;
+	if(w==CACHE_WAYS)
+	{
+		//clock: the first entry that's free or wasn't hit since the hand
+		// last passed, clearing the others on the way
+		while(true)
+		{
+			w = c->hands[set];
+			c->hands[set] = (w+1)%CACHE_WAYS;
+			if(!entries[w].used || !entries[w].ref) break;
+			entries[w].ref = false;
+		}
+		memcpy(imgs+w*c->size, img, c->size);
+		entries[w].hash = h;
+		entries[w].used = true;
+		entries[w].ref = false;
+	}
+	entries[w].label = label;
+	pthread_mutex_unlock(lock);
+}
+
+void cache_stats(const cache_t c, uint64_t * hits, uint64_t * misses)
+{
+	if(hits) *hits = c==CACHE_INVALID ? 0 : atomic_load(&c->hits);
+	if(misses) *misses = c==CACHE_INVALID ? 0 : atomic_load(&c->misses);
+}
+
+void cache_free(cache_t c)
+{
+	if(c==CACHE_INVALID) return;
+	for(int i=0; i<CACHE_LOCKS; i++) pthread_mutex_destroy(&c->locks[i]);
+	free(c->entries);
+	free(c->imgs);
+	free(c->hands);
+	free(c->pimgs);
+	free(c->plabels);
+	free(c->phashes);
+	free(c->ptable);
+	free(c);
+}
@@ -0,0 +1,380 @@
+#define _POSIX_C_SOURCE 200809L // for sysconf
+#include "knn.h"
+#include "mnist.h"
+#include "distance.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#define ERRMSG "Usage: ./condense [train-name] [heldout-name] [out-name] [k] [distance-scheme] [threads]\n"\
+				"Removes duplicates from train-name, edits it with Wilson's rule and\n"\
+				"condenses it with Hart's rule, then saves the result to out-name.\n"\
+				"threads is optional and defaults to the number of cores.\n"\
+				"The following distance schemes are supported: \n" DISTANCE_H_LIB_DESC
+//images classified in parallel by the condensing step between two serial
+// passes over the results.
+#define CNN_BLOCK 1024
+
+/*
+    Usage: ./condense [train-name] [heldout-name] [out-name] [k] [distance-scheme] [threads]
+*/
+
+enum job_mode
+{
+	//knn_data_best_label of each image
+	JOB_LABEL,
+	//knn_data_best_label_loo of each image
+	JOB_LOO,
+	//label of, and distance to, the closest image
+	JOB_NEAREST
+};
+
+struct job
+{
+	enum job_mode mode;
+	//images to classify
+	mnist_image_handle * imgs;
+	int n;
+	//dataset to classify them with, and its handles for JOB_NEAREST
+	mnist_dataset_handle ref;
+	mnist_image_handle * ref_imgs;
+	int k;
+	distance_t distance;
+	int nthreads;
+	//results, one per image
+	int * labels;
+	double * nearest;
+};
+
+struct worker
+{
+	struct job * job;
+	int tid;
+};
+
+static mnist_image_handle * _handles(mnist_dataset_handle mdh)
+{
+	//random access array of the handles of a dataset
+	int n = mnist_image_count(mdh);
+	mnist_image_handle * imgs = malloc((n ? n : 1)*sizeof(mnist_image_handle));
+	if(!imgs) return NULL;
+	mnist_image_handle img = mnist_image_begin(mdh);
+	for(int i=0; i<n; i++)
+	{
+		imgs[i] = img;
+		img = mnist_image_next(img);
+	}
+	return imgs;
+}
+
+static void * _classify_slice(void * arg)
+{
+	//classifies the tid-th slice of the job's images
+	struct worker * w = arg;
+	struct job * job = w->job;
+	int from = (int)((long) job->n*w->tid/job->nthreads);
+	int to = (int)((long) job->n*(w->tid+1)/job->nthreads);
+	int ref_n = mnist_image_count(job->ref);
+
+	for(int i=from; i<to; i++)
+	{
+		knn_data_t knn = knn_data_create(job->imgs[i], job->ref);
+		job->labels[i] = LABEL_INVALID;
+		if(knn==KNN_INVALID) continue;
+		if(job->mode==JOB_LABEL)
+			job->labels[i] = knn_data_best_label(knn, job->k, job->distance);
+		else if(job->mode==JOB_LOO)
+			job->labels[i] = knn_data_best_label_loo(knn, job->k, job->distance);
+		else
+		{
+			double * d = knn_data_get_distances(knn, job->distance);
+			int best = 0;
+			for(int j=1; j<ref_n; j++) if(d[j]<d[best]) best = j;
+			job->labels[i] = mnist_image_label(job->ref_imgs[best]);
+			job->nearest[i] = d[best];
+		}
+		knn_data_free(knn);
+	}
+	return NULL;
+}
+
+static void _classify(struct job * job)
+{
+	pthread_t threads[job->nthreads];
+	struct worker workers[job->nthreads];
+	int started = 0;
+	for(int t=0; t<job->nthreads; t++)
+	{
+		workers[t].job = job;
+		workers[t].tid = t;
+		if(pthread_create(&threads[t], NULL, _classify_slice, &workers[t]))
+			break;
+		started++;
+	}
+	//run whatever could not get a thread here
+	for(int t=started; t<job->nthreads; t++) _classify_slice(&workers[t]);
+	for(int t=0; t<started; t++) pthread_join(threads[t], NULL);
+}
+
+static double _accuracy(mnist_dataset_handle train, mnist_dataset_handle test,
+			int k, distance_t distance, int nthreads)
+{
+	int n = mnist_image_count(test);
+	struct job job = {JOB_LABEL, _handles(test), n, train, NULL, k, distance,
+					nthreads, malloc((n ? n : 1)*sizeof(int)), NULL};
+	if(!job.imgs || !job.labels)
+	{
+		free(job.imgs); free(job.labels);
+		return -1;
+	}
+	_classify(&job);
+	int correct = 0;
+	for(int i=0; i<n; i++)
+		if(job.labels[i]==mnist_image_label(job.imgs[i])) correct++;
+	free(job.imgs);
+	free(job.labels);
+	return n ? (double) correct/n : 0;
+}
+
+static mnist_dataset_handle _dedupe(mnist_dataset_handle mdh)
+{
+	//copies mdh without exact duplicates (the first copy is kept).
+	// open addressing hash table of image numbers+1, 0 is empty.
+	int n = mnist_image_count(mdh);
+	unsigned int x, y;
+	mnist_image_size(mdh, &x, &y);
+	size_t size = 1;
+	while(size<2*(size_t)n) size <<= 1;
+	int * table = calloc(size, sizeof(int));
+	uint64_t * hashes = malloc((n ? n : 1)*sizeof(uint64_t));
+	mnist_image_handle * imgs = _handles(mdh);
+	mnist_dataset_handle out = mnist_create(x, y);
+	if(!table || !hashes || !imgs || out==MNIST_DATASET_INVALID)
+	{
+		free(table); free(hashes); free(imgs); mnist_free(out);
+		return MNIST_DATASET_INVALID;
+	}
+
+	mnist_image_handle last = MNIST_IMAGE_INVALID;
+	for(int i=0; i<n; i++)
+	{
+		const unsigned char * data = mnist_image_data(imgs[i]);
+		hashes[i] = mnist_hash_data(data, x*y);
+		size_t slot = hashes[i]&(size-1);
+		bool dup = false;
+		while(table[slot] && !dup)
+		{
+			int j = table[slot]-1;
+			dup = (hashes[j]==hashes[i])
+				&& !memcmp(mnist_image_data(imgs[j]), data, x*y);
+			slot = (slot+1)&(size-1);
+		}
+		if(dup) continue;
+		table[slot] = i+1;
+		last = mnist_image_add_after(out, last, data, x, y,
+									mnist_image_label(imgs[i]));
+		if(last==MNIST_IMAGE_INVALID)
+		{
+			mnist_free(out);
+			out = MNIST_DATASET_INVALID;
+			break;
+		}
+	}
+	free(table);
+	free(hashes);
+	free(imgs);
+	return out;
+}
+
+static mnist_dataset_handle _wilson_edit(mnist_dataset_handle mdh, int k,
+			distance_t distance, int nthreads)
+{
+	//Wilson's editing: drops every image that its k nearest neighbors
+	// (itself left out) don't classify correctly.
+	int n = mnist_image_count(mdh);
+	unsigned int x, y;
+	mnist_image_size(mdh, &x, &y);
+	struct job job = {JOB_LOO, _handles(mdh), n, mdh, NULL, k, distance,
+					nthreads, malloc((n ? n : 1)*sizeof(int)), NULL};
+	mnist_dataset_handle out = mnist_create(x, y);
+	if(!job.imgs || !job.labels || out==MNIST_DATASET_INVALID)
+	{
+		free(job.imgs); free(job.labels); mnist_free(out);
+		return MNIST_DATASET_INVALID;
+	}
+	_classify(&job);
+
+	mnist_image_handle last = MNIST_IMAGE_INVALID;
+	for(int i=0; i<n; i++)
+	{
+		int label = mnist_image_label(job.imgs[i]);
+		if(job.labels[i]!=label) continue;
+		last = mnist_image_add_after(out, last, mnist_image_data(job.imgs[i]),
+									x, y, label);
+		if(last==MNIST_IMAGE_INVALID)
+		{
+			mnist_free(out);
+			out = MNIST_DATASET_INVALID;
+			break;
+		}
+	}
+	free(job.imgs);
+	free(job.labels);
+	return out;
+}
+
+static mnist_dataset_handle _hart_condense(mnist_dataset_handle mdh,
+			distance_t distance, int nthreads)
+{
+	//Hart's condensed nearest neighbor: starting with the first image,
+	// adds every image the condensed set misclassifies (1-NN), until a
+	// pass over the images adds nothing.
+	// Blocks of CNN_BLOCK images are classified in parallel against the
+	// condensed set; a serial pass then compares each image with the
+	// ones added during the block, which gives the same result as
+	// the serial algorithm.
+	int n = mnist_image_count(mdh);
+	unsigned int x, y;
+	mnist_image_size(mdh, &x, &y);
+	mnist_dataset_handle out = mnist_create(x, y);
+	mnist_image_handle * imgs = _handles(mdh);
+	bool * in_out = calloc(n ? n : 1, sizeof(bool));
+	mnist_image_handle cand[CNN_BLOCK], added[CNN_BLOCK];
+	int labels[CNN_BLOCK];
+	double nearest[CNN_BLOCK];
+	if(out==MNIST_DATASET_INVALID || !imgs || !in_out || n==0)
+	{
+		free(imgs); free(in_out);
+		return out;
+	}
+
+	mnist_image_handle last = mnist_image_add_after(out, MNIST_IMAGE_INVALID,
+			mnist_image_data(imgs[0]), x, y, mnist_image_label(imgs[0]));
+	in_out[0] = true;
+	int num_added = 1;
+	while(num_added && last!=MNIST_IMAGE_INVALID)
+	{
+		num_added = 0;
+		for(int b=0; b<n && last!=MNIST_IMAGE_INVALID; )
+		{
+			//next block of images that are not condensed yet
+			int nc = 0;
+			for(; b<n && nc<CNN_BLOCK; b++)
+				if(!in_out[b]) cand[nc++] = imgs[b];
+			if(!nc) break;
+
+			struct job job = {JOB_NEAREST, cand, nc, out, _handles(out), 0,
+							distance, nthreads, labels, nearest};
+			if(!job.ref_imgs) {last = MNIST_IMAGE_INVALID; break;}
+			_classify(&job);
+			free(job.ref_imgs);
+
+			int na = 0;
+			for(int c=0; c<nc; c++)
+			{
+				const unsigned char * data = mnist_image_data(cand[c]);
+				for(int a=0; a<na; a++)
+				{
+					double d = distance(data, mnist_image_data(added[a]), x, y);
+					if(d<nearest[c])
+					{
+						nearest[c] = d;
+						labels[c] = mnist_image_label(added[a]);
+					}
+				}
+				int label = mnist_image_label(cand[c]);
+				if(labels[c]==label) continue;
+				last = mnist_image_add_after(out, last, data, x, y, label);
+				if(last==MNIST_IMAGE_INVALID) break;
+				added[na++] = cand[c];
+			}
+			num_added += na;
+			//mark the added images
+			for(int a=0, i=0; a<na && i<n; i++)
+			{
+				if(imgs[i]==added[a]) {in_out[i] = true; a++;}
+			}
+		}
+	}
+	free(imgs);
+	free(in_out);
+	if(last==MNIST_IMAGE_INVALID)
+	{
+		mnist_free(out);
+		return MNIST_DATASET_INVALID;
+	}
+	return out;
+}
+
+int main (int argc, char ** args)
+{
+	if ((argc!=6) && (argc!=7))
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * train_name = args[1];
+	char * heldout_name = args[2];
+	char * out_name = args[3];
+	int k = atoi(args[4])-1;
+	distance_t distance = create_distance_function(args[5]);
+	int nthreads = (argc==7) ? atoi(args[6]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(k<0 || !distance || nthreads<=0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+
+	mnist_dataset_handle train_mdh = mnist_open(train_name);
+	mnist_dataset_handle heldout_mdh = mnist_open(heldout_name);
+	if(train_mdh == MNIST_DATASET_INVALID || heldout_mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s or %s cannot be opened.\n", train_name, heldout_name);
+		mnist_free(train_mdh);
+		mnist_free(heldout_mdh);
+		exit(EXIT_FAILURE);
+	}
+
+	mnist_dataset_handle dedup_mdh = _dedupe(train_mdh);
+	mnist_dataset_handle edit_mdh = MNIST_DATASET_INVALID;
+	mnist_dataset_handle cnn_mdh = MNIST_DATASET_INVALID;
+	if(dedup_mdh != MNIST_DATASET_INVALID)
+		edit_mdh = _wilson_edit(dedup_mdh, k, distance, nthreads);
+	if(edit_mdh != MNIST_DATASET_INVALID)
+		cnn_mdh = _hart_condense(edit_mdh, distance, nthreads);
+	if(cnn_mdh == MNIST_DATASET_INVALID || !mnist_save(cnn_mdh, out_name))
+	{
+		printf("Can't condense %s into %s\n", train_name, out_name);
+		mnist_free(cnn_mdh);
+		mnist_free(edit_mdh);
+		mnist_free(dedup_mdh);
+		mnist_free(heldout_mdh);
+		mnist_free(train_mdh);
+		exit(EXIT_FAILURE);
+	}
+
+	int n_train = mnist_image_count(train_mdh);
+	int n_dedup = mnist_image_count(dedup_mdh);
+	int n_edit = mnist_image_count(edit_mdh);
+	int n_cnn = mnist_image_count(cnn_mdh);
+	printf("%s: %d images\n", train_name, n_train);
+	printf("duplicates removed: %d\n", n_train-n_dedup);
+	printf("wilson editing removed: %d\n", n_dedup-n_edit);
+	printf("hart condensing removed: %d\n", n_edit-n_cnn);
+	printf("%s: %d images (%.2f%% smaller)\n", out_name, n_cnn,
+			n_train ? (1-(double) n_cnn/n_train)*100 : 0);
+
+	double acc_before = _accuracy(train_mdh, heldout_mdh, k, distance, nthreads);
+	double acc_after = _accuracy(cnn_mdh, heldout_mdh, k, distance, nthreads);
+	printf("%s accuracy, k=%d: %.2f%% -> %.2f%% (%+.2f)\n", heldout_name, k+1,
+			acc_before*100, acc_after*100, (acc_after-acc_before)*100);
+
+	mnist_free(cnn_mdh);
+	mnist_free(edit_mdh);
+	mnist_free(dedup_mdh);
+	mnist_free(heldout_mdh);
+	mnist_free(train_mdh);
+	return(EXIT_SUCCESS);
+}
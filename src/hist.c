@@ -0,0 +1,110 @@
+#include "hist.h"
+#include <math.h>
+#include <stdio.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+//the single writer's increment: no locked instruction, but readers never
+// see a torn counter
+#define _ADD(counter, v) atomic_store_explicit(&(counter), \
+	atomic_load_explicit(&(counter), memory_order_relaxed)+(v), \
+	memory_order_relaxed)
+#define _GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+int hist_bucket(uint64_t v)
+{
+	if(v>>HIST_MAX_BITS) return HIST_BUCKETS-1;
+	if(v < 2u<<HIST_SUB_BITS) return (int) v;
+	//v is in [2^e, 2^(e+1)), in buckets of 2^shift
+	int e = 63-__builtin_clzll(v), shift = e-HIST_SUB_BITS;
+	return (shift<<HIST_SUB_BITS) + (int) (v>>shift);
+}
+
+uint64_t hist_bucket_low(int b)
+{
+	if(b < 2<<HIST_SUB_BITS) return b;
+	int shift = (b>>HIST_SUB_BITS)-1;
+	uint64_t m = (b&((1<<HIST_SUB_BITS)-1)) + (1<<HIST_SUB_BITS);
+	return m<<shift;
+}
+
+uint64_t hist_bucket_high(int b)
+{
+	if(b>=HIST_BUCKETS-1) return UINT64_MAX;
+	return hist_bucket_low(b+1)-1;
+}
+
+void hist_clear(hist_t * h)
+{
+	atomic_init(&h->count, 0);
+	atomic_init(&h->sum, 0);
+	atomic_init(&h->max, 0);
+	for(int b=0; b<HIST_BUCKETS; b++) atomic_init(&h->buckets[b], 0);
+}
+
+void hist_record(hist_t * h, uint64_t v)
+{
+	_ADD(h->buckets[hist_bucket(v)], 1);
+	_ADD(h->sum, v);
+	if(v>_GET(h->max)) atomic_store_explicit(&h->max, v, memory_order_relaxed);
+	//last, so a reader never sees more values than the buckets hold
+	atomic_store_explicit(&h->count, _GET(h->count)+1, memory_order_release);
+}
+
+void hist_merge(hist_t * to, const hist_t * from)
+{
+	//the buckets are counted rather than read from count, which the writer
+	// updates last
+	uint64_t total = 0;
+	for(int b=0; b<HIST_BUCKETS; b++)
+	{
+		uint64_t n = _GET(from->buckets[b]);
+		if(!n) continue;
+		_ADD(to->buckets[b], n);
+		total += n;
+	}
+	_ADD(to->count, total);
+	_ADD(to->sum, _GET(from->sum));
+	if(_GET(from->max)>_GET(to->max))
+		atomic_store_explicit(&to->max, _GET(from->max), memory_order_relaxed);
+	dprint("%llu values merged", (unsigned long long) total);
+}
+
+uint64_t hist_count(const hist_t * h)
+{
+	//acquire: the buckets hold at least this many values
+	return atomic_load_explicit(&h->count, memory_order_acquire);
+}
+
+uint64_t hist_max(const hist_t * h)
+{
+	return _GET(h->max);
+}
+
+double hist_mean(const hist_t * h)
+{
+	uint64_t count = hist_count(h);
+	return count ? (double) _GET(h->sum)/count : 0;
+}
+
+uint64_t hist_quantile(const hist_t * h, double q)
+{
+	uint64_t count = hist_count(h);
+	if(!count) return 0;
+	uint64_t rank = (uint64_t) ceil(q*count);
+	if(rank<1) rank = 1;
+	uint64_t seen = 0, max = hist_max(h);
+	for(int b=0; b<HIST_BUCKETS; b++)
+	{
+		seen += _GET(h->buckets[b]);
+		if(seen>=rank) return hist_bucket_high(b)<max ? hist_bucket_high(b) : max;
+	}
+	return max;
+}
@@ -0,0 +1,63 @@
+#ifndef HIST_H
+#define HIST_H
+#include <stdatomic.h>
+#include <stdint.h>
+/*
+Latency histograms in the style of HdrHistogram: a fixed array of
+counters, constant time to record a value and no allocation, with a
+bounded relative error over the whole range instead of fixed-width bins.
+
+Values below 2^(HIST_SUB_BITS+1) have a bucket each. Above, every power
+of two [2^e, 2^(e+1)) is split in 2^HIST_SUB_BITS buckets of equal width
+2^(e-HIST_SUB_BITS), so a value is known to within 1/2^HIST_SUB_BITS of
+itself (3% with 5 bits). Values of 2^HIST_MAX_BITS and more (18 minutes,
+in nanoseconds) are counted in the last bucket; the maximum is kept
+exactly.
+
+A histogram has a single writer, but can be read (hist_merge) while it's
+written: the counters are atomics the writer loads and stores, which
+costs it nothing over plain integers, and a reader sees every counter as
+it was at some point of the recording. A histogram of all-zero bytes
+(calloc) is empty, so the pages of a large array of histograms are only
+touched where values are recorded.
+*/
+
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS-HIST_SUB_BITS+1)<<HIST_SUB_BITS)
+
+typedef struct hist
+{
+	atomic_uint_least64_t count, sum, max;
+	atomic_uint_least64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+// empties h
+void hist_clear(hist_t * h);
+
+// adds value v to h; not from two threads at once
+void hist_record(hist_t * h, uint64_t v);
+
+// adds the values of from to to (to must not be recorded into meanwhile)
+void hist_merge(hist_t * to, const hist_t * from);
+
+// number of values of h
+uint64_t hist_count(const hist_t * h);
+
+// largest value of h, 0 if h is empty
+uint64_t hist_max(const hist_t * h);
+
+// mean of the values of h, 0 if h is empty
+double hist_mean(const hist_t * h);
+
+// the q quantile of h (q in [0,1], 0.99 for p99): the largest value of
+// the bucket of the value at rank ceil(q*count) (no larger than
+// hist_max), so at least q of the values are no larger. 0 if h is empty.
+uint64_t hist_quantile(const hist_t * h, double q);
+
+// bucket of v, and the smallest and largest value of bucket b
+int hist_bucket(uint64_t v);
+uint64_t hist_bucket_low(int b);
+uint64_t hist_bucket_high(int b);
+
+#endif
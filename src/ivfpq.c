@@ -0,0 +1,531 @@
+#define _DEFAULT_SOURCE // for mmap and madvise
+#include "ivfpq.h"
+#include "knn.h"
+#include "mnist.h"
+#include "distance.h"
+#include "sample.h"
+#include <arpa/inet.h> // for ntoh functions
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <float.h>
+#include <stdio.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define IVFPQ_HAVE_AVX2 1
+	#include <immintrin.h>
+#else
+	#define IVFPQ_HAVE_AVX2 0
+#endif
+
+//while encoding a file, drop the pages already encoded every
+// this many bytes so the page cache doesn't fill up with them.
+#define IVFPQ_DROP_BYTES (64u<<20)
+
+typedef void (*ivfpq_scan_t)(const float * lut, const uint8_t * codes,
+							uint32_t n, int m, float * out);
+
+struct ivfpq_list
+{
+	//number of images in the list, and allocated room
+	uint32_t n, cap;
+	// codes, in blocks of IVFPQ_BLOCK images. Inside a block the codes
+	// are transposed: byte [j*IVFPQ_BLOCK + t] is sub-quantizer j of
+	// image t, so one load fetches sub-quantizer j of the whole block.
+	uint8_t * codes;
+	// image number of each entry (offset in the idx file)
+	uint32_t * ids;
+};
+
+struct ivfpq
+{
+	unsigned int x, y, d;
+	int nlist, m, ksub;
+
+	// nlist*d coarse centroids
+	float * coarse;
+	// sub-quantizer j covers dims [sub_off[j], sub_off[j+1]) and has
+	// ksub centroids stored at pq+IVFPQ_KSUB*sub_off[j]
+	int * sub_off;
+	float * pq;
+
+	struct ivfpq_list * lists;
+	ivfpq_scan_t scan;
+
+	// labels of the encoded images, by image number
+	uint8_t * labels;
+	uint32_t count;
+
+	// raw image file, used for re-ranking
+	void * map;
+	size_t map_len;
+	const uint8_t * raw;
+};
+
+
+static float _sqdist(const float * a, const float * b, int d)
+{
+	float sum = 0;
+	for(int i=0; i<d; i++)
+	{
+		float diff = a[i]-b[i];
+		sum += diff*diff;
+	}
+	return sum;
+}
+
+static int _nearest(const float * v, const float * cent, int kc, int d)
+{
+	int best = 0;
+	float best_d = FLT_MAX;
+	for(int c=0; c<kc; c++)
+	{
+		float dist = _sqdist(v, cent+(size_t)c*d, d);
+		if(dist<best_d) {best_d = dist; best = c;}
+	}
+	return best;
+}
+
+static bool _kmeans(const float * data, int n, int d, int kc, int iters,
+					sample_rng_t * rng, float * cent)
+{
+	//Lloyd's algorithm. Initial centroids are kc distinct random points,
+	// empty clusters are reseeded with a random point. All drawn from rng.
+	assert(kc<=n);
+	int * seeds = malloc(kc*sizeof(int));
+	int * assign = malloc(n*sizeof(int));
+	int * cnt = malloc(kc*sizeof(int));
+	if(!seeds || !assign || !cnt || !sample_floyd(rng, n, kc, seeds))
+	{
+		free(seeds); free(assign); free(cnt);
+		return false;
+	}
+	for(int c=0; c<kc; c++)
+		memcpy(cent+(size_t)c*d, data+(size_t)seeds[c]*d, d*sizeof(float));
+
+	for(int it=0; it<iters; it++)
+	{
+		int changed = 0;
+		for(int i=0; i<n; i++)
+		{
+			int c = _nearest(data+(size_t)i*d, cent, kc, d);
+			if(it==0 || c!=assign[i]) changed++;
+			assign[i] = c;
+		}
+		dprint("it:%d\tchanged:%d", it, changed);
+		if(!changed) break;
+
+		memset(cent, 0, (size_t)kc*d*sizeof(float));
+		memset(cnt, 0, kc*sizeof(int));
+		for(int i=0; i<n; i++)
+		{
+			float * c = cent+(size_t)assign[i]*d;
+			const float * v = data+(size_t)i*d;
+			for(int p=0; p<d; p++) c[p] += v[p];
+			cnt[assign[i]]++;
+		}
+		for(int c=0; c<kc; c++)
+		{
+			float * cv = cent+(size_t)c*d;
+			if(cnt[c]==0)
+				memcpy(cv, data+(size_t)sample_rng_uniform(rng, n)*d, 
+						d*sizeof(float));
+			else
+				for(int p=0; p<d; p++) cv[p] /= cnt[c];
+		}
+	}
+	free(seeds);
+	free(assign);
+	free(cnt);
+	return true;
+}
+
+static void _scan_scalar(const float * lut, const uint8_t * codes,
+						uint32_t n, int m, float * out)
+{
+	for(uint32_t b=0; b*IVFPQ_BLOCK<n; b++)
+	{
+		const uint8_t * blk = codes+(size_t)b*m*IVFPQ_BLOCK;
+		float acc[IVFPQ_BLOCK] = {0};
+		for(int j=0; j<m; j++)
+		{
+			const float * t_lut = lut+j*IVFPQ_KSUB;
+			for(int t=0; t<IVFPQ_BLOCK; t++)
+				acc[t] += t_lut[blk[j*IVFPQ_BLOCK+t]];
+		}
+		uint32_t left = n-b*IVFPQ_BLOCK;
+		if(left>IVFPQ_BLOCK) left = IVFPQ_BLOCK;
+		memcpy(out+b*IVFPQ_BLOCK, acc, left*sizeof(float));
+	}
+}
+
+#if IVFPQ_HAVE_AVX2
+__attribute__((target("avx2")))
+static void _scan_avx2(const float * lut, const uint8_t * codes,
+						uint32_t n, int m, float * out)
+{
+	//same as _scan_scalar, but a block is one 8-wide gather per
+	// sub-quantizer. The sums are done in the same order, so the
+	// results are bit-identical.
+	for(uint32_t b=0; b*IVFPQ_BLOCK<n; b++)
+	{
+		const uint8_t * blk = codes+(size_t)b*m*IVFPQ_BLOCK;
+		__m256 acc = _mm256_setzero_ps();
+		for(int j=0; j<m; j++)
+		{
+			__m128i c8 = _mm_loadl_epi64((const __m128i *)(blk+j*IVFPQ_BLOCK));
+			__m256i ix = _mm256_cvtepu8_epi32(c8);
+			acc = _mm256_add_ps(acc,
+					_mm256_i32gather_ps(lut+j*IVFPQ_KSUB, ix, 4));
+		}
+		float tmp[IVFPQ_BLOCK];
+		_mm256_storeu_ps(tmp, acc);
+		uint32_t left = n-b*IVFPQ_BLOCK;
+		if(left>IVFPQ_BLOCK) left = IVFPQ_BLOCK;
+		memcpy(out+b*IVFPQ_BLOCK, tmp, left*sizeof(float));
+	}
+}
+#endif
+
+static ivfpq_scan_t _pick_scan(void)
+{
+#if IVFPQ_HAVE_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return _scan_avx2;
+#endif
+	return _scan_scalar;
+}
+
+void ivfpq_free(ivfpq_t index)
+{
+	if(index==IVFPQ_INVALID) return;
+	if(index->lists)
+	{
+		for(int l=0; l<index->nlist; l++)
+		{
+			free(index->lists[l].codes);
+			free(index->lists[l].ids);
+		}
+	}
+	if(index->map) munmap(index->map, index->map_len);
+	free(index->lists);
+	free(index->coarse);
+	free(index->sub_off);
+	free(index->pq);
+	free(index->labels);
+	free(index);
+}
+
+ivfpq_t ivfpq_train(mnist_dataset_handle sample, int nlist, int m)
+{
+	int n = mnist_image_count(sample);
+	unsigned int x, y;
+	mnist_image_size(sample, &x, &y);
+	if(n<=0 || nlist<=0 || m<=0 || (unsigned int) m>x*y) return IVFPQ_INVALID;
+	if(nlist>n) nlist = n;
+	int d = x*y;
+
+	ivfpq_t ix = calloc(1, sizeof(struct ivfpq));
+	if(!ix) return IVFPQ_INVALID;
+	ix->x = x; ix->y = y; ix->d = d;
+	ix->nlist = nlist; ix->m = m;
+	ix->ksub = (n<IVFPQ_KSUB) ? n : IVFPQ_KSUB;
+	ix->scan = _pick_scan();
+	ix->coarse = malloc((size_t)nlist*d*sizeof(float));
+	ix->sub_off = malloc((m+1)*sizeof(int));
+	ix->pq = malloc((size_t)IVFPQ_KSUB*d*sizeof(float));
+	ix->lists = calloc(nlist, sizeof(struct ivfpq_list));
+	float * data = malloc((size_t)n*d*sizeof(float));
+	float * sub = malloc((size_t)n*d*sizeof(float));
+	if(!ix->coarse || !ix->sub_off || !ix->pq || !ix->lists || !data || !sub)
+	{
+		free(data); free(sub);
+		ivfpq_free(ix);
+		return IVFPQ_INVALID;
+	}
+	for(int j=0; j<=m; j++) ix->sub_off[j] = (j*d)/m;
+
+	mnist_image_handle img = mnist_image_begin(sample);
+	for(int i=0; i<n; i++)
+	{
+		const unsigned char * pix = mnist_image_data(img);
+		for(int p=0; p<d; p++) data[(size_t)i*d+p] = pix[p];
+		img = mnist_image_next(img);
+	}
+
+	//stream 0 seeds the coarse quantizer, stream j+1 product quantizer j
+	sample_rng_t rng = sample_rng(IVFPQ_SEED, 0);
+	bool ok = _kmeans(data, n, d, nlist, IVFPQ_KMEANS_ITERS, &rng, 
+					ix->coarse);
+
+	//train the product quantizers on the residuals
+	for(int i=0; ok && i<n; i++)
+	{
+		float * v = data+(size_t)i*d;
+		const float * c = ix->coarse+(size_t)_nearest(v, ix->coarse, nlist, d)*d;
+		for(int p=0; p<d; p++) v[p] -= c[p];
+	}
+	for(int j=0; ok && j<m; j++)
+	{
+		int off = ix->sub_off[j], dsub = ix->sub_off[j+1]-off;
+		for(int i=0; i<n; i++)
+			memcpy(sub+(size_t)i*dsub, data+(size_t)i*d+off, dsub*sizeof(float));
+		rng = sample_rng(IVFPQ_SEED, j+1);
+		ok = _kmeans(sub, n, dsub, ix->ksub, IVFPQ_KMEANS_ITERS, &rng,
+					ix->pq+(size_t)IVFPQ_KSUB*off);
+	}
+	free(data);
+	free(sub);
+	if(!ok)
+	{
+		ivfpq_free(ix);
+		return IVFPQ_INVALID;
+	}
+	dprint("n:%d\tnlist:%d\tm:%d\tksub:%d", n, nlist, m, ix->ksub);
+	return ix;
+}
+
+static bool _list_append(struct ivfpq_list * list, int m,
+						const uint8_t * code, uint32_t id)
+{
+	if(list->n==list->cap)
+	{
+		//capacity is always a multiple of IVFPQ_BLOCK
+		uint32_t cap = list->cap ? 2*list->cap : IVFPQ_BLOCK;
+		uint8_t * codes = realloc(list->codes, (size_t)cap*m);
+		if(!codes) return false;
+		list->codes = codes;
+		uint32_t * ids = realloc(list->ids, cap*sizeof(uint32_t));
+		if(!ids) return false;
+		list->ids = ids;
+		list->cap = cap;
+	}
+	uint8_t * blk = list->codes+(size_t)(list->n/IVFPQ_BLOCK)*m*IVFPQ_BLOCK;
+	int t = list->n%IVFPQ_BLOCK;
+	for(int j=0; j<m; j++) blk[j*IVFPQ_BLOCK+t] = code[j];
+	list->ids[list->n++] = id;
+	return true;
+}
+
+static bool _encode(ivfpq_t ix, const uint8_t * pix, uint32_t id, float * r)
+{
+	int d = ix->d, m = ix->m;
+	uint8_t code[m];
+	for(int p=0; p<d; p++) r[p] = pix[p];
+	int l = _nearest(r, ix->coarse, ix->nlist, d);
+	const float * c = ix->coarse+(size_t)l*d;
+	for(int p=0; p<d; p++) r[p] -= c[p];
+	for(int j=0; j<m; j++)
+	{
+		int off = ix->sub_off[j], dsub = ix->sub_off[j+1]-off;
+		code[j] = (uint8_t) _nearest(r+off, ix->pq+(size_t)IVFPQ_KSUB*off,
+								ix->ksub, dsub);
+	}
+	return _list_append(&ix->lists[l], m, code, id);
+}
+
+static char * _make_path(const char * name, const char * suffix)
+{
+	char * path = (char *) malloc(strlen(name)+strlen(suffix)+1);
+	if(!path) return NULL;
+	strcpy(path, name);
+	strcat(path, suffix);
+	return path;
+}
+
+static bool _read_labels(ivfpq_t ix, const char * path, uint32_t n)
+{
+	FILE * fp = fopen(path, "rb");
+	if(!fp) return false;
+	uint32_t hdr[LBL_HEADER_SIZE/sizeof(uint32_t)];
+	bool ok = (fread(hdr, LBL_HEADER_SIZE, 1, fp)==1)
+			&& (MY_NTOHL(hdr[MN_IX])==LBL_MAGIC_NUM)
+			&& (MY_NTOHL(hdr[NUM_IMG_IX])==n);
+	if(ok)
+	{
+		ix->labels = malloc(n ? n : 1);
+		ok = ix->labels && (n==0 || fread(ix->labels, n, 1, fp)==1);
+	}
+	fclose(fp);
+	return ok;
+}
+
+bool ivfpq_add_file(ivfpq_t index, const char * name)
+{
+	if(index==IVFPQ_INVALID || !name || index->map) return false;
+	char * imgpath = _make_path(name, IMAGES);
+	char * lblpath = _make_path(name, LABELS);
+	int fd = imgpath ? open(imgpath, O_RDONLY) : -1;
+	struct stat st;
+	void * map = MAP_FAILED;
+	if(fd>=0 && fstat(fd, &st)==0 && st.st_size>=IMG_HEADER_SIZE)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(fd>=0) close(fd);
+	if(map==MAP_FAILED)
+	{
+		free(imgpath); free(lblpath);
+		return false;
+	}
+
+	const uint32_t * hdr = map;
+	uint32_t n = MY_NTOHL(hdr[NUM_IMG_IX]);
+	size_t len = st.st_size;
+	bool ok = (MY_NTOHL(hdr[MN_IX])==IMG_MAGIC_NUM)
+			&& (MY_NTOHL(hdr[X_IX])==index->x)
+			&& (MY_NTOHL(hdr[Y_IX])==index->y)
+			&& (IMG_HEADER_SIZE+(size_t)n*index->d<=len)
+			&& _read_labels(index, lblpath, n);
+	free(imgpath);
+	free(lblpath);
+	float * r = malloc(index->d*sizeof(float));
+	if(!ok || !r)
+	{
+		free(r);
+		munmap(map, len);
+		return false;
+	}
+
+	madvise(map, len, MADV_SEQUENTIAL);
+	const uint8_t * raw = (const uint8_t *) map+IMG_HEADER_SIZE;
+	size_t dropped = 0;
+	for(uint32_t i=0; ok && i<n; i++)
+	{
+		ok = _encode(index, raw+(size_t)i*index->d, i, r);
+		//drop whole pages that were already encoded
+		size_t done = (IMG_HEADER_SIZE+(size_t)i*index->d) & ~(size_t)0xfff;
+		if(done-dropped>=IVFPQ_DROP_BYTES)
+		{
+			madvise((uint8_t *) map+dropped, done-dropped, MADV_DONTNEED);
+			dropped = done;
+		}
+	}
+	free(r);
+	if(!ok)
+	{
+		munmap(map, len);
+		return false;
+	}
+	//re-ranking only touches a handful of random images per query
+	madvise(map, len, MADV_RANDOM);
+	index->map = map;
+	index->map_len = len;
+	index->raw = raw;
+	index->count = n;
+	dprint("n:%" PRIu32 "\tlen:%zu", n, len);
+	return true;
+}
+
+int ivfpq_count(const ivfpq_t index)
+{
+	if(index==IVFPQ_INVALID) return -1;
+	return index->count;
+}
+
+int ivfpq_best_label(const ivfpq_t index, const unsigned char * img,
+					int k, int nprobe, int rerank)
+{
+	if(index==IVFPQ_INVALID || !img || k<0 || nprobe<=0 || !index->count)
+		return LABEL_INVALID;
+	int d = index->d, m = index->m, nlist = index->nlist;
+	if(nprobe>nlist) nprobe = nlist;
+
+	//find the nprobe closest lists
+	float q[d];
+	double cdist[nlist];
+	int clist[nlist];
+	for(int p=0; p<d; p++) q[p] = img[p];
+	for(int l=0; l<nlist; l++)
+	{
+		cdist[l] = _sqdist(q, index->coarse+(size_t)l*d, d);
+		clist[l] = l;
+	}
+	if(nprobe<nlist) quickselect(cdist, clist, 0, nlist-1, nprobe-1);
+
+	uint32_t n = 0;
+	for(int i=0; i<nprobe; i++) n += index->lists[clist[i]].n;
+	if(n==0) return LABEL_INVALID;
+
+	double * distances = malloc(n*sizeof(double));
+	int * ids = malloc(n*sizeof(int));
+	float * lut = malloc((size_t)m*IVFPQ_KSUB*sizeof(float));
+	float * approx = malloc((n+IVFPQ_BLOCK)*sizeof(float));
+	if(!distances || !ids || !lut || !approx)
+	{
+		free(distances); free(ids); free(lut); free(approx);
+		return LABEL_INVALID;
+	}
+
+	//approximate distances of every image in the probed lists
+	uint32_t c = 0;
+	for(int i=0; i<nprobe; i++)
+	{
+		const struct ivfpq_list * list = &index->lists[clist[i]];
+		if(!list->n) continue;
+		const float * cent = index->coarse+(size_t)clist[i]*d;
+		for(int j=0; j<m; j++)
+		{
+			int off = index->sub_off[j], dsub = index->sub_off[j+1]-off;
+			const float * pq = index->pq+(size_t)IVFPQ_KSUB*off;
+			for(int s=0; s<IVFPQ_KSUB; s++)
+			{
+				float sum = 0;
+				if(s<index->ksub)
+				{
+					for(int p=0; p<dsub; p++)
+					{
+						float diff = q[off+p]-cent[off+p]-pq[s*dsub+p];
+						sum += diff*diff;
+					}
+				}
+				lut[j*IVFPQ_KSUB+s] = sum;
+			}
+		}
+		index->scan(lut, list->codes, list->n, m, approx);
+		for(uint32_t e=0; e<list->n; e++)
+		{
+			distances[c] = approx[e];
+			ids[c] = list->ids[e];
+			c++;
+		}
+	}
+	assert(c==n);
+
+	//exact re-ranking of the best candidates
+	if(rerank>0 && index->raw)
+	{
+		distance_t euclid = create_distance_function("euclid");
+		if((uint32_t) rerank<n)
+		{
+			quickselect(distances, ids, 0, n-1, rerank-1);
+			n = rerank;
+		}
+		for(uint32_t i=0; i<n; i++)
+			distances[i] = euclid(img, index->raw+(size_t)ids[i]*d,
+								index->x, index->y);
+	}
+
+	//reuse ids for the labels
+	for(uint32_t i=0; i<n; i++) ids[i] = index->labels[ids[i]];
+	int label = knn_vote(distances, ids, n, k);
+
+	free(distances);
+	free(ids);
+	free(lut);
+	free(approx);
+	return label;
+}
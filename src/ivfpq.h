@@ -0,0 +1,61 @@
+#ifndef IVFPQ_H
+#define IVFPQ_H
+#include <stdbool.h>
+#include "mnist.h"
+/*
+Inverted-file index with product-quantized residuals (IVF-PQ).
+
+A k-means coarse quantizer splits the training images into nlist lists.
+Every image is stored in the list of its closest coarse centroid, as an
+m byte code: the residual (image - centroid) is cut into m sub-vectors and
+each sub-vector is replaced by the index of the closest of IVFPQ_KSUB
+sub-centroids. A query only scans the nprobe closest lists, and the
+distance to each code is the sum of m lookups in a per-list table.
+
+Optionally the best candidates are re-ranked with the exact euclid
+distance, reading the raw images from the mmapped idx file.
+*/
+
+#define IVFPQ_INVALID NULL
+//sub-centroids per sub-quantizer; codes are one byte each.
+#define IVFPQ_KSUB 256
+//codes are stored in blocks of this many images (see ivfpq.c)
+#define IVFPQ_BLOCK 8
+#define IVFPQ_DEFAULT_NLIST 256
+#define IVFPQ_DEFAULT_M 16
+#define IVFPQ_KMEANS_ITERS 15
+//seed of the k-means initialisation (see sample.h)
+#define IVFPQ_SEED 0x6976667071ULL
+
+typedef struct ivfpq * ivfpq_t;
+
+// trains the coarse quantizer (nlist centroids) and the m product
+// quantizers on the images of sample. nlist and IVFPQ_KSUB are clamped to
+// the number of sample images. The sample only needs to be a few times
+// larger than nlist, so it can be drawn with mnist_create_sample.
+// The k-means draws from streams of IVFPQ_SEED, not rand(), so the same
+// sample always gives the same index.
+// Returns IVFPQ_INVALID on error. Free with ivfpq_free.
+ivfpq_t ivfpq_train(mnist_dataset_handle sample, int nlist, int m);
+
+// encodes every image of the dataset 'name' (same naming convention as
+// mnist_open) into the index. The image file is mmapped instead of read,
+// so it does not need to fit in memory; the mapping is kept for exact
+// re-ranking. Only one file can be added to an index.
+// Returns false if the files cannot be read or don't match the index.
+bool ivfpq_add_file(ivfpq_t index, const char * name);
+
+// number of images encoded in the index, <0 if index is IVFPQ_INVALID
+int ivfpq_count(const ivfpq_t index);
+
+// classifies img (x*y bytes, same size as the training images).
+// k is 0-indexed as in knn_data_best_label. nprobe is the number of lists
+// to scan. If rerank>0, the rerank best PQ candidates are re-ranked with
+// the exact euclid distance before voting.
+// Returns LABEL_INVALID on error.
+int ivfpq_best_label(const ivfpq_t index, const unsigned char * img,
+					int k, int nprobe, int rerank);
+
+void ivfpq_free(ivfpq_t index);
+
+#endif
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L // for pthreads and mmap
 #include "knn.h"
 #include "mnist.h"
 #include "distance.h"
@@ -6,7 +7,16 @@
 #include <errno.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 #ifndef dprint
@@ -19,6 +29,9 @@
 #endif
 
 #define NUM_IMG_LABELS 10
+//slack on the difference of norms of the euclid search, for the rounding
+// of sqrt
+#define NORM_SLACK 1e-6
 #define SWAP(x, y, TYPE) do {TYPE _t=x; x=y ; y=_t;} while (0)
 
 //convenience
@@ -32,11 +45,6 @@ struct knn_data
 	// k nearest labels
 	int * labels;
 
-	//closest distance of each group with label [i] 
-	// i.e. min_dist[1] is the smallest distance of a 
-	// test_img with label=1.  Use this to break ties.
-	double min_dist[NUM_IMG_LABELS];
-
 	mnist_image_handle train_img;
 	mnist_dataset_handle test_dataset;
 
@@ -69,11 +77,18 @@ knn_data_t knn_data_create(mnist_image_handle train_img,
 	knn->labels = labels;
 	knn->train_img = (mnist_image_handle) train_img;
 	knn->test_dataset = (mnist_dataset_handle) test_dataset;
-	for(int i=0 ; i<NUM_IMG_LABELS; i++) {knn->min_dist[i] = DBL_MAX;}
 
 	return knn;
 }
 
+bool knn_data_set_image(knn_data_t knn, mnist_image_handle train_img)
+{
+	//reuse the distances and labels buffers for another image
+	if(knn==KNN_INVALID || train_img==MNIST_IMAGE_INVALID) return false;
+	knn->train_img = train_img;
+	return true;
+}
+
 void knn_data_free(knn_data_t k)
 {
 	if(k!=KNN_INVALID)
@@ -193,13 +208,92 @@ double * knn_data_get_distances(knn_data_t knn, distance_t distance)
 		dprint("d:%f\tl:%d\ti:%d",d,l,i);
 		knn->distances[i] = d;
 		knn->labels[i] = l;
-		if(d<knn->min_dist[l]) knn->min_dist[l] = d;
 		test_img = mnist_image_next(test_img);
 	}	
 
 	return knn->distances;
 }
 
+int * knn_data_get_labels(knn_data_t knn)
+{
+	if(knn == KNN_INVALID) return NULL;
+	return knn->labels;
+}
+
+
+int knn_vote(double distances[], int labels[], int n, int k)
+{
+	//counts the labels of every entry that is no further away than the
+	// k-th smallest distance (0-indexed) and returns the label with 
+	// plurality. If several labels have the same count, the label with 
+	// the CLOSEST point wins.
+	if((n<=0)||(k<0)||(k>=n)) return LABEL_INVALID;
+
+	//also partially sorts the distances and labels.
+	double k_dist = quickselect(distances, labels, 0, n-1, k);
+	int lblcnt[NUM_IMG_LABELS] = {0};
+
+	//closest distance of each group with label [i] 
+	// i.e. min_dist[1] is the smallest distance of a 
+	// neighbor with label=1.  Use this to break ties.
+	double min_dist[NUM_IMG_LABELS];
+	for(int i=0 ; i<NUM_IMG_LABELS; i++) {min_dist[i] = DBL_MAX;}
+
+	//count labels where dist <= kdist
+	for (int i=0; i<n; i++)
+	{	
+		double d = distances[i];
+		int l = labels[i];
+		if((l<0)||(l>=NUM_IMG_LABELS)) continue;
+		if(d <= k_dist)
+		{
+			lblcnt[l]++;
+			if(d<min_dist[l]) min_dist[l] = d;
+		}
+	}
+
+	int max_cnt = 0;
+	int best_label = LABEL_INVALID;
+
+	for(int i=0; i<NUM_IMG_LABELS; i++)
+	{
+		if(lblcnt[i]>max_cnt)
+		{
+			max_cnt = lblcnt[i];
+			best_label = i;
+		}
+		else if ((lblcnt[i] == max_cnt) && (max_cnt>0))
+		{
+			if(min_dist[i] < min_dist[best_label])
+				best_label = i;
+		}
+	}
+	dprint("k:%d\tk_dist:%f\tbest_label:%d",k,k_dist,best_label);
+	return best_label;
+}
+
+
+int knn_candidates(double distances[], int labels[], int n, int k)
+{
+	//moves the k nearest (0-indexed k) and everything tied with the k-th
+	// to the front of the lists. A vote among the candidates of several 
+	// lists gives the same label as a vote among the whole lists.
+	if((n<0)||(k<0)) return -1;
+	if(n<=k+1) return n;
+	double k_dist = quickselect(distances, labels, 0, n-1, k);
+	int count = k+1;
+	for(int i=count; i<n; i++)
+	{
+		if(distances[i]<=k_dist)
+		{
+			distances[count] = distances[i];
+			labels[count] = labels[i];
+			count++;
+		}
+	}
+	return count;
+}
+
 
 int knn_data_best_label(knn_data_t knn, int k, distance_t distance)
 {
@@ -211,49 +305,848 @@ int knn_data_best_label(knn_data_t knn, int k, distance_t distance)
 
 	//find the kth smallest distance (0-indexed!!, so need to subtract 1 when 
 	// calling this function!
-	// also partially sorts the distances and labels.
 	double * distances = knn_data_get_distances(knn, distance);
 	if(!distances) return LABEL_INVALID;
 	int num_imgs = mnist_image_count(knn->test_dataset);
 	if((k<0)||(k>=num_imgs)) return LABEL_INVALID;
-	// if(k>=num_imgs)
-	// {
-	// 	printf("%s: warning: k:%d>num_imgs:%d. Setting k=num_imgs.\n"
-	// 			,__func__, k+1,num_imgs);
-	// 	k=num_imgs-1;
-	// }	
-	double k_dist = quickselect(knn->distances,knn->labels, 0, num_imgs-1, k);
-	// num of distances <= k_dist
-	int n = 0;
-	int lblcnt[NUM_IMG_LABELS] = {0};
-	//count labels where dist < kdist
-	// for(int i=0; i<num_imgs; i++){dprint("label[%d]:%d",i,knn->labels[i]);}
-	for (int i=0; i<num_imgs; i++)
-	{	
-		double d = knn->distances[i];
-		int l = knn->labels[i];
-		// dprint("d:%f\tl:%d",d,l);
-		//add to nearest neighbors if <k_dist
-		if(d <= k_dist) {lblcnt[l]++; n++;}
-	}
+	return knn_vote(knn->distances, knn->labels, num_imgs, k);
+}
 
-	int max_cnt = 0;
-	int best_label = -1;
 
-	for(int i=0; i<NUM_IMG_LABELS; i++)
+int knn_data_best_label_loo(knn_data_t knn, int k, distance_t distance)
+{
+	//leave-one-out version of knn_data_best_label: the image itself is 
+	// part of the dataset, but does not get a vote.
+	double * distances = knn_data_get_distances(knn, distance);
+	if(!distances) return LABEL_INVALID;
+	int num_imgs = mnist_image_count(knn->test_dataset);
+
+	//find the image and move it to the end of the lists
+	mnist_image_handle img = mnist_image_begin(knn->test_dataset);
+	for(int i=0; i<num_imgs; i++)
 	{
-		if(lblcnt[i]>max_cnt)
+		if(img==knn->train_img)
 		{
-			max_cnt = lblcnt[i];
-			best_label = i;
+			SWAP(knn->distances[i], knn->distances[num_imgs-1], double);
+			SWAP(knn->labels[i], knn->labels[num_imgs-1], int);
+			num_imgs--;
+			break;
 		}
-		else if (lblcnt[i] == max_cnt)
+		img = mnist_image_next(img);
+	}
+	if((k<0)||(k>=num_imgs)) return LABEL_INVALID;
+	return knn_vote(knn->distances, knn->labels, num_imgs, k);
+}
+
+//metrics the classifier knows more about than their distance_t
+#define METRIC_OTHER 0
+#define METRIC_EUCLID 1
+#define METRIC_REDUCED 2
+
+struct _entries
+{
+	//images, labels, keys (norm for euclid, sum of the pixels for 
+	// reduced, 0 otherwise) and ids; len of cap are used
+	const uchar ** imgs;
+	int * labels;
+	double * keys;
+	int * ids;
+	int len, cap;
+};
+
+//words of a snapshot header
+#define SNAP_VERSION_IX 1
+#define SNAP_BOM_IX 2
+#define SNAP_K_IX 3
+#define SNAP_COUNT_IX 4
+#define SNAP_IDS_IX 5
+#define SNAP_X_IX 6
+#define SNAP_Y_IX 7
+#define SNAP_STRIDE_IX 8
+#define SNAP_DATA_IX 9
+#define SNAP_NAME_OFFSET 64
+#define SNAP_BOM 0x01020304
+//suffix of the file a snapshot is written to before it is renamed
+#define SNAP_TMP ".tmp"
+_Static_assert(sizeof(int)==sizeof(int32_t), "snapshots store ints as int32");
+_Static_assert(SNAP_NAME_OFFSET+KNN_METRIC_NAME_SIZE<=KNN_SNAPSHOT_HEADER_SIZE,
+			   "the metric name fits in the header");
+
+struct knn_classifier
+{
+	int metric;
+	char name[KNN_METRIC_NAME_SIZE];
+	distance_t distance;
+	int k;
+	uint x, y;
+	size_t size;
+	//ids below num_train are the images of the training set (or of the
+	// snapshot); the others were inserted, and their copies belong to
+	// the classifier
+	int num_train;
+	//the file of a loaded snapshot, mapped; main's arrays point into it
+	// until the first compaction (but imgs, which is allocated)
+	uint8_t * mapping;
+	size_t mapping_len;
+	bool main_mapped;
+
+	//predictions take the read side, updates, snapshots and the swap of
+	// a compaction the write side
+	pthread_rwlock_t lock;
+	//sorted by key (ties by id), and inserted since the last compaction,
+	// in insertion order
+	struct _entries main, delta;
+	//tombstones by id; num_dead of them are still in main or delta
+	bool * dead;
+	int num_ids, ids_cap, num_dead, num_live;
+
+	//background compaction, started by the first update that needs it.
+	// The flags are under wake_lock (taken after lock, never before): 
+	// pending wakes the compactor, and compacting is set during a 
+	// compaction, one at a time (idle is signalled when it ends)
+	pthread_t compactor;
+	pthread_mutex_t wake_lock;
+	pthread_cond_t wake, idle;
+	bool started, stopping, pending, compacting;
+};
+
+//buffers of a prediction, allocated by each call so that predictions
+// run side by side: candidates (room for every entry), and a max-heap 
+// of the k+1 smallest squared distances
+struct _candidates
+{
+	double * distances;
+	int * labels;
+	uint32_t * heap;
+};
+
+struct _sort_key
+{
+	double key;
+	int i;
+};
+
+static int _compare_key(const void * a, const void * b)
+{
+	const struct _sort_key * ka = a, * kb = b;
+	if(ka->key!=kb->key) return ka->key<kb->key ? -1 : 1;
+	return ka->i-kb->i;
+}
+
+static uint32_t _pixel_sum(const uchar * img, size_t size, bool squares)
+{
+	uint32_t sum = 0;
+	for(size_t p=0; p<size; p++) sum += squares ? (uint32_t) img[p]*img[p] : img[p];
+	return sum;
+}
+
+static double _key(const knn_classifier_t c, const uchar * img)
+{
+	if(c->metric==METRIC_EUCLID) return sqrt(_pixel_sum(img, c->size, true));
+	if(c->metric==METRIC_REDUCED) return _pixel_sum(img, c->size, false);
+	return 0;
+}
+
+static double _image_key(const knn_classifier_t c, mnist_image_handle img)
+{
+	//the key of a dataset's image: read from an aligned file, which 
+	// stores the norms and sums, else computed by mnist as _key would
+	if(c->metric==METRIC_EUCLID) return sqrt(mnist_image_norm2(img));
+	if(c->metric==METRIC_REDUCED) return mnist_image_sum(img);
+	return 0;
+}
+
+static bool _entries_reserve(struct _entries * e, int cap)
+{
+	if(cap<=e->cap) return true;
+	const uchar ** imgs = realloc(e->imgs, cap*sizeof(uchar *));
+	if(imgs) e->imgs = imgs;
+	int * labels = realloc(e->labels, cap*sizeof(int));
+	if(labels) e->labels = labels;
+	double * keys = realloc(e->keys, cap*sizeof(double));
+	if(keys) e->keys = keys;
+	int * ids = realloc(e->ids, cap*sizeof(int));
+	if(ids) e->ids = ids;
+	if(!imgs || !labels || !keys || !ids) return false;
+	e->cap = cap;
+	return true;
+}
+
+static void _entries_free(struct _entries * e)
+{
+	free(e->imgs);
+	free(e->labels);
+	free(e->keys);
+	free(e->ids);
+	memset(e, 0, sizeof(struct _entries));
+}
+
+static void _entries_copy(struct _entries * dst, int to, 
+						  const struct _entries * src, int from)
+{
+	dst->imgs[to] = src->imgs[from];
+	dst->labels[to] = src->labels[from];
+	dst->keys[to] = src->keys[from];
+	dst->ids[to] = src->ids[from];
+}
+
+static bool _entries_sort(const struct _entries * src, struct _entries * dst)
+{
+	//dst is src sorted by key, then id
+	struct _sort_key * order = malloc((src->len ? src->len : 1)*sizeof(struct _sort_key));
+	if(!order || !_entries_reserve(dst, src->len))
+	{
+		free(order);
+		return false;
+	}
+	for(int i=0; i<src->len; i++)
+	{
+		order[i].key = src->keys[i];
+		order[i].i = i;
+	}
+	qsort(order, src->len, sizeof(struct _sort_key), _compare_key);
+	for(int i=0; i<src->len; i++) _entries_copy(dst, i, src, order[i].i);
+	dst->len = src->len;
+	free(order);
+	return true;
+}
+
+static void _init_locks(knn_classifier_t c)
+{
+	pthread_rwlock_init(&c->lock, NULL);
+	pthread_mutex_init(&c->wake_lock, NULL);
+	pthread_cond_init(&c->wake, NULL);
+	pthread_cond_init(&c->idle, NULL);
+}
+
+knn_classifier_t knn_classifier_fit(mnist_dataset_handle train,
+									const char * metric, int k)
+{
+	int n = mnist_image_count(train);
+	if(n<=0 || !metric || k<0 || k>=n) return KNN_CLASSIFIER_INVALID;
+	distance_t distance = create_distance_function(metric);
+	if(!distance) return KNN_CLASSIFIER_INVALID;
+
+	if(strlen(metric)>=KNN_METRIC_NAME_SIZE) return KNN_CLASSIFIER_INVALID;
+	knn_classifier_t c = calloc(1, sizeof(struct knn_classifier));
+	if(!c) return KNN_CLASSIFIER_INVALID;
+	strcpy(c->name, metric);
+	c->metric = !strcmp(metric, "euclid") ? METRIC_EUCLID
+			  : !strcmp(metric, "reduced") ? METRIC_REDUCED : METRIC_OTHER;
+	c->distance = distance;
+	c->k = k;
+	mnist_image_size(train, &c->x, &c->y);
+	c->size = (size_t) c->x*c->y;
+	c->num_train = c->num_ids = c->ids_cap = c->num_live = n;
+	_init_locks(c);
+	struct _entries all = {0};
+	c->dead = calloc(n, sizeof(bool));
+	if(!c->dead || !_entries_reserve(&all, n))
+	{
+		_entries_free(&all);
+		knn_classifier_free(c);
+		errno = ENOMEM;
+		return KNN_CLASSIFIER_INVALID;
+	}
+
+	mnist_image_handle img = mnist_image_begin(train);
+	for(int i=0; i<n; i++, img=mnist_image_next(img))
+	{
+		all.imgs[i] = mnist_image_data(img);
+		all.labels[i] = mnist_image_label(img);
+		all.keys[i] = _image_key(c, img);
+		all.ids[i] = i;
+	}
+	all.len = n;
+	bool ok = _entries_sort(&all, &c->main);
+	_entries_free(&all);
+	if(!ok)
+	{
+		knn_classifier_free(c);
+		errno = ENOMEM;
+		return KNN_CLASSIFIER_INVALID;
+	}
+	dprint("metric:%s\tn:%d\tk:%d", metric, n, k);
+	return c;
+}
+
+static bool _merge(const knn_classifier_t c, const struct _entries * delta,
+				   const bool * dead, struct _entries * merged, 
+				   uchar ** garbage, int * num_garbage)
+{
+	//merged is main and delta sorted, without the dead entries; the 
+	// inserted images among those go to garbage (if not NULL)
+	struct _entries sorted = {0};
+	const struct _entries * main = &c->main;
+	int total = main->len+delta->len;
+	merged->len = 0;
+	bool ok = _entries_sort(delta, &sorted) 
+			  && _entries_reserve(merged, total ? total : 1);
+	for(int i=0, j=0; ok && (i<main->len || j<sorted.len); )
+	{
+		bool from_main = j>=sorted.len || (i<main->len
+			&& (main->keys[i]<sorted.keys[j] || (main->keys[i]==sorted.keys[j]
+			&& main->ids[i]<sorted.ids[j])));
+		const struct _entries * src = from_main ? main : &sorted;
+		int at = from_main ? i++ : j++;
+		if(!dead[src->ids[at]]) _entries_copy(merged, merged->len++, src, at);
+		else if(garbage && src->ids[at]>=c->num_train)
+			garbage[(*num_garbage)++] = (uchar *) src->imgs[at];
+	}
+	_entries_free(&sorted);
+	return ok;
+}
+
+static void _free_main(knn_classifier_t c)
+{
+	//the arrays of a loaded snapshot are in its mapping, but imgs
+	if(!c->main_mapped) _entries_free(&c->main);
+	free(c->main.imgs);
+	memset(&c->main, 0, sizeof(struct _entries));
+	c->main_mapped = false;
+}
+
+static bool _compact(knn_classifier_t c)
+{
+	//merges the sorted delta into main, without the dead entries. The
+	// merge works on a copy of delta and of the tombstones, without the
+	// lock: main only changes here, one compaction at a time (a second
+	// one waits for the first, then merges what is left).
+	pthread_mutex_lock(&c->wake_lock);
+	while(c->compacting) pthread_cond_wait(&c->idle, &c->wake_lock);
+	c->compacting = true;
+	pthread_mutex_unlock(&c->wake_lock);
+
+	pthread_rwlock_rdlock(&c->lock);
+	struct _entries delta = {0}, merged = {0};
+	int d0 = c->delta.len, num_ids = c->num_ids;
+	bool * dead = malloc(num_ids*sizeof(bool));
+	bool ok = dead && _entries_reserve(&delta, d0 ? d0 : 1);
+	if(ok)
+	{
+		memcpy(dead, c->dead, num_ids*sizeof(bool));
+		for(int i=0; i<d0; i++) _entries_copy(&delta, i, &c->delta, i);
+		delta.len = d0;
+	}
+	pthread_rwlock_unlock(&c->lock);
+
+	int total = c->main.len+d0, num_garbage = 0;
+	//the inserted images that are dead, freed once nothing points to them
+	uchar ** garbage = malloc((total ? total : 1)*sizeof(uchar *));
+	ok = ok && garbage && _merge(c, &delta, dead, &merged, garbage, &num_garbage);
+	int removed = total-merged.len;
+
+	pthread_rwlock_wrlock(&c->lock);
+	if(ok)
+	{
+		_free_main(c);
+		c->main = merged;
+		//what was inserted since the copy stays in delta
+		int left = c->delta.len-d0;
+		memmove(c->delta.imgs, c->delta.imgs+d0, left*sizeof(uchar *));
+		memmove(c->delta.labels, c->delta.labels+d0, left*sizeof(int));
+		memmove(c->delta.keys, c->delta.keys+d0, left*sizeof(double));
+		memmove(c->delta.ids, c->delta.ids+d0, left*sizeof(int));
+		c->delta.len = left;
+		c->num_dead -= removed;
+	}
+	pthread_rwlock_unlock(&c->lock);
+	pthread_mutex_lock(&c->wake_lock);
+	c->compacting = false;
+	pthread_cond_broadcast(&c->idle);
+	pthread_mutex_unlock(&c->wake_lock);
+
+	if(ok) for(int i=0; i<num_garbage; i++) free(garbage[i]);
+	else _entries_free(&merged);
+	dprint("merged %d inserted, removed %d, ok:%d", d0, removed, ok);
+	free(garbage);
+	free(dead);
+	_entries_free(&delta);
+	return ok;
+}
+
+static bool _should_compact(const knn_classifier_t c)
+{
+	int limit = c->main.len/KNN_COMPACT_RATIO;
+	if(limit<KNN_COMPACT_MIN) limit = KNN_COMPACT_MIN;
+	return c->delta.len>limit || c->num_dead>limit;
+}
+
+static void * _compactor(void * arg)
+{
+	//compacts when woken, as long as it's still due: the updates made
+	// during a compaction wake it again
+	knn_classifier_t c = arg;
+	pthread_mutex_lock(&c->wake_lock);
+	while(true)
+	{
+		while(!c->stopping && !c->pending)
+			pthread_cond_wait(&c->wake, &c->wake_lock);
+		if(c->stopping) break;
+		c->pending = false;
+		pthread_mutex_unlock(&c->wake_lock);
+		pthread_rwlock_rdlock(&c->lock);
+		bool due = _should_compact(c);
+		pthread_rwlock_unlock(&c->lock);
+		if(due) _compact(c);
+		pthread_mutex_lock(&c->wake_lock);
+	}
+	pthread_mutex_unlock(&c->wake_lock);
+	return NULL;
+}
+
+static void _updated(knn_classifier_t c)
+{
+	//called with the write lock held: wakes the compactor if it's time
+	if(!_should_compact(c)) return;
+	if(!c->started) c->started = !pthread_create(&c->compactor, NULL, _compactor, c);
+	pthread_mutex_lock(&c->wake_lock);
+	c->pending = true;
+	pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->wake_lock);
+}
+
+int knn_classifier_insert(knn_classifier_t c, const unsigned char * img,
+						  int label)
+{
+	if(c==KNN_CLASSIFIER_INVALID || !img || label<0 || label>UCHAR_MAX) return -1;
+	uchar * copy = malloc(c->size);
+	if(!copy) return -1;
+	memcpy(copy, img, c->size);
+	double key = _key(c, copy);
+
+	pthread_rwlock_wrlock(&c->lock);
+	//room for it in delta and the tombstones
+	bool ok = (c->delta.len<c->delta.cap
+			   || _entries_reserve(&c->delta, c->delta.cap ? 2*c->delta.cap : 64))
+			  && c->num_ids<INT_MAX;
+	if(ok && c->num_ids==c->ids_cap)
+	{
+		bool * dead = realloc(c->dead, 2*c->ids_cap*sizeof(bool));
+		if(dead) c->dead = dead;
+		if((ok = dead)) c->ids_cap *= 2;
+	}
+	int id = -1;
+	if(ok)
+	{
+		id = c->num_ids++;
+		c->dead[id] = false;
+		struct _entries * d = &c->delta;
+		d->imgs[d->len] = copy;
+		d->labels[d->len] = label;
+		d->keys[d->len] = key;
+		d->ids[d->len++] = id;
+		c->num_live++;
+		_updated(c);
+	}
+	pthread_rwlock_unlock(&c->lock);
+	if(!ok) free(copy);
+	return id;
+}
+
+bool knn_classifier_remove(knn_classifier_t c, int id)
+{
+	if(c==KNN_CLASSIFIER_INVALID) return false;
+	pthread_rwlock_wrlock(&c->lock);
+	bool ok = id>=0 && id<c->num_ids && !c->dead[id];
+	if(ok)
+	{
+		c->dead[id] = true;
+		c->num_dead++;
+		c->num_live--;
+		_updated(c);
+	}
+	pthread_rwlock_unlock(&c->lock);
+	return ok;
+}
+
+int knn_classifier_count(const knn_classifier_t c)
+{
+	if(c==KNN_CLASSIFIER_INVALID) return -1;
+	pthread_rwlock_rdlock(&c->lock);
+	int n = c->num_live;
+	pthread_rwlock_unlock(&c->lock);
+	return n;
+}
+
+bool knn_classifier_compact(knn_classifier_t c)
+{
+	return c!=KNN_CLASSIFIER_INVALID && _compact(c);
+}
+
+static uint64_t _snapshot_layout(uint64_t count, uint64_t num_ids,
+								 uint64_t offsets[4])
+{
+	//offsets in a snapshot of the labels, keys, ids and tombstones
+	// (MNIST_ALIGN aligned); returns the offset of the images, a multiple
+	// of MNIST_ALIGNED_PAGE
+	offsets[0] = KNN_SNAPSHOT_HEADER_SIZE;
+	offsets[1] = (offsets[0]+4*count+MNIST_ALIGN-1)/MNIST_ALIGN*MNIST_ALIGN;
+	offsets[2] = (offsets[1]+8*count+MNIST_ALIGN-1)/MNIST_ALIGN*MNIST_ALIGN;
+	offsets[3] = (offsets[2]+4*count+MNIST_ALIGN-1)/MNIST_ALIGN*MNIST_ALIGN;
+	return (offsets[3]+num_ids+MNIST_ALIGNED_PAGE-1)/MNIST_ALIGNED_PAGE*MNIST_ALIGNED_PAGE;
+}
+
+bool knn_classifier_save(knn_classifier_t c, const char * path)
+{
+	if(c==KNN_CLASSIFIER_INVALID || !path) return false;
+	//written next to path and renamed over it: a snapshot being loaded 
+	// (or the one c was loaded from) never sees a partial file
+	char * tmp = malloc(strlen(path)+strlen(SNAP_TMP)+1);
+	if(!tmp) return false;
+	strcpy(tmp, path);
+	strcat(tmp, SNAP_TMP);
+	FILE * fp = fopen(tmp, "wb");
+	if(!fp)
+	{
+		free(tmp);
+		return false;
+	}
+	//only reads c: predictions go on, updates wait
+	pthread_rwlock_rdlock(&c->lock);
+	//the images still there, in search order, as a compaction would
+	struct _entries e = {0};
+	bool ok = _merge(c, &c->delta, c->dead, &e, NULL, NULL);
+	size_t size = c->size, stride = (size+MNIST_ALIGN-1)/MNIST_ALIGN*MNIST_ALIGN;
+	uint64_t offsets[4], data = _snapshot_layout(e.len, c->num_ids, offsets);
+	uint32_t header[KNN_SNAPSHOT_HEADER_SIZE/4] = {0};
+	header[MN_IX] = htonl(KNN_SNAPSHOT_MAGIC_NUM);
+	header[SNAP_VERSION_IX] = htonl(KNN_SNAPSHOT_VERSION);
+	header[SNAP_BOM_IX] = SNAP_BOM;
+	header[SNAP_K_IX] = htonl(c->k);
+	header[SNAP_COUNT_IX] = htonl(e.len);
+	header[SNAP_IDS_IX] = htonl(c->num_ids);
+	header[SNAP_X_IX] = htonl(c->x);
+	header[SNAP_Y_IX] = htonl(c->y);
+	header[SNAP_STRIDE_IX] = htonl(stride);
+	header[SNAP_DATA_IX] = htonl((uint32_t)(data>>32));
+	header[SNAP_DATA_IX+1] = htonl((uint32_t) data);
+	memcpy((uint8_t *) header+SNAP_NAME_OFFSET, c->name, strlen(c->name));
+	ok = ok && stride<=UINT32_MAX && fwrite(header, sizeof(header), 1, fp)==1
+		 && fwrite(e.labels, sizeof(int), e.len, fp)==e.len
+		 && !fseek(fp, offsets[1], SEEK_SET)
+		 && fwrite(e.keys, sizeof(double), e.len, fp)==e.len
+		 && !fseek(fp, offsets[2], SEEK_SET)
+		 && fwrite(e.ids, sizeof(int), e.len, fp)==e.len
+		 && !fseek(fp, offsets[3], SEEK_SET)
+		 && fwrite(c->dead, sizeof(bool), c->num_ids, fp)==c->num_ids
+		 && !fseek(fp, data, SEEK_SET);
+	static const uchar zeros[MNIST_ALIGN] = {0};
+	for(int i=0; i<e.len && ok; i++)
+		ok = fwrite(e.imgs[i], 1, size, fp)==size
+			 && fwrite(zeros, 1, stride-size, fp)==stride-size;
+	pthread_rwlock_unlock(&c->lock);
+	ok &= !fclose(fp);
+	ok = ok && !rename(tmp, path);
+	if(!ok) remove(tmp);
+	free(tmp);
+	dprint("%s: %d images, stride %zu, images at %llu, ok:%d", path, e.len,
+			stride, (unsigned long long) data, ok);
+	_entries_free(&e);
+	return ok;
+}
+
+static uint8_t * _map_snapshot(const char * path, size_t * len)
+{
+	//the whole file, read-only; NULL on error or if it's empty
+	int fd = open(path, O_RDONLY);
+	if(fd<0) return NULL;
+	struct stat st;
+	void * p = MAP_FAILED;
+	if(!fstat(fd, &st) && st.st_size>0)
+	{
+		*len = st.st_size;
+		p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	//the mapping stays valid after the file is closed
+	close(fd);
+	return p==MAP_FAILED ? NULL : p;
+}
+
+knn_classifier_t knn_classifier_load(const char * path)
+{
+	if(!path) return KNN_CLASSIFIER_INVALID;
+	size_t len;
+	uint8_t * buf = _map_snapshot(path, &len);
+	if(!buf) return KNN_CLASSIFIER_INVALID;
+
+	//the header, and a file long enough for what it announces
+	const uint32_t * h32 = (const uint32_t *) buf;
+	char name[KNN_METRIC_NAME_SIZE] = {0};
+	uint64_t count = 0, num_ids = 0, size = 0, stride = 0, data = 0, offsets[4];
+	int k = -1;
+	bool ok = len>=KNN_SNAPSHOT_HEADER_SIZE 
+			  && ntohl(h32[MN_IX])==KNN_SNAPSHOT_MAGIC_NUM
+			  && ntohl(h32[SNAP_VERSION_IX])==KNN_SNAPSHOT_VERSION
+			  && h32[SNAP_BOM_IX]==SNAP_BOM;
+	if(ok)
+	{
+		k = ntohl(h32[SNAP_K_IX]);
+		count = ntohl(h32[SNAP_COUNT_IX]);
+		num_ids = ntohl(h32[SNAP_IDS_IX]);
+		size = (uint64_t) ntohl(h32[SNAP_X_IX])*ntohl(h32[SNAP_Y_IX]);
+		stride = ntohl(h32[SNAP_STRIDE_IX]);
+		data = (uint64_t) ntohl(h32[SNAP_DATA_IX])<<32 | ntohl(h32[SNAP_DATA_IX+1]);
+		memcpy(name, buf+SNAP_NAME_OFFSET, KNN_METRIC_NAME_SIZE-1);
+		ok = k>=0 && k<INT_MAX && count<=num_ids && num_ids<INT_MAX && size
+			 && stride>=size && stride%MNIST_ALIGN==0
+			 && data==_snapshot_layout(count, num_ids, offsets)
+			 && len>=data && (len-data)/stride>=count
+			 && create_distance_function(name);
+	}
+	knn_classifier_t c = ok ? calloc(1, sizeof(struct knn_classifier)) : NULL;
+	if(!c)
+	{
+		munmap(buf, len);
+		return KNN_CLASSIFIER_INVALID;
+	}
+	c->mapping = buf;
+	c->mapping_len = len;
+	strcpy(c->name, name);
+	c->metric = !strcmp(name, "euclid") ? METRIC_EUCLID
+			  : !strcmp(name, "reduced") ? METRIC_REDUCED : METRIC_OTHER;
+	c->distance = create_distance_function(name);
+	c->k = k;
+	c->x = ntohl(h32[SNAP_X_IX]);
+	c->y = ntohl(h32[SNAP_Y_IX]);
+	c->size = size;
+	c->num_train = c->num_ids = num_ids;
+	c->ids_cap = num_ids ? num_ids : 1;
+	c->num_live = count;
+	_init_locks(c);
+
+	//the arrays are used in place, but the image pointers and tombstones
+	c->main_mapped = true;
+	c->main.labels = (int *)(buf+offsets[0]);
+	c->main.keys = (double *)(buf+offsets[1]);
+	c->main.ids = (int *)(buf+offsets[2]);
+	c->main.len = c->main.cap = count;
+	c->main.imgs = malloc((count ? count : 1)*sizeof(uchar *));
+	c->dead = malloc(c->ids_cap*sizeof(bool));
+	ok = c->main.imgs && c->dead;
+	if(ok) memcpy(c->dead, buf+offsets[3], num_ids*sizeof(bool));
+	for(uint64_t i=0; i<count && ok; i++)
+	{
+		//an id out of range would index past the tombstones
+		ok = c->main.ids[i]>=0 && c->main.ids[i]<(int) num_ids;
+		c->main.imgs[i] = buf+data+i*stride;
+	}
+	if(!ok)
+	{
+		knn_classifier_free(c);
+		return KNN_CLASSIFIER_INVALID;
+	}
+	dprint("%s: %d images of %d ids, metric %s, k %d", path, (int) count,
+			(int) num_ids, name, k);
+	return c;
+}
+
+static int _lower_bound(const double keys[], int n, double key)
+{
+	//first position whose key is >= key
+	int lo = 0, hi = n;
+	while(lo<hi)
+	{
+		int mid = lo+(hi-lo)/2;
+		if(keys[mid]<key) lo = mid+1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static uint32_t _squared_distance(const uchar * a, const uchar * b,
+								  uint x, uint y, uint32_t bound)
+{
+	//sum of the squared differences, a row at a time; stops early (with
+	// a sum > bound) once it exceeds bound
+	uint32_t sum = 0;
+	for(uint r=0; r<y && sum<=bound; r++, a+=x, b+=x)
+		for(uint p=0; p<x; p++)
 		{
-			if(knn->min_dist[i] < knn->min_dist[best_label])
-				best_label = i;
+			int d = a[p]-b[p];
+			sum += d*d;
 		}
+	return sum;
+}
+
+static void _heap_add(uint32_t heap[], int * len, int cap, uint32_t v)
+{
+	//keeps the cap smallest values seen, the largest of them on top
+	int i;
+	if(*len<cap)
+	{
+		//sift up
+		for(i=(*len)++; i>0 && heap[(i-1)/2]<v; i=(i-1)/2) heap[i] = heap[(i-1)/2];
+		heap[i] = v;
+		return;
 	}
-	dprint("n: %d\tk:%d\tbest_label:%d",n,k,best_label);
-	return best_label;
+	if(v>=heap[0]) return;
+	//replace the top and sift down
+	for(i=0; 2*i+1<cap; )
+	{
+		int child = 2*i+1;
+		if(child+1<cap && heap[child+1]>heap[child]) child++;
+		if(heap[child]<=v) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = v;
 }
 
+struct _euclid_search
+{
+	struct _candidates * b;
+	const uchar * img;
+	//squared distance of the k-th nearest so far (once there are k+1)
+	uint32_t bound;
+	int count, heap_len;
+};
+
+static void _euclid_try(knn_classifier_t c, struct _euclid_search * s,
+						const uchar * img, int label)
+{
+	//img is a candidate if it's no further than the k+1 nearest so far,
+	// ties included
+	uint32_t d = _squared_distance(s->img, img, c->x, c->y, s->bound);
+	if(d>s->bound) return;
+	s->b->distances[s->count] = sqrt(d);
+	s->b->labels[s->count++] = label;
+	_heap_add(s->b->heap, &s->heap_len, c->k+1, d);
+	if(s->heap_len==c->k+1) s->bound = s->b->heap[0];
+}
+
+static int _predict_euclid(knn_classifier_t c, const uchar * img,
+						   struct _candidates * b)
+{
+	struct _euclid_search s = {b, img, UINT32_MAX, 0, 0};
+	double norm = sqrt(_pixel_sum(img, c->size, true));
+	//outward from the norm of img, the closer side first: the difference
+	// of norms only grows, so the first one too large ends the search
+	const struct _entries * e = &c->main;
+	int hi = _lower_bound(e->keys, e->len, norm), lo = hi-1;
+	while(lo>=0 || hi<e->len)
+	{
+		int i = (hi>=e->len || (lo>=0 && norm-e->keys[lo]<e->keys[hi]-norm)) ? lo-- : hi++;
+		double gap = fabs(norm-e->keys[i])-NORM_SLACK;
+		if(gap>0 && gap*gap>s.bound) break;
+		if(!c->dead[e->ids[i]]) _euclid_try(c, &s, e->imgs[i], e->labels[i]);
+	}
+	//then the images inserted since the last compaction, unsorted
+	e = &c->delta;
+	for(int i=0; i<e->len; i++)
+	{
+		double gap = fabs(norm-e->keys[i])-NORM_SLACK;
+		if((gap>0 && gap*gap>s.bound) || c->dead[e->ids[i]]) continue;
+		_euclid_try(c, &s, e->imgs[i], e->labels[i]);
+	}
+	dprint("candidates:%d of %d", s.count, c->main.len+c->delta.len);
+	return knn_vote(b->distances, b->labels, s.count, c->k);
+}
+
+static int _predict_reduced(knn_classifier_t c, const uchar * img,
+							struct _candidates * b)
+{
+	//the k+1 nearest sums and any tied with the k-th, in order of distance
+	const struct _entries * e = &c->main;
+	int n = e->len, count = 0;
+	double sum = _pixel_sum(img, c->size, false), k_dist = 0;
+	int hi = _lower_bound(e->keys, n, sum), lo = hi-1;
+	while(lo>=0 || hi<n)
+	{
+		int i = (hi>=n || (lo>=0 && sum-e->keys[lo]<e->keys[hi]-sum)) ? lo-- : hi++;
+		if(c->dead[e->ids[i]]) continue;
+		double d = fabs(sum-e->keys[i]);
+		if(count>c->k && d>k_dist) break;
+		b->distances[count] = d;
+		b->labels[count++] = e->labels[i];
+		if(count==c->k+1) k_dist = d;
+	}
+	//then every inserted image that could be among them
+	bool full = count>c->k;
+	e = &c->delta;
+	for(int i=0; i<e->len; i++)
+	{
+		double d = fabs(sum-e->keys[i]);
+		if(c->dead[e->ids[i]] || (full && d>k_dist)) continue;
+		b->distances[count] = d;
+		b->labels[count++] = e->labels[i];
+	}
+	return knn_vote(b->distances, b->labels, count, c->k);
+}
+
+static int _predict_other(knn_classifier_t c, const uchar * img,
+						  struct _candidates * b)
+{
+	int count = 0;
+	for(const struct _entries * e=&c->main; e; e=(e==&c->main ? &c->delta : NULL))
+		for(int i=0; i<e->len; i++)
+		{
+			if(c->dead[e->ids[i]]) continue;
+			b->distances[count] = c->distance(img, e->imgs[i], c->x, c->y);
+			b->labels[count++] = e->labels[i];
+		}
+	return knn_vote(b->distances, b->labels, count, c->k);
+}
+
+int knn_classifier_predict(knn_classifier_t c, const unsigned char * img)
+{
+	if(c==KNN_CLASSIFIER_INVALID || !img) return LABEL_INVALID;
+	pthread_rwlock_rdlock(&c->lock);
+	//at most every entry is a candidate
+	size_t cap = c->main.len+c->delta.len ? c->main.len+c->delta.len : 1;
+	struct _candidates b;
+	b.distances = malloc(cap*sizeof(double));
+	b.labels = malloc(cap*sizeof(int));
+	b.heap = malloc(((size_t) c->k+1)*sizeof(uint32_t));
+	int label = LABEL_INVALID;
+	if(b.distances && b.labels && b.heap)
+		label = c->metric==METRIC_EUCLID ? _predict_euclid(c, img, &b)
+			  : c->metric==METRIC_REDUCED ? _predict_reduced(c, img, &b)
+			  : _predict_other(c, img, &b);
+	pthread_rwlock_unlock(&c->lock);
+	free(b.distances);
+	free(b.labels);
+	free(b.heap);
+	return label;
+}
+
+int knn_classifier_predict_batch(knn_classifier_t c,
+								 mnist_dataset_handle test, int labels[])
+{
+	if(c==KNN_CLASSIFIER_INVALID || test==MNIST_DATASET_INVALID || !labels)
+		return -1;
+	uint x, y;
+	mnist_image_size(test, &x, &y);
+	int n = mnist_image_count(test);
+	if(n>0 && (x!=c->x || y!=c->y)) return -1;
+	mnist_image_handle img = mnist_image_begin(test);
+	for(int i=0; i<n; i++, img=mnist_image_next(img))
+		labels[i] = knn_classifier_predict(c, mnist_image_data(img));
+	return n;
+}
+
+void knn_classifier_free(knn_classifier_t c)
+{
+	if(c==KNN_CLASSIFIER_INVALID) return;
+	if(c->started)
+	{
+		pthread_mutex_lock(&c->wake_lock);
+		c->stopping = true;
+		pthread_cond_signal(&c->wake);
+		pthread_mutex_unlock(&c->wake_lock);
+		pthread_join(c->compactor, NULL);
+	}
+	//the inserted images still in main or delta
+	for(const struct _entries * e=&c->main; e; e=(e==&c->main ? &c->delta : NULL))
+		for(int i=0; i<e->len; i++)
+			if(e->ids[i]>=c->num_train) free((uchar *) e->imgs[i]);
+	_free_main(c);
+	_entries_free(&c->delta);
+	if(c->mapping) munmap(c->mapping, c->mapping_len);
+	pthread_rwlock_destroy(&c->lock);
+	pthread_mutex_destroy(&c->wake_lock);
+	pthread_cond_destroy(&c->wake);
+	pthread_cond_destroy(&c->idle);
+	free(c->dead);
+	free(c);
+}
@@ -41,10 +41,157 @@ double quickselect(double ix_list[], int data_list[],
 knn_data_t knn_data_create(mnist_image_handle train_img,
 						   mnist_dataset_handle test_dataset);
 
+// points knn at another image, so the same knn_data (and its buffers)
+// can classify many images against the same dataset.
+// Returns false if knn or train_img is invalid.
+bool knn_data_set_image(knn_data_t knn, mnist_image_handle train_img);
+
 void knn_data_free(knn_data_t k);
 
 double * knn_data_get_distances(knn_data_t knn, distance_t distance);
 
+// labels of the images of the dataset, in the order of the distances of
+// the last knn_data_get_distances (LABEL_INVALID before the first), so a
+// caller can select and vote (knn_candidates, knn_vote) on its own.
+// Returns NULL if knn is KNN_INVALID.
+int * knn_data_get_labels(knn_data_t knn);
+
 int knn_data_best_label(knn_data_t knn, int k, distance_t distance);
 
+// leave-one-out version of knn_data_best_label, for when the image is 
+// itself part of the dataset: it is left out of the vote.
+// (if it isn't part of the dataset, same as knn_data_best_label)
+int knn_data_best_label_loo(knn_data_t knn, int k, distance_t distance);
+
+// votes among the n candidates in distances/labels: returns the label 
+// occurring most often within the k-th smallest distance (0-indexed), 
+// breaking ties with the closest image. Partially sorts both lists.
+// Returns LABEL_INVALID if k is not in [0,n).
+int knn_vote(double distances[], int labels[], int n, int k);
+
+// moves the k nearest of the n candidates (k 0-indexed), and every 
+// candidate tied with the k-th, to the start of distances/labels and 
+// returns how many there are (n if n<=k+1). Voting with knn_vote among 
+// the candidates of several parts of a dataset gives the same label as 
+// voting among the whole dataset. Returns <0 if n or k is negative.
+int knn_candidates(double distances[], int labels[], int n, int k);
+
+/*
+A classifier fitted once to a training set, a metric and k, for when many
+images are classified against the same training set: whatever the metric
+allows is computed at fit time, so a prediction is only the search.
+  euclid:  the training images are sorted by norm. A query starts with
+           the images of about its own norm and moves outward; since
+           |norm(a)-norm(b)| <= euclid(a,b), the search stops once the
+           difference of norms exceeds the distance of the k-th nearest
+           image so far. Distances are summed in integers, a row at a
+           time, and abandoned once they exceed it too.
+  reduced: the distance only depends on the sums of the pixels, which
+           are sorted: a binary search and a walk to the k nearest sums.
+  others:  the distance of every training image, as knn_data_best_label.
+The labels are those of knn_data_best_label.
+
+Images can be inserted and removed while the classifier is in use. An
+insertion appends to a short unsorted list that every prediction scans
+after the sorted images, and a removal is a tombstone that the search
+skips, so both are O(1) amortized. Once either grows past
+1/KNN_COMPACT_RATIO of the sorted images (and KNN_COMPACT_MIN), a
+background thread merges the inserted images into the sorted ones and
+drops the removed ones; it works on a copy and only takes the lock to
+swap the result in. The lock is a read-write lock: predictions from any
+number of threads run side by side (each with buffers of its own), and
+an update, a snapshot or the swap of a compaction waits for them and
+runs alone.
+
+A classifier can be saved to a snapshot and loaded back with mmap, for
+a worker to start serving without reading or fitting the training set.
+*/
+
+#define KNN_CLASSIFIER_INVALID NULL
+//when to compact: inserted or removed images beyond both of
+// sorted images/KNN_COMPACT_RATIO and KNN_COMPACT_MIN
+#define KNN_COMPACT_RATIO 16
+#define KNN_COMPACT_MIN 64
+
+//classifier snapshot, written by knn_classifier_save: a single file. The
+// header is KNN_SNAPSHOT_HEADER_SIZE bytes: uint32 in network byte order
+// (magic, version, a byte order mark, k, number of images, number of
+// ids, x, y, stride, and the offset of the images as a uint64, high word
+// first), the mark being 0x01020304 in the byte order of the machine that
+// wrote the file, then the name of the metric (NUL padded) from byte 64.
+// Then come the arrays of the classifier, in its search order and the
+// writer's byte order, each starting at a multiple of MNIST_ALIGN: the
+// labels (int32), the keys (double: norms for euclid, sums for reduced)
+// and the ids (int32) of the images, and a tombstone byte per id. The
+// images start at a multiple of MNIST_ALIGNED_PAGE, every image padded
+// with zeros to stride bytes, a multiple of MNIST_ALIGN.
+#define KNN_SNAPSHOT_MAGIC_NUM 0x4b4e4e31 //"KNN1"
+#define KNN_SNAPSHOT_VERSION 1
+#define KNN_SNAPSHOT_HEADER_SIZE 128
+#define KNN_METRIC_NAME_SIZE 64
+
+typedef struct knn_classifier * knn_classifier_t;
+
+// fits a classifier voting among the k nearest images of train (k
+// 0-indexed, as in knn_vote) by the distance named metric (see
+// create_distance_function). train must outlive the classifier and not
+// change while it's in use.
+// Returns KNN_CLASSIFIER_INVALID if train is empty, metric unknown, k not
+// in [0,number of images) or out of memory.
+knn_classifier_t knn_classifier_fit(mnist_dataset_handle train,
+									const char * metric, int k);
+
+// label of img (x*y bytes, same size as the training images) among the
+// images of the classifier. Safe from several threads at once; the 
+// candidates of the search are allocated by each call. Returns 
+// LABEL_INVALID if c or img is invalid, there are no more than k images
+// left, or out of memory.
+int knn_classifier_predict(knn_classifier_t c, const unsigned char * img);
+
+// labels of every image of test, in labels[] (in the order of the
+// dataset). Returns the number of images classified, <0 if c or test is
+// invalid or test's images aren't the size of the training images.
+int knn_classifier_predict_batch(knn_classifier_t c,
+								 mnist_dataset_handle test, int labels[]);
+
+// adds a copy of img (x*y bytes) with label to the images of c.
+// Returns its id (the images of the training set are 0 to n-1, in the
+// order of the dataset, and inserted images follow), <0 on error.
+int knn_classifier_insert(knn_classifier_t c, const unsigned char * img,
+						  int label);
+
+// removes the image id from the images of c.
+// Returns false if there is no such image (or it was removed already).
+bool knn_classifier_remove(knn_classifier_t c, int id);
+
+// number of images in c (inserted ones included, removed ones not), <0
+// if c is KNN_CLASSIFIER_INVALID
+int knn_classifier_count(const knn_classifier_t c);
+
+// compacts c now, on the calling thread, instead of waiting for the
+// background thread. If a compaction is already running, waits for it
+// to end and then compacts what it left. Returns false if c is invalid
+// or out of memory (c is left as it was).
+bool knn_classifier_compact(knn_classifier_t c);
+
+// writes the images of c, with everything fitted to them, to the file
+// path (replaced without warning), as described above. The snapshot is
+// written to path.tmp and renamed, so path is always a whole snapshot.
+// Predictions go on while it's written, updates wait. Two saves to the
+// same path must not run at once.
+// Returns false if c is invalid or the file can't be written.
+bool knn_classifier_save(knn_classifier_t c, const char * path);
+
+// a classifier from a snapshot written by knn_classifier_save. The file
+// is mapped read-only and used in place: nothing is parsed or sorted,
+// only the pointers to the images are computed and the tombstones
+// copied. Inserted images come after the ids of the snapshot; removing
+// images of the snapshot works as for the training set.
+// Returns KNN_CLASSIFIER_INVALID if the file can't be mapped, isn't a 
+// snapshot of this version and byte order, or out of memory.
+knn_classifier_t knn_classifier_load(const char * path);
+
+// stops the background thread and frees c, with the inserted images
+void knn_classifier_free(knn_classifier_t c);
+
 #endif
@@ -0,0 +1,75 @@
+#define _POSIX_C_SOURCE 200809L // for sysconf
+#include "nndescent.h"
+#include "mnist.h"
+#include "distance.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+#define ERRMSG "Usage: ./knngraph [name] [k] [distance-scheme] [out-file] [sample] [threads]\n"\
+				"Builds the k nearest neighbor graph of the dataset name with NN-descent,\n"\
+				"writes it to out-file and checks the recall of sample images\n"\
+				"against brute force. threads defaults to the number of cores.\n"\
+				"The following distance schemes are supported: \n" DISTANCE_H_LIB_DESC
+
+/*
+    Usage: ./knngraph [name] [k] [distance-scheme] [out-file] [sample] [threads]
+*/
+
+int main (int argc, char ** args)
+{
+	if ((argc!=6) && (argc!=7))
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * name = args[1];
+	int k = atoi(args[2]);
+	distance_t distance = create_distance_function(args[3]);
+	char * out_file = args[4];
+	int sample = atoi(args[5]);
+	int nthreads = (argc==7) ? atoi(args[6]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(k<=0 || !distance || sample<0 || nthreads<=0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+
+	mnist_dataset_handle mdh = mnist_open(name);
+	if(mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n", name, IMAGES, name, LABELS);
+		exit(EXIT_FAILURE);
+	}
+	int n = mnist_image_count(mdh);
+
+	time_t start = time(0);
+	knn_graph_t g = knn_graph_build(mdh, k, distance, nthreads);
+	if(g == KNN_GRAPH_INVALID)
+	{
+		printf("Can't build a %d nearest neighbor graph of %d images.\n", k, n);
+		mnist_free(mdh);
+		exit(EXIT_FAILURE);
+	}
+	double evals = (double) knn_graph_evals(g);
+	printf("%d images, k=%d: %.0f distances (n^%.2f, brute force n^2=%.0f) in %lds\n",
+			n, k, evals, n>1 ? log(evals)/log(n) : 0, (double) n*n,
+			(long)(time(0)-start));
+
+	if(!knn_graph_save(g, out_file))
+	{
+		printf("Can't write %s\n", out_file);
+		knn_graph_free(g);
+		mnist_free(mdh);
+		exit(EXIT_FAILURE);
+	}
+	printf("wrote %s\n", out_file);
+	if(sample>0)
+		printf("recall of %d images: %.4f\n", sample,
+				knn_graph_recall(g, mdh, distance, sample));
+
+	knn_graph_free(g);
+	mnist_free(mdh);
+	return(EXIT_SUCCESS);
+}
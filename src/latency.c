@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L // for sysconf and clock_gettime
+#include "pknn.h"
+#include "knn.h"
+#include "mnist.h"
+#include "distance.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#define ERRMSG "Usage: ./latency [train-name] [test-name] [queries] [k] [distance-scheme] [max-threads] [placement]\n"\
+				"Classifies queries test images one at a time with the intra-query\n"\
+				"parallel k-NN (pknn.c) for 1, 2, 4, ... up to max-threads pinned\n"\
+				"threads, and reports the p50/p99 latency of a query for each.\n"\
+				"max-threads defaults to the number of cores. placement is where the\n"\
+				"training images go on NUMA machines: none (default, in the dataset),\n"\
+				"replicate (a copy on every node) or interleave (spread over the nodes).\n"\
+				"The following distance schemes are supported: \n" DISTANCE_H_LIB_DESC
+//untimed queries before the timed ones
+#define WARMUP 5
+
+/*
+    Usage: ./latency [train-name] [test-name] [queries] [k] [distance-scheme] [max-threads] [placement]
+*/
+
+static int _cmp_double(const void * a, const void * b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x>y) - (x<y);
+}
+
+static double _now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+int main (int argc, char ** args)
+{
+	if ((argc<6) || (argc>8))
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * train_name = args[1];
+	char * test_name = args[2];
+	int queries = atoi(args[3]);
+	int k = atoi(args[4]);
+	distance_t distance = create_distance_function(args[5]);
+	int max_threads = (argc>=7) ? atoi(args[6]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	char * placements[] = {"none", "replicate", "interleave"};
+	int placement = -1;
+	for(int i=0; i<3; i++)
+		if(strcmp((argc==8) ? args[7] : "none", placements[i])==0) placement = i;
+	if(queries<=0 || k<=0 || !distance || max_threads<=0 || placement<0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+
+	mnist_dataset_handle train_mdh = mnist_open(train_name);
+	if(train_mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n", 
+			train_name, IMAGES, train_name, LABELS);
+		exit(EXIT_FAILURE);
+	}
+	mnist_dataset_handle test_mdh = mnist_open(test_name);
+	if(test_mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n", 
+			test_name, IMAGES, test_name, LABELS);
+		mnist_free(train_mdh);
+		exit(EXIT_FAILURE);
+	}
+	if(queries>mnist_image_count(test_mdh)) queries = mnist_image_count(test_mdh);
+
+	const unsigned char ** imgs = malloc(queries*sizeof(unsigned char *));
+	int * labels = malloc(queries*sizeof(int));
+	double * times = malloc(queries*sizeof(double));
+	mnist_image_handle img = mnist_image_begin(test_mdh);
+	for(int i=0; i<queries; i++)
+	{
+		imgs[i] = mnist_image_data(img);
+		img = mnist_image_next(img);
+	}
+
+	int status = EXIT_SUCCESS;
+	printf("# threads p50_us p99_us mismatches\n");
+	for(int nthreads=1; status==EXIT_SUCCESS; nthreads*=2)
+	{
+		if(nthreads>max_threads) nthreads = max_threads;
+		pknn_t p = pknn_create_numa(train_mdh, nthreads, placement);
+		if(p == PKNN_INVALID)
+		{
+			printf("Can't start %d threads\n", nthreads);
+			status = EXIT_FAILURE;
+			break;
+		}
+		for(int i=0; i<WARMUP && i<queries; i++)
+			pknn_best_label(p, imgs[i], k-1, distance);
+		//labels must not depend on the number of threads
+		int mismatches = 0;
+		for(int i=0; i<queries; i++)
+		{
+			double start = _now_us();
+			int label = pknn_best_label(p, imgs[i], k-1, distance);
+			times[i] = _now_us()-start;
+			if(label==LABEL_INVALID)
+			{
+				puts("pknn_best_label failed. Exiting");
+				status = EXIT_FAILURE;
+				break;
+			}
+			if(nthreads==1) labels[i] = label;
+			else if(label!=labels[i]) mismatches++;
+		}
+		pknn_free(p);
+		if(status!=EXIT_SUCCESS) break;
+		qsort(times, queries, sizeof(double), _cmp_double);
+		printf("%d %.1f %.1f %d\n", nthreads, times[queries/2],
+				times[(int) (0.99*(queries-1))], mismatches);
+		if(nthreads==max_threads) break;
+	}
+
+	free(imgs);
+	free(labels);
+	free(times);
+	mnist_free(test_mdh);
+	mnist_free(train_mdh);
+	return(status);
+}
@@ -1,18 +1,35 @@
+#define _POSIX_C_SOURCE 200809L // for getopt, sysconf, clock_gettime and sigaction
 #define DEBUG_OLD
 // #define DEBUG
 #include "knn.h"
 #include "mnist.h"
 #include "distance.h"
+#include "pool.h"
+#include "hist.h"
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
-#define ERRMSG "Usage: ./ocr [train-name] [train-size] [test-name] [k] [distance-scheme]\n"\
+#include <stdatomic.h>
+#include <unistd.h>
+#define ERRMSG "Usage: ./ocr [-t threads] [train-name] [train-size] [test-name] [k] [distance-scheme]\n"\
+    			"threads defaults to the number of cores.\n"\
+    			"The time of every stage is printed at the end (and on SIGUSR1): \n"\
+    			"p50/p90/p99/p999 in microseconds, per configuration.\n"\
     			"The following distance schemes are supported: \n" DISTANCE_H_LIB_DESC
 #define PRINT_INTERVAL 1
+//test images per task of the sweep
+#define OCR_BLOCK 64
+
+//stages timed once, in main, and for every test image of a configuration
+enum {OCR_LOAD, OCR_SAMPLE, OCR_SETUP_STAGES};
+enum {OCR_SCAN, OCR_SELECT, OCR_VOTE, OCR_STAGES};
+static const char * setup_stage_names[] = {"load", "sample"};
+static const char * stage_names[] = {"scan", "select", "vote"};
 
 /*
-    Usage: ./ocr [train-name] [train-size] [test-name] [k] [distance-scheme]
+    Usage: ./ocr [-t threads] [train-name] [train-size] [test-name] [k] [distance-scheme]
 */
 
 struct ocr_results
@@ -23,6 +40,93 @@ struct ocr_results
 	int train_size;
 };
 
+//one (distance, k, train size) combination of the sweep
+struct ocr_config
+{
+	char * distance;
+	distance_t dist_func;
+	int k;
+	//index of the training sample
+	int sample;
+	//each configuration counts on its own cache line
+	_Alignas(64) atomic_int correct;
+	atomic_int processed;
+};
+
+struct ocr_sweep
+{
+	mnist_image_handle * test_imgs;
+	int num_imgs;
+	int nblocks;
+	mnist_dataset_handle * sample_mdhs;
+	int n_samples;
+	struct ocr_config * configs;
+	//knn data of every thread for every sample, created on first use
+	knn_data_t * knns;
+	atomic_int failed;
+	atomic_int tasks_done;
+	int ntasks;
+	//only written by thread 0, seconds
+	double print_time;
+	//nanoseconds of every stage: OCR_STAGES per configuration, for every
+	// thread
+	hist_t * hists;
+	int nthreads, n_configs;
+};
+
+//main's stages, nanoseconds
+static hist_t setup_hists[OCR_SETUP_STAGES];
+//set by SIGUSR1: the next task to finish prints the timings so far
+static atomic_int dump_requested;
+
+static void _on_sigusr1(int sig)
+{
+	atomic_store(&dump_requested, 1);
+}
+
+static uint64_t _now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+static void _print_hist(const char * stage, const char * config, const hist_t * h)
+{
+	printf("%-7s %-24s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stage, config,
+		(unsigned long long) hist_count(h), hist_quantile(h, 0.5)/1e3,
+		hist_quantile(h, 0.9)/1e3, hist_quantile(h, 0.99)/1e3,
+		hist_quantile(h, 0.999)/1e3, hist_max(h)/1e3);
+}
+
+// prints the quantiles of every stage: main's, then those of every
+// configuration, merging the histograms of the threads. Safe while the
+// sweep runs (the counts are those recorded so far).
+static void print_ocr_timings(const struct ocr_sweep * job)
+{
+	hist_t * merged = malloc(sizeof(hist_t));
+	if(!merged) return;
+	printf("# stage config count p50_us p90_us p99_us p999_us max_us\n");
+	for(int s=0; s<OCR_SETUP_STAGES; s++)
+		_print_hist(setup_stage_names[s], "-", &setup_hists[s]);
+	for(int c=0; job && c<job->n_configs; c++)
+	{
+		const struct ocr_config * config = &job->configs[c];
+		char name[64];
+		snprintf(name, sizeof(name), "%s/k=%d/n=%d", config->distance, 
+			config->k+1, mnist_image_count(job->sample_mdhs[config->sample]));
+		for(int s=0; s<OCR_STAGES; s++)
+		{
+			hist_clear(merged);
+			for(int t=0; t<job->nthreads; t++)
+				hist_merge(merged, &job->hists[(t*job->n_configs+c)*OCR_STAGES+s]);
+			_print_hist(stage_names[s], name, merged);
+		}
+	}
+	fflush(stdout);
+	free(merged);
+}
+
 
 void print_ocr_status(char * distance, int num_processed, 
 					int num_imgs, int correct)
@@ -34,72 +138,170 @@ void print_ocr_status(char * distance, int num_processed,
 		processed_pct, correct, num_processed, correct_pct);
 }
 
-double ocr(mnist_dataset_handle train_mdh,
-	mnist_dataset_handle test_mdh, int k, char * distance)
+static void ocr_task(void * arg, int task, int tid)
 {
-  	time_t print_time = time(0);
-	if(k<0)
+	//classifies block (task % nblocks) of the test images with
+	// configuration (task / nblocks). Thread 0 also prints the progress.
+	struct ocr_sweep * job = arg;
+	if(atomic_load(&job->failed)) return;
+	struct ocr_config * config = &job->configs[task/job->nblocks];
+	int from = (task%job->nblocks)*OCR_BLOCK;
+	int to = (from+OCR_BLOCK<job->num_imgs) ? from+OCR_BLOCK : job->num_imgs;
+	knn_data_t * knn = &job->knns[tid*job->n_samples+config->sample];
+	if(*knn == KNN_INVALID)
 	{
-		puts("Invalid k value. Exiting");
-		return -1;
+		*knn = knn_data_create(job->test_imgs[0], 
+							job->sample_mdhs[config->sample]);
+		if(*knn == KNN_INVALID)
+		{
+			if(!atomic_exchange(&job->failed, 1))
+				puts("Invalid image or dataset. Exiting.");
+			return;
+		}
 	}
+	hist_t * hists = &job->hists[(tid*job->n_configs+task/job->nblocks)*OCR_STAGES];
+	mnist_dataset_handle sample = job->sample_mdhs[config->sample];
 	int correct = 0;
-	int num_processed = 0;
-	int num_imgs = mnist_image_count(test_mdh);
-	if(num_imgs <=0)
-	{
-		puts("No images in test dataset. Exiting.");
-
-	}
-	mnist_image_handle test_img = mnist_image_begin(test_mdh);
-
-	printf("K = %d\n", k+1);
-	for(int i=0; i<num_imgs; i++)
+	for(int i=from; i<to; i++)
 	{
+		mnist_image_handle test_img = job->test_imgs[i];
 		int expected_label = mnist_image_label(test_img);
 		if(expected_label==LABEL_INVALID)
 		{
-			puts("Invalid image. Exiting");
-			return -1;
+			if(!atomic_exchange(&job->failed, 1))
+				puts("Invalid image. Exiting");
+			return;
 		}
-		knn_data_t knn = knn_data_create(test_img, train_mdh);
-		if (knn == KNN_INVALID)
+		//knn_data_best_label, a stage at a time
+		knn_data_set_image(*knn, test_img);
+		uint64_t start = _now_ns();
+		double * distances = knn_data_get_distances(*knn, config->dist_func);
+		int * labels = knn_data_get_labels(*knn);
+		uint64_t scanned = _now_ns();
+		int n = distances ? knn_candidates(distances, labels,
+								mnist_image_count(sample), config->k) : -1;
+		uint64_t selected = _now_ns();
+		int label = n>config->k ? knn_vote(distances, labels, n, config->k) 
+								: LABEL_INVALID;
+		uint64_t voted = _now_ns();
+		hist_record(&hists[OCR_SCAN], scanned-start);
+		hist_record(&hists[OCR_SELECT], selected-scanned);
+		hist_record(&hists[OCR_VOTE], voted-selected);
+		if(label==LABEL_INVALID)
 		{
-			puts("Invalid image or dataset. Exiting.");
-			knn_data_free(knn);
-			return -1;
+			if(!atomic_exchange(&job->failed, 1))
+				puts("Knn_best_label failed. Exiting");
+			return;
 		}
-		distance_t dist_func = create_distance_function(distance);
-		if(!dist_func)
-		{
-			knn_data_free(knn);
-			return -1;
-		} 
-			
-		int label = knn_data_best_label(knn, k, dist_func);
-		if(label==LABEL_INVALID)
+		if (label==expected_label) correct++;
+	}
+	atomic_fetch_add(&config->correct, correct);
+	atomic_fetch_add(&config->processed, to-from);
+	int done = atomic_fetch_add(&job->tasks_done, 1)+1;
+	if (atomic_exchange(&dump_requested, 0)) print_ocr_timings(job);
+	if ((tid==0) && (_now_ns()/1e9-PRINT_INTERVAL>=job->print_time))
+	{
+		job->print_time = _now_ns()/1e9;
+		printf("[sweep] %d/%d tasks (%6.2f%%)\n", done, job->ntasks,
+			((double) done / (double) job->ntasks)*100);
+		//the configurations under way; the finished ones are printed at
+		// the end, in order
+		for(int c=0; c<job->n_configs; c++)
 		{
-			puts("Knn_best_label failed. Exiting");
-			knn_data_free(knn);
-			return -1;
+			int processed = atomic_load(&job->configs[c].processed);
+			if(processed>0 && processed<job->num_imgs)
+				print_ocr_status(job->configs[c].distance, processed, job->num_imgs,
+								atomic_load(&job->configs[c].correct));
 		}
+	}
+}
 
-		if (label==expected_label) correct++;
-		num_processed++;
-		if ((time(0)-PRINT_INTERVAL)>=print_time)
+// classifies every test image with each of the n_configs configurations,
+// as (configuration, block of OCR_BLOCK test images) tasks on the
+// work-stealing scheduler of the pool. Prints the result of every
+// configuration, in order, and stores its accuracy in results[].
+// Returns false on failure.
+bool ocr_sweep(pool_t pool, mnist_dataset_handle * sample_mdhs, int n_samples,
+	mnist_dataset_handle test_mdh, struct ocr_config * configs, int n_configs,
+	double * results)
+{
+	int num_imgs = mnist_image_count(test_mdh);
+	if(num_imgs <=0)
+	{
+		puts("No images in test dataset. Exiting.");
+		return false;
+	}
+	for(int c=0; c<n_configs; c++)
+	{
+		if(configs[c].k<0)
 		{
-			print_time = time(0);
-			print_ocr_status(distance, num_processed, num_imgs, correct);
+			puts("Invalid k value. Exiting");
+			return false;
 		}
+		configs[c].dist_func = create_distance_function(configs[c].distance);
+		if(!configs[c].dist_func) return false;
+		atomic_init(&configs[c].correct, 0);
+		atomic_init(&configs[c].processed, 0);
+	}
+
+	int nthreads = pool_size(pool);
+	struct ocr_sweep job;
+	job.test_imgs = malloc(num_imgs*sizeof(mnist_image_handle));
+	job.knns = calloc(nthreads*n_samples, sizeof(knn_data_t));
+	//calloc: only the pages of the buckets used are touched
+	job.hists = calloc((size_t) nthreads*n_configs*OCR_STAGES, sizeof(hist_t));
+	if(!job.test_imgs || !job.knns || !job.hists)
+	{
+		puts("Out of memory. Exiting.");
+		free(job.test_imgs);
+		free(job.knns);
+		free(job.hists);
+		return false;
+	}
+	//random access to the test images, so tasks can split them up
+	mnist_image_handle test_img = mnist_image_begin(test_mdh);
+	for(int i=0; i<num_imgs; i++)
+	{
+		job.test_imgs[i] = test_img;
 		test_img = mnist_image_next(test_img);
-		knn_data_free(knn);
 	}
-	print_ocr_status(distance, num_processed, num_imgs, correct);
-	double accuracy = (double) correct / (double) num_processed;
-	//prints periodically
-	//returns accuracy
+	job.num_imgs = num_imgs;
+	job.nblocks = (num_imgs+OCR_BLOCK-1)/OCR_BLOCK;
+	job.sample_mdhs = sample_mdhs;
+	job.n_samples = n_samples;
+	job.configs = configs;
+	job.ntasks = job.nblocks*n_configs;
+	job.nthreads = nthreads;
+	job.n_configs = n_configs;
+	atomic_init(&job.failed, 0);
+	atomic_init(&job.tasks_done, 0);
+	job.print_time = _now_ns()/1e9;
 
-	return accuracy;
+	if(!pool_run_tasks(pool, ocr_task, &job, job.ntasks))
+	{
+		puts("Out of memory. Exiting.");
+		atomic_store(&job.failed, 1);
+	}
+	for(int i=0; i<nthreads*n_samples; i++) knn_data_free(job.knns[i]);
+	free(job.knns);
+	free(job.test_imgs);
+	if(atomic_load(&job.failed))
+	{
+		free(job.hists);
+		return false;
+	}
+
+	for(int c=0; c<n_configs; c++)
+	{
+		int correct = atomic_load(&configs[c].correct);
+		int num_processed = atomic_load(&configs[c].processed);
+		printf("K = %d\n", configs[c].k+1);
+		print_ocr_status(configs[c].distance, num_processed, num_imgs, correct);
+		results[c] = (double) correct / (double) num_processed;
+	}
+	print_ocr_timings(&job);
+	free(job.hists);
+	return true;
 }
 
 
@@ -108,16 +310,37 @@ int main (int argc, char ** args)
 	//parse args
 	//check for errors
 	bool print_results = false;
-	if (argc!=6)
+	int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, args, "t:")) != -1)
+	{
+		if (opt=='t') nthreads = atoi(optarg);
+		else
+		{
+			puts(ERRMSG);
+			exit(EXIT_FAILURE);
+		}
+	}
+	//the positional arguments start at args[1], as if there were no options
+	args += optind-1;
+	argc -= optind-1;
+	if (argc!=6 || nthreads<=0)
 	{
 		puts(ERRMSG);
 		exit(EXIT_FAILURE);
 	}
 
+	//a SIGUSR1 before the sweep is answered when its first task ends
+	struct sigaction sa = {.sa_handler = _on_sigusr1, .sa_flags = SA_RESTART};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
 	char * train_name  = args[1]; //"data/train";
 	//open train_name
 	// check if valid
+	uint64_t start = _now_ns();
 	mnist_dataset_handle train_mdh = mnist_open(train_name);
+	hist_record(&setup_hists[OCR_LOAD], _now_ns()-start);
 	if(train_mdh == MNIST_DATASET_INVALID)
 	{
 		printf("%s%s or %s%s cannot be opened.\n", 
@@ -150,7 +373,9 @@ int main (int argc, char ** args)
 	//open test_name
 	//check if valid
 	char * test_name = args[3];   //"data/t10k";
+	start = _now_ns();
 	mnist_dataset_handle test_mdh = mnist_open(test_name);
+	hist_record(&setup_hists[OCR_LOAD], _now_ns()-start);
 	if(test_mdh == MNIST_DATASET_INVALID)
 	{
 
@@ -214,12 +439,18 @@ int main (int argc, char ** args)
 	double *results = malloc(n_distances*n_ks*n_train_sizes*sizeof(double));
 	mnist_dataset_handle * sample_mdhs = malloc(n_train_sizes*sizeof(mnist_dataset_handle));
 	//i=0, for each train_size in train_size[]
-	//create sample sets
+	//create sample sets: views of the training set, so a sweep costs an 
+	// index array per train size rather than a copy of the images
+	int * sample_idx = malloc(mnist_image_count(train_mdh)*sizeof(int));
 	for(int i=0;i<n_train_sizes;i++)
 	{
-		// sample = mnists_create_sample(train_set, trainsize)
-		// printf("%d\n", train_sizes[i]);
-		sample_mdhs[i] = mnist_create_sample(train_mdh, train_sizes[i]);
+		start = _now_ns();
+		sample_rng_t rng = sample_rng(MNIST_SAMPLE_SEED, i);
+		sample_mdhs[i] = MNIST_DATASET_INVALID;
+		if (sample_idx && sample_floyd(&rng, mnist_image_count(train_mdh), 
+										train_sizes[i], sample_idx))
+			sample_mdhs[i] = mnist_view_subset(train_mdh, sample_idx, train_sizes[i]);
+		hist_record(&setup_hists[OCR_SAMPLE], _now_ns()-start);
 		// check for error
 		if (sample_mdhs[i] == MNIST_DATASET_INVALID)
 		{
@@ -228,11 +459,39 @@ int main (int argc, char ** args)
 			for(int j=0;j<i;j++) mnist_free(sample_mdhs[j]);
 			mnist_free(test_mdh);
 			mnist_free(train_mdh);
+			free(sample_idx);
 			free(sample_mdhs);
 			free(results);
 			exit(EXIT_FAILURE);		
 		}
 	}
+	free(sample_idx);
+	pool_t pool = pool_create(nthreads);
+	if (pool == POOL_INVALID)
+	{
+		printf("Can't start %d threads\n", nthreads);
+		for(int m=0;m<n_train_sizes;m++) mnist_free(sample_mdhs[m]);
+		free(results);
+		free(sample_mdhs);
+		mnist_free(test_mdh);
+		mnist_free(train_mdh);
+		exit(EXIT_FAILURE);
+	}
+	//the configurations in the order of the result table
+	int n_configs = n_distances*n_ks*n_train_sizes;
+	struct ocr_config * configs = aligned_alloc(sizeof(struct ocr_config),
+								n_configs*sizeof(struct ocr_config));
+	if (!configs)
+	{
+		puts("Out of memory. Exiting.");
+		pool_free(pool);
+		for(int m=0;m<n_train_sizes;m++) mnist_free(sample_mdhs[m]);
+		free(results);
+		free(sample_mdhs);
+		mnist_free(test_mdh);
+		mnist_free(train_mdh);
+		exit(EXIT_FAILURE);
+	}
 	int ix = 0;
 	//for each distance in distances[]
 	for(int i=0;i<n_distances;i++)
@@ -243,25 +502,27 @@ int main (int argc, char ** args)
 			//for each sample in samples
 			for(int s=0;s<n_train_sizes;s++)
 			{
-				double accuracy = ocr(sample_mdhs[s], test_mdh, 
-								ks[j]-1, distances[i]);
-				if (accuracy<0)
-				{
-					for(int m=0;m<n_train_sizes;m++) mnist_free(sample_mdhs[m]);
-					free(results);
-			   		free(sample_mdhs);
-					mnist_free(test_mdh);
-					mnist_free(train_mdh);
-					return(EXIT_FAILURE);
-				}
-				else
-				{
-					results[ix] = accuracy;
-				}
+				configs[ix].distance = distances[i];
+				configs[ix].k = ks[j]-1;
+				configs[ix].sample = s;
 				ix++;
 			}
 		}	
 	}
+	bool ok = ocr_sweep(pool, sample_mdhs, n_train_sizes, test_mdh, 
+						configs, n_configs, results);
+	free(configs);
+	if (!ok)
+	{
+		pool_free(pool);
+		for(int m=0;m<n_train_sizes;m++) mnist_free(sample_mdhs[m]);
+		free(results);
+		free(sample_mdhs);
+		mnist_free(test_mdh);
+		mnist_free(train_mdh);
+		return(EXIT_FAILURE);
+	}
+	pool_free(pool);
 /*
 # distance k 15000 30000
      euclid 1 50.34 60.33
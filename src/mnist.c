@@ -1,13 +1,25 @@
+#define _DEFAULT_SOURCE // for MAP_POPULATE and madvise
 #include "mnist.h"
 #include <arpa/inet.h> // for ntoh and hton functions
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
 
 // #define DEBUG //use "gcc -D DEBUG" to run with debug
 // #define DEBUG_OLD
+//internal flag of _map_file: map at a MNIST_ALIGNED_PAGE boundary
+#define MNIST_MAP_HUGE_ALIGN (1<<16)
+
 #ifdef DEBUG
   #define debug_print(fmt, ...) printf("debug: " fmt,  __VA_ARGS__)
 #else
@@ -23,8 +35,50 @@ struct mnist_dataset_t
 	// raw data from image file
 	uint8_t * imgbuf;
 
-	//pointer to first image
+	//pointer to first and last image
 	struct mnist_image_t * head;
+	struct mnist_image_t * tail;
+
+	//header fields in host byte order, so the accessors don't have to 
+	// decode the header on every call
+	int count;
+	unsigned int x, y;
+	size_t size;
+	//number of images the heap buffers have room for (0 while mapped)
+	int capacity;
+
+	//first image and first label: right after the headers of imgbuf and
+	// lblbuf, or wherever an aligned file keeps them. stride is the 
+	// distance between images (size, or size padded to MNIST_ALIGN)
+	uint8_t * imgs;
+	uint8_t * lbls;
+	size_t stride;
+	//precomputed per-image squared norms and sums of an aligned file
+	// (network byte order, high word first), NULL otherwise
+	const uint32_t * norms;
+	const uint32_t * sums;
+
+	//the image handles, in blocks of MNIST_HANDLE_BLOCK that never move, 
+	// so handles stay valid when images are added. The handle of the 
+	// image at offset idx of the buffers is blocks[idx/B][idx%B].
+	struct mnist_image_t ** blocks;
+	int nblocks;
+	//true while the list order is the order of the buffers (no image was
+	// inserted anywhere but at the end); then mnist_image_at is a lookup
+	bool ordered;
+	//otherwise, handle of each position, built by mnist_image_at and 
+	// dropped by the next insertion
+	struct mnist_image_t ** order;
+
+	//true if lblbuf and imgbuf are read-only mappings of the files 
+	// (of lbllen and imglen bytes) rather than malloc'd buffers. An
+	// aligned file is a single mapping, imgbuf, and lblbuf is NULL.
+	bool mapped;
+	size_t lbllen, imglen;
+
+	//true for a view (mnist_view_*): no buffers, the handles point to
+	// the images of the parent datasets (their mdh and idx)
+	bool view;
 
 };
 
@@ -66,120 +120,701 @@ void _fisher_yates_shuffle(int *array, int length)
 	}
 }
 
-int _compare_int(const void* a, const void* b)
+static struct mnist_image_t * _slot(mnist_dataset_handle mdh, uint32_t idx)
 {
-	return *(int*)a - *(int*)b;
+	//handle of the image at offset idx, allocating its block if needed.
+	// Returns NULL if out of memory.
+	int b = idx/MNIST_HANDLE_BLOCK;
+	if(b>=mdh->nblocks)
+	{
+		int nblocks = mdh->nblocks ? 2*mdh->nblocks : 1;
+		while(nblocks<=b) nblocks *= 2;
+		struct mnist_image_t ** blocks = realloc(mdh->blocks, 
+									nblocks*sizeof(struct mnist_image_t *));
+		if(!blocks) return NULL;
+		for(int i=mdh->nblocks; i<nblocks; i++) blocks[i] = NULL;
+		mdh->blocks = blocks;
+		mdh->nblocks = nblocks;
+	}
+	if(!mdh->blocks[b])
+	{
+		mdh->blocks[b] = malloc(MNIST_HANDLE_BLOCK*sizeof(struct mnist_image_t));
+		if(!mdh->blocks[b]) return NULL;
+	}
+	return &mdh->blocks[b][idx%MNIST_HANDLE_BLOCK];
 }
 
-void _populate_mnist_dataset(mnist_dataset_handle mdh, uint8_t * lblbuf, uint8_t * imgbuf)
+static void _idx_layout(mnist_dataset_handle mdh)
 {
-	//internal helper function used by mnist_open
-	//populate the fields of mdh as well as make the linked list
+	//images and labels right after the headers of the idx buffers
+	mdh->imgs = mdh->imgbuf+IMG_HEADER_SIZE;
+	mdh->lbls = mdh->lblbuf+LBL_HEADER_SIZE;
+	mdh->stride = mdh->size;
+	mdh->norms = mdh->sums = NULL;
+}
+
+static void _read_header(mnist_dataset_handle mdh)
+{
+	//caches the header fields
+	mdh->count = MY_NTOHL(((uint32_t*)(mdh->lblbuf))[NUM_IMG_IX]);
+	mdh->x = MY_NTOHL(((uint32_t*)(mdh->imgbuf))[X_IX]);
+	mdh->y = MY_NTOHL(((uint32_t*)(mdh->imgbuf))[Y_IX]);
+	mdh->size = (size_t) mdh->x*mdh->y;
+	_idx_layout(mdh);
+}
+
+static bool _link_handles(mnist_dataset_handle mdh)
+{
+	//makes the handles of the images already in the buffers, in blocks
+	// of MNIST_HANDLE_BLOCK instead of one malloc per image.
+	// Returns false if out of memory.
+	mdh->head = mdh->tail = MNIST_IMAGE_INVALID;
+	mdh->ordered = true;
+	mdh->order = NULL;
+	if((mdh->count<=0)||(mdh->x<=0)||(mdh->y<=0))
+		return true;
+
+	mnist_image_handle prev_mih = NULL;
+	for(int i=0; i<mdh->count; i++)
+	{
+		mnist_image_handle mih = _slot(mdh, i);
+		if(!mih) return false;
+		mih->idx = i;
+		mih->next = MNIST_IMAGE_INVALID;
+		mih->mdh = mdh;
+		if(prev_mih) prev_mih->next = mih;
+		else mdh->head = mih;
+		prev_mih = mih;
+	}
+	mdh->tail = prev_mih;
+	return true;
+}
+
+bool _populate_mnist_dataset(mnist_dataset_handle mdh, uint8_t * lblbuf, uint8_t * imgbuf)
+{
+	//internal helper function used by mnist_open and mnist_create
+	//populate the fields of mdh as well as make the handles.
+	// Returns false if out of memory.
 
 	assert(mdh);
 	assert(imgbuf);
 	assert(lblbuf);
 	mdh->imgbuf = imgbuf;
 	mdh->lblbuf = lblbuf;
+	_read_header(mdh);
+	return _link_handles(mdh);
+}
 
-	int img_cnt = mnist_image_count(mdh);
-	unsigned int x=0, y = 0;
-	mnist_image_size(mdh, &x, &y);
+static void _free_handles(mnist_dataset_handle mdh)
+{
+	for(int b=0; b<mdh->nblocks; b++) free(mdh->blocks[b]);
+	free(mdh->blocks);
+	free(mdh->order);
+}
+
+static void * _reserve_aligned(size_t len, size_t align)
+{
+	//an address range of len bytes starting at a multiple of align, 
+	// reserved (PROT_NONE) for a MAP_FIXED mapping. NULL on error.
+	size_t page = sysconf(_SC_PAGESIZE);
+	uint8_t * p = mmap(NULL, len+align, PROT_NONE, 
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p==MAP_FAILED) return NULL;
+	uint8_t * start = (uint8_t *)(((uintptr_t) p+align-1) & ~(uintptr_t)(align-1));
+	uint8_t * end = start+((len+page-1) & ~(page-1));
+	if(start>p) munmap(p, start-p);
+	if(p+len+align>end) munmap(end, p+len+align-end);
+	return start;
+}
 
-	if((img_cnt<=0)||(x<=0)||(y<=0))
+static uint8_t * _map_file(const char * path, size_t * len, int flags)
+{
+	//maps the whole file read-only. Returns NULL on error or if the 
+	// file is empty. With MNIST_MAP_HUGE_ALIGN the mapping starts on a
+	// MNIST_ALIGNED_PAGE boundary (and transparent huge pages are asked
+	// for).
+	int fd = open(path, O_RDONLY);
+	if(fd<0) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) || st.st_size<=0)
 	{
-		mdh->head = MNIST_IMAGE_INVALID;
-		return;
+		close(fd);
+		return NULL;
 	}
-
-	//set head
-	mnist_image_handle mih = (mnist_image_handle) malloc(sizeof(struct mnist_image_t));
-	mih->idx = 0;
-	mih->next = MNIST_IMAGE_INVALID;
-	mih->mdh = mdh;
-	mdh->head = mih;
-	
-	//iterate through rest of images
-	mnist_image_handle prev_mih = NULL;
-	int i = 1;
-	while(i<img_cnt)
+	*len = st.st_size;
+	int mmap_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	if(flags & MNIST_MAP_POPULATE) mmap_flags |= MAP_POPULATE;
+#endif
+	void * at = NULL;
+	if(flags & MNIST_MAP_HUGE_ALIGN)
 	{
-		prev_mih = mih;
-		mih = (mnist_image_handle) malloc(sizeof(struct mnist_image_t));
-		prev_mih->next = mih;
-		//populate data structure
-		mih->idx = i;
-		mih->next = MNIST_IMAGE_INVALID;
-		mih->mdh = mdh;
-		i++;
-	} 
+		at = _reserve_aligned(*len, MNIST_ALIGNED_PAGE);
+		if(at) mmap_flags |= MAP_FIXED;
+	}
+	void * p = mmap(at, *len, PROT_READ, mmap_flags, fd, 0);
+	//the mapping stays valid after the file is closed
+	close(fd);
+	if(p==MAP_FAILED)
+	{
+		if(at) munmap(at, *len);
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if(at) madvise(p, *len, MADV_HUGEPAGE);
+#endif
+	int advice = (flags & MNIST_MAP_SEQUENTIAL) ? MADV_SEQUENTIAL
+				: (flags & MNIST_MAP_RANDOM) ? MADV_RANDOM : MADV_NORMAL;
+	if(advice!=MADV_NORMAL) madvise(p, *len, advice);
+	if(flags & MNIST_MAP_WILLNEED) madvise(p, *len, MADV_WILLNEED);
+	debug_print("_map_file: path=%s\tlen=%zu\tflags=%d\n", path, *len, flags);
+	return p;
 }
 
-int _read_file(uint8_t ** buf, char * path)
-{	
-	// adapted from stackoverflow.com
-	FILE * fp = fopen(path, "rb");  	// Open the file in binary mode
-	if (fp == NULL)
-		return 0;
-	fseek(fp, 0, SEEK_END);          // Jump to the end of the file
-	size_t flen = ftell(fp);             // Get the current byte offset in the file
-	rewind(fp);                      // Jump back to the beginning of the file
-	debug_print("_read_file: path=%s\tflen=%lu\n", path, flen);
-	*buf = (uint8_t *)malloc(flen*sizeof(uint8_t));
-	if (*buf==NULL)
+static bool _valid_headers(const uint8_t * lblbuf, size_t lbllen,
+					const uint8_t * imgbuf, size_t imglen)
+{
+	//checks the headers in place: magic numbers, matching counts, and 
+	// files long enough for the images and labels they announce
+	if(lbllen<LBL_HEADER_SIZE || imglen<IMG_HEADER_SIZE) return false;
+	const uint32_t * lbl32 = (const uint32_t *) lblbuf;
+	const uint32_t * img32 = (const uint32_t *) imgbuf;
+	if(MY_NTOHL(lbl32[MN_IX])!=LBL_MAGIC_NUM 
+		|| MY_NTOHL(img32[MN_IX])!=IMG_MAGIC_NUM)
+		return false;
+	uint64_t count = MY_NTOHL(lbl32[NUM_IMG_IX]);
+	if(count!=MY_NTOHL(img32[NUM_IMG_IX]) || count>INT32_MAX) return false;
+	uint64_t size = (uint64_t) MY_NTOHL(img32[X_IX])*MY_NTOHL(img32[Y_IX]);
+	return (lbllen-LBL_HEADER_SIZE>=count) 
+		&& (imglen-IMG_HEADER_SIZE>=count*size);
+}
+
+struct _gz_member
+{
+	//one gzip member and where its data goes
+	const uint8_t * in;
+	size_t inlen;
+	uint8_t * out;
+	size_t outlen;
+};
+
+struct _gz_job
+{
+	struct _gz_member * members;
+	int n;
+	atomic_int next;
+	atomic_bool ok;
+};
+
+static uint32_t _le32(const uint8_t * p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t) p[3]<<24;
+}
+
+static bool _inflate_member(const struct _gz_member * m)
+{
+	//inflates a whole member straight into its place in the output
+	if(m->inlen>UINT_MAX || m->outlen>UINT_MAX) return false;
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(inflateInit2(&zs, 16+MAX_WBITS)!=Z_OK) return false;
+	zs.next_in = (Bytef *) m->in;
+	zs.avail_in = m->inlen;
+	zs.next_out = m->out;
+	zs.avail_out = m->outlen;
+	int r = inflate(&zs, Z_FINISH);
+	bool ok = (r==Z_STREAM_END) && (zs.total_out==m->outlen) 
+			&& (zs.avail_in==0);
+	inflateEnd(&zs);
+	return ok;
+}
+
+static void * _gz_worker(void * arg)
+{
+	struct _gz_job * job = arg;
+	int i;
+	while((i=atomic_fetch_add(&job->next, 1))<job->n && atomic_load(&job->ok))
+		if(!_inflate_member(&job->members[i]))
+			atomic_store(&job->ok, false);
+	return NULL;
+}
+
+static int _gz_blocks(const uint8_t * buf, size_t len, 
+					struct _gz_member ** members, size_t * total)
+{
+	//finds the members of a blocked gzip file (as written by bgzip): 
+	// the header of every member has an extra subfield "BC" holding the
+	// member's compressed size-1, and the trailer its uncompressed size,
+	// so members can be found and placed without inflating anything.
+	// Returns the number of members, 0 if the file isn't blocked like 
+	// that, <0 if out of memory.
+	int n = 0, cap = 0;
+	size_t off = 0;
+	*members = NULL;
+	*total = 0;
+	while(off<len)
+	{
+		const uint8_t * h = buf+off;
+		size_t left = len-off, bsize = 0;
+		if(left<18 || h[0]!=0x1f || h[1]!=0x8b || h[2]!=Z_DEFLATED || !(h[3]&4))
+			break;
+		size_t xend = 12+(h[10] | h[11]<<8);
+		for(size_t x=12; xend<=left && x+4<=xend; x+=4+(h[x+2] | h[x+3]<<8))
+			if(h[x]=='B' && h[x+1]=='C' && (h[x+2] | h[x+3]<<8)==2 && x+6<=xend)
+				bsize = (h[x+4] | h[x+5]<<8)+1;
+		if(bsize<xend+8 || bsize>left)
+			break;
+		if(n==cap)
+		{
+			cap = cap ? 2*cap : 64;
+			struct _gz_member * m = realloc(*members, cap*sizeof(struct _gz_member));
+			if(!m)
+			{
+				free(*members);
+				*members = NULL;
+				return -1;
+			}
+			*members = m;
+		}
+		(*members)[n].in = h;
+		(*members)[n].inlen = bsize;
+		(*members)[n].outlen = _le32(h+bsize-4);
+		*total += (*members)[n].outlen;
+		n++;
+		off += bsize;
+	}
+	if(off<len || !n)
+	{
+		free(*members);
+		*members = NULL;
 		return 0;
-	// Read in the entire file, return 1 if success, 0 otherwise
-	int _read = fread(*buf, flen, 1, fp); 
-	fclose(fp); // Close the file
-	return _read;
+	}
+	return n;
 }
 
+static uint8_t * _inflate_stream(const uint8_t * in, size_t inlen, size_t * outlen)
+{
+	//inflates member after member in one pass. The buffer starts at the
+	// size in the last trailer (exact for a single member smaller than 
+	// 4GB) and doubles if that's not enough.
+	size_t cap = inlen>=4 ? _le32(in+inlen-4) : 0;
+	if(cap<IMG_HEADER_SIZE) cap = IMG_HEADER_SIZE;
+	uint8_t * out = malloc(cap);
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(!out || inflateInit2(&zs, 16+MAX_WBITS)!=Z_OK)
+	{
+		free(out);
+		return NULL;
+	}
+	size_t pos = 0, done = 0;
+	bool ok = false;
+	for(;;)
+	{
+		if(done==cap)
+		{
+			uint8_t * p = realloc(out, 2*cap);
+			if(!p) break;
+			out = p;
+			cap *= 2;
+		}
+		zs.next_in = (Bytef *) in+pos;
+		zs.avail_in = inlen-pos<UINT_MAX ? inlen-pos : UINT_MAX;
+		zs.next_out = out+done;
+		zs.avail_out = cap-done<UINT_MAX ? cap-done : UINT_MAX;
+		int r = inflate(&zs, Z_NO_FLUSH);
+		pos = zs.next_in-in;
+		done = zs.next_out-out;
+		if(r==Z_STREAM_END)
+		{
+			//another member may follow
+			if(pos==inlen)
+			{
+				ok = true;
+				break;
+			}
+			if(inflateReset(&zs)!=Z_OK) break;
+		}
+		else if((r!=Z_OK && r!=Z_BUF_ERROR) || (pos==inlen && done<cap))
+			break; //corrupt or truncated
+	}
+	inflateEnd(&zs);
+	if(!ok)
+	{
+		free(out);
+		return NULL;
+	}
+	*outlen = done;
+	return out;
+}
 
-mnist_dataset_handle mnist_open(const char * name)
+static uint8_t * _inflate_file(const char * path, size_t * len)
+{
+	//reads the gzip file path into a malloc'd buffer of *len bytes, 
+	// inflating the members of a blocked file in parallel. 
+	// Returns NULL on error.
+	size_t gzlen;
+	uint8_t * gz = _map_file(path, &gzlen, MNIST_MAP_SEQUENTIAL);
+	if(!gz) return NULL;
+	struct _gz_member * members;
+	size_t total;
+	uint8_t * out = NULL;
+	int n = _gz_blocks(gz, gzlen, &members, &total);
+	if(n>0 && (out=malloc(total ? total : 1)))
+	{
+		size_t off = 0;
+		for(int i=0; i<n; i++)
+		{
+			members[i].out = out+off;
+			off += members[i].outlen;
+		}
+		struct _gz_job job = {.members=members, .n=n};
+		atomic_init(&job.next, 0);
+		atomic_init(&job.ok, true);
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		int nthreads = ncpu<n ? (ncpu>1 ? ncpu : 1) : n;
+		if(nthreads>MNIST_GZ_MAX_THREADS) nthreads = MNIST_GZ_MAX_THREADS;
+		pthread_t threads[MNIST_GZ_MAX_THREADS];
+		int started = 0;
+		for(; started<nthreads-1; started++)
+			if(pthread_create(&threads[started], NULL, _gz_worker, &job)) break;
+		_gz_worker(&job);
+		for(int t=0; t<started; t++) pthread_join(threads[t], NULL);
+		debug_print("_inflate_file: %s: %d members, %d threads\n", 
+					path, n, started+1);
+		if(!atomic_load(&job.ok))
+		{
+			free(out);
+			out = NULL;
+		}
+		*len = total;
+	}
+	else if(n==0)
+		out = _inflate_stream(gz, gzlen, len);
+	free(members);
+	munmap(gz, gzlen);
+	return out;
+}
+
+static uint8_t * _heap_file(const char * path, uint8_t * mapping, size_t * len)
+{
+	//a malloc'd copy of the file path: of its mapping if there is one 
+	// (which is unmapped), else inflated from path.gz. Returns NULL on
+	// error.
+	if(mapping)
+	{
+		uint8_t * buf = malloc(*len);
+		if(buf) memcpy(buf, mapping, *len);
+		munmap(mapping, *len);
+		return buf;
+	}
+	char * gzpath = malloc(strlen(path)+strlen(GZ)+1);
+	if(!gzpath) return NULL;
+	strcpy(gzpath, path);
+	strcat(gzpath, GZ);
+	uint8_t * buf = _inflate_file(gzpath, len);
+	free(gzpath);
+	return buf;
+}
+
+static uint64_t _aligned_layout(uint64_t count, uint64_t * norms, uint64_t * sums)
+{
+	//offsets in an aligned file: the header, the labels, the norms and
+	// the sums (MNIST_ALIGN aligned), then the images from the returned
+	// offset, a multiple of MNIST_ALIGNED_PAGE
+	*norms = (ALIGNED_HEADER_SIZE+count+MNIST_ALIGN-1)/MNIST_ALIGN*MNIST_ALIGN;
+	*sums = *norms+8*count;
+	return (*sums+8*count+MNIST_ALIGNED_PAGE-1)/MNIST_ALIGNED_PAGE*MNIST_ALIGNED_PAGE;
+}
+
+static uint64_t _get64(const uint32_t * p)
+{
+	//high word first, both in network byte order
+	return (uint64_t) MY_NTOHL(p[0])<<32 | MY_NTOHL(p[1]);
+}
+
+static void _put64(uint32_t * p, uint64_t v)
+{
+	p[0] = MY_HTONL((uint32_t)(v>>32));
+	p[1] = MY_HTONL((uint32_t) v);
+}
+
+static int _open_aligned(mnist_dataset_handle mdh, const char * path, int flags)
+{
+	//maps the aligned file path into mdh (without making the handles).
+	// Returns 1 on success, 0 if there is no such file, <0 if it isn't
+	// a valid aligned file.
+	size_t len;
+	uint8_t * buf = _map_file(path, &len, flags | MNIST_MAP_HUGE_ALIGN);
+	if(!buf) return 0;
+	const uint32_t * h32 = (const uint32_t *) buf;
+	uint64_t count = 0, size = 0, stride = 0, data = 0, norms, sums;
+	bool ok = len>=ALIGNED_HEADER_SIZE && MY_NTOHL(h32[MN_IX])==ALIGNED_MAGIC_NUM;
+	if(ok)
+	{
+		count = MY_NTOHL(h32[NUM_IMG_IX]);
+		size = (uint64_t) MY_NTOHL(h32[X_IX])*MY_NTOHL(h32[Y_IX]);
+		stride = MY_NTOHL(h32[ALIGNED_STRIDE_IX]);
+		data = _get64(h32+ALIGNED_DATA_IX);
+		ok = count<=INT32_MAX && size && stride>=size && stride%MNIST_ALIGN==0
+			&& data==_aligned_layout(count, &norms, &sums)
+			&& len>=data && (len-data)/stride>=count;
+	}
+	if(!ok)
+	{
+		munmap(buf, len);
+		return -1;
+	}
+	mdh->mapped = true;
+	mdh->imgbuf = buf;
+	mdh->imglen = len;
+	mdh->count = count;
+	mdh->x = MY_NTOHL(h32[X_IX]);
+	mdh->y = MY_NTOHL(h32[Y_IX]);
+	mdh->size = size;
+	mdh->imgs = buf+data;
+	mdh->lbls = buf+ALIGNED_HEADER_SIZE;
+	mdh->stride = stride;
+	mdh->norms = (const uint32_t *)(buf+norms);
+	mdh->sums = (const uint32_t *)(buf+sums);
+	debug_print("_open_aligned: %s: %d images, stride %zu, images at %p\n", 
+				path, mdh->count, mdh->stride, (void *) mdh->imgs);
+	return 1;
+}
+
+static bool _newer(const char * path, const struct stat * than)
+{
+	//whether path, or else path.gz, was modified after than
+	struct stat st;
+	char * gzpath = malloc(strlen(path)+strlen(GZ)+1);
+	if(!gzpath) return false;
+	strcpy(gzpath, path);
+	strcat(gzpath, GZ);
+	bool found = !stat(path, &st) || !stat(gzpath, &st);
+	free(gzpath);
+	return found && (st.st_mtim.tv_sec>than->st_mtim.tv_sec
+				|| (st.st_mtim.tv_sec==than->st_mtim.tv_sec
+					&& st.st_mtim.tv_nsec>than->st_mtim.tv_nsec));
+}
+
+mnist_dataset_handle mnist_open_mapped(const char * name, int flags)
 {
 	char * imgpath = (char *) malloc(strlen(name)+strlen(IMAGES)+1);
+	char * lblpath = (char *) malloc(strlen(name)+strlen(LABELS)+1);
+	mnist_dataset_handle mdh = (mnist_dataset_handle)
+								calloc(1, sizeof(struct mnist_dataset_t)); 
+	if(!imgpath || !lblpath || !mdh)
+	{
+		free(imgpath);
+		free(lblpath);
+		free(mdh);
+		return MNIST_DATASET_INVALID;
+	}
 	strcpy(imgpath, name);
 	strcat(imgpath,IMAGES);
-
-	char * lblpath = (char *) malloc(strlen(name)+strlen(LABELS)+1);
 	strcpy(lblpath, name);
 	strcat(lblpath, LABELS);
 
-	uint8_t * lblbuf = NULL, * imgbuf = NULL;
-	uint32_t imn=0, lmn=0;	//magic numbers
-
-	// indicator if file readreturns 0 if error or no data, 1 otherwise.
-
-	int ibr = _read_file(&imgbuf, imgpath);
-	int lbr = _read_file(&lblbuf, lblpath);
-	debug_print("mnist_open: ibr=%d\tlbr=%d\n", ibr, lbr);
-	debug_print("mnist_open: imgbuf=%p\tlblbuf=%p\n",
-				(void *) imgbuf, (void *) lblbuf);
-	if (!ibr|| !lbr)
+	//an aligned file (mnist_save_aligned) takes precedence, unless an idx
+	// file was written since: it would be stale
+	char * alnpath = malloc(strlen(name)+strlen(ALIGNED)+1);
+	int aligned = -1;
+	if(alnpath)
+	{
+		strcpy(alnpath, name);
+		strcat(alnpath, ALIGNED);
+		struct stat st;
+		aligned = 0;
+		if(!stat(alnpath, &st) && !_newer(imgpath, &st) && !_newer(lblpath, &st))
+			aligned = _open_aligned(mdh, alnpath, flags);
+		else
+			debug_print("mnist_open: %s missing or older than the idx files\n",
+						alnpath);
+		free(alnpath);
+	}
+	if(aligned)
+	{
+		free(imgpath);
+		free(lblpath);
+		if(aligned<0)
 		{
-			free(imgpath);
-			free(lblpath);
+			free(mdh);
 			return MNIST_DATASET_INVALID;
 		}
+		if(!_link_handles(mdh))
+		{
+			mnist_free(mdh);
+			return MNIST_DATASET_INVALID;
+		}
+		return mdh;
+	}
 
-	//read magic number from ifp
-	//cast buf to 32 bit
-	lmn = (uint32_t) MY_NTOHL(((uint32_t * ) lblbuf)[MN_IX]);
-	imn = (uint32_t) MY_NTOHL(((uint32_t * ) imgbuf)[MN_IX]);
+	size_t imglen = 0, lbllen = 0;
+	uint8_t * imgbuf = _map_file(imgpath, &imglen, flags);
+	uint8_t * lblbuf = _map_file(lblpath, &lbllen, flags);
+	bool mapped = imgbuf && lblbuf;
+	if(!mapped)
+	{
+		//compressed files (or one of each): both go to the heap
+		imgbuf = _heap_file(imgpath, imgbuf, &imglen);
+		lblbuf = _heap_file(lblpath, lblbuf, &lbllen);
+	}
+	debug_print("mnist_open: imgbuf=%p\tlblbuf=%p\tmapped=%d\n",
+				(void *) imgbuf, (void *) lblbuf, mapped);
+	free(imgpath);
+	free(lblpath);
+	if (!imgbuf || !lblbuf || !_valid_headers(lblbuf, lbllen, imgbuf, imglen))
+	{
+		if(mapped)
+		{
+			munmap(imgbuf, imglen);
+			munmap(lblbuf, lbllen);
+		}
+		else
+		{
+			free(imgbuf);
+			free(lblbuf);
+		}
+		free(mdh);
+		return MNIST_DATASET_INVALID;
+	}
 
-	if(imn!=IMG_MAGIC_NUM && lmn!=LBL_MAGIC_NUM)
+	mdh->mapped = mapped;
+	mdh->imglen = imglen;
+	mdh->lbllen = lbllen;
+	if(!_populate_mnist_dataset(mdh, lblbuf, imgbuf))
+	{
+		mnist_free(mdh);
 		return MNIST_DATASET_INVALID;
-	debug_print("mnist_open: imn=%" PRIu32 "\tlmn=%" PRIu32 "\n", imn, lmn);
+	}
+	if(!mapped) mdh->capacity = mdh->count;
+	return mdh;
+}
 
-	//make handle to dataset
-	mnist_dataset_handle mdh = (mnist_dataset_handle)
-								malloc(sizeof(struct mnist_dataset_t)); 
+mnist_dataset_handle mnist_open(const char * name)
+{
+	return mnist_open_mapped(name, 0);
+}
 
-	_populate_mnist_dataset(mdh, lblbuf, imgbuf);
+static bool _own_view(mnist_dataset_handle h)
+{
+	//copy-on-write for a view: copies the images of its handles, in 
+	// order, to idx buffers of its own and points the handles at them
+	size_t imgsz = IMG_HEADER_SIZE+h->count*h->size;
+	size_t lblsz = LBL_HEADER_SIZE+(size_t) h->count;
+	uint8_t * imgbuf = malloc(imgsz);
+	uint8_t * lblbuf = malloc(lblsz);
+	if(!imgbuf || !lblbuf)
+	{
+		free(imgbuf);
+		free(lblbuf);
+		return false;
+	}
+	uint32_t * img32 = (uint32_t *) imgbuf, * lbl32 = (uint32_t *) lblbuf;
+	img32[MN_IX] = MY_HTONL(IMG_MAGIC_NUM);
+	img32[NUM_IMG_IX] = MY_HTONL(h->count);
+	img32[X_IX] = MY_HTONL(h->x);
+	img32[Y_IX] = MY_HTONL(h->y);
+	lbl32[MN_IX] = MY_HTONL(LBL_MAGIC_NUM);
+	lbl32[NUM_IMG_IX] = MY_HTONL(h->count);
+	for(int i=0; i<h->count; i++)
+	{
+		mnist_image_handle mih = &h->blocks[i/MNIST_HANDLE_BLOCK][i%MNIST_HANDLE_BLOCK];
+		memcpy(imgbuf+IMG_HEADER_SIZE+i*h->size, mnist_image_data(mih), h->size);
+		lblbuf[LBL_HEADER_SIZE+i] = mnist_image_label(mih);
+		mih->mdh = h;
+		mih->idx = i;
+	}
+	h->imgbuf = imgbuf;
+	h->lblbuf = lblbuf;
+	h->view = false;
+	h->capacity = h->count;
+	_idx_layout(h);
+	debug_print("_own_view: copied %zu+%zu bytes\n", imgsz, lblsz);
+	return true;
+}
 
-	free(imgpath);
-	free(lblpath);
-	return mdh;
+static bool _unmap(mnist_dataset_handle h)
+{
+	//copy-on-write: replaces the read-only mappings with malloc'd 
+	// idx buffers (headers, images without padding, labels), so they 
+	// can grow
+	if(h->view) return _own_view(h);
+	if(!h->mapped) return true;
+	size_t imgsz = IMG_HEADER_SIZE+h->count*h->size;
+	size_t lblsz = LBL_HEADER_SIZE+(size_t) h->count;
+	uint8_t * imgbuf = malloc(imgsz);
+	uint8_t * lblbuf = malloc(lblsz);
+	if(!imgbuf || !lblbuf)
+	{
+		free(imgbuf);
+		free(lblbuf);
+		return false;
+	}
+	uint32_t * img32 = (uint32_t *) imgbuf, * lbl32 = (uint32_t *) lblbuf;
+	img32[MN_IX] = MY_HTONL(IMG_MAGIC_NUM);
+	img32[NUM_IMG_IX] = MY_HTONL(h->count);
+	img32[X_IX] = MY_HTONL(h->x);
+	img32[Y_IX] = MY_HTONL(h->y);
+	lbl32[MN_IX] = MY_HTONL(LBL_MAGIC_NUM);
+	lbl32[NUM_IMG_IX] = MY_HTONL(h->count);
+	if(h->stride==h->size)
+		memcpy(imgbuf+IMG_HEADER_SIZE, h->imgs, h->count*h->size);
+	else
+		for(int i=0; i<h->count; i++)
+			memcpy(imgbuf+IMG_HEADER_SIZE+i*h->size, h->imgs+i*h->stride, h->size);
+	memcpy(lblbuf+LBL_HEADER_SIZE, h->lbls, h->count);
+	munmap(h->imgbuf, h->imglen);
+	if(h->lblbuf) munmap(h->lblbuf, h->lbllen);
+	h->imgbuf = imgbuf;
+	h->lblbuf = lblbuf;
+	h->mapped = false;
+	h->capacity = h->count;
+	_idx_layout(h);
+	debug_print("_unmap: copied %zu+%zu bytes\n", imgsz, lblsz);
+	return true;
+}
+
+bool mnist_reserve(mnist_dataset_handle h, int n)
+{
+	if(h==MNIST_DATASET_INVALID || n<0 || !_unmap(h))
+		return false;
+	if(n<=h->capacity)
+		return true;
+	uint8_t * imgbuf = realloc(h->imgbuf, IMG_HEADER_SIZE+(size_t) n*h->size);
+	if(!imgbuf)
+		return false;
+	h->imgbuf = imgbuf;
+	//imgs may have moved: point at the new buffer before anything can fail
+	_idx_layout(h);
+	uint8_t * lblbuf = realloc(h->lblbuf, LBL_HEADER_SIZE+(size_t) n);
+	if(!lblbuf)
+		return false;
+	h->lblbuf = lblbuf;
+	h->capacity = n;
+	_idx_layout(h);
+	debug_print("mnist_reserve: capacity=%d\n", n);
+	return true;
+}
+
+static bool _grow(mnist_dataset_handle h, int n)
+{
+	//makes room for n images, doubling the capacity so that adding 
+	// images one at a time copies each byte O(1) times on average
+	if(n<=h->capacity && !h->mapped && !h->view)
+		return true;
+	int64_t capacity = h->capacity>16 ? h->capacity : 16;
+	while(capacity<n) capacity *= 2;
+	if(capacity>INT32_MAX) capacity = n;
+	return mnist_reserve(h, (int) capacity);
+}
+
+static void _set_count(mnist_dataset_handle h, int count)
+{
+	//updates the cached count and both headers
+	h->count = count;
+	((uint32_t*)(h->lblbuf))[NUM_IMG_IX] = MY_HTONL((uint32_t) count);
+	((uint32_t*)(h->imgbuf))[NUM_IMG_IX] = MY_HTONL((uint32_t) count);
 }
 
 void mnist_free(mnist_dataset_handle handle)
@@ -190,20 +825,17 @@ void mnist_free(mnist_dataset_handle handle)
 		debug_print("mnist_free: handle=%p\timgbuf=%p\tlblbuf=%p\n",
 			(void*) handle, (void*)handle->imgbuf, (void*)handle->lblbuf);
 		
-		//free image handles
-		mnist_image_handle mih = handle->head;
-		mnist_image_handle prev_mih = MNIST_IMAGE_INVALID;
-
-		while(mih!=MNIST_IMAGE_INVALID)
+		_free_handles(handle);
+		if(handle->mapped)
 		{
-			prev_mih = mih;
-			mih = prev_mih->next;
-			// debug_print("mnist_free: prev_mih->idx:%d\n",prev_mih->idx);
-			free(prev_mih);
+			munmap(handle->imgbuf, handle->imglen);
+			if(handle->lblbuf) munmap(handle->lblbuf, handle->lbllen);
+		}
+		else
+		{
+			free(handle->imgbuf);
+			free(handle->lblbuf);
 		}
-
-		free(handle->imgbuf);
-		free(handle->lblbuf);
 		free(handle);
 	}
 }
@@ -216,7 +848,7 @@ mnist_dataset_handle mnist_create(unsigned int x, unsigned int y)
 
 	//malloc for dataset handle
 	mnist_dataset_handle mdh = (mnist_dataset_handle)
-								malloc(sizeof(struct mnist_dataset_t)); 
+								calloc(1, sizeof(struct mnist_dataset_t)); 
 
 	//allocate memory for img and lbl
 	uint32_t * lblbuf32 = NULL, * imgbuf32 = NULL;
@@ -241,7 +873,7 @@ mnist_dataset_handle mnist_create(unsigned int x, unsigned int y)
 	imgbuf32[X_IX] = MY_HTONL(x);
 	imgbuf32[Y_IX] = MY_HTONL(y);
 
-	//add to dataset
+	//add to dataset (no images: nothing to allocate)
 	_populate_mnist_dataset(mdh, (uint8_t*)lblbuf32, (uint8_t*)imgbuf32);
 	debug_print("mnist_create: mdh->imgbuf=%p\tmdh->lblbuf=%p\n",
 	 			(void*)mdh->imgbuf, (void*)mdh->lblbuf);
@@ -252,9 +884,7 @@ int mnist_image_count (const mnist_dataset_handle handle)
 {
 	if(handle==MNIST_DATASET_INVALID || !handle)
 		return -1;
-	uint32_t count = MY_NTOHL(((uint32_t*)(handle->lblbuf))[NUM_IMG_IX]);
-	debug_print("mnist_image_count: count:%"PRIu32"\n",count);
-	return count;
+	return handle->count;
 }
 
 void mnist_image_size (const mnist_dataset_handle handle,
@@ -264,58 +894,92 @@ void mnist_image_size (const mnist_dataset_handle handle,
 		*x=0, *y=0;
 	else
 	{
-		*x = (unsigned int) MY_NTOHL(((uint32_t*)(handle->imgbuf))[X_IX]);
-		*y = (unsigned int) MY_NTOHL(((uint32_t*)(handle->imgbuf))[Y_IX]);
+		*x = handle->x;
+		*y = handle->y;
 	}
-	debug_print("mnist_image_size: *x=%u\t*y=%u\n", *x, *y);
 }
 
 mnist_image_handle mnist_image_begin (const mnist_dataset_handle handle)
 {
 	if(handle==MNIST_DATASET_INVALID)
 		return MNIST_IMAGE_INVALID;
-	if(mnist_image_count(handle)<=0)
+	if(handle->count<=0)
 		return MNIST_IMAGE_INVALID;
-	debug_print("mnist_image_begin: handle:%p\thandle->head->idx:%d\n", 
-				(void*) handle->head,handle->head->idx);
 	return handle->head;
 }
 
+mnist_image_handle mnist_image_at (const mnist_dataset_handle handle, int i)
+{
+	if(handle==MNIST_DATASET_INVALID || i<0 || i>=handle->count)
+		return MNIST_IMAGE_INVALID;
+	if(handle->ordered)
+		return &handle->blocks[i/MNIST_HANDLE_BLOCK][i%MNIST_HANDLE_BLOCK];
+	if(!handle->order)
+	{
+		//images were inserted in the middle: walk the list once
+		handle->order = malloc(handle->count*sizeof(struct mnist_image_t *));
+		if(!handle->order) return MNIST_IMAGE_INVALID;
+		mnist_image_handle mih = handle->head;
+		for(int j=0; j<handle->count; j++, mih=mih->next) handle->order[j] = mih;
+	}
+	return handle->order[i];
+}
+
 const unsigned char * mnist_image_data (const mnist_image_handle h)
 {
 	if (h==MNIST_IMAGE_INVALID)
 		return NULL;
-	//get pointer to start of imgbuf
-	debug_print("mnist_image_data: h:%p\th->mdh:%p\n", (void*)h, (void*)h->mdh);
-	uint8_t * imgbuf = h->mdh->imgbuf;
-	assert(imgbuf);
-
-	//get idx value
-	uint32_t idx = h->idx;
-	//get size of images
-	unsigned int x=-1, y=-1, size=0;
-	mnist_image_size(h->mdh, &x, &y);
-	size = x*y; //size in bytes
-	const unsigned char * img_data = ((const unsigned char*)imgbuf)+IMG_HEADER_SIZE+idx*size; 
-	debug_print("mnist_image_data: IMG_HEADER_SIZE+idx*size:%d\n",IMG_HEADER_SIZE+idx*size);
-	debug_print("mnist_image_data: img_data:%p\n",(void*)img_data);
-	debug_print("mnist_image_data: *(img_data):%d\n",*img_data);
-	//add (h->idx * imagesize) bytes to imgbuf+headersize to get start of img
-	return img_data;
+	//add (h->idx * stride) bytes to the first image to get start of img
+	return h->mdh->imgs+h->idx*h->mdh->stride;
 }
 
 int mnist_image_label (const mnist_image_handle h)
 {
 	if (h==MNIST_IMAGE_INVALID)
 		return -1;
-	debug_print("mnist_image_label: h:%p\th->mdh:%p\n", (void*)h, (void*)h->mdh);
-	uint8_t * lblbuf = h->mdh->lblbuf;
-	assert(lblbuf);
+	return h->mdh->lbls[h->idx];
+}
+
+size_t mnist_image_stride (const mnist_dataset_handle handle)
+{
+	if(handle==MNIST_DATASET_INVALID)
+		return 0;
+	if(!handle->view)
+		return handle->stride;
+	//a view is a stride apart if its images are consecutive images of a
+	// single parent (views are flat, so the parent has buffers)
+	mnist_image_handle first = handle->head;
+	if(!first)
+		return handle->stride;
+	int i = 0;
+	for(mnist_image_handle img=first; img; img=img->next, i++)
+		if(img->mdh!=first->mdh || img->idx!=first->idx+i)
+			return 0;
+	return first->mdh->stride;
+}
+
+uint64_t mnist_image_norm2 (const mnist_image_handle h)
+{
+	if(h==MNIST_IMAGE_INVALID)
+		return 0;
+	if(h->mdh->norms)
+		return _get64(h->mdh->norms+2*h->idx);
+	const unsigned char * data = mnist_image_data(h);
+	uint64_t norm2 = 0;
+	for(size_t p=0; p<h->mdh->size; p++) norm2 += data[p]*data[p];
+	return norm2;
+}
 
-	//get idx val
-	uint32_t idx = h->idx;
-	debug_print("mnist_image_label: *(lblbuf+LBL_HEADER_SIZE+idx):%d\n", *(lblbuf+LBL_HEADER_SIZE+idx));
-	return *(lblbuf+LBL_HEADER_SIZE+idx);
+uint64_t mnist_image_sum (const mnist_image_handle h)
+{
+	if(h==MNIST_IMAGE_INVALID)
+		return 0;
+	if(h->mdh->sums)
+		return _get64(h->mdh->sums+2*h->idx);
+	const unsigned char * data = mnist_image_data(h);
+	uint64_t sum = 0;
+	for(size_t p=0; p<h->mdh->size; p++) sum += data[p];
+	return sum;
 }
 
 mnist_image_handle mnist_image_next (const mnist_image_handle h)
@@ -331,13 +995,17 @@ mnist_image_handle mnist_image_add_after (mnist_dataset_handle h,
       unsigned int label)
 {
 
+	//the buffers of an opened dataset are read-only mappings
+	if(h==MNIST_DATASET_INVALID || !_unmap(h))
+		return MNIST_IMAGE_INVALID;
+
 	//make useful variables
-	unsigned int y_sz = MY_NTOHL(((uint32_t*)(h->imgbuf))[Y_IX]);
-	unsigned int x_sz = MY_NTOHL(((uint32_t*)(h->imgbuf))[X_IX]);
-	//check x,y against h->imgdata[2], h->imgdata[3]
+	unsigned int y_sz = h->y;
+	unsigned int x_sz = h->x;
+	//check x,y against the header
 	if ( (x!=x_sz) || (y!=y_sz) )
 		return MNIST_IMAGE_INVALID;
-	uint32_t num_images_old = MY_NTOHL(((uint32_t*)(h->imgbuf))[NUM_IMG_IX]);
+	uint32_t num_images_old = h->count;
 	unsigned int imgbuf_old_sz = (y_sz*x_sz)*num_images_old + IMG_HEADER_SIZE;
 	unsigned int lblbuf_old_sz = num_images_old+ LBL_HEADER_SIZE;
 	
@@ -347,40 +1015,31 @@ mnist_image_handle mnist_image_add_after (mnist_dataset_handle h,
 	assert(imagedata);
 	debug_print("mnist_image_add_after: imgbuf_old_sz:%d\tlblbuf_old_sz:%d\tnum_images_old:%d\n",
 				imgbuf_old_sz, lblbuf_old_sz, num_images_old);
-	uint8_t * realloc_check = NULL;
-	assert(imagedata);
+
+	//handle of the new image
+	mnist_image_handle new_mih = _slot(h, num_images_old);
+	if(!new_mih)
+		return MNIST_IMAGE_INVALID;
 	
-	//append imagedata to mdh->imgbuf
-		//realloc mdh->imgbuf
-	realloc_check = (uint8_t*)realloc(h->imgbuf, imgbuf_old_sz+(x*y));
-	if(!realloc_check)
+	//make room for the image (the buffers grow by doubling)
+	if(!_grow(h, num_images_old+1))
 		return MNIST_IMAGE_INVALID;
-	h->imgbuf = realloc_check;
 
-		//memcpy imagedata to imgbuf
+	//append imagedata to mdh->imgbuf and label to mdh->lblbuf
 	memcpy((h->imgbuf)+imgbuf_old_sz, imagedata, (x*y));
+	h->lblbuf[lblbuf_old_sz] = (uint8_t) label;
 	
-	//append label to mdh->lblbuf
-		//realloc mdh->lblbuf
-	realloc_check = NULL;
-	realloc_check = (uint8_t*)realloc(h->lblbuf, lblbuf_old_sz+1);
-	if(!realloc_check)
-		return MNIST_IMAGE_INVALID;
-	h->lblbuf = realloc_check;
-		//add label to lblbuf
-	memcpy((h->lblbuf)+lblbuf_old_sz, &label, 1);
-	
-	//set mdh->lblbuf[1] = num_images + 1
-	uint32_t num_images_new = (uint32_t) (num_images_old+1);
-	((uint32_t*)(h->lblbuf))[NUM_IMG_IX] = MY_HTONL(num_images_new);
-	//set mdh->imgbug[1] = num_images + 1
-	((uint32_t*)(h->imgbuf))[NUM_IMG_IX] = MY_HTONL(num_images_new);
-	debug_print("mnist_image_add_after: num_images_new: %"PRIu32
+	//set the count in both headers to num_images + 1
+	_set_count(h, num_images_old+1);
+	debug_print("mnist_image_add_after: num_images_new: %d"
 				"\th->lblbuf[NUM_IMG_IX]:%"PRIu32"\n", 
-				num_images_new, MY_NTOHL(h->lblbuf[NUM_IMG_IX]));
+				h->count, MY_NTOHL(((uint32_t*)h->lblbuf)[NUM_IMG_IX]));
 
-	//make new_mih
-	mnist_image_handle new_mih = (mnist_image_handle) malloc(sizeof(struct mnist_image_t));
+	//still in buffer order only if appended at the end
+	if(i!=h->tail && num_images_old>0) h->ordered = false;
+	if(i==h->tail || num_images_old==0) h->tail = new_mih;
+	free(h->order);
+	h->order = NULL;
 		//set new_mih->idx = num_images
 	new_mih->idx = num_images_old;
 		//set new_mih->mdh = mdh
@@ -404,6 +1063,81 @@ mnist_image_handle mnist_image_add_after (mnist_dataset_handle h,
 	return new_mih;
 }
 
+mnist_image_handle mnist_image_append_batch(mnist_dataset_handle h,
+		const unsigned char * data, int count, const unsigned char * labels)
+{
+	if(h==MNIST_DATASET_INVALID || !data || !labels || count<=0 
+		|| count>INT32_MAX-h->count)
+		return MNIST_IMAGE_INVALID;
+	int old = h->count;
+	//handles of the new images (one _slot per block), then room in the
+	// buffers, so a failure leaves the dataset as it was
+	for(int i=old; i<old+count; i+=MNIST_HANDLE_BLOCK-i%MNIST_HANDLE_BLOCK)
+		if(!_slot(h, i))
+			return MNIST_IMAGE_INVALID;
+	if(!_grow(h, old+count))
+		return MNIST_IMAGE_INVALID;
+
+	memcpy(h->imgs+old*h->size, data, count*h->size);
+	memcpy(h->lbls+old, labels, count);
+
+	//link the new handles after the last image
+	mnist_image_handle prev = h->tail;
+	for(int i=old; i<old+count; i++)
+	{
+		mnist_image_handle mih = &h->blocks[i/MNIST_HANDLE_BLOCK][i%MNIST_HANDLE_BLOCK];
+		mih->idx = i;
+		mih->mdh = h;
+		mih->next = MNIST_IMAGE_INVALID;
+		if(prev) prev->next = mih;
+		else h->head = mih;
+		prev = mih;
+	}
+	h->tail = prev;
+	_set_count(h, old+count);
+	free(h->order);
+	h->order = NULL;
+	debug_print("mnist_image_append_batch: old=%d\tcount=%d\n", old, count);
+	return prev;
+}
+
+static const uint8_t * _offset_image(const mnist_dataset_handle h, int i)
+{
+	//the image at offset i of the buffers. A view has none: its handle
+	// at offset i knows where the image is.
+	if(h->view)
+		return mnist_image_data(&h->blocks[i/MNIST_HANDLE_BLOCK][i%MNIST_HANDLE_BLOCK]);
+	return h->imgs+i*h->stride;
+}
+
+static bool _write_labels(const mnist_dataset_handle h, FILE * fp)
+{
+	//writes the labels in buffer order
+	if(!h->view)
+		return !h->count || fwrite(h->lbls, h->count, 1, fp)==1;
+	bool ok = true;
+	for(int i=0; i<h->count && ok; i++)
+		ok = fputc(mnist_image_label(&h->blocks[i/MNIST_HANDLE_BLOCK]
+									[i%MNIST_HANDLE_BLOCK]), fp)!=EOF;
+	return ok;
+}
+
+static bool _write_images(const mnist_dataset_handle h, FILE * fp, size_t pad)
+{
+	//writes the images in buffer order, each followed by pad zeros
+	if(h->stride==h->size && !pad && !h->view)
+		return !h->count || fwrite(h->imgs, h->count*h->size, 1, fp)==1;
+	static const uint8_t zeros[MNIST_ALIGN];
+	bool ok = true;
+	for(int i=0; i<h->count && ok; i++)
+	{
+		ok = fwrite(_offset_image(h, i), h->size, 1, fp)==1;
+		for(size_t p=pad; p>0 && ok; p-=(p<MNIST_ALIGN ? p : MNIST_ALIGN))
+			ok = fwrite(zeros, p<MNIST_ALIGN ? p : MNIST_ALIGN, 1, fp)==1;
+	}
+	return ok;
+}
+
 bool mnist_save(const mnist_dataset_handle h, const char * filename)
 {
 	if(h==MNIST_DATASET_INVALID)
@@ -412,9 +1146,9 @@ bool mnist_save(const mnist_dataset_handle h, const char * filename)
 	int num_img = mnist_image_count(h);
 	unsigned int x=0,y=0;
 	mnist_image_size(h, &x, &y);
-	void *lblbuf =(void*)(h->lblbuf), *imgbuf = (void*) (h->imgbuf);
-	size_t img_write_sz = (x*y*num_img)+IMG_HEADER_SIZE;
-	size_t lbl_write_sz = num_img+LBL_HEADER_SIZE;
+	uint32_t lblhdr[LBL_HEADER_SIZE/4] = {MY_HTONL(LBL_MAGIC_NUM), MY_HTONL(num_img)};
+	uint32_t imghdr[IMG_HEADER_SIZE/4] = {MY_HTONL(IMG_MAGIC_NUM), MY_HTONL(num_img),
+										MY_HTONL(x), MY_HTONL(y)};
 	size_t ibw=0, lbw=0;
 
 	if((num_img<0)||!x||!y)
@@ -438,11 +1172,11 @@ bool mnist_save(const mnist_dataset_handle h, const char * filename)
 		return false;
 	}
 
-	//size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
-	lbw = fwrite(lblbuf, lbl_write_sz, 1, lfp);
-	ibw = fwrite(imgbuf, img_write_sz, 1, ifp);
-	fclose(ifp);
-	fclose(lfp);
+	//the headers, then the images (without any padding) and labels
+	lbw = fwrite(lblhdr, LBL_HEADER_SIZE, 1, lfp) && _write_labels(h, lfp);
+	ibw = fwrite(imghdr, IMG_HEADER_SIZE, 1, ifp) && _write_images(h, ifp, 0);
+	lbw &= !fclose(lfp);
+	ibw &= !fclose(ifp);
 	free(imgpath);
 	free(lblpath);
 	if (lbw&&ibw)
@@ -451,82 +1185,294 @@ bool mnist_save(const mnist_dataset_handle h, const char * filename)
 		return false;
 }
 
-mnist_dataset_handle mnist_create_sample(const mnist_dataset_handle h, 
-	unsigned int n)
+bool mnist_save_aligned(const mnist_dataset_handle h, const char * name)
 {
-	assert(h);
-	unsigned int x, y, num_imgs;
-	num_imgs = mnist_image_count(h);
-	assert(num_imgs);
-	mnist_image_size(h, &x, &y);
-	
-	if (n>num_imgs) return MNIST_DATASET_INVALID;
+	if(h==MNIST_DATASET_INVALID || !name)
+		return false;
+	char * path = malloc(strlen(name)+strlen(ALIGNED)+1);
+	if(!path)
+		return false;
+	strcpy(path, name);
+	strcat(path, ALIGNED);
+	FILE * fp = fopen(path, "wb");
+	free(path);
+	if(!fp)
+		return false;
 
-	//get randomly selected list of n out of num_img numbers.
-	// first populate array fully
+	size_t stride = (h->size+MNIST_ALIGN-1)/MNIST_ALIGN*MNIST_ALIGN;
+	uint64_t norms, sums, data = _aligned_layout(h->count, &norms, &sums);
+	uint32_t header[ALIGNED_HEADER_SIZE/4] = {0};
+	header[MN_IX] = MY_HTONL(ALIGNED_MAGIC_NUM);
+	header[NUM_IMG_IX] = MY_HTONL(h->count);
+	header[X_IX] = MY_HTONL(h->x);
+	header[Y_IX] = MY_HTONL(h->y);
+	header[ALIGNED_STRIDE_IX] = MY_HTONL(stride);
+	_put64(header+ALIGNED_DATA_IX, data);
+	bool ok = stride<=UINT32_MAX && fwrite(header, sizeof(header), 1, fp)==1
+			&& _write_labels(h, fp);
 
-	mnist_dataset_handle s_mdh = mnist_create(x,y);
-	if(n==0) return s_mdh;
-	debug_print(" mnist_create_sample: num_imgs:%d\tn:%d\n", num_imgs, n);
+	//norms and sums, in buffer order like everything else
+	ok = ok && !fseek(fp, norms, SEEK_SET);
+	for(int pass=0; pass<2 && ok; pass++)
+		for(int i=0; i<h->count && ok; i++)
+		{
+			const uint8_t * img = _offset_image(h, i);
+			uint64_t v = 0;
+			for(size_t p=0; p<h->size; p++) v += pass ? img[p] : img[p]*img[p];
+			uint32_t word[2];
+			_put64(word, v);
+			ok = fwrite(word, sizeof(word), 1, fp)==1;
+		}
+	//the images from a MNIST_ALIGNED_PAGE boundary, padded with zeros
+	ok = ok && !fseek(fp, data, SEEK_SET) && _write_images(h, fp, stride-h->size);
+	ok &= !fclose(fp);
+	debug_print("mnist_save_aligned: %s: stride %zu, images at %"PRIu64"\n", 
+				name, stride, data);
+	return ok;
+}
 
-	int *sample_idx = malloc(num_imgs*sizeof(int));
-	int i;
-	for(i=0;i<num_imgs;i++) { sample_idx[i] = i; }
-	
-	//shuffle list
-	_fisher_yates_shuffle(sample_idx, num_imgs);
-	
-	//take first n elements of shuffled array
-	void * rcheck = realloc(sample_idx, n*sizeof(int));
-	if(!rcheck)
-	{	
-		free(sample_idx);
-		if ( n!=0) 
-		{	
-			//out of memory, n is too large
-			mnist_free(s_mdh); 
+static struct mnist_image_t ** _walk(const mnist_dataset_handle h)
+{
+	//handle of every position of a dataset that isn't ordered. Unlike 
+	// mnist_image_at this doesn't touch h, so many threads can sample h
+	// at once. Returns NULL if out of memory.
+	struct mnist_image_t ** walk = malloc((h->count ? h->count : 1)
+										*sizeof(struct mnist_image_t *));
+	if(!walk) return NULL;
+	mnist_image_handle mih = h->head;
+	for(int i=0; i<h->count; i++, mih=mih->next) walk[i] = mih;
+	return walk;
+}
+
+static mnist_image_handle _position(const mnist_dataset_handle h, 
+		struct mnist_image_t ** walk, int i)
+{
+	//the image at position i: the handle at offset i while h is ordered
+	return walk ? walk[i] : &h->blocks[i/MNIST_HANDLE_BLOCK][i%MNIST_HANDLE_BLOCK];
+}
+
+mnist_dataset_handle mnist_gather(const mnist_dataset_handle h, 
+	const int * idx, int n)
+{
+	if(h==MNIST_DATASET_INVALID || n<0 || (n && !idx))
+		return MNIST_DATASET_INVALID;
+	for(int i=0; i<n; i++)
+		if(idx[i]<0 || idx[i]>=h->count)
 			return MNIST_DATASET_INVALID;
+	struct mnist_image_t ** walk = NULL;
+	if(!h->ordered && !(walk=_walk(h)))
+		return MNIST_DATASET_INVALID;
+
+	//room for all of them at once, then copy each run of images that are
+	// consecutive in the buffers (the whole dataset for a sorted sample 
+	// of every image) with one memcpy
+	mnist_dataset_handle s_mdh = mnist_create(h->x, h->y);
+	bool ok = s_mdh!=MNIST_DATASET_INVALID && mnist_reserve(s_mdh, n);
+	for (int j=0, run; ok && j<n; j+=run)
+	{
+		//(the images of a view are in the buffers of its parents)
+		mnist_image_handle img = _position(h, walk, idx[j]), next;
+		for(run=1; j+run<n && img->mdh->stride==img->mdh->size; run++)
+		{
+			next = _position(h, walk, idx[j+run]);
+			if(next->mdh!=img->mdh || next->idx!=img->idx+run) break;
 		}
-		// n=0, so s_mdh is empty.
-		return s_mdh;
-	}
-	sample_idx = rcheck;
-	// sort array (to make buikding dataset more efficient)
-	qsort((void*)sample_idx, n, sizeof(int), _compare_int);
-	for(i=0;i<n;i++) {debug_print("mnist_create_sample: sample_idx[i]:%d\n", sample_idx[i]);}
-
-
-	//traverse the original dataset in order, add the index to the 
-	// sample dataset if the idx is in the sample_idx array
-	mnist_image_handle s_img = mnist_image_begin(s_mdh);
-	mnist_image_handle img = mnist_image_begin(h);
-	const unsigned char * img_data = mnist_image_data(img);
-	int img_lbl = mnist_image_label(img);
-	int r=0, j=0;
-	while (j<n)
-	{
-		// debug_print("r:%d\tsample_idx[r]:%d\n", r ,sample_idx[r]);
-		if (r==(sample_idx[j]))
-		{	
-			debug_print(" mnist_create_sample: found img - r:%d\tsample_idx[j]:%d\n", r ,sample_idx[j]);
-			img_data = mnist_image_data(img);
-			img_lbl = mnist_image_label(img);
-			s_img = mnist_image_add_after(s_mdh, s_img, img_data, x,y, img_lbl);
-			assert(s_img);
-			img = img->next;
-			j++;
-			r++;
-			if(j<n) assert((img!=MNIST_IMAGE_INVALID));
-		}
-		else
+		ok = mnist_image_append_batch(s_mdh, mnist_image_data(img), run, 
+							img->mdh->lbls+img->idx)!=MNIST_IMAGE_INVALID;
+	}
+	free(walk);
+	if(!ok)
+	{
+		mnist_free(s_mdh);
+		return MNIST_DATASET_INVALID;
+	}
+	debug_print("mnist_gather: n:%d\ts_mdh:%p\n", n, (void*) s_mdh);
+	return s_mdh;
+}
+
+mnist_dataset_handle mnist_sample(const mnist_dataset_handle h, 
+	unsigned int n, sample_rng_t * rng)
+{
+	if(h==MNIST_DATASET_INVALID || !rng || n>(unsigned int) h->count) 
+		return MNIST_DATASET_INVALID;
+	int * idx = malloc((n ? n : 1)*sizeof(int));
+	mnist_dataset_handle s_mdh = MNIST_DATASET_INVALID;
+	if(idx && sample_floyd(rng, h->count, n, idx))
+		s_mdh = mnist_gather(h, idx, n);
+	free(idx);
+	return s_mdh;
+}
+
+mnist_dataset_handle mnist_sample_stratified(const mnist_dataset_handle h, 
+	unsigned int n, sample_rng_t * rng)
+{
+	if(h==MNIST_DATASET_INVALID || !rng || n>(unsigned int) h->count) 
+		return MNIST_DATASET_INVALID;
+	//labels in position order: the label buffer itself while h is ordered
+	// (and not a view)
+	unsigned char * labels = NULL;
+	if(!h->ordered || h->view)
+	{
+		struct mnist_image_t ** walk = h->ordered ? NULL : _walk(h);
+		labels = malloc(h->count ? h->count : 1);
+		if((!walk && !h->ordered) || !labels)
 		{
-			r++;
-			img=img->next;
-			assert((img!=MNIST_IMAGE_INVALID));
-			// debug_print("not found img - img->idx:%d\n",img->idx);
+			free(walk);
+			free(labels);
+			return MNIST_DATASET_INVALID;
 		}
+		for(int i=0; i<h->count; i++) 
+			labels[i] = mnist_image_label(_position(h, walk, i));
+		free(walk);
 	}
-	free(sample_idx);
-	debug_print(" mnist_create_sample: s_mdh:%p\n", (void*) s_mdh);
+	int * idx = malloc((n ? n : 1)*sizeof(int));
+	mnist_dataset_handle s_mdh = MNIST_DATASET_INVALID;
+	if(idx && sample_stratified(rng, labels ? labels : h->lbls, h->count, n, idx))
+		s_mdh = mnist_gather(h, idx, n);
+	free(idx);
+	free(labels);
 	return s_mdh;
 }
+
+mnist_dataset_handle mnist_create_sample(const mnist_dataset_handle h, 
+	unsigned int n)
+{
+	//every call draws from the next stream of MNIST_SAMPLE_SEED, so 
+	// consecutive samples differ but a run is reproducible
+	static atomic_uint_fast64_t calls;
+	sample_rng_t rng = sample_rng(MNIST_SAMPLE_SEED, atomic_fetch_add(&calls, 1));
+	return mnist_sample(h, n, &rng);
+}
+
+static mnist_dataset_handle _view_create(unsigned int x, unsigned int y)
+{
+	//an empty view of images of x*y
+	mnist_dataset_handle v = calloc(1, sizeof(struct mnist_dataset_t));
+	if(!v) return MNIST_DATASET_INVALID;
+	v->view = true;
+	v->ordered = true;
+	v->x = x;
+	v->y = y;
+	v->size = v->stride = (size_t) x*y;
+	return v;
+}
+
+static bool _view_add(mnist_dataset_handle v, const mnist_image_handle img)
+{
+	//appends a handle to the image of img. The image of a view's handle 
+	// is in a dataset with buffers, so views of views are flat.
+	mnist_image_handle mih = v->count<INT32_MAX ? _slot(v, v->count) : NULL;
+	if(!mih) return false;
+	mih->mdh = img->mdh;
+	mih->idx = img->idx;
+	mih->next = MNIST_IMAGE_INVALID;
+	if(v->tail) v->tail->next = mih;
+	else v->head = mih;
+	v->tail = mih;
+	v->count++;
+	return true;
+}
+
+mnist_dataset_handle mnist_view_subset(const mnist_dataset_handle h, 
+	const int * idx, int n)
+{
+	if(h==MNIST_DATASET_INVALID || n<0 || (n && !idx))
+		return MNIST_DATASET_INVALID;
+	for(int i=0; i<n; i++)
+		if(idx[i]<0 || idx[i]>=h->count)
+			return MNIST_DATASET_INVALID;
+	struct mnist_image_t ** walk = NULL;
+	if(!h->ordered && !(walk=_walk(h)))
+		return MNIST_DATASET_INVALID;
+	mnist_dataset_handle v = _view_create(h->x, h->y);
+	bool ok = v!=MNIST_DATASET_INVALID;
+	for(int i=0; i<n && ok; i++)
+		ok = _view_add(v, _position(h, walk, idx[i]));
+	free(walk);
+	if(!ok)
+	{
+		mnist_free(v);
+		return MNIST_DATASET_INVALID;
+	}
+	debug_print("mnist_view_subset: n:%d\tv:%p\n", n, (void*) v);
+	return v;
+}
+
+mnist_dataset_handle mnist_view_range(const mnist_dataset_handle h, 
+	int first, int count)
+{
+	if(h==MNIST_DATASET_INVALID || first<0 || count<0 || first>h->count-count)
+		return MNIST_DATASET_INVALID;
+	mnist_dataset_handle v = _view_create(h->x, h->y);
+	mnist_image_handle img = h->ordered ? NULL : mnist_image_begin(h);
+	for(int i=0; i<first && img; i++) img = img->next;
+	bool ok = v!=MNIST_DATASET_INVALID;
+	for(int i=first; i<first+count && ok; i++)
+	{
+		//the handle at offset i while h is ordered, else walk the list
+		ok = _view_add(v, img ? img : _position(h, NULL, i));
+		if(img) img = img->next;
+	}
+	if(!ok)
+	{
+		mnist_free(v);
+		return MNIST_DATASET_INVALID;
+	}
+	return v;
+}
+
+mnist_dataset_handle mnist_view_union(const mnist_dataset_handle * hs, int n)
+{
+	if(!hs || n<=0)
+		return MNIST_DATASET_INVALID;
+	for(int j=0; j<n; j++)
+		if(hs[j]==MNIST_DATASET_INVALID || hs[j]->x!=hs[0]->x 
+			|| hs[j]->y!=hs[0]->y)
+			return MNIST_DATASET_INVALID;
+	mnist_dataset_handle v = _view_create(hs[0]->x, hs[0]->y);
+	bool ok = v!=MNIST_DATASET_INVALID;
+	for(int j=0; j<n && ok; j++)
+		for(mnist_image_handle img=mnist_image_begin(hs[j]); img && ok; 
+			img=img->next)
+			ok = _view_add(v, img);
+	if(!ok)
+	{
+		mnist_free(v);
+		return MNIST_DATASET_INVALID;
+	}
+	return v;
+}
+
+bool mnist_is_view(const mnist_dataset_handle h)
+{
+	return h!=MNIST_DATASET_INVALID && h->view;
+}
+
+static uint64_t _mix64(uint64_t z)
+{
+	//splitmix64 finalizer
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+uint64_t mnist_hash_data(const unsigned char * data, size_t len)
+{
+	//hashes 8 bytes per step. memcpy keeps the loads legal for
+	// unaligned data.
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	size_t i = 0;
+	for(; i+sizeof(uint64_t)<=len; i+=sizeof(uint64_t))
+	{
+		uint64_t w;
+		memcpy(&w, data+i, sizeof(w));
+		h = _mix64(h ^ w);
+	}
+	if(i<len)
+	{
+		uint64_t w = 0;
+		memcpy(&w, data+i, len-i);
+		h = _mix64(h ^ w);
+	}
+	return _mix64(h);
+}
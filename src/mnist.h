@@ -3,6 +3,8 @@
 //specs from http://yann.lecun.com/exdb/mnist/
 #define LABELS "-labels-idx1-ubyte"
 #define IMAGES "-images-idx3-ubyte"
+//suffix of gzip compressed files
+#define GZ ".gz"
 #define LBL_MAGIC_NUM 0x00000801
 #define IMG_MAGIC_NUM 0x00000803
 #define LBL_HEADER_SIZE 8
@@ -13,6 +15,30 @@
 #define NUM_IMG_IX 1
 #define X_IX 2
 #define Y_IX 3
+//image handles are allocated in blocks of this many
+#define MNIST_HANDLE_BLOCK 4096
+//most threads inflating the members of a compressed file
+#define MNIST_GZ_MAX_THREADS 64
+//seed of the samples of mnist_create_sample
+#define MNIST_SAMPLE_SEED 0x6d6e697374ULL
+
+//aligned container, written by mnist_save_aligned: a single file
+// name-aligned. The header is ALIGNED_HEADER_SIZE bytes of uint32 in 
+// network byte order: magic, number of images, x, y (at the same 
+// indices as in the image file), stride, and the offset of the images
+// as a uint64 (high word first). Then come the labels, the squared 
+// norms (sum of the squared pixel values) and the sums of the pixel 
+// values of the images as uint64, each array starting at a multiple of
+// MNIST_ALIGN. The images start at a multiple of MNIST_ALIGNED_PAGE, 
+// every image padded with zeros to stride bytes, a multiple of 
+// MNIST_ALIGN.
+#define ALIGNED "-aligned"
+#define ALIGNED_MAGIC_NUM 0x4d4e4131 //"MNA1"
+#define ALIGNED_HEADER_SIZE 64
+#define ALIGNED_STRIDE_IX 4
+#define ALIGNED_DATA_IX 5
+#define MNIST_ALIGN 64
+#define MNIST_ALIGNED_PAGE (2u<<20)
 
 //choose the endian converitng function
 #define MY_NTOHL ntohl 
@@ -21,6 +47,9 @@
 
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sample.h"
 
 struct mnist_dataset_t;
 
@@ -49,8 +78,37 @@ typedef struct mnist_image_t * mnist_image_handle;
 /// The open function checks the 'magic number' at the beginning of the file
 /// and returns MNIST_DATASET_INVALID if the number does not match
 /// expectations.
+///
+/// The files are not read: they are mapped read-only with mmap, the headers
+/// are validated in place (magic numbers, equal image and label counts,
+/// files long enough for their images) and mnist_image_data points into
+/// the mapping, so several processes opening the same dataset share one
+/// copy in the page cache. The first mnist_image_add_after copies the
+/// dataset to the heap (copy-on-write).
+///
+/// If a file doesn't exist but the gzip compressed one does (e.g.
+/// name-images-idx3-ubyte.gz, as distributed), it is inflated in one pass
+/// straight into the dataset's buffer, without a temporary file. Blocked
+/// gzip files (bgzip: many members, each with its size in its header)
+/// are inflated in parallel, a member per thread at a time.
+///
+/// If the aligned file name-aligned (see mnist_save_aligned) exists and
+/// is no older than the idx files (or their .gz), it is opened instead
+/// of them; idx files written since win. It is mapped at a 
+/// MNIST_ALIGNED_PAGE boundary, so every image starts on a MNIST_ALIGN
+/// boundary and is followed by zeros up to mnist_image_stride bytes.
 mnist_dataset_handle mnist_open (const char * name);
 
+/// flags of mnist_open_mapped, can be or'ed together
+#define MNIST_MAP_POPULATE   1 // read the whole files in at open (MAP_POPULATE)
+#define MNIST_MAP_SEQUENTIAL 2 // madvise(MADV_SEQUENTIAL): scanned in order
+#define MNIST_MAP_RANDOM     4 // madvise(MADV_RANDOM): no read-ahead
+#define MNIST_MAP_WILLNEED   8 // madvise(MADV_WILLNEED): start reading now
+
+/// Same as mnist_open, with the MNIST_MAP_* flags applied to the mappings.
+/// mnist_open(name) is mnist_open_mapped(name, 0).
+mnist_dataset_handle mnist_open_mapped (const char * name, int flags);
+
 
 /// Create a new empty dataset.
 /// This only creates the in-memory representation of the dataset.
@@ -82,6 +140,14 @@ void mnist_image_size (const mnist_dataset_handle handle,
 /// return MNIST_IMAGE_INVALID
 mnist_image_handle mnist_image_begin (const mnist_dataset_handle handle);
 
+/// Return a handle to the image at position i (0 for the image of
+/// mnist_image_begin, 1 for the next one...), or MNIST_IMAGE_INVALID if i
+/// is out of range or handle == MNIST_DATASET_INVALID.
+/// O(1) unless images were inserted before the last image with
+/// mnist_image_add_after: the first call after such an insertion walks
+/// the list once (and is not safe to make from several threads at once).
+mnist_image_handle mnist_image_at (const mnist_dataset_handle handle, int i);
+
 /// Return a pointer to the data for the image. The data should not be copied
 /// and the user of the data should not modify or free it. The return pointer
 /// should point to image_size_x * image_size_y bytes, in the same order as
@@ -91,6 +157,24 @@ mnist_image_handle mnist_image_begin (const mnist_dataset_handle handle);
 /// function become invalid as well.
 const unsigned char * mnist_image_data (const mnist_image_handle h);
 
+/// Return the number of bytes from the start of one image's data to the
+/// next: x*y, or for a dataset opened from an aligned file x*y rounded
+/// up to MNIST_ALIGN, the extra bytes being zeros. Only images that
+/// follow each other in the dataset's buffers (mnist_image_at of an
+/// opened dataset) are a stride apart. A view of consecutive images of
+/// a single dataset (mnist_view_range of an opened dataset) has the
+/// stride of that dataset.
+/// Returns 0 if handle == MNIST_DATASET_INVALID or is a view whose
+/// images aren't a stride apart (a subset, or a union of datasets): walk
+/// those with mnist_image_next instead.
+size_t mnist_image_stride (const mnist_dataset_handle handle);
+
+/// Return the sum of the squared pixel values of the image, and the sum
+/// of its pixel values. Precomputed in aligned files, computed otherwise.
+/// Return 0 if h == MNIST_IMAGE_INVALID.
+uint64_t mnist_image_norm2 (const mnist_image_handle h);
+uint64_t mnist_image_sum (const mnist_image_handle h);
+
 /// Obtain the label of the image.
 /// Return <0 if handle is equal to MNIST_IMAGE_INVALID.
 int mnist_image_label (const mnist_image_handle h);
@@ -113,6 +197,9 @@ mnist_image_handle mnist_image_next (const mnist_image_handle h);
 ///  x:         number of columns in the image
 ///  y:         number of rows in the image.
 ///
+/// Handles of the other images stay valid (but pointers returned by
+/// mnist_image_data don't, the buffers may move).
+///
 /// returns MNIST_IMAGE_INVALID if there was an issue.
 ///  (for example, x and y don't match the sizes for which the dataset
 ///   was create).
@@ -122,6 +209,22 @@ mnist_image_handle mnist_image_add_after (mnist_dataset_handle h,
       const unsigned char * imagedata, unsigned int x, unsigned int y,
       unsigned int label);
 
+/// Append count images after the last image of the dataset with one copy:
+///  data:   count*x*y bytes, the images one after the other (as in the
+///          image file). Must not point into h itself.
+///  labels: count labels, one byte each.
+/// Returns a handle to the last new image, or MNIST_IMAGE_INVALID if
+/// count<=0 or there was an issue (the dataset is then unchanged).
+/// Handles stay valid as for mnist_image_add_after.
+mnist_image_handle mnist_image_append_batch (mnist_dataset_handle h,
+      const unsigned char * data, int count, const unsigned char * labels);
+
+/// Make room for n images in total, so adding images up to n doesn't
+/// move the buffers. Adding images grows them by doubling anyway; this
+/// only saves the copies when the final size is known.
+/// Returns false if handle == MNIST_DATASET_INVALID or out of memory.
+bool mnist_reserve (mnist_dataset_handle h, int n);
+
 /// Persist the specified dataset to file.
 ///
 /// Name follows the same convention as for mnist_open.
@@ -138,13 +241,72 @@ mnist_image_handle mnist_image_add_after (mnist_dataset_handle h,
 /// warning.
 bool mnist_save(const mnist_dataset_handle h, const char * filename);
 
+/// Persist the dataset in the aligned format described above, as the 
+/// file name-aligned (overwritten without warning). Images are in the 
+/// order of their buffers, as for mnist_save.
+/// Returns false on any error.
+bool mnist_save_aligned(const mnist_dataset_handle h, const char * name);
+
 /// Function that takes a number N ≤ total number of images and 
 /// returns a NEW dataset that consists of N randomly selected images from 
-// 	old the dataset.
+// 	old the dataset, in the order they have in h.
+/// Every call draws from a new stream of MNIST_SAMPLE_SEED (see 
+/// mnist_sample).
 
 mnist_dataset_handle mnist_create_sample (const mnist_dataset_handle h,
 		unsigned int n);
 
+/// Like mnist_create_sample, with the images drawn by rng (see sample.h):
+/// the same rng state gives the same sample. O(n) for a dataset whose 
+/// images were only ever appended, and it doesn't modify h, so threads
+/// can sample the same dataset at once with an rng each.
+mnist_dataset_handle mnist_sample (const mnist_dataset_handle h,
+		unsigned int n, sample_rng_t * rng);
+
+/// Like mnist_sample, but every label gets its share of the n images 
+/// (see sample_stratified). Reads the labels of all the images.
+mnist_dataset_handle mnist_sample_stratified (const mnist_dataset_handle h,
+		unsigned int n, sample_rng_t * rng);
+
+/// Returns a NEW dataset made of copies of the images at positions
+/// idx[0..n) of h (positions as for mnist_image_at), in that order. 
+/// Images that are next to each other in h are copied together. Doesn't
+/// modify h. Returns MNIST_DATASET_INVALID if a position is out of range
+/// or out of memory.
+mnist_dataset_handle mnist_gather (const mnist_dataset_handle h,
+		const int * idx, int n);
+
+/// Views: datasets whose images are the images of other datasets, not 
+/// copies. A view costs a handle per image and no pixels, and can be 
+/// used wherever a dataset can. The images of a view of a view are those
+/// of the datasets underneath, so views don't chain. The parents must 
+/// outlive the view (they may grow in the meantime). Adding an image to
+/// a view (or mnist_reserve) first copies its images to buffers of its
+/// own, after which it is an ordinary dataset.
+/// The functions return MNIST_DATASET_INVALID on invalid arguments or
+/// out of memory, and never modify the parents.
+
+/// View of the count images of h from position first.
+mnist_dataset_handle mnist_view_range (const mnist_dataset_handle h,
+		int first, int count);
+
+/// View of the images at positions idx[0..n) of h, in that order.
+mnist_dataset_handle mnist_view_subset (const mnist_dataset_handle h,
+		const int * idx, int n);
+
+/// View of the images of hs[0], then those of hs[1]... hs[n-1]. All of
+/// them must have images of the same size.
+mnist_dataset_handle mnist_view_union (const mnist_dataset_handle * hs,
+		int n);
+
+/// True if h is a view that hasn't been copied yet.
+bool mnist_is_view (const mnist_dataset_handle h);
+
+/// Return a 64-bit hash of len bytes of image data (e.g. the data of
+/// mnist_image_data). Equal images have equal hashes; the hash is only
+/// meant for in-memory lookups and is not stable across platforms.
+uint64_t mnist_hash_data(const unsigned char * data, size_t len);
+
 
 //returns an pseudo-random integer that is uniformly distributed
 // in N bins (i.e the range [0,N))
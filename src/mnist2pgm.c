@@ -1,14 +1,140 @@
+#define _POSIX_C_SOURCE 200809L // for getopt, sysconf and pwrite
 #include "mnist.h"
+#include "pool.h"
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#define USAGE "Usage: ./mnist2pgm [-t threads] [-s columns] [dataset-name] [count]\n"\
+   "Converts the first count images of the dataset (0 for all) to binary PGM\n"\
+   "files name-00000.pgm, name-00001.pgm... on threads threads (default: the\n"\
+   "number of cores). With -s, writes a single contact sheet name-sheet.pgm\n"\
+   "instead, the images tiled columns to a row.\n"
 
+struct convert_job
+{
+   mnist_dataset_handle h;
+   const char * name;
+   unsigned int count, imagecount, width, height;
+   //contact sheet: columns, file, offset of the pixels in it
+   unsigned int columns;
+   int fd;
+   size_t header_len;
+   atomic_int failed;
+};
+
+static void convert_image (void * arg, int i, int tid)
+{
+   //one file per image: the header, then the pixels with one fwrite
+   struct convert_job * job = arg;
+   char filename[255];
+   snprintf (filename, sizeof(filename), "%s-%05d.pgm", job->name, i);
+   FILE * f = fopen (filename, "wb");
+   if (!f)
+   {
+      perror (filename);
+      atomic_store (&job->failed, 1);
+      return;
+   }
+   fprintf (f, "P5\n# %s %d/%u\n%u %u\n255\n", job->name, i, job->imagecount,
+            job->width, job->height);
+   const unsigned char * data = mnist_image_data (mnist_image_at (job->h, i));
+   if (fwrite (data, (size_t) job->width*job->height, 1, f) != 1)
+      atomic_store (&job->failed, 1);
+   if (fclose (f))
+      atomic_store (&job->failed, 1);
+}
+
+static void convert_row (void * arg, int row, int tid)
+{
+   //one row of images of the contact sheet, assembled in a strip and
+   // written at its place in the file (empty cells stay black)
+   struct convert_job * job = arg;
+   size_t stride = (size_t) job->columns*job->width;
+   size_t len = stride*job->height;
+   unsigned char * strip = calloc (len, 1);
+   if (!strip)
+   {
+      atomic_store (&job->failed, 1);
+      return;
+   }
+   for (unsigned int c=0; c<job->columns; ++c)
+   {
+      unsigned int i = row*job->columns+c;
+      if (i>=job->count)
+         break;
+      const unsigned char * data = mnist_image_data (mnist_image_at (job->h, i));
+      for (unsigned int y=0; y<job->height; ++y)
+         memcpy (strip+y*stride+c*job->width, data+y*job->width, job->width);
+   }
+   off_t off = job->header_len+(off_t) row*len;
+   for (size_t done=0; done<len; )
+   {
+      ssize_t w = pwrite (job->fd, strip+done, len-done, off+done);
+      if (w<=0)
+      {
+         atomic_store (&job->failed, 1);
+         break;
+      }
+      done += w;
+   }
+   free (strip);
+}
+
+static int write_sheet (struct convert_job * job, pool_t pool)
+{
+   char filename[255];
+   snprintf (filename, sizeof(filename), "%s-sheet.pgm", job->name);
+   FILE * f = fopen (filename, "wb");
+   if (!f)
+   {
+      perror (filename);
+      return 1;
+   }
+   unsigned int rows = (job->count+job->columns-1)/job->columns;
+   int header_len = fprintf (f, "P5\n# %s %u images, %u per row\n%u %u\n255\n",
+                             job->name, job->count, job->columns,
+                             job->columns*job->width, rows*job->height);
+   if (header_len<0 || fflush (f))
+   {
+      fclose (f);
+      return 1;
+   }
+   job->header_len = header_len;
+   job->fd = fileno (f);
+   if (!pool_run_tasks (pool, convert_row, job, rows))
+      atomic_store (&job->failed, 1);
+   if (fclose (f))
+      atomic_store (&job->failed, 1);
+   if (!atomic_load (&job->failed))
+      printf ("Wrote %s (%ux%u)\n", filename, job->columns*job->width,
+              rows*job->height);
+   return atomic_load (&job->failed);
+}
 
 int main (int argc, char ** args)
 {
-   if (argc != 3)
+   int nthreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+   int columns = 0;
+   int opt;
+   while ((opt = getopt (argc, args, "t:s:")) != -1)
    {
-      fprintf (stderr, "Need 2 arguments:\n  - dataset name\n  - number of images to convert. Use 0 for all.");
+      if (opt=='t') nthreads = atoi (optarg);
+      else if (opt=='s') columns = atoi (optarg);
+      else
+      {
+         fputs (USAGE, stderr);
+         exit(1);
+      }
+   }
+   //the positional arguments start at args[1], as if there were no options
+   args += optind-1;
+   argc -= optind-1;
+   if (argc != 3 || nthreads<=0 || columns<0)
+   {
+      fputs (USAGE, stderr);
       exit(1);
    }
 
@@ -31,52 +157,37 @@ int main (int argc, char ** args)
 
    if (!count)
       count = imagecount;
-
-   char filename[255];
-   mnist_image_handle img = mnist_image_begin(h);
-   for (unsigned int i=0; i<count; ++i)
+   if (count>imagecount)
    {
-      if (!img)
-      {
-         fprintf (stderr, "Not enough images in dataset!\n");
-         break;
-      }
-
-      snprintf (filename, sizeof(filename)-1, "%s-%05u.pgm", name, i);
-      // Ensure 0-terminated
-      filename[sizeof(filename)-1]=0;
-
-      FILE * f = fopen (filename, "w");
-      if (!f)
-      {
-         perror ("Couldn't write to file: ");
-         mnist_free (h);
-         return 1;
-      }
-
-      printf ("Writing %s...\n", filename);
-
-      fputs ("P5\n", f);
-      fprintf (f, "# %s %u/%u\n", name, i, imagecount);
-      fprintf (f, "%u %u\n", width, height);
-      fputs ("255\n", f);
-
-      const unsigned char * data = mnist_image_data (img);
-      for (unsigned int y=0; y<height; ++y)
-      {
-         for (unsigned int x=0; x<width; ++x)
-         {
-            unsigned int c = *data;
-            fprintf (f, "%u ", c);
-            ++data;
-         }
-         fputs ("\n", f);
-      }
-      fclose (f);
+      fprintf (stderr, "Not enough images in dataset!\n");
+      count = imagecount;
+   }
 
-      img = mnist_image_next (img);
+   pool_t pool = pool_create (nthreads);
+   if (pool == POOL_INVALID)
+   {
+      fprintf (stderr, "Couldn't start %d threads!\n", nthreads);
+      mnist_free (h);
+      return 1;
+   }
+   struct convert_job job = {.h=h, .name=name, .count=count,
+      .imagecount=imagecount, .width=width, .height=height, .columns=columns};
+   atomic_init (&job.failed, 0);
+   int status = 0;
+   if (columns)
+      status = write_sheet (&job, pool);
+   else if (count)
+   {
+      if (!pool_run_tasks (pool, convert_image, &job, count))
+         atomic_store (&job.failed, 1);
+      status = atomic_load (&job.failed);
+      if (!status)
+         printf ("Wrote %s-%05u.pgm to %s-%05u.pgm\n", name, 0, name, count-1);
    }
+   if (status)
+      fprintf (stderr, "Couldn't write every image!\n");
 
+   pool_free (pool);
    mnist_free (h);
-   exit(EXIT_SUCCESS);
+   exit(status ? 1 : EXIT_SUCCESS);
 }
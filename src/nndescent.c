@@ -0,0 +1,547 @@
+#define _POSIX_C_SOURCE 200809L
+#include "nndescent.h"
+#include "knn.h"
+#include "mnist.h"
+#include "distance.h"
+#include <arpa/inet.h> // for ntoh and hton functions
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+#define NO_ID UINT32_MAX
+#define SWAP(x, y, TYPE) do {TYPE _t=x; x=y ; y=_t;} while (0)
+
+struct knn_graph
+{
+	uint32_t n, k;
+	// n*k neighbor ids and distances. While building, each list is a
+	// max-heap on the distance; at the end it is sorted.
+	uint32_t * ids;
+	float * dists;
+	uint64_t evals;
+};
+
+// state shared by the threads of knn_graph_build
+struct nnd
+{
+	knn_graph_t g;
+	const unsigned char ** data;
+	unsigned int x, y;
+	distance_t distance;
+	int nthreads;
+	// 1 if the entry is new (not yet used in a local join)
+	uint8_t * isnew;
+	pthread_mutex_t * locks;
+	// samples per list (NND_RHO*k)
+	uint32_t s;
+	// candidates of each image: sampled new and old forward neighbors,
+	// and new and old reverse neighbors
+	uint32_t * fwd_new, * fwd_old, * rev_new, * rev_old;
+	uint32_t * fwd_new_n, * fwd_old_n, * rev_new_n, * rev_old_n;
+};
+
+struct nnd_worker
+{
+	struct nnd * nnd;
+	int tid;
+	void (*fn)(struct nnd_worker * w, uint32_t v);
+	uint64_t rng;
+	uint64_t evals;
+	uint64_t updates;
+};
+
+static uint32_t _rand(uint64_t * state, uint32_t range)
+{
+	//xorshift64*, one state per thread
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (uint32_t)(((x*0x2545f4914f6cdd1dULL) >> 32) % range);
+}
+
+static void _sift_down(uint32_t * ids, float * dists, uint8_t * isnew,
+						uint32_t k, uint32_t i)
+{
+	while(true)
+	{
+		uint32_t l = 2*i+1, r = l+1, m = i;
+		if(l<k && dists[l]>dists[m]) m = l;
+		if(r<k && dists[r]>dists[m]) m = r;
+		if(m==i) return;
+		SWAP(ids[i], ids[m], uint32_t);
+		SWAP(dists[i], dists[m], float);
+		if(isnew) SWAP(isnew[i], isnew[m], uint8_t);
+		i = m;
+	}
+}
+
+static int _insert(struct nnd * nnd, uint32_t v, uint32_t u, float d)
+{
+	//tries to add u to the neighbors of v. Returns 1 if it was added.
+	knn_graph_t g = nnd->g;
+	if(u==v) return 0;
+	uint32_t * ids = g->ids+(size_t)v*g->k;
+	float * dists = g->dists+(size_t)v*g->k;
+	uint8_t * isnew = nnd->isnew+(size_t)v*g->k;
+	int added = 0;
+	pthread_mutex_lock(&nnd->locks[v]);
+	if(d<dists[0])
+	{
+		uint32_t i;
+		for(i=0; i<g->k && ids[i]!=u; i++) {}
+		if(i==g->k)
+		{
+			ids[0] = u;
+			dists[0] = d;
+			isnew[0] = 1;
+			_sift_down(ids, dists, isnew, g->k, 0);
+			added = 1;
+		}
+	}
+	pthread_mutex_unlock(&nnd->locks[v]);
+	return added;
+}
+
+static float _dist(struct nnd_worker * w, uint32_t a, uint32_t b)
+{
+	w->evals++;
+	return (float) w->nnd->distance(w->nnd->data[a], w->nnd->data[b],
+									w->nnd->x, w->nnd->y);
+}
+
+static void * _run_slice(void * arg)
+{
+	struct nnd_worker * w = arg;
+	uint32_t n = w->nnd->g->n;
+	uint32_t from = (uint32_t)((uint64_t) n*w->tid/w->nnd->nthreads);
+	uint32_t to = (uint32_t)((uint64_t) n*(w->tid+1)/w->nnd->nthreads);
+	for(uint32_t v=from; v<to; v++) w->fn(w, v);
+	return NULL;
+}
+
+static void _parallel(struct nnd_worker * workers, int nthreads,
+					void (*fn)(struct nnd_worker * w, uint32_t v))
+{
+	//runs fn for every image, split in nthreads slices
+	pthread_t threads[nthreads];
+	int started = 0;
+	for(int t=0; t<nthreads; t++)
+	{
+		workers[t].fn = fn;
+		if(pthread_create(&threads[t], NULL, _run_slice, &workers[t])) break;
+		started++;
+	}
+	for(int t=started; t<nthreads; t++) _run_slice(&workers[t]);
+	for(int t=0; t<started; t++) pthread_join(threads[t], NULL);
+}
+
+static void _init_list(struct nnd_worker * w, uint32_t v)
+{
+	//k random neighbors
+	knn_graph_t g = w->nnd->g;
+	uint32_t filled = 0;
+	while(filled<g->k)
+	{
+		uint32_t u = _rand(&w->rng, g->n);
+		if(u!=v) filled += _insert(w->nnd, v, u, _dist(w, v, u));
+	}
+}
+
+static void _sample(struct nnd_worker * w, uint32_t v)
+{
+	//splits the neighbors of v into old ones and a sample of s new ones;
+	// the sampled ones are not new anymore.
+	struct nnd * nnd = w->nnd;
+	uint32_t k = nnd->g->k, s = nnd->s;
+	const uint32_t * ids = nnd->g->ids+(size_t)v*k;
+	uint8_t * isnew = nnd->isnew+(size_t)v*k;
+	uint32_t * fwd_new = nnd->fwd_new+(size_t)v*s;
+	uint32_t * fwd_old = nnd->fwd_old+(size_t)v*k;
+	uint32_t nn = 0, no = 0, seen = 0;
+	uint32_t slot[s];
+	for(uint32_t i=0; i<k; i++)
+	{
+		if(ids[i]==NO_ID) continue;
+		if(!isnew[i]) {fwd_old[no++] = ids[i]; continue;}
+		//reservoir sample of the new entries
+		seen++;
+		if(nn<s) {slot[nn] = i; fwd_new[nn++] = ids[i];}
+		else
+		{
+			uint32_t r = _rand(&w->rng, seen);
+			if(r<s) {slot[r] = i; fwd_new[r] = ids[i];}
+		}
+	}
+	for(uint32_t i=0; i<nn; i++) isnew[slot[i]] = 0;
+	nnd->fwd_new_n[v] = nn;
+	nnd->fwd_old_n[v] = no;
+}
+
+static void _reverse(struct nnd * nnd, uint64_t * rng, uint32_t * seen_new,
+					uint32_t * seen_old)
+{
+	//reverse neighbors: v is a candidate of u if u is a candidate of v.
+	// Keeps a reservoir sample of s of them.
+	uint32_t n = nnd->g->n, s = nnd->s;
+	memset(nnd->rev_new_n, 0, n*sizeof(uint32_t));
+	memset(nnd->rev_old_n, 0, n*sizeof(uint32_t));
+	memset(seen_new, 0, n*sizeof(uint32_t));
+	memset(seen_old, 0, n*sizeof(uint32_t));
+	for(uint32_t v=0; v<n; v++)
+	{
+		for(int old=0; old<2; old++)
+		{
+			const uint32_t * fwd = old ? nnd->fwd_old+(size_t)v*nnd->g->k
+									: nnd->fwd_new+(size_t)v*s;
+			uint32_t fwd_n = old ? nnd->fwd_old_n[v] : nnd->fwd_new_n[v];
+			uint32_t * rev = old ? nnd->rev_old : nnd->rev_new;
+			uint32_t * rev_n = old ? nnd->rev_old_n : nnd->rev_new_n;
+			uint32_t * seen = old ? seen_old : seen_new;
+			for(uint32_t i=0; i<fwd_n; i++)
+			{
+				uint32_t u = fwd[i];
+				seen[u]++;
+				if(rev_n[u]<s) rev[(size_t)u*s+rev_n[u]++] = v;
+				else
+				{
+					uint32_t r = _rand(rng, seen[u]);
+					if(r<s) rev[(size_t)u*s+r] = v;
+				}
+			}
+		}
+	}
+}
+
+static void _local_join(struct nnd_worker * w, uint32_t v)
+{
+	//compares the new candidates of v with each other and with the old
+	// ones. Old-old pairs were already compared in an earlier round.
+	struct nnd * nnd = w->nnd;
+	uint32_t k = nnd->g->k, s = nnd->s;
+	uint32_t new_c[2*s], old_c[k+s];
+	uint32_t nn = 0, no = 0;
+	for(uint32_t i=0; i<nnd->fwd_new_n[v]; i++) new_c[nn++] = nnd->fwd_new[(size_t)v*s+i];
+	for(uint32_t i=0; i<nnd->rev_new_n[v]; i++) new_c[nn++] = nnd->rev_new[(size_t)v*s+i];
+	for(uint32_t i=0; i<nnd->fwd_old_n[v]; i++) old_c[no++] = nnd->fwd_old[(size_t)v*k+i];
+	for(uint32_t i=0; i<nnd->rev_old_n[v]; i++) old_c[no++] = nnd->rev_old[(size_t)v*s+i];
+
+	for(uint32_t i=0; i<nn; i++)
+	{
+		uint32_t a = new_c[i];
+		for(uint32_t j=i+1; j<nn+no; j++)
+		{
+			uint32_t b = (j<nn) ? new_c[j] : old_c[j-nn];
+			if(a==b) continue;
+			float d = _dist(w, a, b);
+			w->updates += _insert(nnd, a, b, d);
+			w->updates += _insert(nnd, b, a, d);
+		}
+	}
+}
+
+static void _sort_list(struct nnd_worker * w, uint32_t v)
+{
+	//heap sort, closest first
+	knn_graph_t g = w->nnd->g;
+	uint32_t * ids = g->ids+(size_t)v*g->k;
+	float * dists = g->dists+(size_t)v*g->k;
+	for(uint32_t end=g->k-1; end>0; end--)
+	{
+		SWAP(ids[0], ids[end], uint32_t);
+		SWAP(dists[0], dists[end], float);
+		_sift_down(ids, dists, NULL, end, 0);
+	}
+}
+
+static knn_graph_t _graph_alloc(uint32_t n, uint32_t k)
+{
+	knn_graph_t g = calloc(1, sizeof(struct knn_graph));
+	if(!g) return KNN_GRAPH_INVALID;
+	g->n = n;
+	g->k = k;
+	g->ids = malloc((size_t)n*k*sizeof(uint32_t));
+	g->dists = malloc((size_t)n*k*sizeof(float));
+	if(!g->ids || !g->dists)
+	{
+		knn_graph_free(g);
+		return KNN_GRAPH_INVALID;
+	}
+	return g;
+}
+
+void knn_graph_free(knn_graph_t g)
+{
+	if(g==KNN_GRAPH_INVALID) return;
+	free(g->ids);
+	free(g->dists);
+	free(g);
+}
+
+static void _nnd_free(struct nnd * nnd)
+{
+	if(nnd->locks)
+		for(uint32_t v=0; v<nnd->g->n; v++) pthread_mutex_destroy(&nnd->locks[v]);
+	free(nnd->locks);
+	free(nnd->data);
+	free(nnd->isnew);
+	free(nnd->fwd_new); free(nnd->fwd_old); free(nnd->rev_new); free(nnd->rev_old);
+	free(nnd->fwd_new_n); free(nnd->fwd_old_n);
+	free(nnd->rev_new_n); free(nnd->rev_old_n);
+}
+
+knn_graph_t knn_graph_build(mnist_dataset_handle h, int k,
+						distance_t distance, int nthreads)
+{
+	int num_imgs = mnist_image_count(h);
+	if(num_imgs<=0 || k<=0 || k>=num_imgs || !distance || nthreads<=0)
+		return KNN_GRAPH_INVALID;
+	uint32_t n = num_imgs;
+	struct nnd nnd;
+	memset(&nnd, 0, sizeof(nnd));
+	nnd.g = _graph_alloc(n, k);
+	if(nnd.g==KNN_GRAPH_INVALID) return KNN_GRAPH_INVALID;
+	knn_graph_t g = nnd.g;
+	mnist_image_size(h, &nnd.x, &nnd.y);
+	nnd.distance = distance;
+	nnd.nthreads = nthreads;
+	nnd.s = (uint32_t) ceil(NND_RHO*k);
+	uint32_t s = nnd.s;
+	nnd.data = malloc(n*sizeof(unsigned char *));
+	nnd.isnew = malloc((size_t)n*k);
+	nnd.locks = malloc(n*sizeof(pthread_mutex_t));
+	nnd.fwd_new = malloc((size_t)n*s*sizeof(uint32_t));
+	nnd.fwd_old = malloc((size_t)n*k*sizeof(uint32_t));
+	nnd.rev_new = malloc((size_t)n*s*sizeof(uint32_t));
+	nnd.rev_old = malloc((size_t)n*s*sizeof(uint32_t));
+	nnd.fwd_new_n = calloc(n, sizeof(uint32_t));
+	nnd.fwd_old_n = calloc(n, sizeof(uint32_t));
+	nnd.rev_new_n = calloc(n, sizeof(uint32_t));
+	nnd.rev_old_n = calloc(n, sizeof(uint32_t));
+	uint32_t * seen_new = malloc(n*sizeof(uint32_t));
+	uint32_t * seen_old = malloc(n*sizeof(uint32_t));
+	struct nnd_worker * workers = calloc(nthreads, sizeof(struct nnd_worker));
+	if(!nnd.data || !nnd.isnew || !nnd.locks || !nnd.fwd_new || !nnd.fwd_old
+		|| !nnd.rev_new || !nnd.rev_old || !nnd.fwd_new_n || !nnd.fwd_old_n
+		|| !nnd.rev_new_n || !nnd.rev_old_n || !seen_new || !seen_old || !workers)
+	{
+		free(nnd.locks);
+		nnd.locks = NULL;
+		_nnd_free(&nnd);
+		free(seen_new); free(seen_old); free(workers);
+		knn_graph_free(g);
+		return KNN_GRAPH_INVALID;
+	}
+
+	mnist_image_handle img = mnist_image_begin(h);
+	for(uint32_t v=0; v<n; v++)
+	{
+		nnd.data[v] = mnist_image_data(img);
+		img = mnist_image_next(img);
+		pthread_mutex_init(&nnd.locks[v], NULL);
+	}
+	for(size_t i=0; i<(size_t)n*k; i++)
+	{
+		g->ids[i] = NO_ID;
+		g->dists[i] = FLT_MAX;
+	}
+	uint64_t rng = (uint64_t) time(NULL)*0x9e3779b97f4a7c15ULL | 1;
+	for(int t=0; t<nthreads; t++)
+	{
+		workers[t].nnd = &nnd;
+		workers[t].tid = t;
+		workers[t].rng = rng+2*(uint64_t)t+1;
+	}
+
+	_parallel(workers, nthreads, _init_list);
+	for(int it=0; it<NND_MAX_ITERS; it++)
+	{
+		_parallel(workers, nthreads, _sample);
+		_reverse(&nnd, &rng, seen_new, seen_old);
+		for(int t=0; t<nthreads; t++) workers[t].updates = 0;
+		_parallel(workers, nthreads, _local_join);
+		uint64_t updates = 0;
+		for(int t=0; t<nthreads; t++) updates += workers[t].updates;
+		dprint("it:%d\tupdates:%lu", it, (unsigned long) updates);
+		if(updates < NND_DELTA*n*k) break;
+	}
+	_parallel(workers, nthreads, _sort_list);
+
+	for(int t=0; t<nthreads; t++) g->evals += workers[t].evals;
+	_nnd_free(&nnd);
+	free(seen_new);
+	free(seen_old);
+	free(workers);
+	return g;
+}
+
+int knn_graph_count(const knn_graph_t g)
+{
+	if(g==KNN_GRAPH_INVALID) return -1;
+	return g->n;
+}
+
+int knn_graph_k(const knn_graph_t g)
+{
+	if(g==KNN_GRAPH_INVALID) return -1;
+	return g->k;
+}
+
+uint64_t knn_graph_evals(const knn_graph_t g)
+{
+	if(g==KNN_GRAPH_INVALID) return 0;
+	return g->evals;
+}
+
+const uint32_t * knn_graph_neighbors(const knn_graph_t g, int i)
+{
+	if(g==KNN_GRAPH_INVALID || i<0 || (uint32_t) i>=g->n) return NULL;
+	return g->ids+(size_t)i*g->k;
+}
+
+const float * knn_graph_distances(const knn_graph_t g, int i)
+{
+	if(g==KNN_GRAPH_INVALID || i<0 || (uint32_t) i>=g->n) return NULL;
+	return g->dists+(size_t)i*g->k;
+}
+
+bool knn_graph_save(const knn_graph_t g, const char * filename)
+{
+	if(g==KNN_GRAPH_INVALID || !filename) return false;
+	size_t len = (size_t)g->n*g->k;
+	uint32_t * buf = malloc((len ? len : 1)*sizeof(uint32_t));
+	FILE * fp = fopen(filename, "wb");
+	if(!buf || !fp)
+	{
+		free(buf);
+		if(fp) fclose(fp);
+		return false;
+	}
+	uint32_t hdr[] = {MY_HTONL(KNN_GRAPH_MAGIC_NUM), MY_HTONL(KNN_GRAPH_VERSION),
+					MY_HTONL(g->n), MY_HTONL(g->k)};
+	bool ok = fwrite(hdr, KNN_GRAPH_HEADER_SIZE, 1, fp)==1;
+	for(size_t i=0; i<len; i++) buf[i] = MY_HTONL(g->ids[i]);
+	ok = ok && (!len || fwrite(buf, len*sizeof(uint32_t), 1, fp)==1);
+	for(size_t i=0; i<len; i++)
+	{
+		uint32_t bits;
+		memcpy(&bits, &g->dists[i], sizeof(bits));
+		buf[i] = MY_HTONL(bits);
+	}
+	ok = ok && (!len || fwrite(buf, len*sizeof(uint32_t), 1, fp)==1);
+	ok = (fclose(fp)==0) && ok;
+	free(buf);
+	return ok;
+}
+
+knn_graph_t knn_graph_load(const char * filename)
+{
+	if(!filename) return KNN_GRAPH_INVALID;
+	FILE * fp = fopen(filename, "rb");
+	if(!fp) return KNN_GRAPH_INVALID;
+	uint32_t hdr[KNN_GRAPH_HEADER_SIZE/sizeof(uint32_t)];
+	knn_graph_t g = KNN_GRAPH_INVALID;
+	if(fread(hdr, KNN_GRAPH_HEADER_SIZE, 1, fp)==1
+		&& MY_NTOHL(hdr[0])==KNN_GRAPH_MAGIC_NUM
+		&& MY_NTOHL(hdr[1])==KNN_GRAPH_VERSION
+		&& MY_NTOHL(hdr[3])>0 && MY_NTOHL(hdr[3])<MY_NTOHL(hdr[2]))
+		g = _graph_alloc(MY_NTOHL(hdr[2]), MY_NTOHL(hdr[3]));
+	if(g==KNN_GRAPH_INVALID)
+	{
+		fclose(fp);
+		return KNN_GRAPH_INVALID;
+	}
+	size_t len = (size_t)g->n*g->k;
+	bool ok = !len || (fread(g->ids, len*sizeof(uint32_t), 1, fp)==1
+					&& fread(g->dists, len*sizeof(float), 1, fp)==1);
+	fclose(fp);
+	for(size_t i=0; ok && i<len; i++)
+	{
+		uint32_t bits;
+		g->ids[i] = MY_NTOHL(g->ids[i]);
+		memcpy(&bits, &g->dists[i], sizeof(bits));
+		bits = MY_NTOHL(bits);
+		memcpy(&g->dists[i], &bits, sizeof(bits));
+		ok = g->ids[i]<g->n;
+	}
+	if(!ok)
+	{
+		knn_graph_free(g);
+		return KNN_GRAPH_INVALID;
+	}
+	return g;
+}
+
+double knn_graph_recall(const knn_graph_t g, mnist_dataset_handle h,
+						distance_t distance, int sample)
+{
+	int n = mnist_image_count(h);
+	//k<n: the true k-th neighbor is among the n-1 others
+	if(g==KNN_GRAPH_INVALID || n<0 || (uint32_t) n!=g->n || g->k>=g->n 
+		|| sample<=0 || !distance)
+		return -1;
+	if(sample>n) sample = n;
+	unsigned int x, y;
+	mnist_image_size(h, &x, &y);
+	mnist_image_handle * imgs = malloc(n*sizeof(mnist_image_handle));
+	int * ix = malloc(n*sizeof(int));
+	if(!imgs || !ix)
+	{
+		free(imgs); free(ix);
+		return -1;
+	}
+	mnist_image_handle img = mnist_image_begin(h);
+	for(int i=0; i<n; i++)
+	{
+		imgs[i] = img;
+		img = mnist_image_next(img);
+	}
+
+	uint64_t found = 0;
+	for(int s=0; s<sample; s++)
+	{
+		//brute force distances, itself left out
+		int v = _uniform_rand_int(n);
+		knn_data_t knn = knn_data_create(imgs[v], h);
+		double * d = knn_data_get_distances(knn, distance);
+		if(!d)
+		{
+			knn_data_free(knn);
+			found = 0;
+			sample = -1;
+			break;
+		}
+		for(int i=0; i<n; i++) ix[i] = i;
+		SWAP(d[v], d[n-1], double);
+		SWAP(ix[v], ix[n-1], int);
+		double k_dist = quickselect(d, ix, 0, n-2, g->k-1);
+
+		//a neighbor is right if it is as close as the true k-th one
+		const uint32_t * gi = knn_graph_neighbors(g, v);
+		const unsigned char * data = mnist_image_data(imgs[v]);
+		for(uint32_t j=0; j<g->k; j++)
+		{
+			double dj = distance(data, mnist_image_data(imgs[gi[j]]), x, y);
+			if(dj<=k_dist) found++;
+		}
+		knn_data_free(knn);
+	}
+	free(imgs);
+	free(ix);
+	return sample>0 ? (double) found/((uint64_t) sample*g->k) : -1;
+}
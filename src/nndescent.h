@@ -0,0 +1,68 @@
+#ifndef NNDESCENT_H
+#define NNDESCENT_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "distance.h"
+#include "mnist.h"
+/*
+Approximate k nearest neighbor graph of a dataset, built with NN-descent
+(Dong, Charikar, Li: "Efficient k-nearest neighbor graph construction for
+generic similarity measures").
+
+Every image starts with k random neighbors. In each round, the neighbors
+of an image (and the images that have it as a neighbor) are compared with
+each other - "a neighbor of a neighbor is likely a neighbor" - and the
+lists keep the k closest images seen so far. Rounds stop when less than
+NND_DELTA*n*k lists entries changed. Empirically this takes about O(n^1.14)
+distance evaluations instead of the O(n^2) of brute force.
+*/
+
+#define KNN_GRAPH_INVALID NULL
+//fraction of the new neighbors compared in each round
+#define NND_RHO 0.5
+//stop when fewer than NND_DELTA*n*k entries changed in a round
+#define NND_DELTA 0.001
+#define NND_MAX_ITERS 30
+//binary file format: header of 4 uint32 in network byte order
+// (magic, version, n, k), then n*k uint32 neighbor ids, then n*k float
+// distances (the bits as uint32 in network byte order). Lists are sorted
+// by distance.
+#define KNN_GRAPH_MAGIC_NUM 0x4b4e4e47 //"KNNG"
+#define KNN_GRAPH_VERSION 1
+#define KNN_GRAPH_HEADER_SIZE 16
+
+typedef struct knn_graph * knn_graph_t;
+
+// builds the k nearest neighbor graph of the images in h (an image is not
+// its own neighbor) using nthreads threads.
+// Returns KNN_GRAPH_INVALID if k is not in [1, number of images).
+knn_graph_t knn_graph_build(mnist_dataset_handle h, int k,
+						distance_t distance, int nthreads);
+
+void knn_graph_free(knn_graph_t g);
+
+// number of images, number of neighbors per image
+int knn_graph_count(const knn_graph_t g);
+int knn_graph_k(const knn_graph_t g);
+
+// number of distance evaluations knn_graph_build needed (0 if loaded)
+uint64_t knn_graph_evals(const knn_graph_t g);
+
+// the k neighbors of image i (its offset in the dataset), closest first,
+// and their distances. Returns NULL if i is out of range.
+const uint32_t * knn_graph_neighbors(const knn_graph_t g, int i);
+const float * knn_graph_distances(const knn_graph_t g, int i);
+
+// writes/reads the graph in the binary format above. A file with k not in
+// [1, n) or a neighbor id >= n is rejected (KNN_GRAPH_INVALID).
+bool knn_graph_save(const knn_graph_t g, const char * filename);
+knn_graph_t knn_graph_load(const char * filename);
+
+// fraction of the true k nearest neighbors that the graph found, for a
+// random sample of images checked against brute force. Neighbors at the
+// same distance as the true k-th neighbor count as found.
+// Returns <0 on error.
+double knn_graph_recall(const knn_graph_t g, mnist_dataset_handle h,
+						distance_t distance, int sample);
+
+#endif
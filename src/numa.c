@@ -0,0 +1,174 @@
+#define _GNU_SOURCE // for syscall, sched_getaffinity and pthread_setaffinity_np
+#include "numa.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+#define NODE_DIR "/sys/devices/system/node"
+//memory policies of mbind (linux/mempolicy.h)
+#define NUMA_MPOL_BIND 2
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MASK_WORDS ((NUMA_MAX_NODES+63)/64)
+
+static bool _read_cpulist(int node, cpu_set_t * set)
+{
+	//parses a cpulist like "0-3,8-11"
+	char name[64];
+	snprintf(name, sizeof(name), NODE_DIR "/node%d/cpulist", node);
+	FILE * f = fopen(name, "r");
+	if(!f) return false;
+	CPU_ZERO(set);
+	int from, to;
+	char sep;
+	while(fscanf(f, "%d", &from)==1)
+	{
+		to = from;
+		if(fscanf(f, "%c", &sep)==1 && sep=='-')
+		{
+			if(fscanf(f, "%d", &to)!=1) break;
+			if(fscanf(f, "%c", &sep)!=1) sep = '\n';
+		}
+		for(int c=from; c<=to && c<CPU_SETSIZE; c++) CPU_SET(c, set);
+		if(sep!=',') break;
+	}
+	fclose(f);
+	return true;
+}
+
+//the topology, read once
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int num_nodes;
+static signed char cpu_nodes[CPU_SETSIZE];
+
+static void _read_topology(void)
+{
+	cpu_set_t set;
+	memset(cpu_nodes, 0, sizeof(cpu_nodes));
+	while(num_nodes<NUMA_MAX_NODES && _read_cpulist(num_nodes, &set))
+	{
+		for(int c=0; c<CPU_SETSIZE; c++)
+			if(CPU_ISSET(c, &set)) cpu_nodes[c] = num_nodes;
+		num_nodes++;
+	}
+	//no sysfs: a single node with every CPU
+	if(!num_nodes) num_nodes = 1;
+	dprint("nodes:%d", num_nodes);
+}
+
+int numa_nodes(void)
+{
+	pthread_once(&topology_once, _read_topology);
+	return num_nodes;
+}
+
+int numa_cpu_node(int cpu)
+{
+	pthread_once(&topology_once, _read_topology);
+	if(cpu<0 || cpu>=CPU_SETSIZE) return 0;
+	return cpu_nodes[cpu];
+}
+
+int numa_node_cpus(int node, int * cpus, int max)
+{
+	cpu_set_t allowed;
+	if(node<0 || node>=numa_nodes()) return -1;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed)) return -1;
+	int n = 0;
+	for(int c=0; c<CPU_SETSIZE && n<max; c++)
+		if(CPU_ISSET(c, &allowed) && cpu_nodes[c]==node) cpus[n++] = c;
+	return n;
+}
+
+bool numa_pin_cpu(int cpu)
+{
+	if(cpu<0 || cpu>=CPU_SETSIZE) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set)==0;
+}
+
+static bool _mbind(void * p, size_t len, int mode, int node)
+{
+	//node<0: every node
+	unsigned long mask[NUMA_MASK_WORDS] = {0};
+	int nodes = numa_nodes();
+	for(int n=0; n<nodes; n++)
+		if(node<0 || n==node) mask[n/64] |= 1UL<<(n%64);
+	return syscall(SYS_mbind, p, len, mode, mask, 
+					(unsigned long) NUMA_MAX_NODES+1, 0)==0;
+}
+
+struct touch_job
+{
+	unsigned char * p;
+	size_t len;
+	int cpu;
+};
+
+static void * _touch(void * arg)
+{
+	struct touch_job * job = arg;
+	if(job->cpu>=0 && !numa_pin_cpu(job->cpu))
+		dprint("can't pin to cpu %d", job->cpu);
+	long page = sysconf(_SC_PAGESIZE);
+	for(size_t i=0; i<job->len; i+=page) job->p[i] = 0;
+	return NULL;
+}
+
+static void * _alloc(size_t len, int mode, int node)
+{
+	if(len==0) return NULL;
+	void * p = mmap(NULL, len, PROT_READ|PROT_WRITE, 
+					MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(p==MAP_FAILED) return NULL;
+	if(!_mbind(p, len, mode, node))
+		dprint("mbind failed, placing %zu bytes by first touch", len);
+	//fault the pages in from a thread on the node, so they land there 
+	// even if mbind didn't work
+	struct touch_job job = {p, len, -1};
+	int cpus[1];
+	if(node>=0 && numa_node_cpus(node, cpus, 1)==1) job.cpu = cpus[0];
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, _touch, &job)) _touch(&job);
+	else pthread_join(thread, NULL);
+	return p;
+}
+
+void * numa_alloc_on(size_t len, int node)
+{
+	if(node<0 || node>=numa_nodes()) return NULL;
+	return _alloc(len, NUMA_MPOL_BIND, node);
+}
+
+void * numa_alloc_interleave(size_t len)
+{
+	return _alloc(len, NUMA_MPOL_INTERLEAVE, -1);
+}
+
+void * numa_replicate(const void * src, size_t len, int node)
+{
+	if(!src) return NULL;
+	void * p = numa_alloc_on(len, node);
+	if(p) memcpy(p, src, len);
+	return p;
+}
+
+void numa_release(void * p, size_t len)
+{
+	if(p) munmap(p, len);
+}
@@ -0,0 +1,45 @@
+#ifndef NUMA_H
+#define NUMA_H
+#include <stdbool.h>
+#include <stddef.h>
+/*
+Just enough NUMA support to place the training images next to the threads
+that read them, without depending on libnuma.
+
+The topology comes from /sys/devices/system/node (one node with every CPU
+if it isn't there). Memory is placed on a node with the mbind system call
+when the kernel allows it, and otherwise by first touch: a thread pinned
+to a CPU of the node writes every page before anyone else does, and Linux
+allocates a page on the node of the thread that first touches it.
+*/
+
+#define NUMA_MAX_NODES 64
+
+// number of NUMA nodes, >=1
+int numa_nodes(void);
+
+// node of cpu, 0 if unknown
+int numa_cpu_node(int cpu);
+
+// stores up to max CPUs of node, that the process may run on, in cpus.
+// Returns how many it stored, <0 if node doesn't exist.
+int numa_node_cpus(int node, int * cpus, int max);
+
+// pins the calling thread to cpu. Returns false on failure.
+bool numa_pin_cpu(int cpu);
+
+// len bytes of zeroed memory, with every page on node.
+// Returns NULL on failure. Free with numa_release.
+void * numa_alloc_on(size_t len, int node);
+
+// len bytes of zeroed memory, with the pages interleaved round-robin
+// across all the nodes (only if mbind is allowed; otherwise the pages go
+// where they are first touched). Returns NULL on failure.
+void * numa_alloc_interleave(size_t len);
+
+// a copy of len bytes of src, on node. Returns NULL on failure.
+void * numa_replicate(const void * src, size_t len, int node);
+
+void numa_release(void * p, size_t len);
+
+#endif
@@ -0,0 +1,99 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+#include "numa.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#define ERRMSG "Usage: ./numabw [megabytes] [repeats]\n"\
+				"Measures the read bandwidth of one thread on each NUMA node, from a\n"\
+				"buffer of megabytes MB on each node and from an interleaved one.\n"\
+				"megabytes defaults to 256, repeats to 5 (the best one is reported)."
+
+/*
+    Usage: ./numabw [megabytes] [repeats]
+*/
+
+static double _now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static double _read_bandwidth(const void * buf, size_t len, int repeats)
+{
+	//best GB/s of summing the buffer as uint64s
+	const uint64_t * p = buf;
+	size_t n = len/sizeof(uint64_t);
+	double best = 0;
+	volatile uint64_t sink = 0;
+	for(int r=0; r<repeats; r++)
+	{
+		double start = _now();
+		//4 independent sums so the adds don't serialize
+		uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		for(size_t i=0; i+4<=n; i+=4)
+		{
+			s0 += p[i]; s1 += p[i+1]; s2 += p[i+2]; s3 += p[i+3];
+		}
+		sink += s0+s1+s2+s3;
+		double gbs = len/(_now()-start)/1e9;
+		if(gbs>best) best = gbs;
+	}
+	(void) sink;
+	return best;
+}
+
+int main (int argc, char ** args)
+{
+	if (argc>3)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	long mb = (argc>1) ? atol(args[1]) : 256;
+	int repeats = (argc>2) ? atoi(args[2]) : 5;
+	if(mb<=0 || repeats<=0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	size_t len = (size_t) mb<<20;
+	int nodes = numa_nodes();
+
+	//one buffer per node, plus the interleaved one
+	void * bufs[NUMA_MAX_NODES+1];
+	for(int b=0; b<=nodes; b++)
+	{
+		bufs[b] = (b<nodes) ? numa_alloc_on(len, b) : numa_alloc_interleave(len);
+		if(!bufs[b])
+		{
+			printf("Can't allocate %ld MB\n", mb);
+			for(int f=0; f<b; f++) numa_release(bufs[f], len);
+			exit(EXIT_FAILURE);
+		}
+		memset(bufs[b], b+1, len);
+	}
+
+	printf("# read GB/s of one thread; rows: cpu node, columns: memory node\n");
+	printf("# cpu-node");
+	for(int b=0; b<nodes; b++) printf(" node%d", b);
+	printf(" interleave\n");
+	for(int a=0; a<nodes; a++)
+	{
+		int cpu;
+		if(numa_node_cpus(a, &cpu, 1)!=1 || !numa_pin_cpu(cpu))
+		{
+			printf("%d (no cpu available)\n", a);
+			continue;
+		}
+		printf("%d", a);
+		for(int b=0; b<=nodes; b++)
+			printf(" %.2f", _read_bandwidth(bufs[b], len, repeats));
+		printf("\n");
+	}
+
+	for(int b=0; b<=nodes; b++) numa_release(bufs[b], len);
+	return(EXIT_SUCCESS);
+}
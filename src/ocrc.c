@@ -0,0 +1,87 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+#include "server.h"
+#include "mnist.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#define ERRMSG "Usage: ./ocrc [socket-path] [test-name] [batch]\n"\
+				"Sends the images of test-name, batch images per request, to the\n"\
+				"./ocrd listening on socket-path and prints the accuracy of its labels."
+
+/*
+    Usage: ./ocrc [socket-path] [test-name] [batch]
+*/
+
+int main (int argc, char ** args)
+{
+	if(argc!=4)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * path = args[1];
+	char * test_name = args[2];
+	int batch = atoi(args[3]);
+	if(batch<=0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	mnist_dataset_handle test_mdh = mnist_open(test_name);
+	if(test_mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n", 
+			test_name, IMAGES, test_name, LABELS);
+		exit(EXIT_FAILURE);
+	}
+	int fd = server_connect(path);
+	if(fd<0)
+	{
+		printf("Can't connect to %s\n", path);
+		mnist_free(test_mdh);
+		exit(EXIT_FAILURE);
+	}
+	unsigned int x, y;
+	mnist_image_size(test_mdh, &x, &y);
+	unsigned char * imgs = malloc((size_t) batch*x*y);
+	int * expected = malloc(batch*sizeof(int));
+	int * labels = malloc(batch*sizeof(int));
+	int correct = 0, processed = 0, requests = 0;
+	int status = EXIT_SUCCESS;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mnist_image_handle img = mnist_image_begin(test_mdh);
+	while(img != MNIST_IMAGE_INVALID)
+	{
+		int n = 0;
+		for(; n<batch && img!=MNIST_IMAGE_INVALID; n++)
+		{
+			memcpy(imgs+(size_t) n*x*y, mnist_image_data(img), x*y);
+			expected[n] = mnist_image_label(img);
+			img = mnist_image_next(img);
+		}
+		if(server_query(fd, imgs, n, (size_t) x*y, labels)!=n)
+		{
+			printf("The server on %s didn't answer. Exiting\n", path);
+			status = EXIT_FAILURE;
+			break;
+		}
+		for(int i=0; i<n; i++) correct += (labels[i]==expected[i]);
+		processed += n;
+		requests++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+	if(status==EXIT_SUCCESS)
+		printf("%d/%d (%6.2f%%) in %d requests, %.2fs\n", correct, processed,
+			processed ? 100.0*correct/processed : 0.0, requests, secs);
+
+	close(fd);
+	free(imgs);
+	free(expected);
+	free(labels);
+	mnist_free(test_mdh);
+	return(status);
+}
@@ -0,0 +1,118 @@
+#define _POSIX_C_SOURCE 200809L // for getopt, sysconf and sigaction
+#include "server.h"
+#include "cache.h"
+#include "mnist.h"
+#include "distance.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#define ERRMSG "Usage: ./ocrd [-t threads] [-c capacity] [-p] [train-name] [k] [distance-scheme] [socket-path]\n"\
+				"Loads train-name once and classifies the images that clients send\n"\
+				"on the Unix socket socket-path (see src/server.h for the protocol,\n"\
+				"and ./ocrc for a client), on threads threads (default: the number\n"\
+				"of cores), until interrupted.\n"\
+				"-c caches the labels of up to capacity images, so images sent\n"\
+				"again aren't classified again; -p adds every training image to\n"\
+				"the cache at start (its label answers an exact match).\n"\
+				"The following distance schemes are supported: \n" DISTANCE_H_LIB_DESC
+
+/*
+    Usage: ./ocrd [-t threads] [-c capacity] [-p] [train-name] [k] [distance-scheme] [socket-path]
+*/
+
+static server_t server = SERVER_INVALID;
+
+static void _on_signal(int sig)
+{
+	server_stop(server);
+}
+
+int main (int argc, char ** args)
+{
+	int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	int capacity = 0, opt;
+	bool prefill = false;
+	while ((opt = getopt(argc, args, "t:c:p")) != -1)
+	{
+		if (opt=='t') nthreads = atoi(optarg);
+		else if (opt=='c') capacity = atoi(optarg);
+		else if (opt=='p') prefill = true;
+		else
+		{
+			puts(ERRMSG);
+			exit(EXIT_FAILURE);
+		}
+	}
+	//the positional arguments start at args[1], as if there were no options
+	args += optind-1;
+	argc -= optind-1;
+	if (argc!=5 || nthreads<=0 || capacity<0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * train_name = args[1];
+	int k = atoi(args[2]);
+	distance_t distance = create_distance_function(args[3]);
+	char * path = args[4];
+	if(k<=0 || !distance)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+
+	mnist_dataset_handle train_mdh = mnist_open(train_name);
+	if(train_mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n", 
+			train_name, IMAGES, train_name, LABELS);
+		exit(EXIT_FAILURE);
+	}
+	unsigned int x, y;
+	mnist_image_size(train_mdh, &x, &y);
+	//prefilled only: the dynamic part of the cache as small as it gets
+	cache_t cache = capacity || prefill ?
+		cache_create((size_t) x*y, capacity ? capacity : 1) : CACHE_INVALID;
+	if((capacity || prefill) && (cache==CACHE_INVALID
+		|| (prefill && !cache_prefill(cache, train_mdh))))
+	{
+		puts("Out of memory for the cache");
+		cache_free(cache);
+		mnist_free(train_mdh);
+		exit(EXIT_FAILURE);
+	}
+	server = server_create(train_mdh, k-1, distance, nthreads);
+	server_set_cache(server, cache);
+	int fd = server==SERVER_INVALID ? -1 : server_listen(path);
+	if(fd<0)
+	{
+		printf("Can't listen on %s\n", path);
+		server_free(server);
+		cache_free(cache);
+		mnist_free(train_mdh);
+		exit(EXIT_FAILURE);
+	}
+	struct sigaction sa = {.sa_handler = _on_signal};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	printf("serving %d images of %s on %s with %d threads\n", 
+			mnist_image_count(train_mdh), train_name, path, nthreads);
+	fflush(stdout);
+	int status = server_run(server, fd) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if(status!=EXIT_SUCCESS) printf("Can't accept connections on %s\n", path);
+	close(fd);
+	unlink(path);
+	if(cache!=CACHE_INVALID)
+	{
+		uint64_t hits, misses;
+		cache_stats(cache, &hits, &misses);
+		printf("cache: %llu hits, %llu misses\n",
+				(unsigned long long) hits, (unsigned long long) misses);
+	}
+	server_free(server);
+	cache_free(cache);
+	mnist_free(train_mdh);
+	return(status);
+}
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE // for sched_getcpu and CPU_SET
+#include "pknn.h"
+#include "knn.h"
+#include "numa.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define CPU_RELAX() __builtin_ia32_pause()
+#else
+	#define CPU_RELAX() do {} while(0)
+#endif
+
+//a counter that threads can wait on: spin first, then sleep
+struct pknn_event
+{
+	atomic_uint value;
+	//threads sleeping (or about to) on cond
+	atomic_int sleepers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct pknn_worker
+{
+	pknn_t p;
+	int tid;
+	int cpu;
+	//the training images this worker reads; NULL: the dataset's
+	const unsigned char * data;
+	pthread_t thread;
+};
+
+struct pknn
+{
+	int nthreads;
+	struct pknn_worker * workers;
+	int num_imgs;
+	unsigned int x, y;
+	//array access to the training set
+	const unsigned char ** imgs;
+	int * train_labels;
+	//copies of the training images made by pknn_create_numa, x*y bytes 
+	// per image; [0] only when interleaved
+	int placement;
+	unsigned char * copies[NUMA_MAX_NODES];
+	size_t copy_len;
+	//per query scratch; worker t owns [from[t], from[t+1])
+	double * distances;
+	int * labels;
+	int * from;
+	//number of candidates worker t left at the start of its slice
+	int * counts;
+
+	//the current query
+	const unsigned char * img;
+	int k;
+	distance_t distance;
+	bool stop;
+
+	//start.value is the number of the current query, done.value the 
+	// number of the last query that all workers finished
+	struct pknn_event start, done;
+	atomic_int remaining;
+};
+
+static void _event_init(struct pknn_event * e)
+{
+	atomic_init(&e->value, 0);
+	atomic_init(&e->sleepers, 0);
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->cond, NULL);
+}
+
+static void _event_destroy(struct pknn_event * e)
+{
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->cond);
+}
+
+static unsigned int _event_wait(struct pknn_event * e, unsigned int old)
+{
+	//waits until the value is no longer old, and returns it
+	unsigned int v;
+	for(int i=0; i<PKNN_SPIN; i++)
+	{
+		v = atomic_load_explicit(&e->value, memory_order_acquire);
+		if(v!=old) return v;
+		CPU_RELAX();
+	}
+	//the seq_cst increment and the seq_cst store in _event_set can't both
+	// miss each other: either we see the new value, or the setter sees us
+	pthread_mutex_lock(&e->lock);
+	atomic_fetch_add(&e->sleepers, 1);
+	while((v = atomic_load(&e->value))==old)
+		pthread_cond_wait(&e->cond, &e->lock);
+	atomic_fetch_sub(&e->sleepers, 1);
+	pthread_mutex_unlock(&e->lock);
+	return v;
+}
+
+static void _event_set(struct pknn_event * e, unsigned int v)
+{
+	atomic_store(&e->value, v);
+	if(atomic_load(&e->sleepers)>0)
+	{
+		pthread_mutex_lock(&e->lock);
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+	}
+}
+
+static const unsigned char * _node_data(pknn_t p, int cpu)
+{
+	//the copy of the training images closest to cpu
+	switch(p->placement)
+	{
+		case PKNN_NUMA_REPLICATE: return p->copies[numa_cpu_node(cpu)];
+		case PKNN_NUMA_INTERLEAVE: return p->copies[0];
+		default: return NULL;
+	}
+}
+
+static void _scan(pknn_t p, int tid, const unsigned char * data)
+{
+	//distances to the slice of worker tid, then moves its local k nearest
+	// (and everything tied with the k-th) to the start of the slice
+	int from = p->from[tid], to = p->from[tid+1];
+	size_t size = p->x*p->y;
+	for(int i=from; i<to; i++)
+	{
+		const unsigned char * img = data ? data+i*size : p->imgs[i];
+		p->distances[i] = p->distance(p->img, img, p->x, p->y);
+		p->labels[i] = p->train_labels[i];
+	}
+	p->counts[tid] = knn_candidates(p->distances+from, p->labels+from, 
+									to-from, p->k);
+}
+
+static void * _pknn_thread(void * arg)
+{
+	struct pknn_worker * w = arg;
+	pknn_t p = w->p;
+	if(w->cpu>=0 && !numa_pin_cpu(w->cpu))
+		dprint("can't pin worker %d to cpu %d", w->tid, w->cpu);
+	unsigned int seen = 0;
+	while(true)
+	{
+		seen = _event_wait(&p->start, seen);
+		if(p->stop) break;
+		_scan(p, w->tid, w->data);
+		if(atomic_fetch_sub(&p->remaining, 1)==1) _event_set(&p->done, seen);
+	}
+	return NULL;
+}
+
+static bool _place(pknn_t p, int placement)
+{
+	//copies the training images as requested by placement
+	p->placement = placement;
+	if(placement==PKNN_NUMA_NONE) return true;
+	size_t size = p->x*p->y;
+	p->copy_len = p->num_imgs*size;
+	int ncopies = (placement==PKNN_NUMA_REPLICATE) ? numa_nodes() : 1;
+	for(int node=0; node<ncopies; node++)
+	{
+		p->copies[node] = (placement==PKNN_NUMA_REPLICATE) ?
+			numa_alloc_on(p->copy_len, node) : numa_alloc_interleave(p->copy_len);
+		if(!p->copies[node]) return false;
+		for(int i=0; i<p->num_imgs; i++)
+			memcpy(p->copies[node]+i*size, p->imgs[i], size);
+	}
+	dprint("placement:%d copies:%d", placement, ncopies);
+	return true;
+}
+
+static pknn_t _create(mnist_dataset_handle train, int nthreads, bool pin,
+						int placement)
+{
+	int num_imgs = mnist_image_count(train);
+	if(nthreads<=0 || num_imgs<=0) return PKNN_INVALID;
+	pknn_t p = calloc(1, sizeof(struct pknn));
+	if(!p) return PKNN_INVALID;
+	p->num_imgs = num_imgs;
+	mnist_image_size(train, &p->x, &p->y);
+	p->workers = calloc(nthreads, sizeof(struct pknn_worker));
+	p->imgs = malloc(num_imgs*sizeof(unsigned char *));
+	p->train_labels = malloc(num_imgs*sizeof(int));
+	p->distances = malloc(num_imgs*sizeof(double));
+	p->labels = malloc(num_imgs*sizeof(int));
+	p->from = malloc((nthreads+1)*sizeof(int));
+	p->counts = malloc(nthreads*sizeof(int));
+	p->nthreads = 1;
+	_event_init(&p->start);
+	_event_init(&p->done);
+	if(!p->workers || !p->imgs || !p->train_labels || !p->distances
+		|| !p->labels || !p->from || !p->counts || placement<PKNN_NUMA_NONE 
+		|| placement>PKNN_NUMA_INTERLEAVE)
+	{
+		pknn_free(p);
+		return PKNN_INVALID;
+	}
+	mnist_image_handle img = mnist_image_begin(train);
+	for(int i=0; i<num_imgs; i++)
+	{
+		p->imgs[i] = mnist_image_data(img);
+		p->train_labels[i] = mnist_image_label(img);
+		img = mnist_image_next(img);
+	}
+	for(int t=0; t<=nthreads; t++) p->from[t] = (long) num_imgs*t/nthreads;
+	if(!_place(p, placement))
+	{
+		pknn_free(p);
+		return PKNN_INVALID;
+	}
+
+	//the CPUs we may run on, in order
+	cpu_set_t allowed;
+	int ncpus = 0;
+	int cpus[CPU_SETSIZE];
+	if(pin && !sched_getaffinity(0, sizeof(allowed), &allowed))
+	{
+		for(int c=0; c<CPU_SETSIZE; c++)
+			if(CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+	}
+	//worker 0 is the caller
+	for(int t=1; t<nthreads; t++)
+	{
+		struct pknn_worker * w = &p->workers[t];
+		w->p = p;
+		w->tid = t;
+		w->cpu = ncpus ? cpus[t%ncpus] : -1;
+		w->data = _node_data(p, w->cpu>=0 ? w->cpu : 0);
+		if(pthread_create(&w->thread, NULL, _pknn_thread, w))
+		{
+			pknn_free(p);
+			return PKNN_INVALID;
+		}
+		p->nthreads++;
+	}
+	dprint("nthreads:%d pinned:%d", p->nthreads, ncpus>0);
+	return p;
+}
+
+pknn_t pknn_create(mnist_dataset_handle train, int nthreads, bool pin)
+{
+	return _create(train, nthreads, pin, PKNN_NUMA_NONE);
+}
+
+pknn_t pknn_create_numa(mnist_dataset_handle train, int nthreads, 
+						int placement)
+{
+	return _create(train, nthreads, true, placement);
+}
+
+int pknn_size(const pknn_t p)
+{
+	if(p==PKNN_INVALID) return -1;
+	return p->nthreads;
+}
+
+int pknn_best_label(pknn_t p, const unsigned char * img, int k,
+					distance_t distance)
+{
+	if(p==PKNN_INVALID || !img || !distance) return LABEL_INVALID;
+	if(k<0 || k>=p->num_imgs) return LABEL_INVALID;
+	p->img = img;
+	p->k = k;
+	p->distance = distance;
+	unsigned int query = atomic_load(&p->start.value)+1;
+	atomic_store(&p->remaining, p->nthreads-1);
+	//publishes the query to the workers
+	_event_set(&p->start, query);
+	_scan(p, 0, _node_data(p, sched_getcpu()));
+	if(p->nthreads>1) _event_wait(&p->done, query-1);
+
+	//merge: move the candidates of every slice next to each other
+	int n = p->counts[0];
+	for(int t=1; t<p->nthreads; t++)
+	{
+		memmove(p->distances+n, p->distances+p->from[t], 
+				p->counts[t]*sizeof(double));
+		memmove(p->labels+n, p->labels+p->from[t], p->counts[t]*sizeof(int));
+		n += p->counts[t];
+	}
+	return knn_vote(p->distances, p->labels, n, k);
+}
+
+void pknn_free(pknn_t p)
+{
+	if(p==PKNN_INVALID) return;
+	p->stop = true;
+	_event_set(&p->start, atomic_load(&p->start.value)+1);
+	for(int t=1; t<p->nthreads; t++) pthread_join(p->workers[t].thread, NULL);
+	_event_destroy(&p->start);
+	_event_destroy(&p->done);
+	free(p->workers);
+	free(p->imgs);
+	free(p->train_labels);
+	free(p->distances);
+	free(p->labels);
+	free(p->from);
+	free(p->counts);
+	for(int node=0; node<NUMA_MAX_NODES; node++)
+		numa_release(p->copies[node], p->copy_len);
+	free(p);
+}
@@ -0,0 +1,63 @@
+#ifndef PKNN_H
+#define PKNN_H
+#include <stdbool.h>
+#include "distance.h"
+#include "mnist.h"
+/*
+Intra-query parallel k-NN, for when one image has to be classified as fast
+as possible rather than many images per second.
+
+The training set is cut into one contiguous slice per worker. For every
+query, each worker computes the distances to its slice and keeps its local
+k nearest candidates (plus any ties), and the calling thread votes among
+the union of the candidates with knn_vote, which gives exactly the label of
+knn_data_best_label.
+
+The workers are started once and pinned to their own CPU. Between queries,
+and at the merge barrier, threads spin for up to PKNN_SPIN checks before
+sleeping on a condition variable, so a short scan never pays for a
+futex wake-up while an idle pool doesn't burn CPU.
+
+On NUMA machines, pknn_create_numa can also move the training images out
+of the dataset, either as one replica per node (each worker reads the
+replica of its own node) or as one copy interleaved across the nodes.
+*/
+
+#define PKNN_INVALID NULL
+//checks of a flag before a waiting thread goes to sleep
+#define PKNN_SPIN 20000
+
+//where pknn_create_numa puts the training images
+#define PKNN_NUMA_NONE 0 //leaves them in the dataset
+#define PKNN_NUMA_REPLICATE 1 //one copy on every node
+#define PKNN_NUMA_INTERLEAVE 2 //one copy, pages spread over all the nodes
+
+typedef struct pknn * pknn_t;
+
+// starts nthreads workers (the caller is worker 0) for queries against
+// train. If pin is true, worker t is pinned to the t-th CPU the process
+// may run on (the caller is left alone). The dataset must not change
+// while the pknn_t is in use.
+// Returns PKNN_INVALID if nthreads<=0, train is empty or invalid, or the
+// threads can't be started.
+pknn_t pknn_create(mnist_dataset_handle train, int nthreads, bool pin);
+
+// same as pknn_create with pinned workers, with the training images
+// placed as one of the PKNN_NUMA_* above.
+pknn_t pknn_create_numa(mnist_dataset_handle train, int nthreads, 
+						int placement);
+
+// number of workers, <0 if p is PKNN_INVALID
+int pknn_size(const pknn_t p);
+
+// label of img (x*y bytes, same size as the training images) with the
+// k-NN vote of knn_data_best_label (k is 0-indexed). Only one query at
+// a time per pknn_t.
+// Returns LABEL_INVALID on error.
+int pknn_best_label(pknn_t p, const unsigned char * img, int k,
+					distance_t distance);
+
+// stops and joins the workers
+void pknn_free(pknn_t p);
+
+#endif
@@ -0,0 +1,262 @@
+#define _POSIX_C_SOURCE 200809L
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+struct pool_thread
+{
+	pool_t pool;
+	int tid;
+	pthread_t thread;
+};
+
+struct pool
+{
+	int nthreads;
+	struct pool_thread * threads;
+
+	pthread_mutex_t lock;
+	//signalled when a new job is posted, and when the last thread is done
+	pthread_cond_t start, done;
+	//job being run; generation changes every time a job is posted
+	pool_fn_t fn;
+	void * arg;
+	unsigned long generation;
+	//threads that haven't finished the current job
+	int running;
+	bool stop;
+};
+
+static void * _pool_thread(void * arg)
+{
+	struct pool_thread * t = arg;
+	pool_t pool = t->pool;
+	unsigned long seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while(true)
+	{
+		while(!pool->stop && pool->generation==seen)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if(pool->stop) break;
+		seen = pool->generation;
+		pool_fn_t fn = pool->fn;
+		void * fn_arg = pool->arg;
+		pthread_mutex_unlock(&pool->lock);
+
+		fn(fn_arg, t->tid, pool->nthreads);
+
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->running==0) pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+pool_t pool_create(int nthreads)
+{
+	if(nthreads<=0) return POOL_INVALID;
+	pool_t pool = calloc(1, sizeof(struct pool));
+	if(!pool) return POOL_INVALID;
+	pool->threads = calloc(nthreads, sizeof(struct pool_thread));
+	if(!pool->threads)
+	{
+		free(pool);
+		return POOL_INVALID;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->nthreads = 1;
+	//thread 0 is the caller of pool_run
+	for(int t=1; t<nthreads; t++)
+	{
+		pool->threads[t].pool = pool;
+		pool->threads[t].tid = t;
+		if(pthread_create(&pool->threads[t].thread, NULL, _pool_thread,
+							&pool->threads[t]))
+		{
+			pool_free(pool);
+			return POOL_INVALID;
+		}
+		pool->nthreads++;
+	}
+	dprint("nthreads:%d", pool->nthreads);
+	return pool;
+}
+
+int pool_size(const pool_t pool)
+{
+	if(pool==POOL_INVALID) return -1;
+	return pool->nthreads;
+}
+
+void pool_run(pool_t pool, pool_fn_t fn, void * arg)
+{
+	if(pool==POOL_INVALID || !fn) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->running = pool->nthreads-1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	fn(arg, 0, pool->nthreads);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->running>0) pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+Work stealing deques (Chase and Lev, "Dynamic circular work-stealing
+deque", with the C11 orderings of Le et al.). All the tasks are known
+before the run starts, so a deque never grows: it is the range of task ids
+[top, bottom) of a fixed array. The owner pops at bottom and thieves take
+from top; the only contended case is the last task, which both sides
+claim with a CAS on top.
+*/
+struct pool_deque
+{
+	_Alignas(64) atomic_long top;
+	atomic_long bottom;
+	const int * tasks;
+};
+
+struct pool_tasks
+{
+	pool_task_fn_t fn;
+	void * arg;
+	int * tasks;
+	struct pool_deque * deques;
+};
+
+#define POOL_EMPTY -1
+//the steal lost a race, the deque may still have tasks
+#define POOL_ABORT -2
+
+static int _deque_pop(struct pool_deque * d)
+{
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if(t>b)
+	{
+		atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+		return POOL_EMPTY;
+	}
+	int task = d->tasks[b];
+	if(t==b)
+	{
+		//last task: race the thieves for it
+		if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t+1,
+						memory_order_seq_cst, memory_order_relaxed))
+			task = POOL_EMPTY;
+		atomic_store_explicit(&d->bottom, b+1, memory_order_relaxed);
+	}
+	return task;
+}
+
+static int _deque_steal(struct pool_deque * d)
+{
+	long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if(t>=b) return POOL_EMPTY;
+	int task = d->tasks[t];
+	if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t+1,
+					memory_order_seq_cst, memory_order_relaxed))
+		return POOL_ABORT;
+	return task;
+}
+
+static void _pool_task_worker(void * arg, int tid, int nthreads)
+{
+	struct pool_tasks * job = arg;
+	struct pool_deque * own = &job->deques[tid];
+	//xorshift state for picking victims
+	unsigned int rng = 2654435761u*(tid+1);
+	while(true)
+	{
+		int task;
+		while((task = _deque_pop(own))!=POOL_EMPTY)
+			job->fn(job->arg, task, tid);
+		//own deque is empty: steal from the others, starting at a random
+		// victim. Nobody adds tasks, so once every deque is seen empty
+		// the run is over for this thread.
+		rng ^= rng<<13; rng ^= rng>>17; rng ^= rng<<5;
+		int first = rng % nthreads;
+		for(int v=0; v<nthreads && task<0; v++)
+		{
+			int victim = (first+v)%nthreads;
+			if(victim==tid) continue;
+			do task = _deque_steal(&job->deques[victim]);
+			while(task==POOL_ABORT);
+		}
+		if(task<0) break;
+		job->fn(job->arg, task, tid);
+	}
+}
+
+bool pool_run_tasks(pool_t pool, pool_task_fn_t fn, void * arg, int ntasks)
+{
+	if(pool==POOL_INVALID || !fn || ntasks<0) return false;
+	if(ntasks==0) return true;
+	int nthreads = pool->nthreads;
+	struct pool_tasks job;
+	job.fn = fn;
+	job.arg = arg;
+	job.tasks = malloc(ntasks*sizeof(int));
+	job.deques = aligned_alloc(sizeof(struct pool_deque),
+							nthreads*sizeof(struct pool_deque));
+	if(!job.tasks || !job.deques)
+	{
+		free(job.tasks);
+		free(job.deques);
+		return false;
+	}
+	//thread t owns tasks [ntasks*t/nthreads, ntasks*(t+1)/nthreads).
+	// It pops from the end of its range, so the tasks are stored
+	// reversed to run them in increasing order.
+	for(int t=0; t<nthreads; t++)
+	{
+		long from = (long) ntasks*t/nthreads;
+		long to = (long) ntasks*(t+1)/nthreads;
+		for(long i=from; i<to; i++) job.tasks[i] = (int) (to-1-(i-from));
+		atomic_init(&job.deques[t].top, from);
+		atomic_init(&job.deques[t].bottom, to);
+		job.deques[t].tasks = job.tasks;
+	}
+	pool_run(pool, _pool_task_worker, &job);
+	free(job.tasks);
+	free(job.deques);
+	return true;
+}
+
+void pool_free(pool_t pool)
+{
+	if(pool==POOL_INVALID) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for(int t=1; t<pool->nthreads; t++) pthread_join(pool->threads[t].thread, NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+}
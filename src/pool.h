@@ -0,0 +1,47 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stdbool.h>
+/*
+A fixed pool of threads that run the same function in parallel.
+The thread calling pool_run is thread 0 of the pool, so a pool of n
+threads only starts n-1 pthreads. The threads are started once and reused
+by every pool_run, so a parallel loop doesn't pay for pthread_create.
+
+pool_run_tasks runs a list of independent tasks of uneven cost with work
+stealing: every thread owns a deque holding a contiguous range of the
+tasks, takes tasks from its bottom end and, once it is empty, steals from
+the top end of the deque of another thread, so no thread idles while
+there are tasks left anywhere.
+*/
+
+#define POOL_INVALID NULL
+
+typedef struct pool * pool_t;
+
+// fn is called once on every thread with tid in [0,nthreads)
+typedef void (*pool_fn_t)(void * arg, int tid, int nthreads);
+
+// starts a pool of nthreads threads (including the caller).
+// Returns POOL_INVALID if nthreads<=0 or the threads can't be started.
+pool_t pool_create(int nthreads);
+
+// number of threads in the pool, <0 if pool is POOL_INVALID
+int pool_size(const pool_t pool);
+
+// runs fn(arg, tid, nthreads) on every thread of the pool and returns 
+// when all of them are done. Only one pool_run at a time per pool.
+void pool_run(pool_t pool, pool_fn_t fn, void * arg);
+
+// fn is called once for every task in [0,ntasks), on thread tid
+typedef void (*pool_task_fn_t)(void * arg, int task, int tid);
+
+// runs fn(arg, task, tid) for every task in [0,ntasks) on the threads of
+// the pool, with work stealing, and returns when all of them are done.
+// Thread 0 of the pool is the caller.
+// Returns false if the deques can't be allocated (no task is run).
+bool pool_run_tasks(pool_t pool, pool_task_fn_t fn, void * arg, int ntasks);
+
+// stops and joins the threads
+void pool_free(pool_t pool);
+
+#endif
@@ -0,0 +1,166 @@
+#include "sample.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+#define GOLDEN 0x9e3779b97f4a7c15ULL
+//labels are bytes
+#define NUM_LABELS 256
+
+static uint64_t _mix(uint64_t z)
+{
+	//splitmix64 finalizer
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+sample_rng_t sample_rng(uint64_t seed, uint64_t stream)
+{
+	sample_rng_t rng = {_mix(seed ^ _mix(stream+GOLDEN)), 0};
+	return rng;
+}
+
+uint64_t sample_rng_at(const sample_rng_t * rng, uint64_t i)
+{
+	return _mix(rng->key+(i+1)*GOLDEN);
+}
+
+uint64_t sample_rng_next(sample_rng_t * rng)
+{
+	return sample_rng_at(rng, rng->counter++);
+}
+
+uint32_t sample_rng_uniform(sample_rng_t * rng, uint32_t range)
+{
+	//Lemire's multiply and shift: the high word of x*range, rejecting
+	// the few x whose low word falls in the biased part
+	if(!range) return 0;
+	uint64_t m = (sample_rng_next(rng)>>32)*range;
+	if((uint32_t) m<range)
+	{
+		uint32_t threshold = -range%range;
+		while((uint32_t) m<threshold)
+			m = (sample_rng_next(rng)>>32)*range;
+	}
+	return m>>32;
+}
+
+static void _sort_uniform(int * a, int n, int N, int * tmp)
+{
+	//bucket sort for n values spread uniformly over [0,N): n buckets,
+	// then an insertion sort that only has to fix the order inside the
+	// buckets (O(1) expected per bucket). tmp has room for 2n+1 ints.
+	int * cnt = tmp+n;
+	memset(cnt, 0, (n+1)*sizeof(int));
+	for(int i=0; i<n; i++) cnt[(uint64_t) a[i]*n/N+1]++;
+	for(int b=0; b<n; b++) cnt[b+1] += cnt[b];
+	for(int i=0; i<n; i++) tmp[cnt[(uint64_t) a[i]*n/N]++] = a[i];
+	for(int i=1; i<n; i++)
+	{
+		int v = tmp[i], j = i;
+		for(; j>0 && tmp[j-1]>v; j--) tmp[j] = tmp[j-1];
+		tmp[j] = v;
+	}
+	memcpy(a, tmp, n*sizeof(int));
+}
+
+static bool _insert(int * set, size_t mask, int v)
+{
+	//open addressing with linear probing, -1 is an empty slot.
+	// Returns false if v was already there.
+	size_t s = ((uint64_t) v*GOLDEN>>32)&mask;
+	for(; set[s]!=-1; s=(s+1)&mask)
+		if(set[s]==v) return false;
+	set[s] = v;
+	return true;
+}
+
+bool sample_floyd(sample_rng_t * rng, int N, int n, int * out)
+{
+	if(!rng || !out || n<0 || n>N) return false;
+	if(n==0) return true;
+	//the hash set is at most half full; the bucket sort reuses it
+	size_t cap = 16;
+	while(cap<2*(size_t) n+1) cap *= 2;
+	int * set = malloc(cap*sizeof(int));
+	if(!set) return false;
+	memset(set, -1, cap*sizeof(int));
+	//for every j of the last n positions, draw t in [0,j] and take t,
+	// or j if t was taken already: every n-subset is equally likely
+	for(int j=N-n, k=0; j<N; j++, k++)
+	{
+		int t = sample_rng_uniform(rng, j+1);
+		if(!_insert(set, cap-1, t))
+		{
+			t = j;
+			_insert(set, cap-1, t);
+		}
+		out[k] = t;
+	}
+	_sort_uniform(out, n, N, set);
+	free(set);
+	dprint("N:%d\tn:%d\tcap:%zu", N, n, cap);
+	return true;
+}
+
+bool sample_stratified(sample_rng_t * rng, const unsigned char * labels,
+						int N, int n, int * out)
+{
+	if(!rng || !labels || !out || n<0 || n>N) return false;
+	if(n==0) return true;
+	int count[NUM_LABELS] = {0}, start[NUM_LABELS+1], quota[NUM_LABELS];
+	int64_t rem[NUM_LABELS];
+	for(int i=0; i<N; i++) count[labels[i]]++;
+
+	//the positions grouped by label (counting sort). The buffer is reused
+	// by the final bucket sort.
+	int * pos = malloc((N>2*n ? N : 2*n+1)*sizeof(int));
+	if(!pos) return false;
+	start[0] = 0;
+	for(int l=0; l<NUM_LABELS; l++) start[l+1] = start[l]+count[l];
+	int fill[NUM_LABELS];
+	memcpy(fill, start, sizeof(fill));
+	for(int i=0; i<N; i++) pos[fill[labels[i]]++] = i;
+
+	//n*count/N images of every label, rounded down; the images left go
+	// to the labels with the largest remainders
+	int left = n;
+	for(int l=0; l<NUM_LABELS; l++)
+	{
+		quota[l] = (int64_t) n*count[l]/N;
+		rem[l] = (int64_t) n*count[l]%N;
+		left -= quota[l];
+	}
+	for(; left>0; left--)
+	{
+		int best = 0;
+		for(int l=1; l<NUM_LABELS; l++)
+			if(rem[l]>rem[best]) best = l;
+		quota[best]++;
+		rem[best] = -1;
+	}
+
+	int k = 0;
+	bool ok = true;
+	for(int l=0; l<NUM_LABELS; l++)
+	{
+		//positions within the label, then in the dataset
+		if(!(ok = sample_floyd(rng, count[l], quota[l], out+k))) break;
+		for(int i=k; i<k+quota[l]; i++) out[i] = pos[start[l]+out[i]];
+		k += quota[l];
+	}
+	if(ok) _sort_uniform(out, n, N, pos);
+	free(pos);
+	dprint("N:%d\tn:%d\tok:%d", N, n, ok);
+	return ok;
+}
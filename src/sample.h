@@ -0,0 +1,54 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+#include <stdbool.h>
+#include <stdint.h>
+/*
+Random sampling of positions, for drawing training samples.
+
+The generator is counter based: the i-th number of a stream is a hash
+(the splitmix64 finalizer) of a key derived from the seed and the stream
+number, plus i times an odd constant. Its whole state is the key and the
+counter, so every thread can own one (e.g. stream = thread id) without
+locking, a run is reproducible from its seed, and sample_rng_at gives any
+number of a stream without generating the ones before it.
+
+sample_floyd draws n distinct positions out of N with Robert Floyd's
+algorithm: n draws and n insertions in a hash set, so a sample costs O(n)
+however large the dataset. sample_stratified draws from every label in
+proportion to its share of the dataset. Both return the positions sorted,
+with a bucket sort (expected O(n), the positions being uniform), so a
+gather reads the dataset front to back.
+*/
+
+typedef struct
+{
+	uint64_t key;
+	uint64_t counter;
+} sample_rng_t;
+
+// generator of stream number stream of seed seed
+sample_rng_t sample_rng(uint64_t seed, uint64_t stream);
+
+// next 64 random bits of rng
+uint64_t sample_rng_next(sample_rng_t * rng);
+
+// number i of the stream of rng, whatever the state of rng
+uint64_t sample_rng_at(const sample_rng_t * rng, uint64_t i);
+
+// uniformly distributed integer in [0,range) (without the bias of a
+// modulo), 0 if range is 0
+uint32_t sample_rng_uniform(sample_rng_t * rng, uint32_t range);
+
+// writes n distinct positions in [0,N), in increasing order, to out.
+// Returns false if n<0, n>N or out of memory.
+bool sample_floyd(sample_rng_t * rng, int N, int n, int * out);
+
+// writes n distinct positions in [0,N), in increasing order, to out,
+// taking from the positions of every label a share of n as close as
+// possible to its share of N (largest remainder). labels[i] is the label
+// at position i. Costs a pass over the N labels.
+// Returns false if n<0, n>N or out of memory.
+bool sample_stratified(sample_rng_t * rng, const unsigned char * labels,
+						int N, int n, int * out);
+
+#endif
@@ -0,0 +1,93 @@
+#include "shard.h"
+#include "knn.h"
+#include "mnist.h"
+#include "distance.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#define ERRMSG "Usage: ./scatter [test-name] [k] [distance-scheme] [batch] [timeout-ms] [socket-path]...\n"\
+				"Classifies the images of test-name in batches of batch images with the\n"\
+				"training set split across the shards listening on the socket-paths\n"\
+				"(see ./shardd), and reports the accuracy. A shard that doesn't answer\n"\
+				"a batch within timeout-ms is dropped.\n"\
+				"The following distance schemes are supported: \n" DISTANCE_H_LIB_DESC
+
+/*
+    Usage: ./scatter [test-name] [k] [distance-scheme] [batch] [timeout-ms] [socket-path]...
+*/
+
+int main (int argc, char ** args)
+{
+	if (argc<7)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * test_name = args[1];
+	int k = atoi(args[2]);
+	char * distance = args[3];
+	int batch = atoi(args[4]);
+	int timeout_ms = atoi(args[5]);
+	int nshards = argc-6;
+	if(k<=0 || !create_distance_function(distance) || batch<=0 || timeout_ms<0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+
+	mnist_dataset_handle test_mdh = mnist_open(test_name);
+	if(test_mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n", 
+			test_name, IMAGES, test_name, LABELS);
+		exit(EXIT_FAILURE);
+	}
+	shard_client_t c = shard_connect((const char **) args+6, nshards, timeout_ms);
+	if(c == SHARD_INVALID)
+	{
+		puts("Can't reach any shard.");
+		mnist_free(test_mdh);
+		exit(EXIT_FAILURE);
+	}
+	printf("%d/%d shards up\n", shard_alive(c), nshards);
+
+	unsigned int x, y;
+	mnist_image_size(test_mdh, &x, &y);
+	unsigned char * imgs = malloc((size_t) batch*x*y);
+	int * expected = malloc(batch*sizeof(int));
+	int * labels = malloc(batch*sizeof(int));
+	int correct = 0, processed = 0;
+	int status = EXIT_SUCCESS;
+	mnist_image_handle img = mnist_image_begin(test_mdh);
+	while(img != MNIST_IMAGE_INVALID)
+	{
+		int n = 0;
+		for(; n<batch && img!=MNIST_IMAGE_INVALID; n++)
+		{
+			memcpy(imgs+(size_t) n*x*y, mnist_image_data(img), x*y);
+			expected[n] = mnist_image_label(img);
+			img = mnist_image_next(img);
+		}
+		int used = shard_classify(c, imgs, n, x, y, k-1, distance, labels);
+		if(used<0)
+		{
+			puts("No shard answered. Exiting");
+			status = EXIT_FAILURE;
+			break;
+		}
+		if(used<nshards) 
+			printf("batch at %d: only %d/%d shards answered\n", processed, used, nshards);
+		for(int i=0; i<n; i++) correct += (labels[i]==expected[i]);
+		processed += n;
+	}
+	if(status==EXIT_SUCCESS)
+		printf("[%s] %d/%d (%6.2f%%) with %d/%d shards up\n", distance, correct, 
+			processed, 100.0*correct/processed, shard_alive(c), nshards);
+
+	free(imgs);
+	free(expected);
+	free(labels);
+	shard_close(c);
+	mnist_free(test_mdh);
+	return(status);
+}
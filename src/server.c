@@ -0,0 +1,478 @@
+#define _GNU_SOURCE // for accept4 and MSG_NOSIGNAL
+#include "server.h"
+#include "cache.h"
+#include "knn.h"
+#include "pool.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+//convenience
+typedef unsigned char uchar;
+
+static void _put32(uchar * p, uint32_t v) {v = htonl(v); memcpy(p, &v, 4);}
+static uint32_t _get32(const uchar * p) {uint32_t v; memcpy(&v, p, 4); return ntohl(v);}
+
+struct server_conn
+{
+	int fd;
+	//bytes of header and images received so far, images expected
+	uchar header[SERVER_HEADER_SIZE];
+	size_t got, len;
+	uchar * in;
+	size_t in_cap;
+	//response, and how much of it is sent
+	uchar * out;
+	size_t out_len, sent, out_cap;
+	//every connection, and the ones with a request to classify
+	struct server_conn * prev, * next;
+	struct server_conn * next_ready;
+};
+
+struct server
+{
+	int num_imgs;
+	unsigned int x, y;
+	size_t size;
+	const uchar ** imgs;
+	int * train_labels;
+	int k;
+	distance_t distance;
+	//labels already given, CACHE_INVALID if none
+	cache_t cache;
+
+	pool_t pool;
+	//knn_vote buffers of every thread, num_imgs each
+	double * distances;
+	int * labels;
+
+	int epfd;
+	//server_stop writes to stop_pipe[1]
+	int stop_pipe[2];
+	struct server_conn * conns;
+
+	//images of the requests being classified, and where their labels go
+	const uchar ** batch;
+	uchar ** results;
+	int batch_cap;
+};
+
+server_t server_create(mnist_dataset_handle train, int k, distance_t distance,
+		int nthreads)
+{
+	int n = mnist_image_count(train);
+	if(n<=0 || k<0 || !distance || nthreads<=0) return SERVER_INVALID;
+	server_t s = calloc(1, sizeof(struct server));
+	if(!s) return SERVER_INVALID;
+	s->num_imgs = n;
+	mnist_image_size(train, &s->x, &s->y);
+	s->size = (size_t) s->x*s->y;
+	s->k = k;
+	s->distance = distance;
+	s->epfd = s->stop_pipe[0] = s->stop_pipe[1] = -1;
+	s->imgs = malloc(n*sizeof(uchar *));
+	s->train_labels = malloc(n*sizeof(int));
+	s->distances = malloc((size_t) nthreads*n*sizeof(double));
+	s->labels = malloc((size_t) nthreads*n*sizeof(int));
+	s->pool = pool_create(nthreads);
+	if(!s->imgs || !s->train_labels || !s->distances || !s->labels
+		|| s->pool==POOL_INVALID || pipe(s->stop_pipe))
+	{
+		server_free(s);
+		return SERVER_INVALID;
+	}
+	fcntl(s->stop_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(s->stop_pipe[1], F_SETFL, O_NONBLOCK);
+	mnist_image_handle img = mnist_image_begin(train);
+	for(int i=0; i<n; i++, img=mnist_image_next(img))
+	{
+		s->imgs[i] = mnist_image_data(img);
+		s->train_labels[i] = mnist_image_label(img);
+	}
+	return s;
+}
+
+bool server_set_cache(server_t s, cache_t cache)
+{
+	if(s==SERVER_INVALID) return false;
+	s->cache = cache;
+	return true;
+}
+
+int server_listen(const char * path)
+{
+	struct sockaddr_un addr;
+	if(!path || strlen(path)>=sizeof(addr.sun_path)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if(fd<0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, SOMAXCONN))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void _close_conn(server_t s, struct server_conn * c)
+{
+	dprint("fd:%d", c->fd);
+	close(c->fd); //also removes it from the epoll set
+	if(c->prev) c->prev->next = c->next;
+	else s->conns = c->next;
+	if(c->next) c->next->prev = c->prev;
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+static void _accept(server_t s, int listen_fd)
+{
+	while(true)
+	{
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if(fd<0)
+		{
+			//EAGAIN: no one left. Out of descriptors: they wait in the
+			// backlog until a connection closes.
+			if(errno==EINTR || errno==ECONNABORTED) continue;
+			return;
+		}
+		struct server_conn * c = calloc(1, sizeof(struct server_conn));
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+		if(!c || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev))
+		{
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->next = s->conns;
+		if(s->conns) s->conns->prev = c;
+		s->conns = c;
+		dprint("fd:%d", fd);
+	}
+}
+
+static bool _read(server_t s, struct server_conn * c)
+{
+	//reads what has arrived of the request of c (the header, then
+	// exactly the images it announces, so the next request stays in the
+	// socket). Returns false if the connection must be closed.
+	while(true)
+	{
+		uchar * dst;
+		size_t want;
+		if(c->got<SERVER_HEADER_SIZE)
+		{
+			dst = c->header+c->got;
+			want = SERVER_HEADER_SIZE-c->got;
+		}
+		else
+		{
+			dst = c->in+(c->got-SERVER_HEADER_SIZE);
+			want = c->len-(c->got-SERVER_HEADER_SIZE);
+		}
+		if(want==0) return true;
+		ssize_t r = read(c->fd, dst, want);
+		if(r<0 && errno==EINTR) continue;
+		if(r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return true;
+		if(r<=0) return false;
+		c->got += r;
+		if(c->got==SERVER_HEADER_SIZE)
+		{
+			c->len = _get32(c->header+4);
+			if(_get32(c->header)!=SERVER_MAGIC_NUM || c->len>SERVER_MAX_REQUEST
+				|| c->len%s->size)
+			{
+				dprint("bad request, magic:%x", _get32(c->header));
+				return false;
+			}
+			if(c->len>c->in_cap)
+			{
+				uchar * p = realloc(c->in, c->len);
+				if(!p) return false;
+				c->in = p;
+				c->in_cap = c->len;
+			}
+		}
+	}
+}
+
+static bool _complete(const struct server_conn * c)
+{
+	return c->got>=SERVER_HEADER_SIZE && c->got==SERVER_HEADER_SIZE+c->len;
+}
+
+static bool _write(server_t s, struct server_conn * c)
+{
+	//sends what it can of the response of c, then waits for the rest
+	// (EPOLLOUT) or for the next request (EPOLLIN).
+	// Returns false if the connection must be closed.
+	while(c->sent<c->out_len)
+	{
+		ssize_t r = send(c->fd, c->out+c->sent, c->out_len-c->sent, MSG_NOSIGNAL);
+		if(r<0 && errno==EINTR) continue;
+		if(r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+		if(r<=0) return false;
+		c->sent += r;
+	}
+	bool done = c->sent==c->out_len;
+	if(done) c->got = c->len = c->sent = c->out_len = 0;
+	struct epoll_event ev = {.events = done ? EPOLLIN : EPOLLOUT, .data.ptr = c};
+	return !epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void _classify_task(void * arg, int task, int tid)
+{
+	server_t s = arg;
+	double * distances = s->distances+(size_t) tid*s->num_imgs;
+	int * labels = s->labels+(size_t) tid*s->num_imgs;
+	const uchar * img = s->batch[task];
+	int label = cache_lookup(s->cache, img);
+	if(label!=CACHE_MISS)
+	{
+		*s->results[task] = (uchar) label;
+		return;
+	}
+	for(int i=0; i<s->num_imgs; i++)
+	{
+		distances[i] = s->distance(img, s->imgs[i], s->x, s->y);
+		labels[i] = s->train_labels[i];
+	}
+	int k = s->k<s->num_imgs ? s->k : s->num_imgs-1;
+	label = knn_vote(distances, labels, s->num_imgs, k);
+	cache_insert(s->cache, img, label);
+	*s->results[task] = (uchar) label;
+}
+
+static void _answer(server_t s, struct server_conn * ready)
+{
+	//classifies the images of all the complete requests at once, then
+	// sends the responses
+	int total = 0;
+	bool ok = true;
+	for(struct server_conn * c=ready; c; c=c->next_ready)
+	{
+		int n = c->len/s->size;
+		size_t len = SERVER_HEADER_SIZE+n;
+		if(len>c->out_cap)
+		{
+			uchar * p = realloc(c->out, len);
+			if(!p)
+			{
+				ok = false;
+				break;
+			}
+			c->out = p;
+			c->out_cap = len;
+		}
+		_put32(c->out, SERVER_MAGIC_NUM);
+		_put32(c->out+4, n);
+		c->out_len = len;
+		if(total+n>s->batch_cap)
+		{
+			int cap = s->batch_cap ? s->batch_cap : 64;
+			while(cap<total+n) cap *= 2;
+			const uchar ** b = realloc(s->batch, cap*sizeof(uchar *));
+			if(b) s->batch = b;
+			uchar ** r = realloc(s->results, cap*sizeof(uchar *));
+			if(r) s->results = r;
+			if(!b || !r)
+			{
+				ok = false;
+				break;
+			}
+			s->batch_cap = cap;
+		}
+		for(int i=0; i<n; i++, total++)
+		{
+			s->batch[total] = c->in+(size_t) i*s->size;
+			s->results[total] = c->out+SERVER_HEADER_SIZE+i;
+		}
+	}
+	ok = ok && (!total || pool_run_tasks(s->pool, _classify_task, s, total));
+	dprint("%d images, ok:%d", total, ok);
+	while(ready)
+	{
+		struct server_conn * c = ready;
+		ready = ready->next_ready;
+		if(!ok || !_write(s, c)) _close_conn(s, c);
+	}
+}
+
+bool server_run(server_t s, int listen_fd)
+{
+	if(s==SERVER_INVALID || listen_fd<0 
+		|| fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL)|O_NONBLOCK))
+		return false;
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+	//the stop pipe is told apart by its pointer
+	struct epoll_event stop_ev = {.events = EPOLLIN, .data.ptr = s};
+	if(s->epfd<0 || epoll_ctl(s->epfd, EPOLL_CTL_ADD, listen_fd, &ev)
+		|| epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->stop_pipe[0], &stop_ev))
+	{
+		if(s->epfd>=0) close(s->epfd);
+		s->epfd = -1;
+		return false;
+	}
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	bool stop = false;
+	while(!stop)
+	{
+		int n = epoll_wait(s->epfd, events, SERVER_MAX_EVENTS, -1);
+		if(n<0 && errno==EINTR) continue;
+		if(n<0) break;
+		struct server_conn * ready = NULL;
+		for(int i=0; i<n; i++)
+		{
+			void * ptr = events[i].data.ptr;
+			if(!ptr)
+			{
+				_accept(s, listen_fd);
+				continue;
+			}
+			if(ptr==s)
+			{
+				//empty the pipe, so the server can run again
+				char byte;
+				while(read(s->stop_pipe[0], &byte, 1)>0) {/*do nothing*/}
+				stop = true;
+				continue;
+			}
+			struct server_conn * c = ptr;
+			bool ok;
+			if(events[i].events & EPOLLOUT)
+				ok = _write(s, c);
+			else
+			{
+				ok = _read(s, c);
+				if(ok && _complete(c))
+				{
+					//don't read on until it's answered
+					struct epoll_event none = {.events = 0, .data.ptr = c};
+					ok = !epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &none);
+					c->next_ready = ready;
+					if(ok) ready = c;
+				}
+			}
+			if(!ok) _close_conn(s, c);
+		}
+		if(ready) _answer(s, ready);
+	}
+	close(s->epfd);
+	s->epfd = -1;
+	return stop;
+}
+
+void server_stop(server_t s)
+{
+	if(s==SERVER_INVALID) return;
+	char byte = 0;
+	if(write(s->stop_pipe[1], &byte, 1)<0) {/*already stopping*/}
+}
+
+void server_free(server_t s)
+{
+	if(s==SERVER_INVALID) return;
+	while(s->conns) _close_conn(s, s->conns);
+	if(s->pool!=POOL_INVALID) pool_free(s->pool);
+	if(s->stop_pipe[0]>=0) close(s->stop_pipe[0]);
+	if(s->stop_pipe[1]>=0) close(s->stop_pipe[1]);
+	free(s->imgs);
+	free(s->train_labels);
+	free(s->distances);
+	free(s->labels);
+	free(s->batch);
+	free(s->results);
+	free(s);
+}
+
+int server_connect(const char * path)
+{
+	struct sockaddr_un addr;
+	if(!path || strlen(path)>=sizeof(addr.sun_path)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if(fd<0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool _read_full(int fd, void * buf, size_t len)
+{
+	//false on EOF or error
+	uchar * p = buf;
+	while(len>0)
+	{
+		ssize_t r = read(fd, p, len);
+		if(r<0 && errno==EINTR) continue;
+		if(r<=0) return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static bool _write_full(int fd, const void * buf, size_t len)
+{
+	const uchar * p = buf;
+	while(len>0)
+	{
+		ssize_t r = send(fd, p, len, MSG_NOSIGNAL);
+		if(r<0 && errno==EINTR) continue;
+		if(r<=0) return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+int server_query(int fd, const unsigned char * imgs, int n, size_t size,
+		int labels[])
+{
+	if(fd<0 || n<0 || (n && (!imgs || !labels)) || !size
+		|| (size_t) n*size>SERVER_MAX_REQUEST)
+		return -1;
+	uchar header[SERVER_HEADER_SIZE];
+	_put32(header, SERVER_MAGIC_NUM);
+	_put32(header+4, n*size);
+	if(!_write_full(fd, header, SERVER_HEADER_SIZE)
+		|| !_write_full(fd, imgs, n*size)
+		|| !_read_full(fd, header, SERVER_HEADER_SIZE)
+		|| _get32(header)!=SERVER_MAGIC_NUM || _get32(header+4)!=(uint32_t) n)
+		return -1;
+	uchar * out = malloc(n ? n : 1);
+	bool ok = out && _read_full(fd, out, n);
+	for(int i=0; ok && i<n; i++) labels[i] = out[i];
+	free(out);
+	return ok ? n : -1;
+}
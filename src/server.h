@@ -0,0 +1,81 @@
+#ifndef SERVER_H
+#define SERVER_H
+#include <stdbool.h>
+#include "cache.h"
+#include "mnist.h"
+#include "distance.h"
+/*
+A classification service: the training set is loaded once, and clients
+send batches of images over a Unix domain socket and get their labels.
+
+One thread runs an epoll loop over the listening socket and every client
+connection (non-blocking), so idle clients cost a file descriptor and a
+few bytes, not a thread. Every time epoll_wait returns, the loop reads
+what the clients sent; the requests that are complete are then
+classified together, every image a task of pool_run_tasks on the pool
+(the loop's thread being thread 0), and their responses written back.
+A client has at most one request in flight: the loop stops reading a
+connection until its response is written, so pipelined requests wait in
+the socket buffer.
+
+Protocol: every integer is in network byte order.
+  request:  uint32 SERVER_MAGIC_NUM, uint32 number of bytes of images
+            that follow (a multiple of x*y of the training set, at most
+            SERVER_MAX_REQUEST), then the images, x*y bytes each.
+  response: uint32 SERVER_MAGIC_NUM, uint32 number of images, then a
+            uint8 label per image, in the order of the request.
+A malformed request closes the connection.
+
+With server_set_cache, images that were classified before (or are
+images of the training set, if the cache was prefilled) are answered
+from the cache instead of scanning the training set.
+*/
+
+#define SERVER_INVALID NULL
+#define SERVER_MAGIC_NUM 0x4f435231 //"OCR1"
+#define SERVER_HEADER_SIZE 8
+#define SERVER_MAX_REQUEST (64u<<20)
+//most events handled per epoll_wait
+#define SERVER_MAX_EVENTS 256
+
+typedef struct server * server_t;
+
+// creates a server classifying with the k nearest images of train
+// (0-indexed as in knn_vote) by distance, on nthreads threads (including
+// the one calling server_run). train must outlive the server.
+// Returns SERVER_INVALID on invalid arguments or out of memory.
+server_t server_create(mnist_dataset_handle train, int k, distance_t distance,
+		int nthreads);
+
+// looks every image up in cache before classifying it, and adds the ones
+// classified (cache made for images of x*y bytes of the training set, or
+// CACHE_INVALID for no cache). cache must outlive the server; the server
+// doesn't free it. Not while server_run runs.
+// Returns false if s is SERVER_INVALID.
+bool server_set_cache(server_t s, cache_t cache);
+
+// creates a Unix domain socket listening on path (replacing any file
+// there). Returns the socket, <0 on error.
+int server_listen(const char * path);
+
+// serves the clients connecting to listen_fd until server_stop.
+// Returns false if listen_fd is unusable or epoll fails.
+bool server_run(server_t s, int listen_fd);
+
+// makes server_run return once the requests being classified are
+// answered. Safe to call from another thread or a signal handler.
+void server_stop(server_t s);
+
+// closes every connection and frees s; not while server_run runs
+void server_free(server_t s);
+
+// connects to a server listening on path. Returns the socket, <0 on error.
+int server_connect(const char * path);
+
+// sends n images of size bytes each to the server on fd and stores their
+// labels in labels[]. Returns n, <0 on error (the connection is then in
+// an unknown state).
+int server_query(int fd, const unsigned char * imgs, int n, size_t size,
+		int labels[]);
+
+#endif
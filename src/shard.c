@@ -0,0 +1,516 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and MSG_NOSIGNAL
+#include "shard.h"
+#include "knn.h"
+#include "distance.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+//largest batch of queries or response either side accepts
+#define SHARD_MAX_MESSAGE (1u<<30)
+
+//convenience
+typedef unsigned char uchar;
+
+static void _put16(uchar * p, uint16_t v) {v = htons(v); memcpy(p, &v, 2);}
+static void _put32(uchar * p, uint32_t v) {v = htonl(v); memcpy(p, &v, 4);}
+static uint16_t _get16(const uchar * p) {uint16_t v; memcpy(&v, p, 2); return ntohs(v);}
+static uint32_t _get32(const uchar * p) {uint32_t v; memcpy(&v, p, 4); return ntohl(v);}
+
+static void _put_double(uchar * p, double d)
+{
+	uint64_t bits;
+	memcpy(&bits, &d, 8);
+	_put32(p, bits>>32);
+	_put32(p+4, bits & 0xffffffffu);
+}
+
+static double _get_double(const uchar * p)
+{
+	uint64_t bits = ((uint64_t) _get32(p)<<32) | _get32(p+4);
+	double d;
+	memcpy(&d, &bits, 8);
+	return d;
+}
+
+static bool _read_full(int fd, void * buf, size_t len)
+{
+	//false on EOF or error
+	uchar * p = buf;
+	while(len>0)
+	{
+		ssize_t r = read(fd, p, len);
+		if(r<0 && errno==EINTR) continue;
+		if(r<=0) return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static bool _write_full(int fd, const void * buf, size_t len)
+{
+	const uchar * p = buf;
+	while(len>0)
+	{
+		ssize_t r = send(fd, p, len, MSG_NOSIGNAL);
+		if(r<0 && errno==EINTR) continue;
+		if(r<=0) return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static double _now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+int shard_listen(const char * path)
+{
+	struct sockaddr_un addr;
+	if(!path || strlen(path)>=sizeof(addr.sun_path)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd<0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 16))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//what a shard needs to answer queries
+struct shard_data
+{
+	int num_imgs;
+	unsigned int x, y;
+	const uchar ** imgs;
+	int * train_labels;
+	double * distances;
+	int * labels;
+};
+
+static bool _append(uchar ** buf, size_t * len, size_t * cap, size_t more)
+{
+	//makes room for more bytes at the end of buf
+	if(*len+more<=*cap) return true;
+	size_t new_cap = *cap ? *cap : 4096;
+	while(new_cap<*len+more) new_cap *= 2;
+	uchar * p = realloc(*buf, new_cap);
+	if(!p) return false;
+	*buf = p;
+	*cap = new_cap;
+	return true;
+}
+
+static void _serve_connection(struct shard_data * s, int fd)
+{
+	//answers requests until the coordinator disconnects or sends 
+	// something malformed
+	char * names[] = DISTANCE_H_FUNCS;
+	uchar header[SHARD_REQUEST_HEADER_SIZE];
+	uchar * queries = NULL;
+	uchar * resp = NULL;
+	size_t resp_cap = 0;
+	while(_read_full(fd, header, SHARD_REQUEST_HEADER_SIZE))
+	{
+		int dist_ix = header[5];
+		int k = _get16(header+6);
+		uint32_t nqueries = _get32(header+8);
+		unsigned int x = _get16(header+12), y = _get16(header+14);
+		if(_get32(header)!=SHARD_MAGIC_NUM || header[4]!=SHARD_QUERY
+			|| dist_ix>=DISTANCE_H_NUM_FUNCS || x!=s->x || y!=s->y
+			|| nqueries>SHARD_MAX_MESSAGE/(x*y))
+		{
+			dprint("bad request, magic:%x", _get32(header));
+			break;
+		}
+		distance_t distance = create_distance_function(names[dist_ix]);
+		size_t size = x*y;
+		uchar * p = realloc(queries, nqueries*size);
+		if(nqueries && !p) break;
+		queries = p;
+		if(!_read_full(fd, queries, nqueries*size)) break;
+
+		size_t resp_len = SHARD_RESPONSE_HEADER_SIZE;
+		if(!_append(&resp, &resp_len, &resp_cap, 0)) break;
+		bool ok = true;
+		for(uint32_t q=0; q<nqueries && ok; q++)
+		{
+			for(int i=0; i<s->num_imgs; i++)
+			{
+				s->distances[i] = distance(queries+q*size, s->imgs[i], x, y);
+				s->labels[i] = s->train_labels[i];
+			}
+			int count = knn_candidates(s->distances, s->labels, s->num_imgs, k);
+			ok = _append(&resp, &resp_len, &resp_cap, 
+						4+(size_t) count*SHARD_CANDIDATE_SIZE);
+			if(!ok) break;
+			_put32(resp+resp_len, count);
+			resp_len += 4;
+			for(int c=0; c<count; c++)
+			{
+				_put_double(resp+resp_len, s->distances[c]);
+				resp[resp_len+8] = (uchar) s->labels[c];
+				resp_len += SHARD_CANDIDATE_SIZE;
+			}
+		}
+		if(!ok) break;
+		_put32(resp, SHARD_MAGIC_NUM);
+		_put32(resp+4, nqueries);
+		_put32(resp+8, resp_len-SHARD_RESPONSE_HEADER_SIZE);
+		if(!_write_full(fd, resp, resp_len)) break;
+	}
+	free(queries);
+	free(resp);
+}
+
+bool shard_serve(mnist_dataset_handle shard, int listen_fd)
+{
+	if(listen_fd<0 || shard==MNIST_DATASET_INVALID) return false;
+	struct shard_data s;
+	s.num_imgs = mnist_image_count(shard);
+	mnist_image_size(shard, &s.x, &s.y);
+	s.imgs = malloc((s.num_imgs+1)*sizeof(uchar *));
+	s.train_labels = malloc((s.num_imgs+1)*sizeof(int));
+	s.distances = malloc((s.num_imgs+1)*sizeof(double));
+	s.labels = malloc((s.num_imgs+1)*sizeof(int));
+	bool ok = s.imgs && s.train_labels && s.distances && s.labels;
+	mnist_image_handle img = mnist_image_begin(shard);
+	for(int i=0; ok && i<s.num_imgs; i++)
+	{
+		s.imgs[i] = mnist_image_data(img);
+		s.train_labels[i] = mnist_image_label(img);
+		img = mnist_image_next(img);
+	}
+	while(ok)
+	{
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd<0)
+		{
+			if(errno==EINTR || errno==ECONNABORTED) continue;
+			ok = false;
+			break;
+		}
+		_serve_connection(&s, fd);
+		close(fd);
+	}
+	free(s.imgs);
+	free(s.train_labels);
+	free(s.distances);
+	free(s.labels);
+	return ok;
+}
+
+struct shard_conn
+{
+	int fd; //<0: down
+	//request bytes sent so far
+	size_t sent;
+	uchar header[SHARD_RESPONSE_HEADER_SIZE];
+	uchar * resp;
+	size_t resp_len, got;
+	//offset in resp of the next query's candidates, while merging
+	size_t cursor;
+};
+
+struct shard_client
+{
+	int nshards;
+	int timeout_ms;
+	struct shard_conn * conns;
+	//merge buffers
+	double * distances;
+	int * labels;
+	size_t cap;
+};
+
+static void _shard_down(struct shard_conn * conn)
+{
+	dprint("shard fd %d is down", conn->fd);
+	if(conn->fd>=0) close(conn->fd);
+	conn->fd = -1;
+}
+
+static int _connect(const char * path)
+{
+	struct sockaddr_un addr;
+	if(!path || strlen(path)>=sizeof(addr.sun_path)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd<0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) 
+		|| fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+shard_client_t shard_connect(const char ** paths, int nshards, int timeout_ms)
+{
+	if(!paths || nshards<=0 || nshards>SHARD_MAX_SHARDS || timeout_ms<0) 
+		return SHARD_INVALID;
+	shard_client_t c = calloc(1, sizeof(struct shard_client));
+	if(!c) return SHARD_INVALID;
+	c->conns = calloc(nshards, sizeof(struct shard_conn));
+	if(!c->conns)
+	{
+		free(c);
+		return SHARD_INVALID;
+	}
+	c->nshards = nshards;
+	c->timeout_ms = timeout_ms;
+	for(int s=0; s<nshards; s++) c->conns[s].fd = _connect(paths[s]);
+	if(shard_alive(c)==0)
+	{
+		shard_close(c);
+		return SHARD_INVALID;
+	}
+	return c;
+}
+
+int shard_alive(const shard_client_t c)
+{
+	if(c==SHARD_INVALID) return -1;
+	int alive = 0;
+	for(int s=0; s<c->nshards; s++) alive += (c->conns[s].fd>=0);
+	return alive;
+}
+
+static bool _check_response(struct shard_conn * conn, uint32_t nqueries)
+{
+	//every query's candidate list fits exactly in the response
+	size_t off = 0;
+	for(uint32_t q=0; q<nqueries; q++)
+	{
+		if(off+4>conn->resp_len) return false;
+		size_t count = _get32(conn->resp+off);
+		off += 4;
+		if(count>(conn->resp_len-off)/SHARD_CANDIDATE_SIZE) return false;
+		off += count*SHARD_CANDIDATE_SIZE;
+	}
+	return off==conn->resp_len;
+}
+
+static void _receive(struct shard_conn * conn, uint32_t nqueries)
+{
+	//reads what is available of the response; the shard goes down on
+	// any error
+	while(conn->fd>=0)
+	{
+		bool in_header = conn->got<SHARD_RESPONSE_HEADER_SIZE;
+		uchar * dst = in_header ? conn->header+conn->got 
+						: conn->resp+conn->got-SHARD_RESPONSE_HEADER_SIZE;
+		size_t want = in_header ? SHARD_RESPONSE_HEADER_SIZE-conn->got 
+						: conn->resp_len+SHARD_RESPONSE_HEADER_SIZE-conn->got;
+		if(want==0) return;
+		ssize_t r = read(conn->fd, dst, want);
+		if(r<0 && errno==EINTR) continue;
+		if(r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+		if(r<=0)
+		{
+			_shard_down(conn);
+			return;
+		}
+		conn->got += r;
+		if(in_header && conn->got==SHARD_RESPONSE_HEADER_SIZE)
+		{
+			conn->resp_len = _get32(conn->header+8);
+			if(_get32(conn->header)!=SHARD_MAGIC_NUM 
+				|| _get32(conn->header+4)!=nqueries
+				|| conn->resp_len>SHARD_MAX_MESSAGE
+				|| !(conn->resp = malloc(conn->resp_len+1)))
+			{
+				_shard_down(conn);
+				return;
+			}
+		}
+	}
+}
+
+static bool _done(const struct shard_conn * conn)
+{
+	return conn->fd>=0 && conn->got>=SHARD_RESPONSE_HEADER_SIZE
+		&& conn->got==conn->resp_len+SHARD_RESPONSE_HEADER_SIZE;
+}
+
+static bool _scatter(shard_client_t c, const uchar * req, size_t req_len,
+					uint32_t nqueries)
+{
+	//sends the request to every shard and waits for their responses 
+	// until the timeout. Returns false if no shard answered.
+	struct pollfd fds[SHARD_MAX_SHARDS];
+	//shard of every entry of fds
+	int shards[SHARD_MAX_SHARDS];
+	double deadline = _now_ms()+c->timeout_ms;
+	while(true)
+	{
+		int nfds = 0;
+		for(int s=0; s<c->nshards; s++)
+		{
+			struct shard_conn * conn = &c->conns[s];
+			if(conn->fd<0 || _done(conn)) continue;
+			fds[nfds].fd = conn->fd;
+			fds[nfds].events = (conn->sent<req_len) ? POLLOUT : POLLIN;
+			fds[nfds].revents = 0;
+			shards[nfds++] = s;
+		}
+		if(nfds==0) break;
+		int wait = (int) (deadline-_now_ms());
+		int ready = (wait>0) ? poll(fds, nfds, wait) : 0;
+		if(ready<0 && errno==EINTR) continue;
+		if(ready<=0)
+		{
+			//timeout: the shards that haven't answered are dropped
+			for(int s=0; s<c->nshards; s++)
+				if(c->conns[s].fd>=0 && !_done(&c->conns[s]))
+					_shard_down(&c->conns[s]);
+			break;
+		}
+		for(int f=0; f<nfds; f++)
+		{
+			struct shard_conn * conn = &c->conns[shards[f]];
+			if(!fds[f].revents) continue;
+			if(conn->sent<req_len)
+			{
+				ssize_t r = send(conn->fd, req+conn->sent, req_len-conn->sent, 
+								MSG_NOSIGNAL);
+				if(r>0) conn->sent += r;
+				else if(r<0 && errno!=EAGAIN && errno!=EWOULDBLOCK 
+						&& errno!=EINTR) _shard_down(conn);
+			}
+			else _receive(conn, nqueries);
+			if(_done(conn) && !_check_response(conn, nqueries)) 
+				_shard_down(conn);
+		}
+	}
+	for(int s=0; s<c->nshards; s++)
+		if(_done(&c->conns[s])) return true;
+	return false;
+}
+
+int shard_classify(shard_client_t c, const unsigned char * imgs, int nqueries,
+		unsigned int x, unsigned int y, int k, const char * distance, int labels[])
+{
+	if(c==SHARD_INVALID || !imgs || nqueries<=0 || !distance || !labels) 
+		return -1;
+	if(k<0 || k>UINT16_MAX || x==0 || x>UINT16_MAX || y==0 || y>UINT16_MAX) 
+		return -1;
+	char * names[] = DISTANCE_H_FUNCS;
+	int dist_ix = -1;
+	for(int i=0; i<DISTANCE_H_NUM_FUNCS; i++)
+		if(strcmp(distance, names[i])==0) dist_ix = i;
+	if(dist_ix<0) return -1;
+
+	size_t size = x*y;
+	size_t req_len = SHARD_REQUEST_HEADER_SIZE+nqueries*size;
+	uchar * req = malloc(req_len);
+	if(!req) return -1;
+	_put32(req, SHARD_MAGIC_NUM);
+	req[4] = SHARD_QUERY;
+	req[5] = dist_ix;
+	_put16(req+6, k);
+	_put32(req+8, nqueries);
+	_put16(req+12, x);
+	_put16(req+14, y);
+	memcpy(req+SHARD_REQUEST_HEADER_SIZE, imgs, nqueries*size);
+	for(int s=0; s<c->nshards; s++)
+	{
+		c->conns[s].sent = 0;
+		c->conns[s].got = 0;
+		c->conns[s].resp_len = 0;
+		c->conns[s].cursor = 0;
+	}
+	bool answered = _scatter(c, req, req_len, nqueries);
+	free(req);
+
+	//gather: vote among the candidates of every shard that answered
+	int used = 0;
+	for(int s=0; s<c->nshards; s++) used += _done(&c->conns[s]);
+	for(int q=0; answered && q<nqueries; q++)
+	{
+		size_t n = 0;
+		for(int s=0; s<c->nshards; s++)
+		{
+			struct shard_conn * conn = &c->conns[s];
+			if(!_done(conn)) continue;
+			size_t count = _get32(conn->resp+conn->cursor);
+			conn->cursor += 4;
+			if(n+count>c->cap)
+			{
+				size_t cap = 2*(n+count);
+				double * d = realloc(c->distances, cap*sizeof(double));
+				if(d) c->distances = d;
+				int * l = realloc(c->labels, cap*sizeof(int));
+				if(l) c->labels = l;
+				if(!d || !l)
+				{
+					answered = false;
+					break;
+				}
+				c->cap = cap;
+			}
+			for(size_t i=0; i<count; i++)
+			{
+				c->distances[n] = _get_double(conn->resp+conn->cursor);
+				uchar l = conn->resp[conn->cursor+8];
+				c->labels[n] = (l==UINT8_MAX) ? LABEL_INVALID : l;
+				conn->cursor += SHARD_CANDIDATE_SIZE;
+				n++;
+			}
+		}
+		int vote_k = ((size_t) k<n) ? k : (int) n-1;
+		labels[q] = answered ? knn_vote(c->distances, c->labels, n, vote_k) 
+							: LABEL_INVALID;
+	}
+	for(int s=0; s<c->nshards; s++)
+	{
+		free(c->conns[s].resp);
+		c->conns[s].resp = NULL;
+	}
+	return answered ? used : -1;
+}
+
+void shard_close(shard_client_t c)
+{
+	if(c==SHARD_INVALID) return;
+	for(int s=0; s<c->nshards; s++)
+	{
+		if(c->conns[s].fd>=0) close(c->conns[s].fd);
+		free(c->conns[s].resp);
+	}
+	free(c->conns);
+	free(c->distances);
+	free(c->labels);
+	free(c);
+}
@@ -0,0 +1,70 @@
+#ifndef SHARD_H
+#define SHARD_H
+#include <stdbool.h>
+#include "mnist.h"
+/*
+Scatter-gather k-NN over a training set split across processes.
+
+Every shard process holds part of the training set and listens on a Unix
+domain socket (shard_listen, shard_serve). A coordinator connects to all
+the shards (shard_connect), sends each of them the same batch of queries,
+and every shard answers with its local k nearest candidates per query
+(knn_candidates: the k nearest plus ties). The coordinator votes among the
+union of the candidates with knn_vote, which gives the same label as a
+single process holding the whole training set.
+
+Protocol: every integer is in network byte order.
+  request:  uint32 SHARD_MAGIC_NUM, uint8 SHARD_QUERY, uint8 distance
+            (index in DISTANCE_H_FUNCS), uint16 k (0-indexed),
+            uint32 number of queries, uint16 x, uint16 y,
+            then x*y bytes per query.
+  response: uint32 SHARD_MAGIC_NUM, uint32 number of queries,
+            uint32 length of the rest, then for every query a uint32
+            number of candidates and for each candidate the bits of its
+            distance as a uint64 and its label as a uint8.
+A shard that doesn't answer a batch within the timeout, or sends anything
+malformed, is disconnected and the batch is voted without it.
+*/
+
+#define SHARD_INVALID NULL
+#define SHARD_MAGIC_NUM 0x53484431 //"SHD1"
+#define SHARD_QUERY 1
+#define SHARD_REQUEST_HEADER_SIZE 16
+#define SHARD_RESPONSE_HEADER_SIZE 12
+//bytes per candidate in a response
+#define SHARD_CANDIDATE_SIZE 9
+#define SHARD_MAX_SHARDS 256
+
+// creates a Unix domain socket listening on path (replacing any file
+// there). Returns the socket, <0 on error.
+int shard_listen(const char * path);
+
+// answers the requests of coordinators on the listening socket with the
+// candidates of the images of shard, one connection at a time, until
+// the process is killed. Returns false if listen_fd is unusable.
+bool shard_serve(mnist_dataset_handle shard, int listen_fd);
+
+typedef struct shard_client * shard_client_t;
+
+// connects to the shards listening on paths. Shards that can't be
+// reached are counted as down. timeout_ms is the time every shard gets
+// to answer a batch.
+// Returns SHARD_INVALID if no shard can be reached.
+shard_client_t shard_connect(const char ** paths, int nshards, int timeout_ms);
+
+// number of shards that are still up, <0 if c is SHARD_INVALID
+int shard_alive(const shard_client_t c);
+
+// classifies nqueries images of x*y bytes each, stored one after the
+// other in imgs, storing their labels in labels[]. k is 0-indexed as in
+// knn_data_best_label; if the shards that answered have fewer images
+// than k+1, all of them vote.
+// Returns the number of shards whose answers were used, <0 if the
+// arguments are invalid or no shard answered.
+int shard_classify(shard_client_t c, const unsigned char * imgs, int nqueries,
+		unsigned int x, unsigned int y, int k, const char * distance, int labels[]);
+
+// disconnects from every shard
+void shard_close(shard_client_t c);
+
+#endif
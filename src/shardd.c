@@ -0,0 +1,69 @@
+#include "shard.h"
+#include "mnist.h"
+#include <stdlib.h>
+#include <stdio.h>
+#define ERRMSG "Usage: ./shardd [name] [socket-path] [index] [count]\n"\
+				"Serves the images of the dataset name as one shard of a scatter-gather\n"\
+				"classification (see ./scatter) on the Unix socket socket-path.\n"\
+				"With index and count, only serves every count-th image starting\n"\
+				"at image index, so that count local processes can split one dataset."
+
+/*
+    Usage: ./shardd [name] [socket-path] [index] [count]
+*/
+
+int main (int argc, char ** args)
+{
+	if ((argc!=3) && (argc!=5))
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * name = args[1];
+	char * path = args[2];
+	int index = (argc==5) ? atoi(args[3]) : 0;
+	int count = (argc==5) ? atoi(args[4]) : 1;
+	if(count<=0 || index<0 || index>=count)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+
+	mnist_dataset_handle mdh = mnist_open(name);
+	if(mdh == MNIST_DATASET_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n", name, IMAGES, name, LABELS);
+		exit(EXIT_FAILURE);
+	}
+	if(count>1)
+	{
+		unsigned int x, y;
+		mnist_image_size(mdh, &x, &y);
+		mnist_dataset_handle shard = mnist_create(x, y);
+		mnist_image_handle last = MNIST_IMAGE_INVALID;
+		mnist_image_handle img = mnist_image_begin(mdh);
+		for(int i=0; img!=MNIST_IMAGE_INVALID; i++)
+		{
+			if(i%count==index)
+				last = mnist_image_add_after(shard, last, mnist_image_data(img),
+											x, y, mnist_image_label(img));
+			img = mnist_image_next(img);
+		}
+		mnist_free(mdh);
+		mdh = shard;
+	}
+
+	int fd = shard_listen(path);
+	if(fd<0)
+	{
+		printf("Can't listen on %s\n", path);
+		mnist_free(mdh);
+		exit(EXIT_FAILURE);
+	}
+	printf("serving %d images of %s on %s\n", mnist_image_count(mdh), name, path);
+	fflush(stdout);
+	shard_serve(mdh, fd);
+	printf("Can't accept connections on %s\n", path);
+	mnist_free(mdh);
+	return(EXIT_FAILURE);
+}
@@ -0,0 +1,427 @@
+#define _GNU_SOURCE // for O_DIRECT
+#include "stream.h"
+#include "knn.h"
+#include "mnist.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef dprint
+	#ifdef DEBUG
+	  #define dprint(fmt, ...) printf("debug: %s:"  fmt "\n", __func__, \
+	  				 __VA_ARGS__)
+	#else
+	  #define dprint(fmt, ...) do {} while(0)
+	#endif
+#endif
+
+//convenience
+typedef unsigned char uchar;
+
+struct stream_buf
+{
+	//STREAM_ALIGN aligned, buflen bytes
+	uchar * mem;
+	//first image of the chunk, somewhere in mem
+	const uchar * data;
+	uchar * labels;
+	//number of images, 0 at the end of the pass, <0 after a read error
+	int n;
+	//filled by the I/O thread and not yet released by the caller
+	bool full;
+};
+
+struct stream
+{
+	int imgfd, lblfd;
+	bool direct;
+	int count;
+	unsigned int x, y;
+	size_t size;
+	int chunk, nchunks;
+	size_t buflen;
+	struct stream_buf bufs[2];
+
+	pthread_t io;
+	//an I/O thread is running (a pass has started)
+	bool running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	//asks the I/O thread to stop
+	bool stop;
+	//chunk the caller gets next, buffer it holds (-1: none)
+	int next;
+	int held;
+};
+
+static bool _pread_full(int fd, void * buf, size_t len, off_t off, size_t * got)
+{
+	//reads len bytes at off, or up to the end of the file. Sets *got.
+	size_t done = 0;
+	while(done<len)
+	{
+		ssize_t r = pread(fd, (uchar *) buf+done, len-done, off+done);
+		if(r<0 && errno==EINTR) continue;
+		if(r<0) return false;
+		if(r==0) break;
+		done += r;
+	}
+	*got = done;
+	return true;
+}
+
+static int _read_chunk(stream_t s, struct stream_buf * b, int c)
+{
+	//reads chunk c into b: the STREAM_ALIGN aligned range of the image
+	// file around its images, and its labels. Returns the number of
+	// images, <0 on error.
+	int first = c*s->chunk;
+	int n = s->count-first<s->chunk ? s->count-first : s->chunk;
+	off_t off = IMG_HEADER_SIZE+(off_t) first*s->size;
+	off_t start = off & ~(off_t)(STREAM_ALIGN-1);
+	size_t need = (off-start)+n*s->size;
+	size_t len = (need+STREAM_ALIGN-1) & ~(size_t)(STREAM_ALIGN-1);
+	size_t got;
+	if(!_pread_full(s->imgfd, b->mem, len, start, &got) || got<need)
+		return -1;
+	b->data = b->mem+(off-start);
+	if(!_pread_full(s->lblfd, b->labels, n, LBL_HEADER_SIZE+(off_t) first, &got)
+		|| got<(size_t) n)
+		return -1;
+	dprint("chunk %d: %d images, %zu bytes at %lld", c, n, len, (long long) start);
+	return n;
+}
+
+static void * _io_thread(void * arg)
+{
+	//fills the buffers in turn, chunk after chunk, then marks the end
+	// of the pass with an empty chunk
+	stream_t s = arg;
+	for(int c=0; c<=s->nchunks; c++)
+	{
+		struct stream_buf * b = &s->bufs[c%2];
+		pthread_mutex_lock(&s->lock);
+		while(b->full && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+		bool stop = s->stop;
+		pthread_mutex_unlock(&s->lock);
+		if(stop) break;
+
+		int n = c<s->nchunks ? _read_chunk(s, b, c) : 0;
+
+		pthread_mutex_lock(&s->lock);
+		b->n = n;
+		b->full = true;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		if(n<=0) break;
+	}
+	return NULL;
+}
+
+static int _open_direct(const char * path)
+{
+	//reopens path with O_DIRECT if the file system supports it for our
+	// reads (tried on the first block). Returns the new descriptor, <0 if
+	// O_DIRECT can't be used.
+#ifdef O_DIRECT
+	int dfd = open(path, O_RDONLY | O_DIRECT);
+	if(dfd<0) return -1;
+	void * probe = NULL;
+	if(posix_memalign(&probe, STREAM_ALIGN, STREAM_ALIGN))
+	{
+		close(dfd);
+		return -1;
+	}
+	bool ok = pread(dfd, probe, STREAM_ALIGN, 0)>=0;
+	free(probe);
+	if(ok) return dfd;
+	close(dfd);
+#else
+	(void) path;
+#endif
+	return -1;
+}
+
+static bool _read_headers(stream_t s)
+{
+	//checks the headers as mnist_open does: magic numbers, matching
+	// counts, files long enough
+	uint32_t lbl[LBL_HEADER_SIZE/4], img[IMG_HEADER_SIZE/4];
+	size_t got;
+	struct stat lst, ist;
+	if(!_pread_full(s->lblfd, lbl, sizeof(lbl), 0, &got) || got<sizeof(lbl)
+		|| !_pread_full(s->imgfd, img, sizeof(img), 0, &got) || got<sizeof(img)
+		|| fstat(s->lblfd, &lst) || fstat(s->imgfd, &ist))
+		return false;
+	if(MY_NTOHL(lbl[MN_IX])!=LBL_MAGIC_NUM || MY_NTOHL(img[MN_IX])!=IMG_MAGIC_NUM)
+		return false;
+	uint64_t count = MY_NTOHL(lbl[NUM_IMG_IX]);
+	s->x = MY_NTOHL(img[X_IX]);
+	s->y = MY_NTOHL(img[Y_IX]);
+	s->size = (size_t) s->x*s->y;
+	if(count!=MY_NTOHL(img[NUM_IMG_IX]) || count>INT32_MAX || !s->size
+		|| (uint64_t) lst.st_size<LBL_HEADER_SIZE+count
+		|| (uint64_t) ist.st_size<IMG_HEADER_SIZE+count*s->size)
+		return false;
+	s->count = count;
+	return true;
+}
+
+stream_t stream_open(const char * name, int chunk, int flags)
+{
+	if(!name || chunk<=0)
+		return STREAM_INVALID;
+	stream_t s = calloc(1, sizeof(struct stream));
+	char * imgpath = malloc(strlen(name)+strlen(IMAGES)+1);
+	char * lblpath = malloc(strlen(name)+strlen(LABELS)+1);
+	if(!s || !imgpath || !lblpath)
+	{
+		free(s);
+		free(imgpath);
+		free(lblpath);
+		return STREAM_INVALID;
+	}
+	strcpy(imgpath, name);
+	strcat(imgpath, IMAGES);
+	strcpy(lblpath, name);
+	strcat(lblpath, LABELS);
+	s->imgfd = open(imgpath, O_RDONLY);
+	s->lblfd = open(lblpath, O_RDONLY);
+	bool ok = s->imgfd>=0 && s->lblfd>=0 && _read_headers(s);
+	if(ok && (flags & STREAM_DIRECT))
+	{
+		int dfd = _open_direct(imgpath);
+		if(dfd>=0)
+		{
+			close(s->imgfd);
+			s->imgfd = dfd;
+			s->direct = true;
+		}
+	}
+	free(imgpath);
+	free(lblpath);
+	if(ok && (size_t) chunk>(SIZE_MAX-2*STREAM_ALIGN)/s->size)
+		ok = false;
+
+	if(ok)
+	{
+		s->chunk = s->count<chunk && s->count ? s->count : chunk;
+		s->nchunks = (s->count+s->chunk-1)/s->chunk;
+		//a chunk's images plus the partial blocks at both ends
+		s->buflen = ((s->chunk*s->size+STREAM_ALIGN-1) & ~(size_t)(STREAM_ALIGN-1))
+					+ STREAM_ALIGN;
+		for(int i=0; i<2 && ok; i++)
+		{
+			void * mem = NULL;
+			ok = !posix_memalign(&mem, STREAM_ALIGN, s->buflen);
+			s->bufs[i].mem = mem;
+			s->bufs[i].labels = malloc(s->chunk);
+			ok = ok && s->bufs[i].labels;
+		}
+	}
+	if(!ok)
+	{
+		if(s->imgfd>=0) close(s->imgfd);
+		if(s->lblfd>=0) close(s->lblfd);
+		for(int i=0; i<2; i++)
+		{
+			free(s->bufs[i].mem);
+			free(s->bufs[i].labels);
+		}
+		free(s);
+		return STREAM_INVALID;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->held = -1;
+	dprint("%s: %d images in %d chunks of %d, direct=%d", name, s->count,
+			s->nchunks, s->chunk, s->direct);
+	return s;
+}
+
+static void _end_pass(stream_t s)
+{
+	//stops the I/O thread if it's still going, and resets the buffers
+	if(!s->running) return;
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->io, NULL);
+	s->running = false;
+	s->stop = false;
+	s->bufs[0].full = s->bufs[1].full = false;
+	s->next = 0;
+	s->held = -1;
+}
+
+void stream_rewind(stream_t s)
+{
+	if(s==STREAM_INVALID) return;
+	_end_pass(s);
+}
+
+int stream_next(stream_t s, const unsigned char ** data,
+				const unsigned char ** labels)
+{
+	if(s==STREAM_INVALID || !data || !labels)
+		return -1;
+	if(!s->running)
+	{
+		if(pthread_create(&s->io, NULL, _io_thread, s))
+			return -1;
+		s->running = true;
+	}
+	pthread_mutex_lock(&s->lock);
+	//hand the previous chunk's buffer back to the I/O thread
+	if(s->held>=0)
+	{
+		s->bufs[s->held].full = false;
+		s->held = -1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	struct stream_buf * b = &s->bufs[s->next%2];
+	while(!b->full)
+		pthread_cond_wait(&s->cond, &s->lock);
+	s->held = s->next%2;
+	s->next++;
+	int n = b->n;
+	pthread_mutex_unlock(&s->lock);
+	if(n<=0)
+	{
+		//end of the pass (or a read error): the thread has returned
+		_end_pass(s);
+		return n;
+	}
+	*data = b->data;
+	*labels = b->labels;
+	return n;
+}
+
+int stream_classify(stream_t s, const unsigned char * imgs, int nqueries,
+					int k, distance_t distance, int labels[])
+{
+	if(s==STREAM_INVALID || !imgs || nqueries<0 || k<0 || !distance || !labels)
+		return -1;
+	//the candidates of every query so far: the k nearest plus ties.
+	// Every chunk is voted on together with them in scratch, so memory
+	// is one chunk plus the candidates.
+	double ** cand_dist = calloc(nqueries, sizeof(double *));
+	int ** cand_labels = calloc(nqueries, sizeof(int *));
+	int * ncand = calloc(nqueries, sizeof(int));
+	int scratch_cap = k+1+s->chunk;
+	double * dist = malloc(scratch_cap*sizeof(double));
+	int * lbl = malloc(scratch_cap*sizeof(int));
+	int ret = 0;
+	if((nqueries && (!cand_dist || !cand_labels || !ncand)) || !dist || !lbl)
+		ret = -1;
+
+	stream_rewind(s);
+	const uchar * data, * chunk_labels;
+	int n;
+	while(!ret && (n=stream_next(s, &data, &chunk_labels))>0)
+	{
+		for(int q=0; q<nqueries && !ret; q++)
+		{
+			int m = ncand[q];
+			if(m+n>scratch_cap)
+			{
+				//more ties than k+1
+				double * d = realloc(dist, (m+n)*sizeof(double));
+				if(d) dist = d;
+				int * l = realloc(lbl, (m+n)*sizeof(int));
+				if(l) lbl = l;
+				if(!d || !l)
+				{
+					ret = -1;
+					break;
+				}
+				scratch_cap = m+n;
+			}
+			if(m)
+			{
+				memcpy(dist, cand_dist[q], m*sizeof(double));
+				memcpy(lbl, cand_labels[q], m*sizeof(int));
+			}
+			const uchar * query = imgs+(size_t) q*s->size;
+			for(int i=0; i<n; i++)
+			{
+				dist[m+i] = distance(query, data+i*s->size, s->x, s->y);
+				lbl[m+i] = chunk_labels[i];
+			}
+			int count = knn_candidates(dist, lbl, m+n, k);
+			if(count>m)
+			{
+				double * d = realloc(cand_dist[q], count*sizeof(double));
+				if(d) cand_dist[q] = d;
+				int * l = realloc(cand_labels[q], count*sizeof(int));
+				if(l) cand_labels[q] = l;
+				if(!d || !l)
+				{
+					ret = -1;
+					break;
+				}
+			}
+			memcpy(cand_dist[q], dist, count*sizeof(double));
+			memcpy(cand_labels[q], lbl, count*sizeof(int));
+			ncand[q] = count;
+		}
+	}
+	if(!ret && n<0) ret = -1;
+	stream_rewind(s);
+
+	for(int q=0; q<nqueries && !ret; q++)
+		labels[q] = ncand[q] ? knn_vote(cand_dist[q], cand_labels[q], ncand[q],
+									k<ncand[q] ? k : ncand[q]-1) : LABEL_INVALID;
+	for(int q=0; q<nqueries && cand_dist && cand_labels; q++)
+	{
+		free(cand_dist[q]);
+		free(cand_labels[q]);
+	}
+	free(cand_dist);
+	free(cand_labels);
+	free(ncand);
+	free(dist);
+	free(lbl);
+	return ret;
+}
+
+int stream_count(const stream_t s)
+{
+	return s==STREAM_INVALID ? -1 : s->count;
+}
+
+void stream_size(const stream_t s, unsigned int * x, unsigned int * y)
+{
+	*x = s==STREAM_INVALID ? 0 : s->x;
+	*y = s==STREAM_INVALID ? 0 : s->y;
+}
+
+bool stream_direct(const stream_t s)
+{
+	return s!=STREAM_INVALID && s->direct;
+}
+
+void stream_close(stream_t s)
+{
+	if(s==STREAM_INVALID) return;
+	_end_pass(s);
+	close(s->imgfd);
+	close(s->lblfd);
+	for(int i=0; i<2; i++)
+	{
+		free(s->bufs[i].mem);
+		free(s->bufs[i].labels);
+	}
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
@@ -0,0 +1,69 @@
+#ifndef STREAM_H
+#define STREAM_H
+#include <stdbool.h>
+#include "distance.h"
+/*
+Out-of-core scan of a dataset in the MNIST file format, for training sets
+that don't fit in memory.
+
+The images are read in chunks of a fixed number of images by a background
+I/O thread into two rotating buffers: while the caller works on one chunk
+(stream_next), the thread reads the next one into the other buffer, so
+disk and compute overlap and memory use is two chunks whatever the size of
+the file. Reads are large, STREAM_ALIGN aligned preads, with O_DIRECT when
+asked for and the file system supports it (the page cache is bypassed, so
+a scan doesn't evict everything else), plain preads otherwise.
+
+stream_classify runs k-NN for a batch of queries in one pass over the
+file: every chunk is reduced to each query's knn_candidates, which are
+voted on at the end with knn_vote - the same labels as knn_data_best_label
+over the whole dataset.
+*/
+
+#define STREAM_INVALID NULL
+//flags of stream_open
+#define STREAM_DIRECT 1 // read with O_DIRECT if possible
+//alignment of the reads (offset, length and buffer); enough for O_DIRECT
+// on the usual block sizes
+#define STREAM_ALIGN 4096
+
+typedef struct stream * stream_t;
+
+// opens the dataset name (name-images-idx3-ubyte, name-labels-idx1-ubyte
+// as for mnist_open) for scanning chunk images at a time. The headers are
+// checked as by mnist_open; nothing else is read until stream_next.
+// Returns STREAM_INVALID on error.
+stream_t stream_open(const char * name, int chunk, int flags);
+
+// stops the I/O thread and frees everything
+void stream_close(stream_t s);
+
+// number of images (<0 if s is STREAM_INVALID), size of the images
+int stream_count(const stream_t s);
+void stream_size(const stream_t s, unsigned int * x, unsigned int * y);
+
+// true if the reads bypass the page cache (O_DIRECT)
+bool stream_direct(const stream_t s);
+
+// waits for the next chunk of the current pass over the file, starting a
+// new pass if there is none. Sets *data to its images (x*y bytes each,
+// one after the other) and *labels to their labels, which stay valid
+// until the next call, and returns the number of images in the chunk.
+// Returns 0 at the end of the pass (the next call starts a new one) and
+// <0 if a read failed or s is STREAM_INVALID.
+int stream_next(stream_t s, const unsigned char ** data,
+				const unsigned char ** labels);
+
+// abandons the current pass: the next stream_next starts from the first
+// image.
+void stream_rewind(stream_t s);
+
+// classifies nqueries images of x*y bytes each, stored one after the
+// other in imgs, with one pass over the dataset, storing their labels in
+// labels[]. k is 0-indexed as in knn_data_best_label; if the dataset has
+// fewer than k+1 images, all of them vote.
+// Returns 0, <0 if the arguments are invalid or a read failed.
+int stream_classify(stream_t s, const unsigned char * imgs, int nqueries,
+					int k, distance_t distance, int labels[]);
+
+#endif
@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+#include "stream.h"
+#include "knn.h"
+#include "mnist.h"
+#include "distance.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#define ERRMSG "Usage: ./streamknn [train-name] [test-name] [k] [distance-scheme] [chunk] [batch] [direct]\n"\
+				"Classifies the images of test-name without loading train-name: every\n"\
+				"batch of test images is classified with one pass over the training\n"\
+				"files, read chunk images at a time by a background thread. direct is 1\n"\
+				"to read with O_DIRECT (bypassing the page cache), 0 otherwise.\n"\
+				"The following distance schemes are supported: \n" DISTANCE_H_LIB_DESC
+
+/*
+    Usage: ./streamknn [train-name] [test-name] [k] [distance-scheme] [chunk] [batch] [direct]
+*/
+
+int main (int argc, char ** args)
+{
+	if (argc!=8)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+	char * train_name = args[1];
+	char * test_name = args[2];
+	int k = atoi(args[3]);
+	distance_t distance = create_distance_function(args[4]);
+	int chunk = atoi(args[5]);
+	int batch = atoi(args[6]);
+	int direct = atoi(args[7]);
+	if(k<=0 || !distance || chunk<=0 || batch<=0)
+	{
+		puts(ERRMSG);
+		exit(EXIT_FAILURE);
+	}
+
+	stream_t s = stream_open(train_name, chunk, direct ? STREAM_DIRECT : 0);
+	if(s == STREAM_INVALID)
+	{
+		printf("%s%s or %s%s cannot be opened.\n",
+			train_name, IMAGES, train_name, LABELS);
+		exit(EXIT_FAILURE);
+	}
+	mnist_dataset_handle test_mdh = mnist_open(test_name);
+	unsigned int x, y, tx, ty;
+	stream_size(s, &x, &y);
+	mnist_image_size(test_mdh, &tx, &ty);
+	if(test_mdh == MNIST_DATASET_INVALID || x!=tx || y!=ty)
+	{
+		printf("%s%s or %s%s cannot be opened, or its images aren't %ux%u.\n",
+			test_name, IMAGES, test_name, LABELS, x, y);
+		stream_close(s);
+		exit(EXIT_FAILURE);
+	}
+	printf("%d training images in chunks of %d, %s\n", stream_count(s), chunk,
+			stream_direct(s) ? "O_DIRECT" : "buffered");
+
+	unsigned char * imgs = malloc((size_t) batch*x*y);
+	int * expected = malloc(batch*sizeof(int));
+	int * labels = malloc(batch*sizeof(int));
+	int correct = 0, processed = 0, passes = 0;
+	int status = EXIT_SUCCESS;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mnist_image_handle img = mnist_image_begin(test_mdh);
+	while(img != MNIST_IMAGE_INVALID)
+	{
+		int n = 0;
+		for(; n<batch && img!=MNIST_IMAGE_INVALID; n++)
+		{
+			memcpy(imgs+(size_t) n*x*y, mnist_image_data(img), x*y);
+			expected[n] = mnist_image_label(img);
+			img = mnist_image_next(img);
+		}
+		if(stream_classify(s, imgs, n, k-1, distance, labels)<0)
+		{
+			printf("Can't read %s%s. Exiting\n", train_name, IMAGES);
+			status = EXIT_FAILURE;
+			break;
+		}
+		for(int i=0; i<n; i++) correct += (labels[i]==expected[i]);
+		processed += n;
+		passes++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+	if(status==EXIT_SUCCESS)
+		printf("[%s] %d/%d (%6.2f%%) in %d passes, %.2fs (%.1f MB/s scanned)\n",
+			args[4], correct, processed, 100.0*correct/processed, passes, secs,
+			(double) passes*stream_count(s)*x*y/secs/1e6);
+
+	free(imgs);
+	free(expected);
+	free(labels);
+	stream_close(s);
+	mnist_free(test_mdh);
+	return(status);
+}
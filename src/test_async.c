@@ -0,0 +1,209 @@
+#include "async.h"
+#include "knn.h"
+#include "mnist.h"
+#include "test_data.h"
+#include "distance.h"
+#include <CUnit/Basic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DATASET_X 	8
+#define DATASET_Y 	8
+#define NUM_IMGS 	300
+#define NUM_QUERIES 100
+#define NUM_SUBMITTERS 4
+#define NUM_THREADS 3
+
+static void _expected(mnist_dataset_handle train, mnist_dataset_handle test,
+		int k, distance_t distance, async_request_t reqs[], int expected[])
+{
+	//the requests for the images of test, and the labels they should get
+	mnist_image_handle img = mnist_image_begin(test);
+	knn_data_t knn = knn_data_create(img, train);
+	for(int q=0; q<NUM_QUERIES; q++, img=mnist_image_next(img))
+	{
+		reqs[q].img = mnist_image_data(img);
+		reqs[q].user = &expected[q];
+		knn_data_set_image(knn, img);
+		expected[q] = knn_data_best_label(knn, k, distance);
+	}
+	knn_data_free(knn);
+}
+
+static void test_async_create()
+{
+	mnist_dataset_handle mdh = test_tie_dataset(10, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle empty = mnist_create(DATASET_X, DATASET_Y);
+	distance_t distance = create_distance_function("euclid");
+	CU_ASSERT_EQUAL(async_create(empty, 0, distance, 1, 1, -1), ASYNC_INVALID);
+	CU_ASSERT_EQUAL(async_create(mdh, -1, distance, 1, 1, -1), ASYNC_INVALID);
+	CU_ASSERT_EQUAL(async_create(mdh, 0, NULL, 1, 1, -1), ASYNC_INVALID);
+	CU_ASSERT_EQUAL(async_create(mdh, 0, distance, 0, 1, -1), ASYNC_INVALID);
+	CU_ASSERT_EQUAL(async_create(mdh, 0, distance, 1, 0, -1), ASYNC_INVALID);
+	async_t a = async_create(mdh, 0, distance, 2, 4, -1);
+	CU_ASSERT_NOT_EQUAL_FATAL(a, ASYNC_INVALID);
+	async_request_t req = {NULL, NULL, 0, NULL}, * done[1];
+	CU_ASSERT_FALSE(async_submit(a, NULL));
+	CU_ASSERT_FALSE(async_submit(a, &req));
+	CU_ASSERT_FALSE(async_submit(ASYNC_INVALID, &req));
+	//nothing pending: doesn't wait
+	CU_ASSERT_EQUAL(async_complete(a, done, 1, true), 0);
+	CU_ASSERT_TRUE(async_complete(ASYNC_INVALID, done, 1, true)<0);
+	async_free(a);
+	async_free(ASYNC_INVALID);
+	mnist_free(mdh);
+	mnist_free(empty);
+}
+
+static void test_async_labels()
+{
+	//same labels as knn_data_best_label whatever the batching
+	mnist_dataset_handle train = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle test = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	char * names[] = {"euclid", "reduced"};
+	int ks[] = {0, 4, NUM_IMGS+10};
+	//max_batch, deadline
+	long settings[][2] = {{1, 0}, {7, 0}, {NUM_QUERIES, -1}, {64, 100000}};
+	async_request_t reqs[NUM_QUERIES], * done[NUM_QUERIES];
+	int expected[NUM_QUERIES];
+	for(int d=0; d<2; d++)
+		for(int j=0; j<3; j++)
+		{
+			distance_t distance = create_distance_function(names[d]);
+			_expected(train, test, ks[j]<NUM_IMGS ? ks[j] : NUM_IMGS-1,
+					distance, reqs, expected);
+			for(int s=0; s<4; s++)
+			{
+				async_t a = async_create(train, ks[j], distance, NUM_THREADS,
+										settings[s][0], settings[s][1]);
+				CU_ASSERT_NOT_EQUAL_FATAL(a, ASYNC_INVALID);
+				bool ok = true;
+				for(int q=0; q<NUM_QUERIES; q++) ok &= async_submit(a, &reqs[q]);
+				int n = 0;
+				while(n<NUM_QUERIES)
+				{
+					int got = async_complete(a, done+n, NUM_QUERIES-n, true);
+					if(got<=0) break;
+					n += got;
+				}
+				CU_ASSERT_EQUAL(n, NUM_QUERIES);
+				for(int q=0; q<n; q++)
+					ok &= done[q]->label==*(int *) done[q]->user;
+				//one thread submitting: completed in submission order
+				for(int q=0; q<n; q++) ok &= done[q]==&reqs[q];
+				CU_ASSERT_TRUE(ok);
+				CU_ASSERT_EQUAL(async_complete(a, done, NUM_QUERIES, false), 0);
+				async_free(a);
+			}
+		}
+	mnist_free(train);
+	mnist_free(test);
+}
+
+struct submitter
+{
+	async_t a;
+	async_request_t * reqs;
+	int n;
+	bool ok;
+};
+
+static void * _submit(void * arg)
+{
+	struct submitter * s = arg;
+	for(int q=0; q<s->n; q++) s->ok &= async_submit(s->a, &s->reqs[q]);
+	return NULL;
+}
+
+static void test_async_submitters()
+{
+	//several threads submitting at once, another collecting
+	mnist_dataset_handle train = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle test = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	distance_t distance = create_distance_function("euclid");
+	async_request_t reqs[NUM_QUERIES], * done[NUM_QUERIES];
+	int expected[NUM_QUERIES], seen[NUM_QUERIES] = {0};
+	_expected(train, test, 2, distance, reqs, expected);
+	async_t a = async_create(train, 2, distance, NUM_THREADS, 16, 50);
+	CU_ASSERT_NOT_EQUAL_FATAL(a, ASYNC_INVALID);
+	struct submitter subs[NUM_SUBMITTERS];
+	pthread_t threads[NUM_SUBMITTERS];
+	int per = NUM_QUERIES/NUM_SUBMITTERS;
+	for(int t=0; t<NUM_SUBMITTERS; t++)
+	{
+		subs[t] = (struct submitter) {a, reqs+t*per, per, true};
+		CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[t], NULL, _submit, &subs[t]), 0);
+	}
+	int n = 0;
+	bool ok = true;
+	while(n<NUM_SUBMITTERS*per)
+	{
+		int got = async_complete(a, done, NUM_QUERIES, true);
+		for(int i=0; i<got; i++)
+		{
+			ok &= done[i]->label==*(int *) done[i]->user;
+			seen[done[i]-reqs]++;
+		}
+		n += got;
+	}
+	for(int t=0; t<NUM_SUBMITTERS; t++)
+	{
+		pthread_join(threads[t], NULL);
+		ok &= subs[t].ok;
+	}
+	for(int q=0; q<NUM_SUBMITTERS*per; q++) ok &= seen[q]==1;
+	CU_ASSERT_TRUE(ok);
+
+	//async_free finishes what was submitted
+	for(int q=0; q<NUM_QUERIES; q++) reqs[q].label = LABEL_INVALID;
+	for(int q=0; q<NUM_QUERIES; q++) ok &= async_submit(a, &reqs[q]);
+	async_free(a);
+	for(int q=0; q<NUM_QUERIES; q++) ok &= reqs[q].label==expected[q];
+	CU_ASSERT_TRUE(ok);
+	mnist_free(train);
+	mnist_free(test);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "async_create()\n", test_async_create))
+       || (NULL == CU_add_test(pSuite, "async labels\n", test_async_labels))
+       || (NULL == CU_add_test(pSuite, "concurrent submitters\n", test_async_submitters))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
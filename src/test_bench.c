@@ -0,0 +1,188 @@
+#define _POSIX_C_SOURCE 200809L // for fmemopen
+#include "bench.h"
+#include "mnist.h"
+#include <CUnit/Basic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void test_bench_median()
+{
+	double odd[] = {5, 1, 4, 2, 3};
+	CU_ASSERT_DOUBLE_EQUAL(bench_median(odd, 5), 3, 1e-12);
+	double even[] = {4, 1, 3, 2};
+	CU_ASSERT_DOUBLE_EQUAL(bench_median(even, 4), 2.5, 1e-12);
+	CU_ASSERT_DOUBLE_EQUAL(bench_median(NULL, 0), 0, 1e-12);
+	//an outlier moves neither the median nor the MAD
+	double x[] = {10, 11, 9, 10, 1000, 10, 12};
+	double m = bench_median(x, 7);
+	CU_ASSERT_DOUBLE_EQUAL(m, 10, 1e-12);
+	CU_ASSERT_DOUBLE_EQUAL(bench_mad(x, 7, m), 1, 1e-12);
+	double same[] = {2, 2, 2};
+	CU_ASSERT_DOUBLE_EQUAL(bench_mad(same, 3, 2), 0, 1e-12);
+}
+
+struct counter
+{
+	int setups, calls;
+	bool ordered;
+};
+
+static void _setup(void * arg)
+{
+	struct counter * c = arg;
+	c->ordered &= c->setups==c->calls;
+	c->setups++;
+}
+
+static void _call(void * arg)
+{
+	struct counter * c = arg;
+	c->ordered &= c->setups==c->calls+1;
+	c->calls++;
+}
+
+static void test_bench_run()
+{
+	bench_options_t opts = {2, 5, -1, false};
+	struct counter c = {0, 0, true};
+	bench_stats_t s = bench_run(&opts, _setup, _call, &c);
+	CU_ASSERT_EQUAL(s.reps, 5);
+	CU_ASSERT_EQUAL(c.calls, 7);
+	CU_ASSERT_EQUAL(c.setups, 7);
+	CU_ASSERT_TRUE(c.ordered);
+	CU_ASSERT_TRUE(s.min>=0 && s.min<=s.median && s.median<=s.max && s.mad>=0);
+	c = (struct counter) {0, 0, true};
+	s = bench_run(&opts, NULL, _call, &c);
+	CU_ASSERT_EQUAL(c.calls, 7);
+	CU_ASSERT_EQUAL(c.setups, 0);
+}
+
+static void test_bench_options()
+{
+	char * argv[] = {"bench", "-w", "1", "-r", "9", "-c", "-1", "-j", "data", NULL};
+	bench_options_t opts;
+	optind = 1;
+	CU_ASSERT_EQUAL(bench_options(9, argv, &opts), 8);
+	CU_ASSERT_EQUAL(opts.warmup, 1);
+	CU_ASSERT_EQUAL(opts.reps, 9);
+	CU_ASSERT_EQUAL(opts.cpu, -1);
+	CU_ASSERT_TRUE(opts.json);
+	char * defaults[] = {"bench", NULL};
+	optind = 1;
+	CU_ASSERT_EQUAL(bench_options(1, defaults, &opts), 1);
+	CU_ASSERT_EQUAL(opts.warmup, BENCH_WARMUP);
+	CU_ASSERT_EQUAL(opts.reps, BENCH_REPS);
+	CU_ASSERT_FALSE(opts.json);
+	char * bad[] = {"bench", "-r", "0", NULL};
+	optind = 1;
+	CU_ASSERT_TRUE(bench_options(3, bad, &opts)<0);
+}
+
+static void test_bench_synthetic()
+{
+	mnist_dataset_handle a = bench_synthetic(50, 28, 28, 7);
+	mnist_dataset_handle b = bench_synthetic(50, 28, 28, 7);
+	mnist_dataset_handle c = bench_synthetic(50, 28, 28, 8);
+	CU_ASSERT_NOT_EQUAL_FATAL(a, MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_count(a), 50);
+	bool same = true, other = false, labels = true;
+	mnist_image_handle ia = mnist_image_begin(a), ib = mnist_image_begin(b),
+					   ic = mnist_image_begin(c);
+	for(int i=0; i<50; i++)
+	{
+		same &= !memcmp(mnist_image_data(ia), mnist_image_data(ib), 28*28)
+				&& mnist_image_label(ia)==mnist_image_label(ib);
+		other |= memcmp(mnist_image_data(ia), mnist_image_data(ic), 28*28)!=0;
+		labels &= mnist_image_label(ia)>=0 && mnist_image_label(ia)<10;
+		ia = mnist_image_next(ia);
+		ib = mnist_image_next(ib);
+		ic = mnist_image_next(ic);
+	}
+	CU_ASSERT_TRUE(same);
+	CU_ASSERT_TRUE(other);
+	CU_ASSERT_TRUE(labels);
+	mnist_free(a);
+	mnist_free(b);
+	mnist_free(c);
+}
+
+static void test_bench_report()
+{
+	char buf[4096];
+	FILE * out = fmemopen(buf, sizeof(buf), "w");
+	CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+	bench_options_t opts = {1, 3, -1, true};
+	bench_report_t r;
+	bench_stats_t s = {3, 0.5, 0.01, 0.4, 0.6};
+	bench_report_begin(&r, out, "test", &opts);
+	bench_report(&r, "a\"b", "synthetic", s, 1000, "pairs", 2e9);
+	bench_report(&r, "c", "data\\x", s, 10, "images", 0);
+	bench_report_end(&r);
+	fclose(out);
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "{\"suite\": \"test\", \"warmup\": 1, \"reps\": 3"));
+	//escaped strings, rates, and a comma between the results only
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"name\": \"a\\\"b\""));
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"data\": \"data\\\\x\""));
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"items_per_s\": 2000"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"gb_per_s\": 4}"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"ns_per_item\": 500000,"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "},\n  {"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "}\n]}\n"));
+	CU_ASSERT_PTR_NULL(strstr(buf, "[,"));
+
+	out = fmemopen(buf, sizeof(buf), "w");
+	CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+	opts.json = false;
+	bench_report_begin(&r, out, "test", &opts);
+	bench_report(&r, "euclid", "synthetic", s, 1000, "pairs", 2e9);
+	bench_report_end(&r);
+	fclose(out);
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "2.00 kpairs/s"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(buf, "2.0%"));
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "bench_median(), bench_mad()\n", test_bench_median))
+       || (NULL == CU_add_test(pSuite, "bench_run()\n", test_bench_run))
+       || (NULL == CU_add_test(pSuite, "bench_options()\n", test_bench_options))
+       || (NULL == CU_add_test(pSuite, "bench_synthetic()\n", test_bench_synthetic))
+       || (NULL == CU_add_test(pSuite, "bench_report()\n", test_bench_report))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
@@ -0,0 +1,293 @@
+#include "cache.h"
+#include "mnist.h"
+#include <CUnit/Basic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DATASET_X 	28
+#define DATASET_Y 	28
+#define IMG_SIZE 	(DATASET_X*DATASET_Y)
+#define NUM_IMGS 	200
+#define NUM_THREADS 4
+
+static void _random_image(unsigned char img[IMG_SIZE])
+{
+	for(int p=0; p<IMG_SIZE; p++) img[p] = rand()%256;
+}
+
+static void test_cache_hash()
+{
+	unsigned char a[IMG_SIZE], b[IMG_SIZE];
+	srand(1);
+	_random_image(a);
+	memcpy(b, a, IMG_SIZE);
+	CU_ASSERT_EQUAL(cache_hash(a, IMG_SIZE), cache_hash(b, IMG_SIZE));
+	//a single bit anywhere, the tail included
+	bool ok = true;
+	for(int p=0; p<IMG_SIZE; p+=37)
+	{
+		b[p] ^= 1;
+		ok &= cache_hash(a, IMG_SIZE)!=cache_hash(b, IMG_SIZE);
+		b[p] ^= 1;
+	}
+	b[IMG_SIZE-1] ^= 0x80;
+	ok &= cache_hash(a, IMG_SIZE)!=cache_hash(b, IMG_SIZE);
+	CU_ASSERT_TRUE(ok);
+	//the length counts, zeros or not
+	unsigned char zeros[16] = {0};
+	CU_ASSERT_NOT_EQUAL(cache_hash(zeros, 15), cache_hash(zeros, 16));
+	CU_ASSERT_NOT_EQUAL(cache_hash(zeros, 0), cache_hash(zeros, 1));
+}
+
+static void test_cache_lookup()
+{
+	CU_ASSERT_EQUAL(cache_create(0, 10), CACHE_INVALID);
+	CU_ASSERT_EQUAL(cache_create(IMG_SIZE, 0), CACHE_INVALID);
+	CU_ASSERT_EQUAL(cache_lookup(CACHE_INVALID, NULL), CACHE_MISS);
+	cache_free(CACHE_INVALID);
+
+	cache_t c = cache_create(IMG_SIZE, NUM_IMGS);
+	CU_ASSERT_NOT_EQUAL_FATAL(c, CACHE_INVALID);
+	unsigned char imgs[8][IMG_SIZE];
+	srand(2);
+	for(int i=0; i<8; i++) _random_image(imgs[i]);
+	CU_ASSERT_EQUAL(cache_lookup(c, imgs[0]), CACHE_MISS);
+	for(int i=0; i<8; i++) cache_insert(c, imgs[i], i);
+	bool ok = true;
+	for(int i=0; i<8; i++) ok &= cache_lookup(c, imgs[i])==i;
+	CU_ASSERT_TRUE(ok);
+	//a copy of the image is kept
+	unsigned char copy[IMG_SIZE];
+	memcpy(copy, imgs[3], IMG_SIZE);
+	imgs[3][0] ^= 1;
+	CU_ASSERT_EQUAL(cache_lookup(c, imgs[3]), CACHE_MISS);
+	CU_ASSERT_EQUAL(cache_lookup(c, copy), 3);
+	//a new label replaces the old one
+	cache_insert(c, copy, 9);
+	CU_ASSERT_EQUAL(cache_lookup(c, copy), 9);
+	//invalid labels are ignored
+	cache_insert(c, imgs[3], -1);
+	cache_insert(c, imgs[3], 256);
+	CU_ASSERT_EQUAL(cache_lookup(c, imgs[3]), CACHE_MISS);
+
+	uint64_t hits, misses;
+	cache_stats(c, &hits, &misses);
+	CU_ASSERT_EQUAL(hits, 10);
+	CU_ASSERT_EQUAL(misses, 3);
+	cache_free(c);
+}
+
+static void test_cache_eviction()
+{
+	//a single set: never more than CACHE_WAYS images
+	cache_t c = cache_create(IMG_SIZE, 1);
+	CU_ASSERT_NOT_EQUAL_FATAL(c, CACHE_INVALID);
+	unsigned char imgs[CACHE_WAYS+1][IMG_SIZE];
+	srand(3);
+	for(int i=0; i<=CACHE_WAYS; i++) _random_image(imgs[i]);
+	for(int i=0; i<CACHE_WAYS; i++) cache_insert(c, imgs[i], i);
+	//hit 0 and 2: the clock evicts 1, the first that wasn't hit
+	CU_ASSERT_EQUAL(cache_lookup(c, imgs[0]), 0);
+	CU_ASSERT_EQUAL(cache_lookup(c, imgs[2]), 2);
+	cache_insert(c, imgs[CACHE_WAYS], CACHE_WAYS);
+	int found = 0;
+	for(int i=0; i<=CACHE_WAYS; i++) found += cache_lookup(c, imgs[i])==i;
+	CU_ASSERT_EQUAL(found, CACHE_WAYS);
+	CU_ASSERT_EQUAL(cache_lookup(c, imgs[1]), CACHE_MISS);
+	CU_ASSERT_EQUAL(cache_lookup(c, imgs[CACHE_WAYS]), CACHE_WAYS);
+	cache_free(c);
+
+	//many more images than the capacity
+	c = cache_create(IMG_SIZE, 16);
+	unsigned char img[IMG_SIZE];
+	srand(4);
+	for(int i=0; i<NUM_IMGS; i++)
+	{
+		_random_image(img);
+		cache_insert(c, img, i%10);
+	}
+	srand(4);
+	found = 0;
+	bool ok = true;
+	for(int i=0; i<NUM_IMGS; i++)
+	{
+		_random_image(img);
+		int label = cache_lookup(c, img);
+		if(label==CACHE_MISS) continue;
+		found++;
+		ok &= label==i%10;
+	}
+	CU_ASSERT_TRUE(ok);
+	CU_ASSERT_TRUE(found>0 && found<=16);
+	cache_free(c);
+}
+
+static mnist_dataset_handle _make_test_dataset(int n, int seed)
+{
+	mnist_dataset_handle mdh = mnist_create(DATASET_X,DATASET_Y);
+	mnist_image_handle img = mnist_image_begin(mdh);
+	srand(seed);
+	for(int i=0; i<n; i++)
+	{
+		unsigned char img_data[IMG_SIZE];
+		_random_image(img_data);
+		img = mnist_image_add_after(mdh, img, img_data,
+									DATASET_X, DATASET_Y, rand()%10);
+	}
+	return mdh;
+}
+
+static void test_cache_prefill()
+{
+	mnist_dataset_handle train = _make_test_dataset(NUM_IMGS, 5);
+	//a duplicate with a smaller and one with a larger label
+	//(copied: adding an image may move the others)
+	mnist_image_handle first = mnist_image_begin(train);
+	int label = mnist_image_label(first);
+	unsigned char copy[IMG_SIZE];
+	memcpy(copy, mnist_image_data(first), IMG_SIZE);
+	mnist_image_add_after(train, first, copy, DATASET_X, DATASET_Y, label+1);
+	if(label>0)
+		mnist_image_add_after(train, first, copy, DATASET_X, DATASET_Y, label-1);
+	int expected = label>0 ? label-1 : label;
+	mnist_dataset_handle other = mnist_create(DATASET_X+1, DATASET_Y);
+	//a dynamic part of one set, so everything found is prefilled
+	cache_t c = cache_create(IMG_SIZE, 1);
+	CU_ASSERT_FALSE(cache_prefill(c, other));
+	CU_ASSERT_FALSE(cache_prefill(c, MNIST_DATASET_INVALID));
+	CU_ASSERT_TRUE_FATAL(cache_prefill(c, train));
+	bool ok = true;
+	mnist_image_handle img = mnist_image_next(first);
+	for(; img!=MNIST_IMAGE_INVALID; img=mnist_image_next(img))
+		if(memcmp(mnist_image_data(img), mnist_image_data(first), IMG_SIZE))
+			ok &= cache_lookup(c, mnist_image_data(img))==mnist_image_label(img);
+	CU_ASSERT_TRUE(ok);
+	CU_ASSERT_EQUAL(cache_lookup(c, mnist_image_data(first)), expected);
+	//inserting doesn't override nor evict a prefilled image
+	cache_insert(c, copy, 9);
+	CU_ASSERT_EQUAL(cache_lookup(c, copy), expected);
+
+	//prefilling again adds to what's there, growing the table
+	mnist_dataset_handle more = _make_test_dataset(NUM_IMGS, 6);
+	CU_ASSERT_TRUE_FATAL(cache_prefill(c, more));
+	for(img=mnist_image_begin(more); img!=MNIST_IMAGE_INVALID; img=mnist_image_next(img))
+		ok &= cache_lookup(c, mnist_image_data(img))==mnist_image_label(img);
+	CU_ASSERT_TRUE(ok);
+	CU_ASSERT_EQUAL(cache_lookup(c, mnist_image_data(first)), expected);
+	unsigned char img_data[IMG_SIZE];
+	srand(7);
+	_random_image(img_data);
+	CU_ASSERT_EQUAL(cache_lookup(c, img_data), CACHE_MISS);
+	cache_free(c);
+	mnist_free(train);
+	mnist_free(more);
+	mnist_free(other);
+}
+
+struct worker
+{
+	cache_t c;
+	mnist_dataset_handle test;
+	int seed;
+	bool ok;
+};
+
+static void * _work(void * arg)
+{
+	//looks up and inserts the images of test in a random order: whatever
+	// is found has the right label
+	struct worker * w = arg;
+	int n = mnist_image_count(w->test);
+	unsigned int seed = w->seed;
+	const unsigned char * imgs[NUM_IMGS];
+	int labels[NUM_IMGS];
+	mnist_image_handle img = mnist_image_begin(w->test);
+	for(int i=0; i<n; i++, img=mnist_image_next(img))
+	{
+		imgs[i] = mnist_image_data(img);
+		labels[i] = mnist_image_label(img);
+	}
+	for(int r=0; r<10*n; r++)
+	{
+		seed = seed*1103515245+12345;
+		int i = (seed>>16)%n;
+		int label = cache_lookup(w->c, imgs[i]);
+		if(label==CACHE_MISS) cache_insert(w->c, imgs[i], labels[i]);
+		else w->ok &= label==labels[i];
+	}
+	return NULL;
+}
+
+static void test_cache_concurrent()
+{
+	mnist_dataset_handle test = _make_test_dataset(NUM_IMGS, 8);
+	//smaller than the images, so threads evict each other's
+	cache_t c = cache_create(IMG_SIZE, NUM_IMGS/2);
+	CU_ASSERT_NOT_EQUAL_FATAL(c, CACHE_INVALID);
+	struct worker workers[NUM_THREADS];
+	pthread_t threads[NUM_THREADS];
+	for(int t=0; t<NUM_THREADS; t++)
+	{
+		workers[t] = (struct worker) {c, test, t+1, true};
+		CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[t], NULL, _work, &workers[t]), 0);
+	}
+	bool ok = true;
+	for(int t=0; t<NUM_THREADS; t++)
+	{
+		pthread_join(threads[t], NULL);
+		ok &= workers[t].ok;
+	}
+	CU_ASSERT_TRUE(ok);
+	uint64_t hits, misses;
+	cache_stats(c, &hits, &misses);
+	CU_ASSERT_EQUAL(hits+misses, (uint64_t) NUM_THREADS*10*NUM_IMGS);
+	CU_ASSERT_TRUE(hits>0 && misses>=NUM_IMGS/2);
+	cache_free(c);
+	mnist_free(test);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "cache_hash()\n", test_cache_hash))
+       || (NULL == CU_add_test(pSuite, "cache_lookup()\n", test_cache_lookup))
+       || (NULL == CU_add_test(pSuite, "cache eviction\n", test_cache_eviction))
+       || (NULL == CU_add_test(pSuite, "cache_prefill()\n", test_cache_prefill))
+       || (NULL == CU_add_test(pSuite, "concurrent lookups\n", test_cache_concurrent))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
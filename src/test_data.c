@@ -0,0 +1,23 @@
+#include "test_data.h"
+#include <stdlib.h>
+
+mnist_dataset_handle test_tie_dataset(int n, unsigned int x, unsigned int y,
+									  int seed)
+{
+	mnist_dataset_handle mdh = mnist_create(x, y);
+	unsigned char * img_data = malloc((size_t) x*y);
+	if(!img_data)
+	{
+		mnist_free(mdh);
+		return MNIST_DATASET_INVALID;
+	}
+	mnist_image_handle img = mnist_image_begin(mdh);
+	srand(seed);
+	for(int i=0; i<n; i++)
+	{
+		for(size_t p=0; p<(size_t) x*y; p++) img_data[p] = (rand()%4)*60;
+		img = mnist_image_add_after(mdh, img, img_data, x, y, rand()%10);
+	}
+	free(img_data);
+	return mdh;
+}
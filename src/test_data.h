@@ -0,0 +1,15 @@
+#ifndef TEST_DATA_H
+#define TEST_DATA_H
+#include "mnist.h"
+/*
+Datasets shared by the unit tests of the modules built on knn.
+*/
+
+// n images of x*y and their labels (0 to 9), drawn with rand() after
+// srand(seed). The pixels take four values only, so there are many ties
+// between distances, which the results must break as knn does.
+// Returns MNIST_DATASET_INVALID if out of memory.
+mnist_dataset_handle test_tie_dataset(int n, unsigned int x, unsigned int y,
+									  int seed);
+
+#endif
@@ -0,0 +1,180 @@
+#include "hist.h"
+#include <CUnit/Basic.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_VALUES 100000
+#define NUM_READS 50
+
+static void test_hist_buckets()
+{
+	//every bucket starts where the previous one ends
+	bool ok = true;
+	for(int b=0; b<HIST_BUCKETS-1; b++)
+	{
+		ok &= hist_bucket_high(b)+1==hist_bucket_low(b+1);
+		ok &= hist_bucket(hist_bucket_low(b))==b && hist_bucket(hist_bucket_high(b))==b;
+	}
+	CU_ASSERT_TRUE(ok);
+	//exact below 2^(HIST_SUB_BITS+1), then within 1/2^HIST_SUB_BITS
+	CU_ASSERT_EQUAL(hist_bucket(0), 0);
+	CU_ASSERT_EQUAL(hist_bucket(63), 63);
+	CU_ASSERT_EQUAL(hist_bucket_low(hist_bucket(64)), 64);
+	CU_ASSERT_EQUAL(hist_bucket_low(hist_bucket(65)), 64);
+	for(uint64_t v=1; v<(1ull<<HIST_MAX_BITS); v=v*3+1)
+	{
+		int b = hist_bucket(v);
+		uint64_t width = hist_bucket_high(b)-hist_bucket_low(b)+1;
+		ok &= hist_bucket_low(b)<=v && v<=hist_bucket_high(b);
+		ok &= width*(1u<<HIST_SUB_BITS)<=v || width==1;
+	}
+	CU_ASSERT_TRUE(ok);
+	//too large: the last bucket
+	CU_ASSERT_EQUAL(hist_bucket(1ull<<HIST_MAX_BITS), HIST_BUCKETS-1);
+	CU_ASSERT_EQUAL(hist_bucket(UINT64_MAX), HIST_BUCKETS-1);
+	CU_ASSERT_EQUAL(hist_bucket_high(HIST_BUCKETS-1), UINT64_MAX);
+}
+
+static void test_hist_quantile()
+{
+	hist_t * h = calloc(1, sizeof(hist_t));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+	//zeroed is empty
+	CU_ASSERT_EQUAL(hist_count(h), 0);
+	CU_ASSERT_EQUAL(hist_quantile(h, 0.5), 0);
+	CU_ASSERT_EQUAL(hist_max(h), 0);
+	CU_ASSERT_DOUBLE_EQUAL(hist_mean(h), 0, 1e-12);
+
+	//1..1000: each quantile within the error of the exact one, not below
+	for(uint64_t v=1000; v>=1; v--) hist_record(h, v);
+	CU_ASSERT_EQUAL(hist_count(h), 1000);
+	CU_ASSERT_EQUAL(hist_max(h), 1000);
+	CU_ASSERT_DOUBLE_EQUAL(hist_mean(h), 500.5, 1e-9);
+	double qs[] = {0.5, 0.9, 0.99, 0.999};
+	for(int i=0; i<4; i++)
+	{
+		uint64_t exact = (uint64_t) (qs[i]*1000), v = hist_quantile(h, qs[i]);
+		CU_ASSERT_TRUE(v>=exact && v<=exact+exact/(1u<<HIST_SUB_BITS));
+	}
+	CU_ASSERT_EQUAL(hist_quantile(h, 1), 1000);
+	CU_ASSERT_EQUAL(hist_quantile(h, 0), 1);
+
+	//one outlier: the median doesn't move, the maximum is exact
+	hist_record(h, 123456789);
+	CU_ASSERT_EQUAL(hist_quantile(h, 1), 123456789);
+	CU_ASSERT_TRUE(hist_quantile(h, 0.5)<=520);
+	hist_clear(h);
+	CU_ASSERT_EQUAL(hist_count(h), 0);
+	CU_ASSERT_EQUAL(hist_quantile(h, 0.99), 0);
+	free(h);
+}
+
+static void test_hist_merge()
+{
+	hist_t * a = calloc(3, sizeof(hist_t)), * b = a+1, * all = a+2;
+	CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+	srand(1);
+	for(int i=0; i<NUM_VALUES; i++)
+	{
+		uint64_t v = rand()%1000000;
+		hist_record(i%2 ? a : b, v);
+		hist_record(all, v);
+	}
+	hist_t * merged = calloc(1, sizeof(hist_t));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(merged);
+	hist_merge(merged, a);
+	hist_merge(merged, b);
+	CU_ASSERT_EQUAL(hist_count(merged), NUM_VALUES);
+	CU_ASSERT_EQUAL(hist_max(merged), hist_max(all));
+	CU_ASSERT_DOUBLE_EQUAL(hist_mean(merged), hist_mean(all), 1e-6);
+	CU_ASSERT_EQUAL(memcmp(merged->buckets, all->buckets, sizeof(all->buckets)), 0);
+	free(merged);
+	free(a);
+}
+
+struct reader
+{
+	hist_t * h;
+	bool ok;
+};
+
+static void * _read(void * arg)
+{
+	//merges while the histogram is recorded into: never fewer values in
+	// the buckets than the count says, never a count going down
+	struct reader * r = arg;
+	hist_t * merged = malloc(sizeof(hist_t));
+	uint64_t last = 0;
+	for(int i=0; i<NUM_READS && merged; i++)
+	{
+		uint64_t count = hist_count(r->h);
+		r->ok &= count>=last;
+		last = count;
+		hist_clear(merged);
+		hist_merge(merged, r->h);
+		r->ok &= hist_count(merged)>=count;
+		r->ok &= hist_quantile(r->h, 0.99)<=hist_max(r->h) || !count;
+	}
+	free(merged);
+	return NULL;
+}
+
+static void test_hist_concurrent()
+{
+	hist_t * h = calloc(1, sizeof(hist_t));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+	struct reader r = {h, true};
+	pthread_t thread;
+	CU_ASSERT_EQUAL_FATAL(pthread_create(&thread, NULL, _read, &r), 0);
+	for(int i=0; i<NUM_VALUES; i++) hist_record(h, i);
+	pthread_join(thread, NULL);
+	CU_ASSERT_TRUE(r.ok);
+	CU_ASSERT_EQUAL(hist_count(h), NUM_VALUES);
+	free(h);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "hist_bucket()\n", test_hist_buckets))
+       || (NULL == CU_add_test(pSuite, "hist_quantile()\n", test_hist_quantile))
+       || (NULL == CU_add_test(pSuite, "hist_merge()\n", test_hist_merge))
+       || (NULL == CU_add_test(pSuite, "concurrent reads\n", test_hist_concurrent))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
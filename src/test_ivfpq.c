@@ -0,0 +1,187 @@
+#include "ivfpq.h"
+#include "knn.h"
+#include "mnist.h"
+#include <CUnit/Basic.h>
+#include <stdlib.h>
+#define TEST_OUTFILE "data/test_ivfpq"
+
+//data used in the tests: IMG_PER_LBL noisy copies of one pattern per
+// label. Each label lights up a different band of rows.
+#define DATASET_X 	28
+#define DATASET_Y 	28
+#define NUM_LABELS  10
+#define IMG_PER_LBL 30
+#define NOISE 		40
+
+static mnist_dataset_handle _make_test_dataset(void)
+{
+	mnist_dataset_handle mdh = mnist_create(DATASET_X,DATASET_Y);
+	mnist_image_handle img = mnist_image_begin(mdh);
+	srand(1);
+	for(int i=0; i<NUM_LABELS*IMG_PER_LBL; i++)
+	{
+		int label = i%NUM_LABELS;
+		unsigned char img_data[DATASET_X*DATASET_Y];
+		for(int p=0; p<DATASET_X*DATASET_Y; p++)
+		{
+			int row = p/DATASET_X;
+			int base = (row>=label*2 && row<label*2+8) ? 200 : 0;
+			int v = base + rand()%NOISE;
+			img_data[p] = v>255 ? 255 : v;
+		}
+		img = mnist_image_add_after(mdh, img, img_data, 
+									DATASET_X, DATASET_Y, label);
+	}
+	return mdh;
+}
+
+//percentage of the images of mdh that the index labels correctly
+static double _accuracy(ivfpq_t index, mnist_dataset_handle mdh, 
+						int k, int nprobe, int rerank)
+{
+	int correct = 0, n = mnist_image_count(mdh);
+	mnist_image_handle img = mnist_image_begin(mdh);
+	for(int i=0; i<n; i++)
+	{
+		int label = ivfpq_best_label(index, mnist_image_data(img), 
+									k, nprobe, rerank);
+		if(label==mnist_image_label(img)) correct++;
+		img = mnist_image_next(img);
+	}
+	return (double) correct/n*100;
+}
+
+static void test_ivfpq_train()
+{
+	//test normal dataset
+	mnist_dataset_handle mdh = _make_test_dataset();
+	ivfpq_t index = ivfpq_train(mdh, 4, 16);
+	CU_ASSERT_NOT_EQUAL_FATAL(index, IVFPQ_INVALID);
+	CU_ASSERT_EQUAL(ivfpq_count(index), 0);
+	ivfpq_free(index);
+
+	//test more sub-quantizers than pixels
+	CU_ASSERT_EQUAL(ivfpq_train(mdh, 4, DATASET_X*DATASET_Y+1), IVFPQ_INVALID);
+	//test invalid and empty datasets
+	CU_ASSERT_EQUAL(ivfpq_train(MNIST_DATASET_INVALID, 4, 16), IVFPQ_INVALID);
+	mnist_dataset_handle empty = mnist_create(DATASET_X,DATASET_Y);
+	CU_ASSERT_EQUAL(ivfpq_train(empty, 4, 16), IVFPQ_INVALID);
+	mnist_free(empty);
+	mnist_free(mdh);
+	//test invalid index
+	CU_ASSERT_TRUE(ivfpq_count(IVFPQ_INVALID)<0);
+	ivfpq_free(IVFPQ_INVALID);
+}
+
+static void test_ivfpq_add_file()
+{
+	mnist_dataset_handle mdh = _make_test_dataset();
+	CU_ASSERT_TRUE_FATAL(mnist_save(mdh, TEST_OUTFILE));
+	ivfpq_t index = ivfpq_train(mdh, 4, 16);
+	//test invalid file
+	CU_ASSERT_FALSE(ivfpq_add_file(index, "invalid"));
+	//test normal file
+	CU_ASSERT_TRUE(ivfpq_add_file(index, TEST_OUTFILE));
+	CU_ASSERT_EQUAL(ivfpq_count(index), NUM_LABELS*IMG_PER_LBL);
+	//only one file per index
+	CU_ASSERT_FALSE(ivfpq_add_file(index, TEST_OUTFILE));
+
+	//test file with different image size
+	unsigned char img_data[2*2] = {0};
+	mnist_dataset_handle small = mnist_create(2,2);
+	mnist_image_add_after(small, MNIST_IMAGE_INVALID, img_data, 2, 2, 1);
+	CU_ASSERT_TRUE_FATAL(mnist_save(small, TEST_OUTFILE));
+	ivfpq_free(index);
+	index = ivfpq_train(mdh, 4, 16);
+	CU_ASSERT_FALSE(ivfpq_add_file(index, TEST_OUTFILE));
+	ivfpq_free(index);
+	mnist_free(small);
+	mnist_free(mdh);
+}
+
+static void test_ivfpq_best_label()
+{
+	mnist_dataset_handle mdh = _make_test_dataset();
+	CU_ASSERT_TRUE_FATAL(mnist_save(mdh, TEST_OUTFILE));
+	ivfpq_t index = ivfpq_train(mdh, 4, 16);
+	CU_ASSERT_TRUE_FATAL(ivfpq_add_file(index, TEST_OUTFILE));
+
+	//every image has its own copy in the index, so re-ranking with all
+	// lists must find it.
+	CU_ASSERT_EQUAL(_accuracy(index, mdh, 0, 4, 10), 100.0);
+	//PQ distances only, and only the closest list
+	CU_ASSERT_TRUE(_accuracy(index, mdh, 4, 4, 0)>=90.0);
+	CU_ASSERT_TRUE(_accuracy(index, mdh, 4, 1, 0)>=90.0);
+
+	//training doesn't depend on rand(): the same sample gives the same
+	// lists and codes, so the same PQ-only labels
+	srand(2);
+	ivfpq_t again = ivfpq_train(mdh, 4, 16);
+	CU_ASSERT_TRUE_FATAL(ivfpq_add_file(again, TEST_OUTFILE));
+	bool same = true;
+	for(mnist_image_handle img = mnist_image_begin(mdh); 
+		img!=MNIST_IMAGE_INVALID; img = mnist_image_next(img))
+		same &= ivfpq_best_label(index, mnist_image_data(img), 0, 1, 0)==
+				ivfpq_best_label(again, mnist_image_data(img), 0, 1, 0);
+	CU_ASSERT_TRUE(same);
+	ivfpq_free(again);
+
+	//test invalid arguments
+	const unsigned char * data = mnist_image_data(mnist_image_begin(mdh));
+	CU_ASSERT_EQUAL(ivfpq_best_label(index, data, -1, 4, 0), LABEL_INVALID);
+	CU_ASSERT_EQUAL(ivfpq_best_label(index, data, 0, 0, 0), LABEL_INVALID);
+	CU_ASSERT_EQUAL(ivfpq_best_label(index, NULL, 0, 4, 0), LABEL_INVALID);
+	CU_ASSERT_EQUAL(ivfpq_best_label(IVFPQ_INVALID, data, 0, 4, 0), 
+					LABEL_INVALID);
+	//k larger than the number of candidates
+	CU_ASSERT_EQUAL(ivfpq_best_label(index, data, 5, 4, 5), LABEL_INVALID);
+	ivfpq_free(index);
+
+	//test index without images
+	index = ivfpq_train(mdh, 4, 16);
+	CU_ASSERT_EQUAL(ivfpq_best_label(index, data, 0, 4, 0), LABEL_INVALID);
+	ivfpq_free(index);
+	mnist_free(mdh);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "ivfpq_train()\n", test_ivfpq_train))
+       || (NULL == CU_add_test(pSuite, "ivfpq_add_file()\n", test_ivfpq_add_file))
+       || (NULL == CU_add_test(pSuite, "ivfpq_best_label()\n", test_ivfpq_best_label))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
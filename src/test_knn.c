@@ -1,7 +1,11 @@
 #include "knn.h"
 #include "mnist.h"
 #include "distance.h"
+#include "test_data.h"
 #include <CUnit/Basic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <limits.h>
 #include <errno.h>
 #include <float.h>
@@ -24,6 +28,7 @@
 #define IMG_SUM5	{0,1,2,2} //sum = 5, exactly halfway between two images groups
 #define IMG_SUM4	{0,1,1,2} // sum = 4, closer to lower label group
 #define IMG_SUM6	{0,1,2,3} //sum = 6, closer to higher label group
+#define TEST_ALIGNED "data/test_knn_aligned"
 
 
 static mnist_dataset_handle _make_test_dataset(unsigned char base_img[])
@@ -231,6 +236,34 @@ static void test_knn_data_create_free()
 }
 
 
+static void test_knn_data_set_image()
+{
+	//a reused knn_data gives the same labels as a new one
+	unsigned char base_img[] = BASE_IMG;
+	unsigned char offset_img[] = IMG_SUM6;
+	mnist_dataset_handle train_mdh =_make_test_dataset(offset_img);
+	mnist_dataset_handle test_mdh = _make_test_dataset(base_img);
+	mnist_image_handle train_img = mnist_image_begin(train_mdh);
+	distance_t distance = create_distance_function("reduced");
+	knn_data_t reused = knn_data_create(train_img, test_mdh);
+	for(int i=0;i<mnist_image_count(train_mdh);i++)
+	{
+		knn_data_t knn = knn_data_create(train_img, test_mdh);
+		CU_ASSERT_TRUE_FATAL(knn_data_set_image(reused, train_img));
+		CU_ASSERT_EQUAL_FATAL(knn_data_best_label(reused, 2, distance),
+							knn_data_best_label(knn, 2, distance));
+		knn_data_free(knn);
+		train_img = mnist_image_next(train_img);
+	}
+	//test invalid
+	CU_ASSERT_FALSE(knn_data_set_image(reused, MNIST_IMAGE_INVALID));
+	CU_ASSERT_FALSE(knn_data_set_image(KNN_INVALID, 
+					mnist_image_begin(train_mdh)));
+	knn_data_free(reused);
+	mnist_free(train_mdh);
+	mnist_free(test_mdh);
+}
+
 static void test_knn_data_get_distances()
 {
 	//test normal dataset
@@ -254,6 +287,17 @@ static void test_knn_data_get_distances()
 		// printf("%f\t%f\n", distances[i], expected_dist);
 		CU_ASSERT_EQUAL_FATAL(distances[i], expected_dist);
 	}
+	//the labels go with the distances, and select and vote as
+	// knn_data_best_label does
+	int * labels = knn_data_get_labels(knn);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(labels);
+	for(int i = 0; i < NUM_LABELS * IMG_PER_LBL; i++)
+		CU_ASSERT_EQUAL_FATAL(labels[i], i/IMG_PER_LBL);
+	int n = knn_candidates(distances, labels, NUM_LABELS*IMG_PER_LBL, 5);
+	CU_ASSERT_TRUE(n>5);
+	int label = knn_vote(distances, labels, n, 5);
+	CU_ASSERT_EQUAL(label, knn_data_best_label(knn, 5, distance));
+	CU_ASSERT_PTR_NULL(knn_data_get_labels(KNN_INVALID));
 
 	knn_data_free(knn);
 	mnist_free(train_mdh);
@@ -481,6 +525,496 @@ static void test_knn_data_best_label()
 
 }
 
+static void test_knn_data_best_label_loo()
+{
+	//test with two different images: leaving one out, the
+	// other one is the only neighbor.
+	{
+		unsigned char img1[] = BASE_IMG;
+		unsigned char img2[] = IMG_SUM6;
+		mnist_dataset_handle mdh = mnist_create(DATASET_X,DATASET_Y);
+		mnist_image_handle first = mnist_image_add_after(mdh, 
+					MNIST_IMAGE_INVALID, img1, DATASET_X, DATASET_Y, 1);
+		mnist_image_add_after(mdh, first, img2, DATASET_X, DATASET_Y, 2);
+		distance_t distance = create_distance_function("reduced");
+
+		knn_data_t knn = knn_data_create(first, mdh);
+		CU_ASSERT_EQUAL(knn_data_best_label(knn, 0, distance), 1);
+		knn_data_free(knn);
+		knn = knn_data_create(first, mdh);
+		CU_ASSERT_EQUAL(knn_data_best_label_loo(knn, 0, distance), 2);
+		knn_data_free(knn);
+		//k must leave room for the left out image
+		knn = knn_data_create(first, mdh);
+		CU_ASSERT_EQUAL(knn_data_best_label_loo(knn, 1, distance), 
+						LABEL_INVALID);
+		knn_data_free(knn);
+		mnist_free(mdh);
+	}
+	//test normal dataset against itself: the other images of the 
+	// same label are still the closest.
+	{
+		unsigned char base_img[] = BASE_IMG;
+		mnist_dataset_handle mdh = _make_test_dataset(base_img);
+		mnist_image_handle img = mnist_image_begin(mdh);
+		distance_t distance = create_distance_function("reduced");
+		for(int i=0;i<mnist_image_count(mdh);i++)
+		{
+			knn_data_t knn = knn_data_create(img, mdh);
+			CU_ASSERT_EQUAL_FATAL(knn_data_best_label_loo(knn, 1, distance), 
+						mnist_image_label(img));
+			knn_data_free(knn);
+			img = mnist_image_next(img);
+		}
+		mnist_free(mdh);
+	}
+}
+
+static void test_knn_candidates()
+{
+	//the candidates are everything within the k-th smallest distance
+	double repeats[] = REPEATS;
+	int labels[] = SORTED;
+	int n = sizeof(repeats)/sizeof(repeats[0]);
+	//k=2: the 3 zeros
+	CU_ASSERT_EQUAL(knn_candidates(repeats, labels, n, 2), 3);
+	for(int i=0; i<3; i++) CU_ASSERT_EQUAL(repeats[i], 0);
+	//k=3: the zeros and all three ones
+	CU_ASSERT_EQUAL(knn_candidates(repeats, labels, n, 3), 6);
+	bool ok = true;
+	for(int i=0; i<6; i++) ok &= (repeats[i]<=1);
+	CU_ASSERT_TRUE(ok);
+	//every label travels with its distance
+	double same[] = SAME_VAL;
+	CU_ASSERT_EQUAL(knn_candidates(same, labels, n, 0), n);
+	//fewer than k+1 entries: all of them
+	CU_ASSERT_EQUAL(knn_candidates(same, labels, 4, 5), 4);
+	//a vote among the candidates of two halves is the vote of the whole
+	double dists[] = UNSORTED;
+	double half[] = UNSORTED;
+	int whole_labels[] = REPEATS;
+	int half_labels[] = REPEATS;
+	int a = knn_candidates(half, half_labels, n/2, 4);
+	int b = knn_candidates(half+n/2, half_labels+n/2, n-n/2, 4);
+	for(int i=0; i<b; i++)
+	{
+		half[a+i] = half[n/2+i];
+		half_labels[a+i] = half_labels[n/2+i];
+	}
+	CU_ASSERT_EQUAL(knn_vote(half, half_labels, a+b, 4), 
+					knn_vote(dists, whole_labels, n, 4));
+	//test invalid
+	CU_ASSERT_TRUE(knn_candidates(same, labels, -1, 0)<0);
+	CU_ASSERT_TRUE(knn_candidates(same, labels, n, -1)<0);
+}
+
+static bool _same_labels(mnist_dataset_handle train, mnist_dataset_handle test,
+						 const char * metric, int k)
+{
+	//the classifier agrees with knn_data_best_label on every image of test
+	knn_classifier_t c = knn_classifier_fit(train, metric, k);
+	if(c==KNN_CLASSIFIER_INVALID) return false;
+	distance_t distance = create_distance_function(metric);
+	int n = mnist_image_count(test);
+	int * labels = malloc(n*sizeof(int));
+	bool ok = knn_classifier_predict_batch(c, test, labels)==n;
+	mnist_image_handle img = mnist_image_begin(test);
+	knn_data_t knn = knn_data_create(img, train);
+	for(int i=0; i<n; i++, img=mnist_image_next(img))
+	{
+		knn_data_set_image(knn, img);
+		int expected = knn_data_best_label(knn, k, distance);
+		ok &= labels[i]==expected;
+		ok &= knn_classifier_predict(c, mnist_image_data(img))==expected;
+	}
+	knn_data_free(knn);
+	free(labels);
+	knn_classifier_free(c);
+	return ok;
+}
+
+static void test_knn_classifier()
+{
+	unsigned char base_img[] = BASE_IMG;
+	mnist_dataset_handle train_mdh = _make_test_dataset(base_img);
+	int n = mnist_image_count(train_mdh);
+	//test invalid
+	mnist_dataset_handle empty = mnist_create(DATASET_X, DATASET_Y);
+	CU_ASSERT_EQUAL(knn_classifier_fit(empty, "euclid", 0), KNN_CLASSIFIER_INVALID);
+	CU_ASSERT_EQUAL(knn_classifier_fit(train_mdh, NULL, 0), KNN_CLASSIFIER_INVALID);
+	CU_ASSERT_EQUAL(knn_classifier_fit(train_mdh, "nope", 0), KNN_CLASSIFIER_INVALID);
+	CU_ASSERT_EQUAL(knn_classifier_fit(train_mdh, "euclid", -1), KNN_CLASSIFIER_INVALID);
+	CU_ASSERT_EQUAL(knn_classifier_fit(train_mdh, "euclid", n), KNN_CLASSIFIER_INVALID);
+	CU_ASSERT_EQUAL(knn_classifier_predict(KNN_CLASSIFIER_INVALID, base_img), LABEL_INVALID);
+	knn_classifier_t c = knn_classifier_fit(train_mdh, "reduced", 0);
+	CU_ASSERT_EQUAL(knn_classifier_predict(c, NULL), LABEL_INVALID);
+	int label;
+	CU_ASSERT_TRUE(knn_classifier_predict_batch(c, MNIST_DATASET_INVALID, &label)<0);
+	mnist_dataset_handle wide = mnist_create(DATASET_X+1, DATASET_Y);
+	unsigned char wide_img[(DATASET_X+1)*DATASET_Y] = {0};
+	mnist_image_add_after(wide, mnist_image_begin(wide), wide_img, 
+						  DATASET_X+1, DATASET_Y, 0);
+	CU_ASSERT_TRUE(knn_classifier_predict_batch(c, wide, &label)<0);
+	CU_ASSERT_EQUAL(knn_classifier_predict_batch(c, empty, &label), 0);
+	knn_classifier_free(c);
+	knn_classifier_free(KNN_CLASSIFIER_INVALID);
+
+	//the images halfway between label groups, every k
+	char * metrics[] = {"euclid", "reduced"};
+	unsigned char ties[][DATASET_X*DATASET_Y] = {IMG_SUM4, IMG_SUM5, IMG_SUM6};
+	mnist_dataset_handle tie_mdh = mnist_create(DATASET_X, DATASET_Y);
+	mnist_image_handle img = mnist_image_begin(tie_mdh);
+	for(int i=0; i<3; i++)
+		img = mnist_image_add_after(tie_mdh, img, ties[i], DATASET_X, DATASET_Y, 0);
+	bool ok = true;
+	for(int m=0; m<2; m++)
+		for(int k=0; k<n; k++)
+		{
+			ok &= _same_labels(train_mdh, tie_mdh, metrics[m], k);
+			ok &= _same_labels(train_mdh, train_mdh, metrics[m], k);
+		}
+	CU_ASSERT_TRUE(ok);
+
+	//random images with many ties
+	mnist_dataset_handle rand_train = test_tie_dataset(500, 6, 6, 1);
+	mnist_dataset_handle rand_test = test_tie_dataset(100, 6, 6, 2);
+	int ks[] = {0, 1, 4, 10, 499};
+	ok = true;
+	for(int m=0; m<2; m++)
+		for(int j=0; j<5; j++)
+			ok &= _same_labels(rand_train, rand_test, metrics[m], ks[j]);
+	CU_ASSERT_TRUE(ok);
+
+	//an aligned dataset: the keys are its stored norms and sums
+	CU_ASSERT_TRUE_FATAL(mnist_save_aligned(rand_train, TEST_ALIGNED));
+	mnist_dataset_handle aligned = mnist_open(TEST_ALIGNED);
+	CU_ASSERT_NOT_EQUAL_FATAL(aligned, MNIST_DATASET_INVALID);
+	ok = true;
+	for(int m=0; m<2; m++)
+		for(int j=0; j<4; j++)
+			ok &= _same_labels(aligned, rand_test, metrics[m], ks[j]);
+	CU_ASSERT_TRUE(ok);
+	mnist_free(aligned);
+	remove(TEST_ALIGNED ALIGNED);
+
+	mnist_free(rand_train);
+	mnist_free(rand_test);
+	mnist_free(tie_mdh);
+	mnist_free(wide);
+	mnist_free(empty);
+	mnist_free(train_mdh);
+}
+
+#define UPD_SIZE 6
+#define TEST_SNAPSHOT "data/test_snapshot"
+#define UPD_TRAIN 200
+#define UPD_OPS 600
+
+struct updates
+{
+	//every image the classifier has seen, by id, and which are removed
+	unsigned char imgs[UPD_TRAIN+UPD_OPS][UPD_SIZE*UPD_SIZE];
+	int labels[UPD_TRAIN+UPD_OPS];
+	bool dead[UPD_TRAIN+UPD_OPS];
+	int num_ids;
+};
+
+static void _random_update(knn_classifier_t c, struct updates * u, bool * ok)
+{
+	//inserts a random image, or removes a random one still there
+	if(rand()%3)
+	{
+		unsigned char * img = u->imgs[u->num_ids];
+		for(int p=0; p<UPD_SIZE*UPD_SIZE; p++) img[p] = (rand()%4)*85;
+		u->labels[u->num_ids] = rand()%10;
+		*ok &= knn_classifier_insert(c, img, u->labels[u->num_ids])==u->num_ids;
+		u->dead[u->num_ids++] = false;
+	}
+	else
+	{
+		int id = rand()%u->num_ids;
+		*ok &= knn_classifier_remove(c, id)==!u->dead[id];
+		u->dead[id] = true;
+	}
+}
+
+static bool _same_as_rebuilt(knn_classifier_t c, const struct updates * u,
+							 mnist_dataset_handle test, const char * metric, int k)
+{
+	//the classifier gives the labels of a dataset of the images still there
+	mnist_dataset_handle live = mnist_create(UPD_SIZE, UPD_SIZE);
+	mnist_image_handle img = mnist_image_begin(live);
+	int n = 0;
+	for(int id=0; id<u->num_ids; id++)
+		if(!u->dead[id])
+		{
+			img = mnist_image_add_after(live, img, u->imgs[id], UPD_SIZE, 
+										UPD_SIZE, u->labels[id]);
+			n++;
+		}
+	bool ok = knn_classifier_count(c)==n;
+	distance_t distance = create_distance_function(metric);
+	img = mnist_image_begin(test);
+	knn_data_t knn = knn_data_create(img, live);
+	for(; img!=MNIST_IMAGE_INVALID; img=mnist_image_next(img))
+	{
+		knn_data_set_image(knn, img);
+		int expected = n ? knn_data_best_label(knn, k, distance) : LABEL_INVALID;
+		ok &= knn_classifier_predict(c, mnist_image_data(img))==expected;
+	}
+	knn_data_free(knn);
+	mnist_free(live);
+	return ok;
+}
+
+static struct updates _updates;
+
+static void test_knn_classifier_updates()
+{
+	char * metrics[] = {"euclid", "reduced"};
+	int ks[] = {0, 4};
+	mnist_dataset_handle train = test_tie_dataset(UPD_TRAIN, UPD_SIZE, UPD_SIZE, 3);
+	mnist_dataset_handle test = test_tie_dataset(30, UPD_SIZE, UPD_SIZE, 4);
+	bool ok = true;
+	for(int m=0; m<2; m++)
+		for(int j=0; j<2; j++)
+		{
+			//the training set is ids 0 to n-1
+			struct updates * u = &_updates;
+			mnist_image_handle img = mnist_image_begin(train);
+			for(int i=0; i<UPD_TRAIN; i++, img=mnist_image_next(img))
+			{
+				memcpy(u->imgs[i], mnist_image_data(img), UPD_SIZE*UPD_SIZE);
+				u->labels[i] = mnist_image_label(img);
+				u->dead[i] = false;
+			}
+			u->num_ids = UPD_TRAIN;
+			knn_classifier_t c = knn_classifier_fit(train, metrics[m], ks[j]);
+			CU_ASSERT_NOT_EQUAL_FATAL(c, KNN_CLASSIFIER_INVALID);
+			srand(5);
+			for(int op=0; op<UPD_OPS; op++)
+			{
+				_random_update(c, u, &ok);
+				//now and then, with or without a compaction (the background
+				// one may have run any time)
+				if(op%150==149) ok &= _same_as_rebuilt(c, u, test, metrics[m], ks[j]);
+				if(op%200==199) ok &= knn_classifier_compact(c);
+			}
+			ok &= _same_as_rebuilt(c, u, test, metrics[m], ks[j]);
+			ok &= knn_classifier_compact(c);
+			ok &= _same_as_rebuilt(c, u, test, metrics[m], ks[j]);
+			knn_classifier_free(c);
+		}
+	CU_ASSERT_TRUE(ok);
+
+	//ids and invalid updates
+	knn_classifier_t c = knn_classifier_fit(train, "euclid", 0);
+	unsigned char img[UPD_SIZE*UPD_SIZE] = {0};
+	CU_ASSERT_EQUAL(knn_classifier_insert(c, img, 3), UPD_TRAIN);
+	CU_ASSERT_TRUE(knn_classifier_insert(c, NULL, 3)<0);
+	CU_ASSERT_TRUE(knn_classifier_insert(c, img, -1)<0);
+	CU_ASSERT_TRUE(knn_classifier_insert(KNN_CLASSIFIER_INVALID, img, 3)<0);
+	CU_ASSERT_EQUAL(knn_classifier_count(c), UPD_TRAIN+1);
+	CU_ASSERT_EQUAL(knn_classifier_predict(c, img), 3);
+	CU_ASSERT_TRUE(knn_classifier_remove(c, UPD_TRAIN));
+	CU_ASSERT_FALSE(knn_classifier_remove(c, UPD_TRAIN));
+	CU_ASSERT_FALSE(knn_classifier_remove(c, UPD_TRAIN+1));
+	CU_ASSERT_FALSE(knn_classifier_remove(c, -1));
+	CU_ASSERT_TRUE(knn_classifier_remove(c, 0));
+	CU_ASSERT_EQUAL(knn_classifier_count(c), UPD_TRAIN-1);
+	CU_ASSERT_TRUE(knn_classifier_count(KNN_CLASSIFIER_INVALID)<0);
+	CU_ASSERT_FALSE(knn_classifier_compact(KNN_CLASSIFIER_INVALID));
+	//no image left: nothing to vote on
+	for(int id=1; id<UPD_TRAIN; id++) knn_classifier_remove(c, id);
+	CU_ASSERT_EQUAL(knn_classifier_predict(c, img), LABEL_INVALID);
+	CU_ASSERT_TRUE(knn_classifier_compact(c));
+	CU_ASSERT_EQUAL(knn_classifier_predict(c, img), LABEL_INVALID);
+	CU_ASSERT_EQUAL(knn_classifier_insert(c, img, 7), UPD_TRAIN+1);
+	CU_ASSERT_EQUAL(knn_classifier_predict(c, img), 7);
+	knn_classifier_free(c);
+	mnist_free(train);
+	mnist_free(test);
+}
+
+struct updater
+{
+	knn_classifier_t c;
+	struct updates * u;
+	bool ok;
+};
+
+static void * _update(void * arg)
+{
+	struct updater * up = arg;
+	for(int op=0; op<UPD_OPS; op++) _random_update(up->c, up->u, &up->ok);
+	return NULL;
+}
+
+struct predictor
+{
+	knn_classifier_t c;
+	mnist_dataset_handle test;
+	bool ok;
+};
+
+static void * _predict(void * arg)
+{
+	struct predictor * p = arg;
+	for(int r=0; r<20; r++)
+		for(mnist_image_handle img=mnist_image_begin(p->test); 
+			img!=MNIST_IMAGE_INVALID; img=mnist_image_next(img))
+		{
+			int label = knn_classifier_predict(p->c, mnist_image_data(img));
+			p->ok &= label>=0 && label<NUM_LABELS;
+		}
+	return NULL;
+}
+
+#define PREDICTORS 3
+
+static void test_knn_classifier_concurrent()
+{
+	//predictions from several threads while another one inserts and 
+	// removes, and compactions on demand besides the background ones
+	mnist_dataset_handle train = test_tie_dataset(UPD_TRAIN, UPD_SIZE, UPD_SIZE, 3);
+	mnist_dataset_handle test = test_tie_dataset(30, UPD_SIZE, UPD_SIZE, 4);
+	struct updates * u = &_updates;
+	mnist_image_handle img = mnist_image_begin(train);
+	for(int i=0; i<UPD_TRAIN; i++, img=mnist_image_next(img))
+	{
+		memcpy(u->imgs[i], mnist_image_data(img), UPD_SIZE*UPD_SIZE);
+		u->labels[i] = mnist_image_label(img);
+		u->dead[i] = false;
+	}
+	u->num_ids = UPD_TRAIN;
+	knn_classifier_t c = knn_classifier_fit(train, "euclid", 2);
+	struct updater up = {c, u, true};
+	struct predictor preds[PREDICTORS];
+	pthread_t thread, threads[PREDICTORS];
+	srand(6);
+	CU_ASSERT_EQUAL_FATAL(pthread_create(&thread, NULL, _update, &up), 0);
+	for(int t=0; t<PREDICTORS; t++)
+	{
+		preds[t] = (struct predictor) {c, test, true};
+		CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[t], NULL, _predict, &preds[t]), 0);
+	}
+	bool ok = true;
+	for(int r=0; r<10; r++) ok &= knn_classifier_compact(c);
+	for(int t=0; t<PREDICTORS; t++)
+	{
+		pthread_join(threads[t], NULL);
+		ok &= preds[t].ok;
+	}
+	pthread_join(thread, NULL);
+	CU_ASSERT_TRUE(ok);
+	CU_ASSERT_TRUE(up.ok);
+	CU_ASSERT_TRUE(_same_as_rebuilt(c, u, test, "euclid", 2));
+	//what the last compaction left, merged
+	CU_ASSERT_TRUE(knn_classifier_compact(c));
+	CU_ASSERT_TRUE(_same_as_rebuilt(c, u, test, "euclid", 2));
+	knn_classifier_free(c);
+	mnist_free(train);
+	mnist_free(test);
+}
+
+static bool _same_predictions(knn_classifier_t a, knn_classifier_t b,
+							  mnist_dataset_handle test)
+{
+	bool ok = knn_classifier_count(a)==knn_classifier_count(b);
+	for(mnist_image_handle img=mnist_image_begin(test); img!=MNIST_IMAGE_INVALID; 
+		img=mnist_image_next(img))
+		ok &= knn_classifier_predict(a, mnist_image_data(img))
+			  ==knn_classifier_predict(b, mnist_image_data(img));
+	return ok;
+}
+
+static void test_knn_classifier_snapshot()
+{
+	char * metrics[] = {"euclid", "reduced"};
+	int ks[] = {0, 6};
+	mnist_dataset_handle train = test_tie_dataset(UPD_TRAIN, UPD_SIZE, UPD_SIZE, 3);
+	mnist_dataset_handle test = test_tie_dataset(50, UPD_SIZE, UPD_SIZE, 4);
+	unsigned char img[UPD_SIZE*UPD_SIZE];
+	bool ok = true;
+	for(int m=0; m<2; m++)
+		for(int j=0; j<2; j++)
+		{
+			//with inserted and removed images, compacted or not
+			knn_classifier_t c = knn_classifier_fit(train, metrics[m], ks[j]);
+			srand(7);
+			for(int i=0; i<30; i++)
+			{
+				for(int p=0; p<UPD_SIZE*UPD_SIZE; p++) img[p] = (rand()%4)*85;
+				knn_classifier_insert(c, img, rand()%10);
+				knn_classifier_remove(c, rand()%UPD_TRAIN);
+			}
+			ok &= knn_classifier_save(c, TEST_SNAPSHOT);
+			knn_classifier_t l = knn_classifier_load(TEST_SNAPSHOT);
+			if(l==KNN_CLASSIFIER_INVALID)
+			{
+				ok = false;
+				knn_classifier_free(c);
+				continue;
+			}
+			ok &= _same_predictions(c, l, test);
+			//the same ids on both sides
+			ok &= knn_classifier_insert(l, img, 1)==knn_classifier_insert(c, img, 1);
+			for(int id=0; id<UPD_TRAIN+30; id+=3)
+				ok &= knn_classifier_remove(l, id)==knn_classifier_remove(c, id);
+			ok &= _same_predictions(c, l, test);
+			//once compacted, the arrays leave the mapping
+			ok &= knn_classifier_compact(l);
+			ok &= _same_predictions(c, l, test);
+			//a snapshot of a loaded classifier
+			ok &= knn_classifier_save(l, TEST_SNAPSHOT);
+			knn_classifier_free(l);
+			l = knn_classifier_load(TEST_SNAPSHOT);
+			ok &= l!=KNN_CLASSIFIER_INVALID && _same_predictions(c, l, test);
+			knn_classifier_free(l);
+			knn_classifier_free(c);
+		}
+	CU_ASSERT_TRUE(ok);
+
+	//test invalid
+	CU_ASSERT_FALSE(knn_classifier_save(KNN_CLASSIFIER_INVALID, TEST_SNAPSHOT));
+	knn_classifier_t c = knn_classifier_fit(train, "euclid", 0);
+	CU_ASSERT_FALSE(knn_classifier_save(c, NULL));
+	CU_ASSERT_FALSE(knn_classifier_save(c, "data/no/such/dir"));
+	CU_ASSERT_EQUAL(knn_classifier_load(NULL), KNN_CLASSIFIER_INVALID);
+	CU_ASSERT_EQUAL(knn_classifier_load("data/no_such_snapshot"), KNN_CLASSIFIER_INVALID);
+	CU_ASSERT_TRUE_FATAL(knn_classifier_save(c, TEST_SNAPSHOT));
+	knn_classifier_free(c);
+	FILE * fp = fopen(TEST_SNAPSHOT, "r+b");
+	CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+	fseek(fp, 0, SEEK_END);
+	long len = ftell(fp);
+	unsigned char * buf = malloc(len);
+	fseek(fp, 0, SEEK_SET);
+	CU_ASSERT_EQUAL(fread(buf, 1, len, fp), len);
+	//a later version, then a truncated file
+	unsigned char version = buf[7];
+	buf[7]++;
+	fseek(fp, 0, SEEK_SET);
+	fwrite(buf, 1, len, fp);
+	fclose(fp);
+	CU_ASSERT_EQUAL(knn_classifier_load(TEST_SNAPSHOT), KNN_CLASSIFIER_INVALID);
+	buf[7] = version;
+	fp = fopen(TEST_SNAPSHOT, "wb");
+	fwrite(buf, 1, len-1, fp);
+	fclose(fp);
+	CU_ASSERT_EQUAL(knn_classifier_load(TEST_SNAPSHOT), KNN_CLASSIFIER_INVALID);
+	fp = fopen(TEST_SNAPSHOT, "wb");
+	fwrite(buf, 1, len, fp);
+	fclose(fp);
+	c = knn_classifier_load(TEST_SNAPSHOT);
+	CU_ASSERT_NOT_EQUAL(c, KNN_CLASSIFIER_INVALID);
+	knn_classifier_free(c);
+	free(buf);
+	remove(TEST_SNAPSHOT);
+	mnist_free(train);
+	mnist_free(test);
+}
+
 static int init_suite(void)
 {
 	return 0;
@@ -510,8 +1044,15 @@ int main()
    if ((   NULL == CU_add_test(pSuite, "partition()\n", test_partition))
        || (NULL == CU_add_test(pSuite, "quickselect()\n", test_quickselect))
        || (NULL == CU_add_test(pSuite, "knn_data_create() and _free()\n", test_knn_data_create_free))
+       || (NULL == CU_add_test(pSuite, "knn_data_set_image()\n", test_knn_data_set_image))
        || (NULL == CU_add_test(pSuite, "knn_data_get_distances()\n", test_knn_data_get_distances))
        || (NULL == CU_add_test(pSuite, "knn_data_best_label()\n", test_knn_data_best_label))
+       || (NULL == CU_add_test(pSuite, "knn_data_best_label_loo()\n", test_knn_data_best_label_loo))
+       || (NULL == CU_add_test(pSuite, "knn_candidates()\n", test_knn_candidates))
+       || (NULL == CU_add_test(pSuite, "knn_classifier\n", test_knn_classifier))
+       || (NULL == CU_add_test(pSuite, "knn_classifier updates\n", test_knn_classifier_updates))
+       || (NULL == CU_add_test(pSuite, "knn_classifier concurrent updates\n", test_knn_classifier_concurrent))
+       || (NULL == CU_add_test(pSuite, "knn_classifier snapshots\n", test_knn_classifier_snapshot))
       )
    {
       CU_cleanup_registry();
@@ -1,9 +1,19 @@
+#define _POSIX_C_SOURCE 200809L // for ftruncate, fileno and utimensat
 #include "mnist.h"
 #include <CUnit/Basic.h>
 #include <limits.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #define TEST_T10K "data/t10k"
 #define TEST_TRAIN "data/train"
 #define TEST_OUTFILE "data/test"
+#define TEST_BADFILE "data/test_bad"
+#define TEST_GZFILE "data/test_gz"
+#define TEST_ALIGNED "data/test_aligned"
 #define TEST_T10K_FIRST_LBL 7
 #define TEST_T10k_FILE_SZ 10008
 
@@ -49,6 +59,316 @@ static void test_mnist_open()
 	mnist_free(mdh);
 }
 
+static void _write_bad_files(uint32_t magic, uint32_t lbl_count, 
+							uint32_t img_count, int num_imgs)
+{
+	//idx files of 2x2 images with the given header values and num_imgs 
+	// images and labels
+	uint32_t lbl_header[] = {htonl(LBL_MAGIC_NUM), htonl(lbl_count)};
+	uint32_t img_header[] = {htonl(magic), htonl(img_count), htonl(2), htonl(2)};
+	unsigned char data[4*16] = {0};
+	FILE * fp = fopen(TEST_BADFILE LABELS, "wb");
+	fwrite(lbl_header, sizeof(lbl_header), 1, fp);
+	fwrite(data, num_imgs, 1, fp);
+	fclose(fp);
+	fp = fopen(TEST_BADFILE IMAGES, "wb");
+	fwrite(img_header, sizeof(img_header), 1, fp);
+	fwrite(data, 4*num_imgs, 1, fp);
+	fclose(fp);
+}
+
+static void test_mnist_open_mapped()
+{
+	//every flag gives the same dataset
+	int flags[] = {MNIST_MAP_POPULATE, MNIST_MAP_SEQUENTIAL, MNIST_MAP_RANDOM,
+				MNIST_MAP_WILLNEED|MNIST_MAP_RANDOM};
+	mnist_dataset_handle ref = mnist_open(TEST_T10K);
+	for(int i=0; i<sizeof(flags)/sizeof(flags[0]); i++)
+	{
+		mnist_dataset_handle mdh = mnist_open_mapped(TEST_T10K, flags[i]);
+		CU_ASSERT_NOT_EQUAL_FATAL(mdh, MNIST_DATASET_INVALID);
+		CU_ASSERT_EQUAL(mnist_image_count(mdh), mnist_image_count(ref));
+		CU_ASSERT_EQUAL(memcmp(mnist_image_data(mnist_image_begin(mdh)),
+						mnist_image_data(mnist_image_begin(ref)), 28*28), 0);
+		mnist_free(mdh);
+	}
+	mnist_free(ref);
+
+	//headers are validated
+	_write_bad_files(IMG_MAGIC_NUM, 3, 3, 3);
+	mnist_dataset_handle mdh = mnist_open(TEST_BADFILE);
+	CU_ASSERT_NOT_EQUAL(mdh, MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), 3);
+	mnist_free(mdh);
+	//wrong magic number
+	_write_bad_files(LBL_MAGIC_NUM, 3, 3, 3);
+	CU_ASSERT_EQUAL(mnist_open(TEST_BADFILE), MNIST_DATASET_INVALID);
+	//counts don't match
+	_write_bad_files(IMG_MAGIC_NUM, 3, 2, 3);
+	CU_ASSERT_EQUAL(mnist_open(TEST_BADFILE), MNIST_DATASET_INVALID);
+	//truncated files
+	_write_bad_files(IMG_MAGIC_NUM, 5, 5, 3);
+	CU_ASSERT_EQUAL(mnist_open(TEST_BADFILE), MNIST_DATASET_INVALID);
+}
+
+static void test_mnist_copy_on_write()
+{
+	//adding to an opened dataset doesn't touch the files
+	mnist_dataset_handle mdh = mnist_open(TEST_T10K);
+	int count = mnist_image_count(mdh);
+	unsigned char first[28*28], img_data[28*28];
+	memcpy(first, mnist_image_data(mnist_image_begin(mdh)), sizeof(first));
+	for(int i=0; i<sizeof(img_data); i++) img_data[i] = i;
+	mnist_image_handle img = mnist_image_add_after(mdh, MNIST_IMAGE_INVALID,
+										img_data, 28, 28, 3);
+	CU_ASSERT_NOT_EQUAL_FATAL(img, MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), count+1);
+	CU_ASSERT_EQUAL(mnist_image_begin(mdh), img);
+	CU_ASSERT_EQUAL(memcmp(mnist_image_data(img), img_data, sizeof(img_data)), 0);
+	CU_ASSERT_EQUAL(mnist_image_label(img), 3);
+	CU_ASSERT_EQUAL(memcmp(mnist_image_data(mnist_image_next(img)), first, 
+					sizeof(first)), 0);
+	CU_ASSERT_EQUAL(mnist_image_label(mnist_image_next(img)), TEST_T10K_FIRST_LBL);
+	mnist_free(mdh);
+	mdh = mnist_open(TEST_T10K);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), count);
+	mnist_free(mdh);
+}
+
+static bool _write_gz(const char * path, const unsigned char * data, size_t len,
+					size_t member, bool blocked)
+{
+	//writes data gzip compressed, in members of member bytes (one member
+	// if 0). Blocked members carry their size in a "BC" extra subfield 
+	// like bgzip's.
+	FILE * fp = fopen(path, "wb");
+	if(!fp) return false;
+	bool ok = true;
+	size_t off = 0;
+	do
+	{
+		size_t n = member && len-off>member ? member : len-off;
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		ok &= deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16+MAX_WBITS,
+						8, Z_DEFAULT_STRATEGY)==Z_OK;
+		unsigned char extra[6] = {'B', 'C', 2, 0, 0, 0};
+		gz_header header;
+		memset(&header, 0, sizeof(header));
+		header.extra = extra;
+		header.extra_len = sizeof(extra);
+		if(blocked) deflateSetHeader(&zs, &header);
+		uLong cap = deflateBound(&zs, n)+64;
+		unsigned char * out = malloc(cap);
+		zs.next_in = (Bytef *) data+off;
+		zs.avail_in = n;
+		zs.next_out = out;
+		zs.avail_out = cap;
+		ok &= deflate(&zs, Z_FINISH)==Z_STREAM_END;
+		size_t size = zs.total_out;
+		deflateEnd(&zs);
+		if(blocked)
+		{
+			//BSIZE: member size-1, after the 12 byte header and the 
+			// subfield's id and length
+			ok &= size-1<=0xffff;
+			out[16] = (size-1) & 0xff;
+			out[17] = (size-1)>>8;
+		}
+		ok &= fwrite(out, size, 1, fp)==1;
+		free(out);
+		off += n;
+	} while(off<len && ok);
+	fclose(fp);
+	return ok;
+}
+
+static bool _write_gz_dataset(const char * name, mnist_dataset_handle mdh,
+					size_t member, bool blocked)
+{
+	//name-images-idx3-ubyte.gz and name-labels-idx1-ubyte.gz with the 
+	// images and labels of mdh (as mnist_save writes them)
+	if(!mnist_save(mdh, name)) return false;
+	const char * suffixes[] = {IMAGES, LABELS};
+	bool ok = true;
+	for(int i=0; i<2; i++)
+	{
+		char path[256], gzpath[256+sizeof(GZ)];
+		snprintf(path, sizeof(path), "%s%s", name, suffixes[i]);
+		snprintf(gzpath, sizeof(gzpath), "%s%s", path, GZ);
+		FILE * fp = fopen(path, "rb");
+		fseek(fp, 0, SEEK_END);
+		long len = ftell(fp);
+		rewind(fp);
+		unsigned char * data = malloc(len);
+		ok &= fread(data, len, 1, fp)==1;
+		fclose(fp);
+		ok &= _write_gz(gzpath, data, len, member, blocked);
+		free(data);
+		remove(path);
+	}
+	return ok;
+}
+
+static bool _same_dataset(mnist_dataset_handle a, mnist_dataset_handle b)
+{
+	if(mnist_image_count(a)!=mnist_image_count(b)) return false;
+	mnist_image_handle ia = mnist_image_begin(a), ib = mnist_image_begin(b);
+	unsigned int x, y;
+	mnist_image_size(a, &x, &y);
+	bool same = true;
+	for(; ia && ib; ia=mnist_image_next(ia), ib=mnist_image_next(ib))
+		same &= !memcmp(mnist_image_data(ia), mnist_image_data(ib), x*y)
+				&& mnist_image_label(ia)==mnist_image_label(ib);
+	return same && !ia && !ib;
+}
+
+static void test_mnist_open_gz()
+{
+	mnist_dataset_handle t10k = mnist_open(TEST_T10K);
+	//one member, several members, blocked members (inflated in parallel)
+	size_t members[] = {0, 1000000, 32768};
+	bool blocked[] = {false, false, true};
+	for(int i=0; i<3; i++)
+	{
+		CU_ASSERT_TRUE_FATAL(_write_gz_dataset(TEST_GZFILE, t10k, members[i], 
+												blocked[i]));
+		mnist_dataset_handle mdh = mnist_open(TEST_GZFILE);
+		CU_ASSERT_NOT_EQUAL_FATAL(mdh, MNIST_DATASET_INVALID);
+		CU_ASSERT_TRUE(_same_dataset(mdh, t10k));
+		//it's on the heap: adding images works as usual
+		unsigned char img_data[28*28] = {0};
+		CU_ASSERT_NOT_EQUAL(mnist_image_add_after(mdh, MNIST_IMAGE_INVALID, 
+											img_data, 28, 28, 1), MNIST_IMAGE_INVALID);
+		CU_ASSERT_EQUAL(mnist_image_count(mdh), mnist_image_count(t10k)+1);
+		mnist_free(mdh);
+	}
+	//the labels uncompressed, the images compressed
+	mnist_dataset_handle small = mnist_create_sample(t10k, 100);
+	CU_ASSERT_TRUE_FATAL(_write_gz_dataset(TEST_GZFILE, small, 0, false));
+	mnist_save(small, TEST_OUTFILE);
+	rename(TEST_OUTFILE LABELS, TEST_GZFILE LABELS);
+	remove(TEST_GZFILE LABELS GZ);
+	mnist_dataset_handle mdh = mnist_open(TEST_GZFILE);
+	CU_ASSERT_TRUE(_same_dataset(mdh, small));
+	mnist_free(mdh);
+	remove(TEST_GZFILE LABELS);
+
+	//truncated and corrupt files are invalid
+	for(int i=0; i<2; i++)
+	{
+		CU_ASSERT_TRUE_FATAL(_write_gz_dataset(TEST_GZFILE, small, 8192, i));
+		FILE * fp = fopen(TEST_GZFILE IMAGES GZ, "r+b");
+		fseek(fp, 0, SEEK_END);
+		long len = ftell(fp);
+		CU_ASSERT_EQUAL(ftruncate(fileno(fp), len-5), 0);
+		fclose(fp);
+		CU_ASSERT_EQUAL(mnist_open(TEST_GZFILE), MNIST_DATASET_INVALID);
+
+		CU_ASSERT_TRUE_FATAL(_write_gz_dataset(TEST_GZFILE, small, 8192, i));
+		fp = fopen(TEST_GZFILE IMAGES GZ, "r+b");
+		fseek(fp, len/2, SEEK_SET);
+		int c = fgetc(fp);
+		fseek(fp, len/2, SEEK_SET);
+		fputc(c^0x55, fp);
+		fclose(fp);
+		CU_ASSERT_EQUAL(mnist_open(TEST_GZFILE), MNIST_DATASET_INVALID);
+	}
+	remove(TEST_GZFILE IMAGES GZ);
+	remove(TEST_GZFILE LABELS GZ);
+	CU_ASSERT_EQUAL(mnist_open(TEST_GZFILE), MNIST_DATASET_INVALID);
+	mnist_free(small);
+	mnist_free(t10k);
+}
+
+static void test_mnist_save_aligned()
+{
+	mnist_dataset_handle t10k = mnist_open(TEST_T10K);
+	CU_ASSERT_TRUE_FATAL(mnist_save_aligned(t10k, TEST_ALIGNED));
+	CU_ASSERT_FALSE(mnist_save_aligned(MNIST_DATASET_INVALID, TEST_ALIGNED));
+	mnist_dataset_handle mdh = mnist_open(TEST_ALIGNED);
+	CU_ASSERT_NOT_EQUAL_FATAL(mdh, MNIST_DATASET_INVALID);
+	CU_ASSERT_TRUE(_same_dataset(mdh, t10k));
+	CU_ASSERT_EQUAL(mnist_image_stride(t10k), 28*28);
+	CU_ASSERT_EQUAL(mnist_image_stride(mdh), 13*MNIST_ALIGN);
+	CU_ASSERT_EQUAL(mnist_image_stride(MNIST_DATASET_INVALID), 0);
+	//aligned, zero padded, a stride apart, with the right norms and sums
+	CU_ASSERT_EQUAL((uintptr_t) mnist_image_data(mnist_image_begin(mdh))
+					% MNIST_ALIGNED_PAGE, 0);
+	bool ok = true;
+	mnist_image_handle a = mnist_image_begin(mdh), b = mnist_image_begin(t10k);
+	const unsigned char * first = mnist_image_data(a);
+	for(int i=0; a && b; i++, a=mnist_image_next(a), b=mnist_image_next(b))
+	{
+		const unsigned char * data = mnist_image_data(a);
+		ok &= data==first+i*mnist_image_stride(mdh);
+		for(size_t p=28*28; p<mnist_image_stride(mdh); p++) ok &= !data[p];
+		ok &= mnist_image_norm2(a)==mnist_image_norm2(b);
+		ok &= mnist_image_sum(a)==mnist_image_sum(b);
+	}
+	CU_ASSERT_TRUE(ok);
+	unsigned char img_data[28*28];
+	for(int i=0; i<sizeof(img_data); i++) img_data[i] = i%3;
+	mnist_dataset_handle one = mnist_create(28, 28);
+	mnist_image_add_after(one, MNIST_IMAGE_INVALID, img_data, 28, 28, 1);
+	CU_ASSERT_EQUAL(mnist_image_norm2(mnist_image_begin(one)), 261*5);
+	CU_ASSERT_EQUAL(mnist_image_sum(mnist_image_begin(one)), 261*3);
+	CU_ASSERT_EQUAL(mnist_image_sum(MNIST_IMAGE_INVALID), 0);
+	mnist_free(one);
+
+	//saved back to idx files, sampled, and added to like any dataset
+	CU_ASSERT_TRUE(mnist_save(mdh, TEST_GZFILE));
+	mnist_dataset_handle copy = mnist_open(TEST_GZFILE);
+	CU_ASSERT_TRUE(_same_dataset(copy, t10k));
+	mnist_free(copy);
+	remove(TEST_GZFILE IMAGES);
+	remove(TEST_GZFILE LABELS);
+	mnist_dataset_handle sample = mnist_create_sample(mdh, mnist_image_count(mdh));
+	CU_ASSERT_TRUE(_same_dataset(sample, t10k));
+	mnist_free(sample);
+	mnist_image_handle last = mnist_image_at(mdh, mnist_image_count(mdh)-1);
+	CU_ASSERT_NOT_EQUAL(mnist_image_add_after(mdh, last, img_data, 28, 28, 1),
+						MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_stride(mdh), 28*28);
+	mnist_image_add_after(t10k, mnist_image_at(t10k, mnist_image_count(t10k)-1),
+						img_data, 28, 28, 1);
+	CU_ASSERT_TRUE(_same_dataset(mdh, t10k));
+	mnist_free(mdh);
+
+	//idx files newer than the aligned file are opened instead, and an
+	// aligned file saved again wins back
+	mnist_dataset_handle small = mnist_open("data/small");
+	CU_ASSERT_TRUE_FATAL(mnist_save(small, TEST_ALIGNED));
+	struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+	CU_ASSERT_EQUAL(utimensat(AT_FDCWD, TEST_ALIGNED ALIGNED, times, 0), 0);
+	mdh = mnist_open(TEST_ALIGNED);
+	CU_ASSERT_TRUE(_same_dataset(mdh, small));
+	mnist_free(mdh);
+	CU_ASSERT_TRUE_FATAL(mnist_save_aligned(t10k, TEST_ALIGNED));
+	mdh = mnist_open(TEST_ALIGNED);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), mnist_image_count(t10k));
+	CU_ASSERT_EQUAL(mnist_image_stride(mdh), 13*MNIST_ALIGN);
+	mnist_free(mdh);
+	remove(TEST_ALIGNED IMAGES);
+	remove(TEST_ALIGNED LABELS);
+	mnist_free(small);
+
+	//truncated or with a bad magic number: invalid, and the idx files
+	// aren't tried
+	FILE * fp = fopen(TEST_ALIGNED ALIGNED, "r+b");
+	fseek(fp, 0, SEEK_END);
+	long len = ftell(fp);
+	CU_ASSERT_EQUAL(ftruncate(fileno(fp), len-1), 0);
+	fclose(fp);
+	CU_ASSERT_EQUAL(mnist_open(TEST_ALIGNED), MNIST_DATASET_INVALID);
+	fp = fopen(TEST_ALIGNED ALIGNED, "r+b");
+	fputc('X', fp);
+	fclose(fp);
+	CU_ASSERT_EQUAL(mnist_open(TEST_ALIGNED), MNIST_DATASET_INVALID);
+	remove(TEST_ALIGNED ALIGNED);
+	mnist_free(t10k);
+}
+
 static void test_mnist_create()
 {
 	//test empty valid create
@@ -152,6 +472,114 @@ static void test_mnist_image_next()
 
 }
 
+static void test_mnist_image_at()
+{
+	//same images as iterating
+	mnist_dataset_handle mdh = mnist_open(TEST_T10K);
+	mnist_image_handle mih = mnist_image_begin(mdh);
+	bool ok = true;
+	for(int i=0; i<mnist_image_count(mdh); i++)
+	{
+		ok &= (mnist_image_at(mdh, i)==mih);
+		mih = mnist_image_next(mih);
+	}
+	CU_ASSERT_TRUE(ok);
+	//test out of range
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, -1), MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, mnist_image_count(mdh)), MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_at(MNIST_DATASET_INVALID, 0), MNIST_IMAGE_INVALID);
+	mnist_free(mdh);
+
+	//positions follow insertions in the middle, and handles stay valid
+	mdh = mnist_create(2,2);
+	unsigned char img_data[4] = {0};
+	mnist_image_handle first = mnist_image_add_after(mdh, MNIST_IMAGE_INVALID,
+												img_data, 2, 2, 0);
+	mnist_image_handle last = first;
+	for(int i=1; i<2*MNIST_HANDLE_BLOCK; i++)
+		last = mnist_image_add_after(mdh, last, img_data, 2, 2, i%10);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 0), first);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 2*MNIST_HANDLE_BLOCK-1), last);
+	mnist_image_handle second = mnist_image_add_after(mdh, first, img_data, 2, 2, 7);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 0), first);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 1), second);
+	CU_ASSERT_EQUAL(mnist_image_label(mnist_image_at(mdh, 2)), 1);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 2*MNIST_HANDLE_BLOCK), last);
+	mnist_image_handle new_first = mnist_image_add_after(mdh, MNIST_IMAGE_INVALID,
+												img_data, 2, 2, 5);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 0), new_first);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 1), first);
+	CU_ASSERT_EQUAL(mnist_image_label(first), 0);
+	mnist_free(mdh);
+}
+
+static void test_mnist_image_append_batch()
+{
+	unsigned char data[5*4], labels[5];
+	for(int i=0; i<5*4; i++) data[i] = i;
+	for(int i=0; i<5; i++) labels[i] = i;
+	mnist_dataset_handle mdh = mnist_create(2,2);
+	//invalid arguments leave the dataset unchanged
+	CU_ASSERT_EQUAL(mnist_image_append_batch(mdh, data, 0, labels), MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_append_batch(mdh, NULL, 1, labels), MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_append_batch(mdh, data, 1, NULL), MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_append_batch(MNIST_DATASET_INVALID, data, 1, labels), 
+					MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), 0);
+
+	//into an empty dataset
+	mnist_image_handle last = mnist_image_append_batch(mdh, data, 3, labels);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), 3);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 2), last);
+	CU_ASSERT_EQUAL(mnist_image_next(last), MNIST_IMAGE_INVALID);
+	//after an image inserted at the front, the batch still goes at the end
+	mnist_image_handle first = mnist_image_add_after(mdh, MNIST_IMAGE_INVALID, 
+											data+4*4, 2, 2, 9);
+	last = mnist_image_append_batch(mdh, data+3*4, 2, labels+3);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), 6);
+	CU_ASSERT_EQUAL(mnist_image_begin(mdh), first);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, 5), last);
+	int expect[] = {4, 0, 1, 2, 3, 4};
+	int ok = 1;
+	mnist_image_handle mih = mnist_image_begin(mdh);
+	for(int i=0; i<6; i++, mih=mnist_image_next(mih))
+		ok &= !memcmp(mnist_image_data(mih), data+4*expect[i], 4)
+			&& mnist_image_label(mih)==(i ? expect[i] : 9);
+	CU_ASSERT_TRUE(ok);
+	mnist_free(mdh);
+
+	//a batch larger than a handle block into an opened (mapped) dataset
+	mdh = mnist_open(TEST_T10K);
+	int count = mnist_image_count(mdh);
+	int n = MNIST_HANDLE_BLOCK+10;
+	unsigned char * big = calloc(n, 28*28);
+	unsigned char * big_labels = calloc(n, 1);
+	big[(n-1)*28*28] = 42;
+	big_labels[n-1] = 7;
+	last = mnist_image_append_batch(mdh, big, n, big_labels);
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), count+n);
+	CU_ASSERT_EQUAL(mnist_image_at(mdh, count+n-1), last);
+	CU_ASSERT_EQUAL(mnist_image_data(last)[0], 42);
+	CU_ASSERT_EQUAL(mnist_image_label(last), 7);
+	free(big);
+	free(big_labels);
+	mnist_free(mdh);
+
+	//reserving doesn't change the contents
+	mdh = mnist_create(2,2);
+	CU_ASSERT_FALSE(mnist_reserve(MNIST_DATASET_INVALID, 10));
+	CU_ASSERT_FALSE(mnist_reserve(mdh, -1));
+	CU_ASSERT_TRUE(mnist_reserve(mdh, 100));
+	CU_ASSERT_EQUAL(mnist_image_count(mdh), 0);
+	mnist_image_append_batch(mdh, data, 5, labels);
+	const unsigned char * p = mnist_image_data(mnist_image_begin(mdh));
+	for(int i=0; i<95; i++)
+		mnist_image_add_after(mdh, MNIST_IMAGE_INVALID, data, 2, 2, 1);
+	//no copy up to the reserved size
+	CU_ASSERT_EQUAL(mnist_image_data(mnist_image_at(mdh, 95)), p);
+	mnist_free(mdh);
+}
+
 static void test_mnist_image_add_after()
 {
 	//test with mdh, mih
@@ -266,10 +694,159 @@ static void test_mnist_create_sample()
 
 	// num different should be >95 with greater than 99% probability
 	CU_ASSERT_TRUE((diff_img_count>95));
-
-	mnist_free(mdh);
 	mnist_free(sample1);
 	mnist_free(sample2);
+
+	//a sample of every image is the dataset, in order
+	int count = mnist_image_count(mdh);
+	sample1 = mnist_create_sample(mdh, count);
+	CU_ASSERT_EQUAL_FATAL(mnist_image_count(sample1), count);
+	bool same = true;
+	s1_img = mnist_image_begin(sample1);
+	for(mnist_image_handle img=mnist_image_begin(mdh); img!=MNIST_IMAGE_INVALID;
+		img=mnist_image_next(img), s1_img=mnist_image_next(s1_img))
+		same &= !memcmp(mnist_image_data(img), mnist_image_data(s1_img), num_pixels)
+			&& mnist_image_label(img)==mnist_image_label(s1_img);
+	CU_ASSERT_TRUE(same);
+	CU_ASSERT_EQUAL(s1_img, MNIST_IMAGE_INVALID);
+	mnist_free(sample1);
+	mnist_free(mdh);
+}
+
+static void test_mnist_views()
+{
+	mnist_dataset_handle t10k = mnist_open(TEST_T10K);
+	CU_ASSERT_TRUE_FATAL(mnist_save_aligned(t10k, TEST_ALIGNED));
+	mnist_dataset_handle aligned = mnist_open(TEST_ALIGNED);
+	CU_ASSERT_NOT_EQUAL_FATAL(aligned, MNIST_DATASET_INVALID);
+
+	//a range: the images of the parent, not copies
+	mnist_dataset_handle range = mnist_view_range(t10k, 100, 50);
+	CU_ASSERT_EQUAL_FATAL(mnist_image_count(range), 50);
+	CU_ASSERT_TRUE(mnist_is_view(range));
+	CU_ASSERT_FALSE(mnist_is_view(t10k));
+	//consecutive images of one parent: its stride
+	CU_ASSERT_EQUAL(mnist_image_stride(range), 28*28);
+	const unsigned char * first = mnist_image_data(mnist_image_begin(range));
+	bool ok = true;
+	mnist_image_handle img = mnist_image_begin(range);
+	for(int i=0; i<50; i++, img=mnist_image_next(img))
+		ok &= mnist_image_data(img)==mnist_image_data(mnist_image_at(t10k, 100+i))
+			&& mnist_image_data(img)==first+i*mnist_image_stride(range)
+			&& mnist_image_label(img)==mnist_image_label(mnist_image_at(t10k, 100+i))
+			&& mnist_image_at(range, i)==img;
+	CU_ASSERT_TRUE(ok);
+	CU_ASSERT_EQUAL(img, MNIST_IMAGE_INVALID);
+	CU_ASSERT_EQUAL(mnist_view_range(t10k, 9990, 20), MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_view_range(t10k, -1, 2), MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_view_range(MNIST_DATASET_INVALID, 0, 1), MNIST_DATASET_INVALID);
+
+	//a subset, repeats allowed
+	int idx[] = {3, 1, 4, 1, 5};
+	mnist_dataset_handle subset = mnist_view_subset(t10k, idx, 5);
+	CU_ASSERT_EQUAL_FATAL(mnist_image_count(subset), 5);
+	ok = true;
+	img = mnist_image_begin(subset);
+	for(int i=0; i<5; i++, img=mnist_image_next(img))
+		ok &= mnist_image_data(img)==mnist_image_data(mnist_image_at(t10k, idx[i]));
+	CU_ASSERT_TRUE(ok);
+	int bad[] = {0, 10000};
+	CU_ASSERT_EQUAL(mnist_view_subset(t10k, bad, 2), MNIST_DATASET_INVALID);
+	//not a stride apart: 0, and an ascending subset or a range of an
+	// aligned dataset has the parent's stride
+	CU_ASSERT_EQUAL(mnist_image_stride(subset), 0);
+	int seq[] = {7, 8, 9};
+	mnist_dataset_handle consecutive = mnist_view_subset(aligned, seq, 3);
+	CU_ASSERT_EQUAL(mnist_image_stride(consecutive), 13*MNIST_ALIGN);
+	CU_ASSERT_EQUAL(mnist_image_data(mnist_image_at(consecutive, 2)),
+		mnist_image_data(mnist_image_begin(consecutive))+2*13*MNIST_ALIGN);
+	mnist_free(consecutive);
+	mnist_dataset_handle empty = mnist_view_range(t10k, 0, 0);
+	CU_ASSERT_EQUAL(mnist_image_stride(empty), 28*28);
+	mnist_free(empty);
+
+	//a union of a view and a dataset with another stride: flat, so the
+	// images of a view of it are those of the parents
+	mnist_dataset_handle parts[] = {range, aligned};
+	mnist_dataset_handle all = mnist_view_union(parts, 2);
+	CU_ASSERT_EQUAL_FATAL(mnist_image_count(all), 50+10000);
+	mnist_dataset_handle tail = mnist_view_range(all, 49, 2);
+	CU_ASSERT_EQUAL(mnist_image_data(mnist_image_begin(tail)), 
+					mnist_image_data(mnist_image_at(t10k, 149)));
+	CU_ASSERT_EQUAL(mnist_image_data(mnist_image_at(tail, 1)), 
+					mnist_image_data(mnist_image_begin(aligned)));
+	CU_ASSERT_EQUAL(mnist_image_stride(all), 0);
+	CU_ASSERT_EQUAL(mnist_image_stride(tail), 0);
+	CU_ASSERT_EQUAL(mnist_image_norm2(mnist_image_at(tail, 1)), 
+					mnist_image_norm2(mnist_image_begin(t10k)));
+	mnist_dataset_handle small = mnist_create(7, 5);
+	mnist_dataset_handle mixed[] = {t10k, small};
+	CU_ASSERT_EQUAL(mnist_view_union(mixed, 2), MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_view_union(parts, 0), MNIST_DATASET_INVALID);
+	mnist_free(small);
+
+	//saved, gathered and sampled like any dataset
+	CU_ASSERT_TRUE_FATAL(mnist_save(tail, TEST_OUTFILE));
+	mnist_dataset_handle saved = mnist_open(TEST_OUTFILE);
+	CU_ASSERT_TRUE(_same_dataset(saved, tail));
+	mnist_free(saved);
+	int pick[] = {60, 0, 1, 2, 49, 50};
+	mnist_dataset_handle gathered = mnist_gather(all, pick, 6);
+	mnist_dataset_handle picked = mnist_view_subset(all, pick, 6);
+	CU_ASSERT_TRUE(_same_dataset(gathered, picked));
+	CU_ASSERT_FALSE(mnist_is_view(gathered));
+	mnist_free(gathered);
+	mnist_free(picked);
+	sample_rng_t rng = sample_rng(1, 0);
+	mnist_dataset_handle sample = mnist_sample_stratified(all, 100, &rng);
+	CU_ASSERT_EQUAL(mnist_image_count(sample), 100);
+	mnist_free(sample);
+
+	//adding an image copies the view; the parents don't change
+	unsigned char data[28*28] = {0};
+	img = mnist_image_add_after(tail, mnist_image_at(tail, 0), data, 28, 28, 3);
+	CU_ASSERT_NOT_EQUAL(img, MNIST_IMAGE_INVALID);
+	CU_ASSERT_FALSE(mnist_is_view(tail));
+	CU_ASSERT_EQUAL(mnist_image_count(tail), 3);
+	CU_ASSERT_NOT_EQUAL(mnist_image_data(mnist_image_begin(tail)),
+						mnist_image_data(mnist_image_at(t10k, 149)));
+	CU_ASSERT_EQUAL(memcmp(mnist_image_data(mnist_image_begin(tail)),
+						mnist_image_data(mnist_image_at(t10k, 149)), 28*28), 0);
+	CU_ASSERT_EQUAL(mnist_image_label(mnist_image_at(tail, 1)), 3);
+	CU_ASSERT_EQUAL(mnist_image_count(t10k), 10000);
+	CU_ASSERT_EQUAL(mnist_image_count(all), 10050);
+
+	mnist_free(tail);
+	mnist_free(all);
+	mnist_free(subset);
+	mnist_free(range);
+	mnist_free(aligned);
+	mnist_free(t10k);
+	remove(TEST_ALIGNED ALIGNED);
+}
+
+static void test_mnist_hash_data()
+{
+	//test that equal images hash the same
+	unsigned char img1[28*28] = {0}, img2[28*28] = {0};
+	CU_ASSERT_EQUAL(mnist_hash_data(img1, sizeof(img1)), 
+					mnist_hash_data(img2, sizeof(img2)));
+	//test one different pixel, also in the last (partial) word
+	img2[100] = 1;
+	CU_ASSERT_NOT_EQUAL(mnist_hash_data(img1, sizeof(img1)), 
+					mnist_hash_data(img2, sizeof(img2)));
+	CU_ASSERT_NOT_EQUAL(mnist_hash_data(img1, 5), 
+					mnist_hash_data(img1+1, 4));
+	img2[100] = 0;
+	img2[4] = 1;
+	CU_ASSERT_NOT_EQUAL(mnist_hash_data(img1, 5), mnist_hash_data(img2, 5));
+	//test the first image of t10k against its copy
+	mnist_dataset_handle mdh = mnist_open(TEST_T10K);
+	const unsigned char * data = mnist_image_data(mnist_image_begin(mdh));
+	memcpy(img1, data, sizeof(img1));
+	CU_ASSERT_EQUAL(mnist_hash_data(img1, sizeof(img1)), 
+					mnist_hash_data(data, sizeof(img1)));
+	mnist_free(mdh);
 }
 
 
@@ -297,6 +874,9 @@ int main()
    /* NOTE - ORDER IS IMPORTANT - MUST TEST fread() AFTER fprintf() */
    if (
        (NULL == CU_add_test(pSuite, "mnist_open()\n", test_mnist_open))
+       || (NULL == CU_add_test(pSuite, "mnist_open_mapped()\n", test_mnist_open_mapped))
+       || (NULL == CU_add_test(pSuite, "copy-on-write of opened datasets\n", test_mnist_copy_on_write))
+       || (NULL == CU_add_test(pSuite, "mnist_open() of gzip files\n", test_mnist_open_gz))
        || (NULL == CU_add_test(pSuite, "mnist_create()\n", test_mnist_create))
 	   || (NULL == CU_add_test(pSuite, "mnist_image_count()\n", test_mnist_image_count))
 	   || (NULL == CU_add_test(pSuite, "mnist_image_size()\n", test_mnist_image_size))
@@ -304,9 +884,14 @@ int main()
 	   || (NULL == CU_add_test(pSuite, "mnist_image_data()\n", test_mnist_image_data))
 	   || (NULL == CU_add_test(pSuite, "mnist_image_label()\n", test_mnist_image_label))
 	   || (NULL == CU_add_test(pSuite, "mnist_image_next()\n", test_mnist_image_next))
+	   || (NULL == CU_add_test(pSuite, "mnist_image_at()\n", test_mnist_image_at))
 	   || (NULL == CU_add_test(pSuite, "mnist_image_add_after()\n", test_mnist_image_add_after))
+	   || (NULL == CU_add_test(pSuite, "mnist_image_append_batch()\n", test_mnist_image_append_batch))
 	   || (NULL == CU_add_test(pSuite, "mnist_save()\n", test_mnist_save))
+	   || (NULL == CU_add_test(pSuite, "mnist_save_aligned()\n", test_mnist_save_aligned))
 	   || (NULL == CU_add_test(pSuite, "mnist_create_sample()\n", test_mnist_create_sample))
+	   || (NULL == CU_add_test(pSuite, "mnist_view_*()\n", test_mnist_views))
+	   || (NULL == CU_add_test(pSuite, "mnist_hash_data()\n", test_mnist_hash_data))
       )
    {
       CU_cleanup_registry();
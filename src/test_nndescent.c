@@ -0,0 +1,159 @@
+#include "nndescent.h"
+#include "mnist.h"
+#include "distance.h"
+#include <CUnit/Basic.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#define TEST_OUTFILE "data/test_knngraph"
+
+#define DATASET_X 	8
+#define DATASET_Y 	8
+#define NUM_IMGS 	400
+#define K 			8
+
+static mnist_dataset_handle _make_test_dataset(void)
+{
+	//gradients with a random direction and offset: the images lie 
+	// close to a low dimensional surface, like real digits do.
+	mnist_dataset_handle mdh = mnist_create(DATASET_X,DATASET_Y);
+	mnist_image_handle img = mnist_image_begin(mdh);
+	srand(1);
+	for(int i=0; i<NUM_IMGS; i++)
+	{
+		unsigned char img_data[DATASET_X*DATASET_Y];
+		int a = rand()%16, b = rand()%16, c = rand()%32;
+		for(int p=0; p<DATASET_X*DATASET_Y; p++)
+			img_data[p] = a*(p%DATASET_X) + b*(p/DATASET_X) + c + rand()%4;
+		img = mnist_image_add_after(mdh, img, img_data, 
+									DATASET_X, DATASET_Y, i%10);
+	}
+	return mdh;
+}
+
+static void test_knn_graph_build()
+{
+	mnist_dataset_handle mdh = _make_test_dataset();
+	distance_t distance = create_distance_function("euclid");
+	knn_graph_t g = knn_graph_build(mdh, K, distance, 3);
+	CU_ASSERT_NOT_EQUAL_FATAL(g, KNN_GRAPH_INVALID);
+	CU_ASSERT_EQUAL(knn_graph_count(g), NUM_IMGS);
+	CU_ASSERT_EQUAL(knn_graph_k(g), K);
+	//should need fewer distances than brute force
+	CU_ASSERT_TRUE(knn_graph_evals(g) < (uint64_t) NUM_IMGS*NUM_IMGS);
+
+	//lists are sorted, distinct and don't contain the image itself
+	bool ok = true;
+	for(int i=0; i<NUM_IMGS; i++)
+	{
+		const uint32_t * ids = knn_graph_neighbors(g, i);
+		const float * dists = knn_graph_distances(g, i);
+		for(int j=0; j<K; j++)
+		{
+			ok &= (ids[j]!=(uint32_t) i) && (ids[j]<NUM_IMGS);
+			if(j) ok &= (dists[j-1]<=dists[j]);
+			for(int l=0; l<j; l++) ok &= (ids[l]!=ids[j]);
+		}
+	}
+	CU_ASSERT_TRUE(ok);
+	CU_ASSERT_EQUAL(knn_graph_neighbors(g, NUM_IMGS), NULL);
+	CU_ASSERT_EQUAL(knn_graph_neighbors(g, -1), NULL);
+
+	//test recall
+	CU_ASSERT_TRUE(knn_graph_recall(g, mdh, distance, 50) >= 0.9);
+	knn_graph_free(g);
+
+	//test invalid k
+	CU_ASSERT_EQUAL(knn_graph_build(mdh, 0, distance, 1), KNN_GRAPH_INVALID);
+	CU_ASSERT_EQUAL(knn_graph_build(mdh, NUM_IMGS, distance, 1), 
+					KNN_GRAPH_INVALID);
+	//test invalid dataset
+	CU_ASSERT_EQUAL(knn_graph_build(MNIST_DATASET_INVALID, K, distance, 1), 
+					KNN_GRAPH_INVALID);
+	mnist_free(mdh);
+}
+
+static void test_knn_graph_save_load()
+{
+	mnist_dataset_handle mdh = _make_test_dataset();
+	distance_t distance = create_distance_function("euclid");
+	knn_graph_t g = knn_graph_build(mdh, K, distance, 2);
+	CU_ASSERT_TRUE_FATAL(knn_graph_save(g, TEST_OUTFILE));
+	knn_graph_t g2 = knn_graph_load(TEST_OUTFILE);
+	CU_ASSERT_NOT_EQUAL_FATAL(g2, KNN_GRAPH_INVALID);
+	CU_ASSERT_EQUAL(knn_graph_count(g2), NUM_IMGS);
+	CU_ASSERT_EQUAL(knn_graph_k(g2), K);
+	bool same = true;
+	for(int i=0; i<NUM_IMGS; i++)
+	{
+		for(int j=0; j<K; j++)
+		{
+			same &= knn_graph_neighbors(g, i)[j]==knn_graph_neighbors(g2, i)[j];
+			same &= knn_graph_distances(g, i)[j]==knn_graph_distances(g2, i)[j];
+		}
+	}
+	CU_ASSERT_TRUE(same);
+	knn_graph_free(g);
+	knn_graph_free(g2);
+
+	//test invalid
+	CU_ASSERT_FALSE(knn_graph_save(KNN_GRAPH_INVALID, TEST_OUTFILE));
+	CU_ASSERT_EQUAL(knn_graph_load("invalid"), KNN_GRAPH_INVALID);
+	//an mnist file is not a graph
+	CU_ASSERT_TRUE_FATAL(mnist_save(mdh, TEST_OUTFILE));
+	CU_ASSERT_EQUAL(knn_graph_load(TEST_OUTFILE IMAGES), KNN_GRAPH_INVALID);
+	//k must be less than n, even with valid ids
+	uint32_t bad[] = {htonl(KNN_GRAPH_MAGIC_NUM), htonl(KNN_GRAPH_VERSION),
+					htonl(2), htonl(2), htonl(1), htonl(0), htonl(0), htonl(1),
+					0, 0, 0, 0};
+	FILE * fp = fopen(TEST_OUTFILE, "wb");
+	CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+	CU_ASSERT_EQUAL(fwrite(bad, sizeof(bad), 1, fp), 1);
+	fclose(fp);
+	CU_ASSERT_EQUAL(knn_graph_load(TEST_OUTFILE), KNN_GRAPH_INVALID);
+	mnist_free(mdh);
+	remove(TEST_OUTFILE);
+	remove(TEST_OUTFILE IMAGES);
+	remove(TEST_OUTFILE LABELS);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "knn_graph_build()\n", test_knn_graph_build))
+       || (NULL == CU_add_test(pSuite, "knn_graph_save() and _load()\n", test_knn_graph_save_load))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
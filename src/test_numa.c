@@ -0,0 +1,110 @@
+#include "numa.h"
+#include <CUnit/Basic.h>
+#include <stdlib.h>
+#include <string.h>
+#define BUF_SIZE (1<<20)
+#define MAX_CPUS 1024
+
+static void test_numa_topology()
+{
+	int nodes = numa_nodes();
+	CU_ASSERT_TRUE_FATAL(nodes>=1 && nodes<=NUMA_MAX_NODES);
+	//every CPU we may use is on exactly one node
+	int cpus[MAX_CPUS];
+	int total = 0;
+	bool ok = true;
+	for(int node=0; node<nodes; node++)
+	{
+		int n = numa_node_cpus(node, cpus, MAX_CPUS);
+		ok &= (n>=0);
+		for(int c=0; c<n; c++) ok &= (numa_cpu_node(cpus[c])==node);
+		total += n;
+	}
+	CU_ASSERT_TRUE(ok);
+	CU_ASSERT_TRUE(total>=1);
+	//test invalid
+	CU_ASSERT_TRUE(numa_node_cpus(-1, cpus, MAX_CPUS)<0);
+	CU_ASSERT_TRUE(numa_node_cpus(nodes, cpus, MAX_CPUS)<0);
+	CU_ASSERT_EQUAL(numa_cpu_node(-1), 0);
+}
+
+static void test_numa_pin_cpu()
+{
+	int cpu;
+	CU_ASSERT_EQUAL_FATAL(numa_node_cpus(0, &cpu, 1), 1);
+	CU_ASSERT_TRUE(numa_pin_cpu(cpu));
+	CU_ASSERT_FALSE(numa_pin_cpu(-1));
+}
+
+static void test_numa_alloc()
+{
+	unsigned char * src = malloc(BUF_SIZE);
+	for(int i=0; i<BUF_SIZE; i++) src[i] = i*7;
+	for(int node=0; node<numa_nodes(); node++)
+	{
+		unsigned char * p = numa_alloc_on(BUF_SIZE, node);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+		//zeroed and writable
+		CU_ASSERT_TRUE(p[0]==0 && p[BUF_SIZE-1]==0);
+		p[BUF_SIZE-1] = 1;
+		numa_release(p, BUF_SIZE);
+
+		p = numa_replicate(src, BUF_SIZE, node);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+		CU_ASSERT_EQUAL(memcmp(p, src, BUF_SIZE), 0);
+		numa_release(p, BUF_SIZE);
+	}
+	unsigned char * p = numa_alloc_interleave(BUF_SIZE);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+	CU_ASSERT_TRUE(p[0]==0 && p[BUF_SIZE-1]==0);
+	numa_release(p, BUF_SIZE);
+	//test invalid
+	CU_ASSERT_PTR_NULL(numa_alloc_on(BUF_SIZE, -1));
+	CU_ASSERT_PTR_NULL(numa_alloc_on(BUF_SIZE, numa_nodes()));
+	CU_ASSERT_PTR_NULL(numa_alloc_on(0, 0));
+	CU_ASSERT_PTR_NULL(numa_replicate(NULL, BUF_SIZE, 0));
+	numa_release(NULL, BUF_SIZE);
+	free(src);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "numa_nodes(), _cpu_node(), _node_cpus()\n", test_numa_topology))
+       || (NULL == CU_add_test(pSuite, "numa_pin_cpu()\n", test_numa_pin_cpu))
+       || (NULL == CU_add_test(pSuite, "numa_alloc_on(), _interleave(), _replicate()\n", test_numa_alloc))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
@@ -0,0 +1,154 @@
+#include "pknn.h"
+#include "knn.h"
+#include "mnist.h"
+#include "test_data.h"
+#include "distance.h"
+#include <CUnit/Basic.h>
+#include <stdlib.h>
+
+#define DATASET_X 	8
+#define DATASET_Y 	8
+#define NUM_IMGS 	300
+#define NUM_QUERIES 40
+#define MAX_THREADS 5
+
+static void test_pknn_best_label()
+{
+	//same labels as knn_data_best_label, for any number of threads
+	mnist_dataset_handle train_mdh = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle test_mdh = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	char * names[] = {"euclid", "reduced"};
+	int ks[] = {0, 4, 24};
+	for(int t=1; t<=MAX_THREADS; t++)
+	{
+		pknn_t p = pknn_create(train_mdh, t, t%2);
+		CU_ASSERT_NOT_EQUAL_FATAL(p, PKNN_INVALID);
+		CU_ASSERT_EQUAL(pknn_size(p), t);
+		bool ok = true;
+		for(int d=0; d<2; d++)
+		{
+			distance_t distance = create_distance_function(names[d]);
+			for(int j=0; j<3; j++)
+			{
+				mnist_image_handle img = mnist_image_begin(test_mdh);
+				knn_data_t knn = knn_data_create(img, train_mdh);
+				while(img != MNIST_IMAGE_INVALID)
+				{
+					knn_data_set_image(knn, img);
+					ok &= pknn_best_label(p, mnist_image_data(img), ks[j], 
+								distance) == knn_data_best_label(knn, ks[j], distance);
+					img = mnist_image_next(img);
+				}
+				knn_data_free(knn);
+			}
+		}
+		CU_ASSERT_TRUE(ok);
+		//test invalid k
+		distance_t distance = create_distance_function("euclid");
+		const unsigned char * data = mnist_image_data(mnist_image_begin(test_mdh));
+		CU_ASSERT_EQUAL(pknn_best_label(p, data, -1, distance), LABEL_INVALID);
+		CU_ASSERT_EQUAL(pknn_best_label(p, data, NUM_IMGS, distance), LABEL_INVALID);
+		CU_ASSERT_EQUAL(pknn_best_label(p, NULL, 0, distance), LABEL_INVALID);
+		pknn_free(p);
+	}
+	//more threads than images
+	mnist_dataset_handle tiny_mdh = test_tie_dataset(3, DATASET_X, DATASET_Y, 3);
+	pknn_t p = pknn_create(tiny_mdh, MAX_THREADS, false);
+	distance_t distance = create_distance_function("euclid");
+	mnist_image_handle img = mnist_image_begin(tiny_mdh);
+	CU_ASSERT_EQUAL(pknn_best_label(p, mnist_image_data(img), 0, distance), 
+					mnist_image_label(img));
+	pknn_free(p);
+	mnist_free(tiny_mdh);
+	mnist_free(test_mdh);
+	mnist_free(train_mdh);
+}
+
+static void test_pknn_create_numa()
+{
+	//the copies of the training images give the same labels
+	mnist_dataset_handle train_mdh = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle test_mdh = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	distance_t distance = create_distance_function("euclid");
+	int placements[] = {PKNN_NUMA_NONE, PKNN_NUMA_REPLICATE, PKNN_NUMA_INTERLEAVE};
+	for(int i=0; i<3; i++)
+	{
+		pknn_t p = pknn_create_numa(train_mdh, 3, placements[i]);
+		CU_ASSERT_NOT_EQUAL_FATAL(p, PKNN_INVALID);
+		mnist_image_handle img = mnist_image_begin(test_mdh);
+		knn_data_t knn = knn_data_create(img, train_mdh);
+		bool ok = true;
+		while(img != MNIST_IMAGE_INVALID)
+		{
+			knn_data_set_image(knn, img);
+			ok &= pknn_best_label(p, mnist_image_data(img), 4, distance) 
+					== knn_data_best_label(knn, 4, distance);
+			img = mnist_image_next(img);
+		}
+		CU_ASSERT_TRUE(ok);
+		knn_data_free(knn);
+		pknn_free(p);
+	}
+	//test invalid
+	CU_ASSERT_EQUAL(pknn_create_numa(train_mdh, 3, -1), PKNN_INVALID);
+	CU_ASSERT_EQUAL(pknn_create_numa(train_mdh, 3, PKNN_NUMA_INTERLEAVE+1), 
+					PKNN_INVALID);
+	mnist_free(test_mdh);
+	mnist_free(train_mdh);
+}
+
+static void test_pknn_create_invalid()
+{
+	mnist_dataset_handle mdh = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle empty_mdh = mnist_create(DATASET_X,DATASET_Y);
+	CU_ASSERT_EQUAL(pknn_create(mdh, 0, false), PKNN_INVALID);
+	CU_ASSERT_EQUAL(pknn_create(empty_mdh, 2, false), PKNN_INVALID);
+	CU_ASSERT_EQUAL(pknn_create(MNIST_DATASET_INVALID, 2, false), PKNN_INVALID);
+	CU_ASSERT_TRUE(pknn_size(PKNN_INVALID)<0);
+	CU_ASSERT_EQUAL(pknn_best_label(PKNN_INVALID, NULL, 0, NULL), LABEL_INVALID);
+	pknn_free(PKNN_INVALID);
+	mnist_free(empty_mdh);
+	mnist_free(mdh);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "pknn_best_label()\n", test_pknn_best_label))
+       || (NULL == CU_add_test(pSuite, "pknn_create_numa()\n", test_pknn_create_numa))
+       || (NULL == CU_add_test(pSuite, "pknn_create() invalid\n", test_pknn_create_invalid))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
@@ -0,0 +1,145 @@
+#include "pool.h"
+#include <CUnit/Basic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#define NUM_THREADS 4
+#define NUM_RUNS 100
+#define NUM_TASKS 10000
+
+struct test_job
+{
+	int calls[NUM_THREADS];
+	int nthreads[NUM_THREADS];
+};
+
+static void _count(void * arg, int tid, int nthreads)
+{
+	struct test_job * job = arg;
+	job->calls[tid]++;
+	job->nthreads[tid] = nthreads;
+}
+
+struct test_tasks
+{
+	atomic_int runs[NUM_TASKS];
+	atomic_int per_thread[NUM_THREADS];
+};
+
+static void _run_task(void * arg, int task, int tid)
+{
+	struct test_tasks * job = arg;
+	atomic_fetch_add(&job->runs[task], 1);
+	atomic_fetch_add(&job->per_thread[tid], 1);
+	//uneven costs: the first tasks are much slower
+	volatile int spin = 0;
+	for(int i=0; i<(task<NUM_TASKS/10 ? 20000 : 10); i++) spin++;
+}
+
+static void test_pool_create_free()
+{
+	pool_t pool = pool_create(NUM_THREADS);
+	CU_ASSERT_NOT_EQUAL_FATAL(pool, POOL_INVALID);
+	CU_ASSERT_EQUAL(pool_size(pool), NUM_THREADS);
+	pool_free(pool);
+	//a pool of one thread is just the caller
+	pool = pool_create(1);
+	CU_ASSERT_EQUAL(pool_size(pool), 1);
+	pool_free(pool);
+	//test invalid
+	CU_ASSERT_EQUAL(pool_create(0), POOL_INVALID);
+	CU_ASSERT_EQUAL(pool_create(-1), POOL_INVALID);
+	CU_ASSERT_TRUE(pool_size(POOL_INVALID)<0);
+	pool_free(POOL_INVALID);
+}
+
+static void test_pool_run()
+{
+	//every thread runs every job exactly once
+	pool_t pool = pool_create(NUM_THREADS);
+	struct test_job job = {{0}, {0}};
+	for(int r=0; r<NUM_RUNS; r++) pool_run(pool, _count, &job);
+	bool ok = true;
+	for(int t=0; t<NUM_THREADS; t++)
+		ok &= (job.calls[t]==NUM_RUNS) && (job.nthreads[t]==NUM_THREADS);
+	CU_ASSERT_TRUE(ok);
+	//test invalid
+	pool_run(pool, NULL, &job);
+	pool_run(POOL_INVALID, _count, &job);
+	CU_ASSERT_EQUAL(job.calls[0], NUM_RUNS);
+	pool_free(pool);
+}
+
+static void test_pool_run_tasks()
+{
+	//every task runs exactly once, for any number of threads and tasks
+	int ntasks[] = {NUM_TASKS, NUM_THREADS-1, 1, 0};
+	struct test_tasks * job = malloc(sizeof(struct test_tasks));
+	for(int n=1; n<=NUM_THREADS; n++)
+	{
+		pool_t pool = pool_create(n);
+		for(int c=0; c<sizeof(ntasks)/sizeof(ntasks[0]); c++)
+		{
+			for(int i=0; i<NUM_TASKS; i++) atomic_init(&job->runs[i], 0);
+			for(int t=0; t<NUM_THREADS; t++) atomic_init(&job->per_thread[t], 0);
+			CU_ASSERT_TRUE(pool_run_tasks(pool, _run_task, job, ntasks[c]));
+			bool ok = true;
+			for(int i=0; i<NUM_TASKS; i++)
+				ok &= (atomic_load(&job->runs[i])==(i<ntasks[c] ? 1 : 0));
+			CU_ASSERT_TRUE(ok);
+			int total = 0;
+			for(int t=0; t<NUM_THREADS; t++) total += atomic_load(&job->per_thread[t]);
+			CU_ASSERT_EQUAL(total, ntasks[c]);
+		}
+		pool_free(pool);
+	}
+	//test invalid
+	CU_ASSERT_FALSE(pool_run_tasks(POOL_INVALID, _run_task, job, 1));
+	pool_t pool = pool_create(1);
+	CU_ASSERT_FALSE(pool_run_tasks(pool, NULL, job, 1));
+	CU_ASSERT_FALSE(pool_run_tasks(pool, _run_task, job, -1));
+	pool_free(pool);
+	free(job);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "pool_create() and _free()\n", test_pool_create_free))
+       || (NULL == CU_add_test(pSuite, "pool_run()\n", test_pool_run))
+       || (NULL == CU_add_test(pSuite, "pool_run_tasks()\n", test_pool_run_tasks))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
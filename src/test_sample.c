@@ -0,0 +1,308 @@
+#include "sample.h"
+#include "mnist.h"
+#include <CUnit/Basic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DATASET_X 	4
+#define DATASET_Y 	3
+#define NUM_IMGS 	5000
+#define NUM_THREADS 4
+
+static mnist_dataset_handle _make_test_dataset(int n)
+{
+	//image i holds i in its first bytes, so images are easy to find.
+	// Label 0 gets half of the images, the others share the rest.
+	mnist_dataset_handle mdh = mnist_create(DATASET_X,DATASET_Y);
+	mnist_image_handle img = mnist_image_begin(mdh);
+	for(int i=0; i<n; i++)
+	{
+		unsigned char img_data[DATASET_X*DATASET_Y] = {0};
+		img_data[0] = i&255;
+		img_data[1] = i>>8;
+		img = mnist_image_add_after(mdh, img, img_data, DATASET_X, DATASET_Y,
+									i%2 ? 0 : 1+i/2%9);
+	}
+	return mdh;
+}
+
+static int _image_id(mnist_image_handle img)
+{
+	const unsigned char * data = mnist_image_data(img);
+	return data[0]|data[1]<<8;
+}
+
+static bool _increasing(const int * idx, int n, int N)
+{
+	bool ok = n==0 || (idx[0]>=0 && idx[n-1]<N);
+	for(int i=1; i<n; i++) ok &= idx[i-1]<idx[i];
+	return ok;
+}
+
+static void test_sample_rng()
+{
+	//same seed and stream, same numbers
+	sample_rng_t a = sample_rng(1, 0), b = sample_rng(1, 0);
+	sample_rng_t c = sample_rng(1, 1), d = sample_rng(2, 0);
+	bool same = true, diff_stream = true, diff_seed = true, at = true;
+	for(int i=0; i<100; i++)
+	{
+		uint64_t r = sample_rng_next(&a);
+		at &= sample_rng_at(&b, i)==r;
+		same &= sample_rng_next(&b)==r;
+		diff_stream &= sample_rng_next(&c)!=r;
+		diff_seed &= sample_rng_next(&d)!=r;
+	}
+	CU_ASSERT_TRUE(same);
+	CU_ASSERT_TRUE(at);
+	CU_ASSERT_TRUE(diff_stream);
+	CU_ASSERT_TRUE(diff_seed);
+
+	//uniform in range: every bin within 5% of its expected count
+	CU_ASSERT_EQUAL(sample_rng_uniform(&a, 0), 0);
+	CU_ASSERT_EQUAL(sample_rng_uniform(&a, 1), 0);
+	int bins[10] = {0};
+	bool in_range = true;
+	for(int i=0; i<100000; i++)
+	{
+		uint32_t r = sample_rng_uniform(&a, 10);
+		in_range &= r<10;
+		if(r<10) bins[r]++;
+	}
+	CU_ASSERT_TRUE_FATAL(in_range);
+	for(int i=0; i<10; i++)
+		CU_ASSERT_TRUE(bins[i]>9500 && bins[i]<10500);
+	uint32_t big = 3000000000u;
+	bool big_range = true;
+	for(int i=0; i<1000; i++) big_range &= sample_rng_uniform(&a, big)<big;
+	CU_ASSERT_TRUE(big_range);
+}
+
+static void test_sample_floyd()
+{
+	sample_rng_t rng = sample_rng(3, 0);
+	int idx[NUM_IMGS];
+	//test invalid arguments
+	CU_ASSERT_FALSE(sample_floyd(&rng, 10, 11, idx));
+	CU_ASSERT_FALSE(sample_floyd(&rng, 10, -1, idx));
+	CU_ASSERT_FALSE(sample_floyd(NULL, 10, 1, idx));
+	CU_ASSERT_FALSE(sample_floyd(&rng, 10, 1, NULL));
+	CU_ASSERT_TRUE(sample_floyd(&rng, 10, 0, idx));
+	CU_ASSERT_TRUE(sample_floyd(&rng, 0, 0, idx));
+
+	//all of them, in order
+	CU_ASSERT_TRUE_FATAL(sample_floyd(&rng, NUM_IMGS, NUM_IMGS, idx));
+	bool all = true;
+	for(int i=0; i<NUM_IMGS; i++) all &= idx[i]==i;
+	CU_ASSERT_TRUE(all);
+
+	//distinct and sorted, for sparse and dense samples
+	int ns[] = {1, 7, 100, NUM_IMGS/2, NUM_IMGS-1};
+	for(int j=0; j<5; j++)
+	{
+		CU_ASSERT_TRUE_FATAL(sample_floyd(&rng, NUM_IMGS, ns[j], idx));
+		CU_ASSERT_TRUE(_increasing(idx, ns[j], NUM_IMGS));
+	}
+
+	//reproducible
+	int idx2[100];
+	sample_rng_t r1 = sample_rng(4, 2), r2 = sample_rng(4, 2);
+	sample_floyd(&r1, NUM_IMGS, 100, idx);
+	sample_floyd(&r2, NUM_IMGS, 100, idx2);
+	CU_ASSERT_EQUAL(memcmp(idx, idx2, sizeof(idx2)), 0);
+
+	//every position equally likely: 3 of 10, 30000 times
+	int hits[10] = {0};
+	for(int t=0; t<30000; t++)
+	{
+		sample_floyd(&rng, 10, 3, idx);
+		for(int i=0; i<3; i++) hits[idx[i]]++;
+	}
+	for(int i=0; i<10; i++)
+		CU_ASSERT_TRUE(hits[i]>8500 && hits[i]<9500);
+}
+
+static void test_sample_stratified()
+{
+	sample_rng_t rng = sample_rng(5, 0);
+	unsigned char labels[1000];
+	int idx[1000];
+	//400 zeros, 300 ones, 200 twos, 100 threes, shuffled
+	for(int i=0; i<1000; i++) labels[i] = i<400 ? 0 : i<700 ? 1 : i<900 ? 2 : 3;
+	for(int i=999; i>0; i--)
+	{
+		int r = sample_rng_uniform(&rng, i+1);
+		unsigned char t = labels[i];
+		labels[i] = labels[r];
+		labels[r] = t;
+	}
+	CU_ASSERT_FALSE(sample_stratified(&rng, labels, 1000, 1001, idx));
+	CU_ASSERT_FALSE(sample_stratified(&rng, NULL, 1000, 10, idx));
+	CU_ASSERT_TRUE(sample_stratified(&rng, labels, 1000, 0, idx));
+
+	//exact shares, and the largest remainders for the rest:
+	// 15 images are 6, 4.5, 3, 1.5 -> 6, 5, 3, 1 (ties go to the lower label)
+	int ns[] = {10, 15, 1000};
+	int expected[3][4] = {{4, 3, 2, 1}, {6, 5, 3, 1}, {400, 300, 200, 100}};
+	for(int j=0; j<3; j++)
+	{
+		CU_ASSERT_TRUE_FATAL(sample_stratified(&rng, labels, 1000, ns[j], idx));
+		CU_ASSERT_TRUE(_increasing(idx, ns[j], 1000));
+		int count[4] = {0};
+		for(int i=0; i<ns[j]; i++) count[labels[idx[i]]]++;
+		CU_ASSERT_EQUAL(memcmp(count, expected[j], sizeof(count)), 0);
+	}
+}
+
+static void test_mnist_gather()
+{
+	mnist_dataset_handle mdh = _make_test_dataset(NUM_IMGS);
+	int idx[] = {5, 6, 7, 0, 4999, 7};
+	mnist_dataset_handle g = mnist_gather(mdh, idx, 6);
+	CU_ASSERT_EQUAL_FATAL(mnist_image_count(g), 6);
+	bool ok = true;
+	mnist_image_handle img = mnist_image_begin(g);
+	for(int i=0; i<6; i++, img=mnist_image_next(img))
+		ok &= _image_id(img)==idx[i]
+			&& mnist_image_label(img)==mnist_image_label(mnist_image_at(mdh, idx[i]));
+	CU_ASSERT_TRUE(ok);
+	mnist_free(g);
+	//test invalid arguments
+	int bad[] = {1, NUM_IMGS};
+	CU_ASSERT_EQUAL(mnist_gather(mdh, bad, 2), MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_gather(mdh, NULL, 2), MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_gather(MNIST_DATASET_INVALID, idx, 1), MNIST_DATASET_INVALID);
+	g = mnist_gather(mdh, NULL, 0);
+	CU_ASSERT_EQUAL(mnist_image_count(g), 0);
+	mnist_free(g);
+
+	//positions, not buffer offsets, once an image is inserted in the middle
+	unsigned char data[DATASET_X*DATASET_Y] = {0xff, 0xff};
+	mnist_image_add_after(mdh, mnist_image_begin(mdh), data, DATASET_X, DATASET_Y, 9);
+	int moved[] = {0, 1, 2, 3};
+	g = mnist_gather(mdh, moved, 4);
+	img = mnist_image_begin(g);
+	CU_ASSERT_EQUAL(_image_id(img), 0);
+	CU_ASSERT_EQUAL(_image_id(img=mnist_image_next(img)), 0xffff);
+	CU_ASSERT_EQUAL(_image_id(img=mnist_image_next(img)), 1);
+	CU_ASSERT_EQUAL(_image_id(mnist_image_next(img)), 2);
+	mnist_free(g);
+	sample_rng_t rng = sample_rng(6, 0);
+	g = mnist_sample_stratified(mdh, NUM_IMGS/10, &rng);
+	CU_ASSERT_EQUAL(mnist_image_count(g), NUM_IMGS/10);
+	int zeros = 0;
+	for(img=mnist_image_begin(g); img; img=mnist_image_next(img))
+		zeros += mnist_image_label(img)==0;
+	CU_ASSERT_EQUAL(zeros, NUM_IMGS/20);
+	mnist_free(g);
+	mnist_free(mdh);
+}
+
+struct sample_job
+{
+	mnist_dataset_handle mdh;
+	int tid;
+	mnist_dataset_handle sample;
+};
+
+static void * _sample_thread(void * arg)
+{
+	struct sample_job * job = arg;
+	sample_rng_t rng = sample_rng(7, job->tid);
+	job->sample = mnist_sample(job->mdh, 500, &rng);
+	return NULL;
+}
+
+static void test_mnist_sample()
+{
+	mnist_dataset_handle mdh = _make_test_dataset(NUM_IMGS);
+	sample_rng_t rng = sample_rng(8, 0);
+	CU_ASSERT_EQUAL(mnist_sample(mdh, NUM_IMGS+1, &rng), MNIST_DATASET_INVALID);
+	CU_ASSERT_EQUAL(mnist_sample(mdh, 1, NULL), MNIST_DATASET_INVALID);
+
+	//images in the order of the dataset, labels with them
+	mnist_dataset_handle s = mnist_sample(mdh, 300, &rng);
+	CU_ASSERT_EQUAL_FATAL(mnist_image_count(s), 300);
+	bool ok = true;
+	int prev = -1;
+	for(mnist_image_handle img=mnist_image_begin(s); img; img=mnist_image_next(img))
+	{
+		int id = _image_id(img);
+		ok &= id>prev
+			&& mnist_image_label(img)==mnist_image_label(mnist_image_at(mdh, id));
+		prev = id;
+	}
+	CU_ASSERT_TRUE(ok);
+	mnist_free(s);
+
+	//threads sampling the same dataset get the samples of their streams
+	pthread_t threads[NUM_THREADS];
+	struct sample_job jobs[NUM_THREADS];
+	for(int t=0; t<NUM_THREADS; t++)
+	{
+		jobs[t] = (struct sample_job) {mdh, t, MNIST_DATASET_INVALID};
+		CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[t], NULL, _sample_thread,
+											&jobs[t]), 0);
+	}
+	for(int t=0; t<NUM_THREADS; t++) pthread_join(threads[t], NULL);
+	ok = true;
+	for(int t=0; t<NUM_THREADS; t++)
+	{
+		rng = sample_rng(7, t);
+		s = mnist_sample(mdh, 500, &rng);
+		mnist_image_handle a = mnist_image_begin(s), b = mnist_image_begin(jobs[t].sample);
+		for(; a && b; a=mnist_image_next(a), b=mnist_image_next(b))
+			ok &= _image_id(a)==_image_id(b);
+		ok &= !a && !b;
+		mnist_free(s);
+		mnist_free(jobs[t].sample);
+	}
+	CU_ASSERT_TRUE(ok);
+	mnist_free(mdh);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "sample_rng()\n", test_sample_rng))
+       || (NULL == CU_add_test(pSuite, "sample_floyd()\n", test_sample_floyd))
+       || (NULL == CU_add_test(pSuite, "sample_stratified()\n", test_sample_stratified))
+       || (NULL == CU_add_test(pSuite, "mnist_gather()\n", test_mnist_gather))
+       || (NULL == CU_add_test(pSuite, "mnist_sample()\n", test_mnist_sample))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L // for nanosleep
+#include "server.h"
+#include "knn.h"
+#include "mnist.h"
+#include "test_data.h"
+#include "distance.h"
+#include <CUnit/Basic.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DATASET_X 	8
+#define DATASET_Y 	8
+#define NUM_IMGS 	300
+#define NUM_QUERIES 40
+#define NUM_CLIENTS 50
+#define NUM_THREADS 3
+#define SOCKET_FMT "/tmp/test_server_%d.sock"
+
+struct server_fixture
+{
+	server_t s;
+	pthread_t thread;
+	char path[64];
+	mnist_dataset_handle train_mdh, test_mdh;
+	unsigned char imgs[NUM_QUERIES*DATASET_X*DATASET_Y];
+	int expected[NUM_QUERIES];
+};
+
+static void * _serve(void * arg)
+{
+	struct server_fixture * f = arg;
+	int fd = server_listen(f->path);
+	//_start waits for the socket file to appear
+	server_run(f->s, fd);
+	close(fd);
+	return NULL;
+}
+
+static bool _start(struct server_fixture * f, int k, const char * name)
+{
+	//a server thread, and the labels it should give
+	snprintf(f->path, sizeof(f->path), SOCKET_FMT, (int) getpid());
+	f->train_mdh = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	f->test_mdh = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	distance_t distance = create_distance_function(name);
+	mnist_image_handle img = mnist_image_begin(f->test_mdh);
+	knn_data_t knn = knn_data_create(img, f->train_mdh);
+	for(int q=0; q<NUM_QUERIES; q++, img=mnist_image_next(img))
+	{
+		memcpy(f->imgs+q*DATASET_X*DATASET_Y, mnist_image_data(img),
+				DATASET_X*DATASET_Y);
+		knn_data_set_image(knn, img);
+		f->expected[q] = knn_data_best_label(knn, k, distance);
+	}
+	knn_data_free(knn);
+	f->s = server_create(f->train_mdh, k, distance, NUM_THREADS);
+	unlink(f->path);
+	if(f->s==SERVER_INVALID || pthread_create(&f->thread, NULL, _serve, f))
+		return false;
+	//wait for the socket
+	struct timespec ms = {0, 1000000};
+	for(int i=0; i<1000 && access(f->path, F_OK); i++) nanosleep(&ms, NULL);
+	return !access(f->path, F_OK);
+}
+
+static void _stop(struct server_fixture * f)
+{
+	server_stop(f->s);
+	pthread_join(f->thread, NULL);
+	server_free(f->s);
+	unlink(f->path);
+	mnist_free(f->train_mdh);
+	mnist_free(f->test_mdh);
+}
+
+static void test_server_create()
+{
+	mnist_dataset_handle mdh = test_tie_dataset(10, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle empty = mnist_create(DATASET_X, DATASET_Y);
+	distance_t distance = create_distance_function("euclid");
+	CU_ASSERT_EQUAL(server_create(empty, 0, distance, 1), SERVER_INVALID);
+	CU_ASSERT_EQUAL(server_create(mdh, -1, distance, 1), SERVER_INVALID);
+	CU_ASSERT_EQUAL(server_create(mdh, 0, NULL, 1), SERVER_INVALID);
+	CU_ASSERT_EQUAL(server_create(mdh, 0, distance, 0), SERVER_INVALID);
+	server_t s = server_create(mdh, 0, distance, 2);
+	CU_ASSERT_NOT_EQUAL(s, SERVER_INVALID);
+	CU_ASSERT_FALSE(server_run(s, -1));
+	server_free(s);
+	CU_ASSERT_TRUE(server_listen(NULL)<0);
+	CU_ASSERT_TRUE(server_connect("/tmp/does_not_exist.sock")<0);
+	mnist_free(mdh);
+	mnist_free(empty);
+}
+
+static void test_server_query()
+{
+	//same labels as knn_data_best_label, for batches of any size
+	char * names[] = {"euclid", "reduced"};
+	int ks[] = {0, 4};
+	for(int d=0; d<2; d++)
+		for(int j=0; j<2; j++)
+		{
+			struct server_fixture f;
+			CU_ASSERT_TRUE_FATAL(_start(&f, ks[j], names[d]));
+			int fd = server_connect(f.path);
+			CU_ASSERT_TRUE_FATAL(fd>=0);
+			int labels[NUM_QUERIES];
+			bool ok = true;
+			for(int n=0; n<=NUM_QUERIES; n+=NUM_QUERIES/4)
+			{
+				memset(labels, -1, sizeof(labels));
+				ok &= server_query(fd, f.imgs, n, DATASET_X*DATASET_Y, labels)==n;
+				for(int q=0; q<n; q++) ok &= labels[q]==f.expected[q];
+			}
+			CU_ASSERT_TRUE(ok);
+			CU_ASSERT_TRUE(server_query(fd, f.imgs, 1, 0, labels)<0);
+			close(fd);
+			_stop(&f);
+		}
+}
+
+static void test_server_clients()
+{
+	struct server_fixture f;
+	CU_ASSERT_TRUE_FATAL(_start(&f, 2, "euclid"));
+	//many clients with a request each, all sent before any answer is read
+	int fds[NUM_CLIENTS];
+	size_t size = DATASET_X*DATASET_Y;
+	bool ok = true;
+	for(int c=0; c<NUM_CLIENTS; c++)
+	{
+		fds[c] = server_connect(f.path);
+		ok &= fds[c]>=0;
+	}
+	CU_ASSERT_TRUE_FATAL(ok);
+	for(int c=0; c<NUM_CLIENTS; c++)
+	{
+		//query c%NUM_QUERIES, with the header and the image sent apart
+		uint32_t header[2] = {htonl(SERVER_MAGIC_NUM), htonl(size)};
+		ok &= write(fds[c], header, sizeof(header))==sizeof(header);
+	}
+	for(int c=0; c<NUM_CLIENTS; c++)
+		ok &= write(fds[c], f.imgs+c%NUM_QUERIES*size, size)==size;
+	for(int c=0; c<NUM_CLIENTS; c++)
+	{
+		unsigned char resp[SERVER_HEADER_SIZE+1];
+		size_t got = 0;
+		while(got<sizeof(resp))
+		{
+			ssize_t r = read(fds[c], resp+got, sizeof(resp)-got);
+			if(r<=0) break;
+			got += r;
+		}
+		uint32_t magic, n;
+		memcpy(&magic, resp, 4);
+		memcpy(&n, resp+4, 4);
+		ok &= got==sizeof(resp) && ntohl(magic)==SERVER_MAGIC_NUM && ntohl(n)==1
+			&& resp[SERVER_HEADER_SIZE]==f.expected[c%NUM_QUERIES];
+	}
+	CU_ASSERT_TRUE(ok);
+	for(int c=0; c<NUM_CLIENTS; c++) close(fds[c]);
+
+	//pipelined requests are answered in order
+	int fd = server_connect(f.path);
+	uint32_t header[2] = {htonl(SERVER_MAGIC_NUM), htonl(2*size)};
+	unsigned char req[2*(SERVER_HEADER_SIZE+2*DATASET_X*DATASET_Y)];
+	for(int r=0; r<2; r++)
+	{
+		unsigned char * p = req+r*(SERVER_HEADER_SIZE+2*size);
+		memcpy(p, header, sizeof(header));
+		memcpy(p+SERVER_HEADER_SIZE, f.imgs+2*r*size, 2*size);
+	}
+	CU_ASSERT_EQUAL(write(fd, req, sizeof(req)), sizeof(req));
+	unsigned char resp[2*(SERVER_HEADER_SIZE+2)];
+	size_t got = 0;
+	while(got<sizeof(resp))
+	{
+		ssize_t r = read(fd, resp+got, sizeof(resp)-got);
+		if(r<=0) break;
+		got += r;
+	}
+	CU_ASSERT_EQUAL_FATAL(got, sizeof(resp));
+	CU_ASSERT_EQUAL(resp[SERVER_HEADER_SIZE], f.expected[0]);
+	CU_ASSERT_EQUAL(resp[SERVER_HEADER_SIZE+1], f.expected[1]);
+	CU_ASSERT_EQUAL(resp[2*SERVER_HEADER_SIZE+2], f.expected[2]);
+	CU_ASSERT_EQUAL(resp[2*SERVER_HEADER_SIZE+3], f.expected[3]);
+	close(fd);
+
+	//a malformed request closes the connection, and only that one
+	fd = server_connect(f.path);
+	header[0] = htonl(0xdeadbeef);
+	CU_ASSERT_EQUAL(write(fd, header, sizeof(header)), sizeof(header));
+	CU_ASSERT_EQUAL(read(fd, resp, 1), 0);
+	close(fd);
+	fd = server_connect(f.path);
+	header[0] = htonl(SERVER_MAGIC_NUM);
+	header[1] = htonl(size+1);
+	CU_ASSERT_EQUAL(write(fd, header, sizeof(header)), sizeof(header));
+	CU_ASSERT_EQUAL(read(fd, resp, 1), 0);
+	close(fd);
+	fd = server_connect(f.path);
+	int label;
+	CU_ASSERT_EQUAL(server_query(fd, f.imgs, 1, size, &label), 1);
+	CU_ASSERT_EQUAL(label, f.expected[0]);
+	close(fd);
+	_stop(&f);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "server_create()\n", test_server_create))
+       || (NULL == CU_add_test(pSuite, "server_query()\n", test_server_query))
+       || (NULL == CU_add_test(pSuite, "many clients\n", test_server_clients))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
@@ -0,0 +1,228 @@
+#define _POSIX_C_SOURCE 200809L // for kill
+#include "shard.h"
+#include "knn.h"
+#include "mnist.h"
+#include "test_data.h"
+#include "distance.h"
+#include <CUnit/Basic.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define DATASET_X 	8
+#define DATASET_Y 	8
+#define NUM_IMGS 	300
+#define NUM_QUERIES 40
+#define NUM_SHARDS 	3
+#define TIMEOUT_MS 	2000
+#define SOCKET_FMT "/tmp/test_shard_%d_%d.sock"
+
+static mnist_dataset_handle _make_shard(int index, int count)
+{
+	//the images i of the training set with i%count==index
+	mnist_dataset_handle all = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	int idx[NUM_IMGS], n = 0;
+	for(int i=index; i<NUM_IMGS; i+=count) idx[n++] = i;
+	mnist_dataset_handle shard = mnist_gather(all, idx, n);
+	mnist_free(all);
+	return shard;
+}
+
+static pid_t _start_shard(const char * path, int index)
+{
+	//a child process serving shard index of the training set
+	int fd = shard_listen(path);
+	if(fd<0) return -1;
+	pid_t pid = fork();
+	if(pid==0)
+	{
+		mnist_dataset_handle shard = _make_shard(index, NUM_SHARDS);
+		shard_serve(shard, fd);
+		_exit(EXIT_FAILURE);
+	}
+	close(fd);
+	return pid;
+}
+
+static void _stop_shard(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+static void _queries(mnist_dataset_handle test_mdh, unsigned char * imgs)
+{
+	int q = 0;
+	for(mnist_image_handle img = mnist_image_begin(test_mdh);
+		img != MNIST_IMAGE_INVALID; img = mnist_image_next(img))
+		memcpy(imgs+(q++)*DATASET_X*DATASET_Y, mnist_image_data(img), 
+				DATASET_X*DATASET_Y);
+}
+
+static void test_shard_classify()
+{
+	//same labels as one process with the whole training set
+	char paths[NUM_SHARDS][64];
+	const char * path_ptrs[NUM_SHARDS];
+	pid_t pids[NUM_SHARDS];
+	for(int s=0; s<NUM_SHARDS; s++)
+	{
+		snprintf(paths[s], sizeof(paths[s]), SOCKET_FMT, (int) getpid(), s);
+		path_ptrs[s] = paths[s];
+		pids[s] = _start_shard(paths[s], s);
+		CU_ASSERT_TRUE_FATAL(pids[s]>0);
+	}
+	mnist_dataset_handle train_mdh = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	mnist_dataset_handle test_mdh = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	unsigned char imgs[NUM_QUERIES*DATASET_X*DATASET_Y];
+	_queries(test_mdh, imgs);
+
+	shard_client_t c = shard_connect(path_ptrs, NUM_SHARDS, TIMEOUT_MS);
+	CU_ASSERT_NOT_EQUAL_FATAL(c, SHARD_INVALID);
+	CU_ASSERT_EQUAL(shard_alive(c), NUM_SHARDS);
+	char * names[] = {"euclid", "reduced"};
+	int ks[] = {0, 4, 24};
+	int labels[NUM_QUERIES];
+	bool ok = true;
+	for(int d=0; d<2; d++)
+	{
+		distance_t distance = create_distance_function(names[d]);
+		for(int j=0; j<3; j++)
+		{
+			CU_ASSERT_EQUAL(shard_classify(c, imgs, NUM_QUERIES, DATASET_X, 
+							DATASET_Y, ks[j], names[d], labels), NUM_SHARDS);
+			mnist_image_handle img = mnist_image_begin(test_mdh);
+			knn_data_t knn = knn_data_create(img, train_mdh);
+			for(int q=0; q<NUM_QUERIES; q++)
+			{
+				knn_data_set_image(knn, img);
+				ok &= (labels[q]==knn_data_best_label(knn, ks[j], distance));
+				img = mnist_image_next(img);
+			}
+			knn_data_free(knn);
+		}
+	}
+	CU_ASSERT_TRUE(ok);
+	//test invalid
+	CU_ASSERT_TRUE(shard_classify(c, imgs, NUM_QUERIES, DATASET_X, DATASET_Y, 
+								0, "nope", labels)<0);
+	CU_ASSERT_TRUE(shard_classify(c, imgs, 0, DATASET_X, DATASET_Y, 
+								0, "euclid", labels)<0);
+	CU_ASSERT_TRUE(shard_classify(c, imgs, NUM_QUERIES, DATASET_X, DATASET_Y, 
+								-1, "euclid", labels)<0);
+	//a batch of the wrong image size gets the shards disconnected
+	CU_ASSERT_TRUE(shard_classify(c, imgs, 1, DATASET_X+1, DATASET_Y, 
+								0, "euclid", labels)<0);
+	CU_ASSERT_EQUAL(shard_alive(c), 0);
+	shard_close(c);
+
+	for(int s=0; s<NUM_SHARDS; s++)
+	{
+		_stop_shard(pids[s]);
+		unlink(paths[s]);
+	}
+	mnist_free(test_mdh);
+	mnist_free(train_mdh);
+}
+
+static void test_shard_failures()
+{
+	//shard 0 is killed, shard 1 never answers (nobody accepts its 
+	// connections), shard 2 works
+	char paths[NUM_SHARDS][64];
+	const char * path_ptrs[NUM_SHARDS];
+	for(int s=0; s<NUM_SHARDS; s++)
+	{
+		snprintf(paths[s], sizeof(paths[s]), SOCKET_FMT, (int) getpid(), s);
+		path_ptrs[s] = paths[s];
+	}
+	pid_t killed = _start_shard(paths[0], 0);
+	int hung_fd = shard_listen(paths[1]);
+	pid_t working = _start_shard(paths[2], 2);
+	CU_ASSERT_TRUE_FATAL(killed>0 && hung_fd>=0 && working>0);
+
+	shard_client_t c = shard_connect(path_ptrs, NUM_SHARDS, 200);
+	CU_ASSERT_NOT_EQUAL_FATAL(c, SHARD_INVALID);
+	CU_ASSERT_EQUAL(shard_alive(c), NUM_SHARDS);
+	_stop_shard(killed);
+
+	mnist_dataset_handle test_mdh = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	unsigned char imgs[NUM_QUERIES*DATASET_X*DATASET_Y];
+	_queries(test_mdh, imgs);
+	int labels[NUM_QUERIES];
+	CU_ASSERT_EQUAL(shard_classify(c, imgs, NUM_QUERIES, DATASET_X, DATASET_Y,
+								4, "euclid", labels), 1);
+	CU_ASSERT_EQUAL(shard_alive(c), 1);
+	//the labels come from the working shard alone
+	mnist_dataset_handle shard_mdh = _make_shard(2, NUM_SHARDS);
+	distance_t distance = create_distance_function("euclid");
+	mnist_image_handle img = mnist_image_begin(test_mdh);
+	knn_data_t knn = knn_data_create(img, shard_mdh);
+	bool ok = true;
+	for(int q=0; q<NUM_QUERIES; q++)
+	{
+		knn_data_set_image(knn, img);
+		ok &= (labels[q]==knn_data_best_label(knn, 4, distance));
+		img = mnist_image_next(img);
+	}
+	CU_ASSERT_TRUE(ok);
+	knn_data_free(knn);
+	shard_close(c);
+
+	//no shard left
+	_stop_shard(working);
+	c = shard_connect(path_ptrs+2, 1, 200);
+	CU_ASSERT_EQUAL(c, SHARD_INVALID);
+	CU_ASSERT_EQUAL(shard_connect(path_ptrs, 0, 200), SHARD_INVALID);
+	CU_ASSERT_TRUE(shard_alive(SHARD_INVALID)<0);
+	shard_close(SHARD_INVALID);
+
+	close(hung_fd);
+	for(int s=0; s<NUM_SHARDS; s++) unlink(paths[s]);
+	mnist_free(shard_mdh);
+	mnist_free(test_mdh);
+}
+
+static int init_suite(void)
+{
+	return 0;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "shard_classify()\n", test_shard_classify))
+       || (NULL == CU_add_test(pSuite, "shard_classify() with failed shards\n", test_shard_failures))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L // for ftruncate and fileno
+#include "stream.h"
+#include "knn.h"
+#include "mnist.h"
+#include "test_data.h"
+#include "distance.h"
+#include <CUnit/Basic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//odd image size, so chunks start in the middle of aligned blocks
+#define DATASET_X 	7
+#define DATASET_Y 	5
+#define NUM_IMGS 	1000
+#define NUM_QUERIES 20
+#define TEST_STREAM "data/test_stream"
+#define TEST_STREAM_BAD "data/test_stream_bad"
+
+static void test_stream_open()
+{
+	CU_ASSERT_EQUAL(stream_open("data/does_not_exist", 10, 0), STREAM_INVALID);
+	CU_ASSERT_EQUAL(stream_open(TEST_STREAM, 0, 0), STREAM_INVALID);
+	CU_ASSERT_EQUAL(stream_open(NULL, 10, 0), STREAM_INVALID);
+	CU_ASSERT_EQUAL(stream_count(STREAM_INVALID), -1);
+	stream_t s = stream_open(TEST_STREAM, 10, 0);
+	CU_ASSERT_NOT_EQUAL_FATAL(s, STREAM_INVALID);
+	CU_ASSERT_EQUAL(stream_count(s), NUM_IMGS);
+	unsigned int x, y;
+	stream_size(s, &x, &y);
+	CU_ASSERT_EQUAL(x, DATASET_X);
+	CU_ASSERT_EQUAL(y, DATASET_Y);
+	CU_ASSERT_FALSE(stream_direct(s));
+	stream_close(s);
+
+	//an image file shorter than its header says
+	mnist_dataset_handle mdh = test_tie_dataset(10, DATASET_X, DATASET_Y, 3);
+	mnist_save(mdh, TEST_STREAM_BAD);
+	mnist_free(mdh);
+	FILE * f = fopen(TEST_STREAM_BAD IMAGES, "r+b");
+	CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+	CU_ASSERT_EQUAL(ftruncate(fileno(f), IMG_HEADER_SIZE+9*DATASET_X*DATASET_Y), 0);
+	fclose(f);
+	CU_ASSERT_EQUAL(stream_open(TEST_STREAM_BAD, 10, 0), STREAM_INVALID);
+}
+
+static void test_stream_next()
+{
+	//the chunks of a pass are the images of the dataset, in order
+	mnist_dataset_handle mdh = mnist_open(TEST_STREAM);
+	CU_ASSERT_NOT_EQUAL_FATAL(mdh, MNIST_DATASET_INVALID);
+	int chunks[] = {1, 13, NUM_IMGS, 5*NUM_IMGS};
+	for(int c=0; c<4; c++)
+		for(int flags=0; flags<=STREAM_DIRECT; flags++)
+		{
+			stream_t s = stream_open(TEST_STREAM, chunks[c], flags);
+			CU_ASSERT_NOT_EQUAL_FATAL(s, STREAM_INVALID);
+			for(int pass=0; pass<2; pass++)
+			{
+				const unsigned char * data, * labels;
+				mnist_image_handle img = mnist_image_begin(mdh);
+				int n, total = 0;
+				bool ok = true;
+				while((n=stream_next(s, &data, &labels))>0)
+				{
+					ok &= n<=chunks[c];
+					for(int i=0; i<n && img; i++, img=mnist_image_next(img))
+						ok &= !memcmp(data+i*DATASET_X*DATASET_Y, mnist_image_data(img),
+										DATASET_X*DATASET_Y)
+								&& labels[i]==mnist_image_label(img);
+					total += n;
+				}
+				CU_ASSERT_EQUAL(n, 0);
+				CU_ASSERT_EQUAL(total, NUM_IMGS);
+				CU_ASSERT_TRUE(ok);
+			}
+			//rewinding in the middle of a pass starts over
+			const unsigned char * data, * labels;
+			stream_next(s, &data, &labels);
+			stream_next(s, &data, &labels);
+			stream_rewind(s);
+			CU_ASSERT_TRUE(stream_next(s, &data, &labels)>0);
+			CU_ASSERT_EQUAL(labels[0], mnist_image_label(mnist_image_begin(mdh)));
+			stream_close(s);
+		}
+	CU_ASSERT_EQUAL(stream_next(STREAM_INVALID, NULL, NULL), -1);
+	mnist_free(mdh);
+}
+
+static void test_stream_classify()
+{
+	//same labels as knn_data_best_label, for any chunk size
+	mnist_dataset_handle train_mdh = mnist_open(TEST_STREAM);
+	mnist_dataset_handle test_mdh = test_tie_dataset(NUM_QUERIES, DATASET_X, DATASET_Y, 2);
+	unsigned char * imgs = malloc(NUM_QUERIES*DATASET_X*DATASET_Y);
+	mnist_image_handle img = mnist_image_begin(test_mdh);
+	for(int q=0; img!=MNIST_IMAGE_INVALID; q++, img=mnist_image_next(img))
+		memcpy(imgs+q*DATASET_X*DATASET_Y, mnist_image_data(img), DATASET_X*DATASET_Y);
+	char * names[] = {"euclid", "reduced"};
+	int ks[] = {0, 4, 24};
+	int chunks[] = {1, 7, 100, NUM_IMGS};
+	int labels[NUM_QUERIES];
+	for(int c=0; c<4; c++)
+	{
+		stream_t s = stream_open(TEST_STREAM, chunks[c], STREAM_DIRECT);
+		CU_ASSERT_NOT_EQUAL_FATAL(s, STREAM_INVALID);
+		bool ok = true;
+		for(int d=0; d<2; d++)
+		{
+			distance_t distance = create_distance_function(names[d]);
+			for(int j=0; j<3; j++)
+			{
+				CU_ASSERT_EQUAL(stream_classify(s, imgs, NUM_QUERIES, ks[j],
+												distance, labels), 0);
+				img = mnist_image_begin(test_mdh);
+				knn_data_t knn = knn_data_create(img, train_mdh);
+				for(int q=0; img!=MNIST_IMAGE_INVALID; q++, img=mnist_image_next(img))
+				{
+					knn_data_set_image(knn, img);
+					ok &= labels[q]==knn_data_best_label(knn, ks[j], distance);
+				}
+				knn_data_free(knn);
+			}
+		}
+		CU_ASSERT_TRUE(ok);
+		//test invalid arguments
+		distance_t distance = create_distance_function("euclid");
+		CU_ASSERT_TRUE(stream_classify(s, imgs, NUM_QUERIES, -1, distance, labels)<0);
+		CU_ASSERT_TRUE(stream_classify(s, NULL, NUM_QUERIES, 0, distance, labels)<0);
+		CU_ASSERT_TRUE(stream_classify(s, imgs, NUM_QUERIES, 0, NULL, labels)<0);
+		CU_ASSERT_TRUE(stream_classify(STREAM_INVALID, imgs, 1, 0, distance, labels)<0);
+		stream_close(s);
+	}
+	//fewer images than k+1: all of them vote
+	mnist_dataset_handle tiny_mdh = test_tie_dataset(3, DATASET_X, DATASET_Y, 3);
+	mnist_save(tiny_mdh, TEST_STREAM_BAD);
+	stream_t s = stream_open(TEST_STREAM_BAD, 2, 0);
+	img = mnist_image_begin(tiny_mdh);
+	CU_ASSERT_EQUAL(stream_classify(s, mnist_image_data(img), 1, 10,
+					create_distance_function("euclid"), labels), 0);
+	knn_data_t knn = knn_data_create(img, tiny_mdh);
+	CU_ASSERT_EQUAL(labels[0], knn_data_best_label(knn, 2, create_distance_function("euclid")));
+	knn_data_free(knn);
+	stream_close(s);
+	mnist_free(tiny_mdh);
+	free(imgs);
+	mnist_free(test_mdh);
+	mnist_free(train_mdh);
+}
+
+static int init_suite(void)
+{
+	mnist_dataset_handle mdh = test_tie_dataset(NUM_IMGS, DATASET_X, DATASET_Y, 1);
+	bool ok = mnist_save(mdh, TEST_STREAM);
+	mnist_free(mdh);
+	return ok ? 0 : -1;
+}
+
+static int clean_suite(void)
+{
+	return 0;
+}
+
+int main()
+{
+	CU_pSuite pSuite = NULL;
+	   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Unit Test Suite", init_suite, clean_suite);
+   if (NULL == pSuite)
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((   NULL == CU_add_test(pSuite, "stream_open()\n", test_stream_open))
+       || (NULL == CU_add_test(pSuite, "stream_next()\n", test_stream_next))
+       || (NULL == CU_add_test(pSuite, "stream_classify()\n", test_stream_classify))
+      )
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}